@@ -0,0 +1,411 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <atomic>
+#include "abmscan.h"
+#include "map.h"
+#include "mapblock.h"
+#include "noise.h"
+#include "serverenvironment.h"
+#include "threading/thread.h"
+#include "util/numeric.h"
+#include "util/string.h"
+
+/*
+	ABMHandler
+*/
+
+ABMHandler::ABMHandler(std::vector<ABMWithState> &abms,
+	const std::vector<std::vector<u32> > &abm_lookup,
+	float dtime_s, ServerEnvironment *env,
+	bool use_timers):
+	m_env(env),
+	m_abm_lookup(abm_lookup)
+{
+	if(dtime_s < 0.001)
+		return;
+	bool any_active = false;
+	m_aabms.resize(abms.size());
+	for (size_t k = 0; k < abms.size(); k++) {
+		ABMWithState *i = &abms[k];
+		ActiveBlockModifier *abm = i->abm;
+		float trigger_interval = abm->getTriggerInterval();
+		if(trigger_interval < 0.001)
+			trigger_interval = 0.001;
+		float actual_interval = dtime_s;
+		if(use_timers){
+			i->timer += dtime_s;
+			if(i->timer < trigger_interval)
+				continue;
+			i->timer -= trigger_interval;
+			actual_interval = trigger_interval;
+		}
+		float chance = abm->getTriggerChance();
+		if(chance == 0)
+			chance = 1;
+		ActiveABM &aabm = m_aabms[k];
+		aabm.abm = abm;
+		if (abm->getSimpleCatchUp()) {
+			float intervals = actual_interval / trigger_interval;
+			if(intervals == 0)
+				continue;
+			aabm.chance = chance / intervals;
+			if(aabm.chance == 0)
+				aabm.chance = 1;
+		} else {
+			aabm.chance = chance;
+		}
+
+		if (!i->required_neighbors.empty()) {
+			aabm.required_neighbors = &i->required_neighbors;
+			m_need_neighbors = true;
+		}
+
+		// Trigger contents
+		for (std::vector<content_t>::const_iterator c =
+				i->trigger_contents.begin();
+				c != i->trigger_contents.end(); ++c) {
+			if (*c >= m_trigger_contents.size())
+				m_trigger_contents.resize(*c + 256, false);
+			m_trigger_contents[*c] = true;
+			any_active = true;
+		}
+	}
+	if (!any_active)
+		m_aabms.clear();
+}
+
+u32 ABMHandler::countObjects(MapBlock *block, Map *map, u32 &wider)
+{
+	wider = 0;
+	u32 wider_unknown_count = 0;
+	for(s16 x=-1; x<=1; x++)
+		for(s16 y=-1; y<=1; y++)
+			for(s16 z=-1; z<=1; z++)
+			{
+				MapBlock *block2 = map->getBlockNoCreateNoEx(
+					block->getPos() + v3s16(x,y,z));
+				if(block2==NULL){
+					wider_unknown_count++;
+					continue;
+				}
+				wider += block2->m_static_objects.m_active.size()
+					+ block2->m_static_objects.m_stored.size();
+			}
+	// Extrapolate
+	u32 active_object_count = block->m_static_objects.m_active.size();
+	u32 wider_known_count = 3*3*3 - wider_unknown_count;
+	wider += wider_unknown_count * wider / wider_known_count;
+	return active_object_count;
+
+}
+
+void ABMHandler::fetchNeighborhood(const ABMBlockScan &scan,
+	content_t *neighborhood)
+{
+	const s16 ps = ABM_PADDED_SIZE;
+	v3s16 bp;
+	for (bp.Z = -1; bp.Z <= 1; bp.Z++)
+	for (bp.Y = -1; bp.Y <= 1; bp.Y++)
+	for (bp.X = -1; bp.X <= 1; bp.X++) {
+		MapBlock *block2 = scan.blocks[ABMBlockScan::neighborIndex(bp)];
+
+		// Range of the neighbour's nodes that lie in the padded area
+		v3s16 minp(bp.X == 1 ? 0 : (bp.X == -1 ? MAP_BLOCKSIZE - 1 : 0),
+			bp.Y == 1 ? 0 : (bp.Y == -1 ? MAP_BLOCKSIZE - 1 : 0),
+			bp.Z == 1 ? 0 : (bp.Z == -1 ? MAP_BLOCKSIZE - 1 : 0));
+		v3s16 maxp(bp.X == 0 ? MAP_BLOCKSIZE - 1 : minp.X,
+			bp.Y == 0 ? MAP_BLOCKSIZE - 1 : minp.Y,
+			bp.Z == 0 ? MAP_BLOCKSIZE - 1 : minp.Z);
+
+		v3s16 p;
+		for (p.Z = minp.Z; p.Z <= maxp.Z; p.Z++)
+		for (p.Y = minp.Y; p.Y <= maxp.Y; p.Y++)
+		for (p.X = minp.X; p.X <= maxp.X; p.X++) {
+			// Position inside the padded area
+			s16 x = p.X + bp.X * MAP_BLOCKSIZE + 1;
+			s16 y = p.Y + bp.Y * MAP_BLOCKSIZE + 1;
+			s16 z = p.Z + bp.Z * MAP_BLOCKSIZE + 1;
+			neighborhood[(z * ps + y) * ps + x] = block2 ?
+				block2->getNodeUnsafe(p).getContent() : CONTENT_IGNORE;
+		}
+	}
+}
+
+bool ABMHandler::hasNeighbor(const content_t *neighborhood, v3s16 p0,
+	const std::vector<bool> &required_neighbors)
+{
+	const s16 ps = ABM_PADDED_SIZE;
+	v3s16 p1;
+	for(p1.Z = p0.Z; p1.Z <= p0.Z + 2; p1.Z++)
+	for(p1.Y = p0.Y; p1.Y <= p0.Y + 2; p1.Y++)
+	for(p1.X = p0.X; p1.X <= p0.X + 2; p1.X++)
+	{
+		// p1 is in padded coordinates, skip the node itself
+		if(p1 == p0 + v3s16(1, 1, 1))
+			continue;
+		content_t c = neighborhood[(p1.Z * ps + p1.Y) * ps + p1.X];
+		if (c < required_neighbors.size() && required_neighbors[c])
+			return true;
+	}
+	return false;
+}
+
+bool ABMHandler::prepare(MapBlock *block, ABMBlockScan &scan)
+{
+	if(m_aabms.empty() || block->isDummy())
+		return false;
+
+	// Skip the block if it contains nothing to trigger on
+	const std::vector<content_t> &contents = block->getContents();
+	bool has_trigger_content = false;
+	for (std::vector<content_t>::const_iterator c = contents.begin();
+			c != contents.end(); ++c) {
+		if (*c < m_trigger_contents.size() && m_trigger_contents[*c]) {
+			has_trigger_content = true;
+			break;
+		}
+	}
+	if (!has_trigger_content)
+		return false;
+
+	scan.blockpos = block->getPos();
+	for (u32 k = 0; k < 27; k++)
+		scan.blocks[k] = NULL;
+	scan.blocks[ABMBlockScan::neighborIndex(v3s16(0, 0, 0))] = block;
+
+	if (m_need_neighbors) {
+		Map *map = block->getParent();
+		v3s16 bp;
+		for (bp.Z = -1; bp.Z <= 1; bp.Z++)
+		for (bp.Y = -1; bp.Y <= 1; bp.Y++)
+		for (bp.X = -1; bp.X <= 1; bp.X++) {
+			if (bp == v3s16(0, 0, 0))
+				continue;
+			MapBlock *block2 = map->getBlockNoCreateNoEx(scan.blockpos + bp);
+			if (block2 && !block2->isDummy())
+				scan.blocks[ABMBlockScan::neighborIndex(bp)] = block2;
+		}
+	}
+
+	scan.seed = myrand();
+	scan.triggers.clear();
+	return true;
+}
+
+void ABMHandler::scan(ABMBlockScan &scan, content_t *neighborhood) const
+{
+	MapBlock *block = scan.blocks[ABMBlockScan::neighborIndex(v3s16(0, 0, 0))];
+	PcgRandom pr(scan.seed);
+	bool neighborhood_fetched = false;
+
+	v3s16 p0;
+	for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+	for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+	for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+	{
+		const MapNode &n = block->getNodeUnsafe(p0);
+		content_t c = n.getContent();
+
+		if (c >= m_trigger_contents.size() || !m_trigger_contents[c])
+			continue;
+
+		const std::vector<u32> &abm_ids = m_abm_lookup[c];
+		for(std::vector<u32>::const_iterator
+			k = abm_ids.begin(); k != abm_ids.end(); ++k) {
+			const ActiveABM *i = &m_aabms[*k];
+			if(i->chance == 0)
+				continue;
+			if(pr.next() % i->chance != 0)
+				continue;
+
+			// Check neighbors
+			if(i->required_neighbors)
+			{
+				if (!neighborhood_fetched) {
+					fetchNeighborhood(scan, neighborhood);
+					neighborhood_fetched = true;
+				}
+				if (!hasNeighbor(neighborhood, p0, *i->required_neighbors))
+					continue;
+			}
+
+			ABMTrigger trigger;
+			trigger.abm_id = *k;
+			trigger.p0 = p0;
+			trigger.n = n;
+			scan.triggers.push_back(trigger);
+		}
+	}
+}
+
+void ABMHandler::run(const ABMBlockScan &scan)
+{
+	if (scan.triggers.empty())
+		return;
+
+	// Callbacks of earlier blocks may have changed the map since the
+	// scan, so look the block up again
+	ServerMap *map = &m_env->getServerMap();
+	MapBlock *block = map->getBlockNoCreateNoEx(scan.blockpos);
+	if (block == NULL || block->isDummy())
+		return;
+
+	u32 active_object_count_wider;
+	u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
+	m_env->m_added_objects = 0;
+
+	for (std::vector<ABMTrigger>::const_iterator
+			t = scan.triggers.begin(); t != scan.triggers.end(); ++t) {
+		// Skip nodes that an earlier callback replaced
+		v3s16 p0 = t->p0;
+		MapNode n = block->getNodeUnsafe(p0);
+		if (n.getContent() != t->n.getContent())
+			continue;
+
+		v3s16 p = p0 + block->getPosRelative();
+		ActiveBlockModifier *abm = m_aabms[t->abm_id].abm;
+
+		// Call all the trigger variations
+		abm->trigger(m_env, p, n);
+		abm->trigger(m_env, p, n,
+			active_object_count, active_object_count_wider);
+
+		// Count surrounding objects again if the abms added any
+		if(m_env->m_added_objects > 0) {
+			active_object_count = countObjects(block, map, active_object_count_wider);
+			m_env->m_added_objects = 0;
+		}
+	}
+}
+
+void ABMHandler::apply(MapBlock *block)
+{
+	ABMBlockScan block_scan;
+	if (!prepare(block, block_scan))
+		return;
+	scan(block_scan, m_neighborhood);
+	run(block_scan);
+}
+
+/*
+	ABM block scans shared between the threads of an ABMScanPool
+*/
+struct ABMScanBatch
+{
+	const ABMHandler *handler;
+	std::vector<ABMBlockScan> *scans;
+	std::atomic<size_t> next;
+
+	void work(content_t *neighborhood)
+	{
+		for (;;) {
+			size_t i = next++;
+			if (i >= scans->size())
+				return;
+			handler->scan((*scans)[i], neighborhood);
+		}
+	}
+};
+
+class ABMScanThread : public Thread
+{
+public:
+	ABMScanThread(int id, Semaphore &done):
+		Thread("ABMScan" + itos(id)),
+		m_done(done)
+	{}
+
+	void startBatch(ABMScanBatch *batch)
+	{
+		m_batch = batch;
+		m_start.post();
+	}
+
+	void stopAndWait()
+	{
+		stop();
+		m_start.post();
+		wait();
+	}
+
+protected:
+	void *run();
+
+private:
+	Semaphore m_start;
+	Semaphore &m_done;
+	ABMScanBatch *m_batch = nullptr;
+	content_t m_neighborhood[ABM_PADDED_VOLUME];
+};
+
+void *ABMScanThread::run()
+{
+	DSTACK(FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	for (;;) {
+		m_start.wait();
+		if (stopRequested())
+			break;
+		m_batch->work(m_neighborhood);
+		m_done.post();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER
+	return NULL;
+}
+
+/*
+	ABMScanPool
+*/
+
+ABMScanPool::ABMScanPool(u16 num_threads)
+{
+	for (u16 i = 1; i < num_threads; i++) {
+		ABMScanThread *thread = new ABMScanThread(i, m_done);
+		thread->start();
+		m_threads.push_back(thread);
+	}
+}
+
+ABMScanPool::~ABMScanPool()
+{
+	for (std::vector<ABMScanThread *>::iterator
+			i = m_threads.begin(); i != m_threads.end(); ++i) {
+		(*i)->stopAndWait();
+		delete *i;
+	}
+}
+
+void ABMScanPool::scan(const ABMHandler &handler,
+	std::vector<ABMBlockScan> &scans)
+{
+	ABMScanBatch batch;
+	batch.handler = &handler;
+	batch.scans = &scans;
+	batch.next = 0;
+
+	for (std::vector<ABMScanThread *>::iterator
+			i = m_threads.begin(); i != m_threads.end(); ++i)
+		(*i)->startBatch(&batch);
+	batch.work(m_neighborhood);
+	for (size_t i = 0; i < m_threads.size(); i++)
+		m_done.wait();
+}
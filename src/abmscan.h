@@ -0,0 +1,158 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ABMSCAN_HEADER
+#define ABMSCAN_HEADER
+
+#include <vector>
+#include "constants.h"
+#include "irr_v3d.h"
+#include "mapnode.h"
+#include "threading/semaphore.h"
+
+class ActiveBlockModifier;
+class ABMScanThread;
+class MapBlock;
+class Map;
+class ServerEnvironment;
+struct ABMWithState;
+
+struct ActiveABM
+{
+	ActiveBlockModifier *abm = nullptr;
+	// 0 = not triggered in this interval
+	int chance = 0;
+	const std::vector<bool> *required_neighbors = nullptr;
+};
+
+// A node of a block that passed the chance and neighbor checks of an ABM
+struct ABMTrigger
+{
+	// Index into m_abms
+	u32 abm_id;
+	// Position relative to the block
+	v3s16 p0;
+	MapNode n;
+};
+
+/*
+	Scan of a single block for ABM triggers.
+	Everything the scan reads is looked up beforehand on the server thread,
+	so that ABMHandler::scan() doesn't touch the map and can run on any
+	thread.
+*/
+struct ABMBlockScan
+{
+	v3s16 blockpos;
+	// The block and its neighbors, see neighborIndex(). Neighbors are
+	// only looked up if an ABM with required neighbors is active.
+	MapBlock *blocks[27];
+	// Seed of the chance rolls
+	u32 seed = 0;
+	std::vector<ABMTrigger> triggers;
+
+	static inline u32 neighborIndex(v3s16 bp)
+	{
+		return (bp.Z + 1) * 9 + (bp.Y + 1) * 3 + (bp.X + 1);
+	}
+};
+
+// Side length of the neighbourhood cached by ABMHandler
+#define ABM_PADDED_SIZE (MAP_BLOCKSIZE + 2)
+#define ABM_PADDED_VOLUME (ABM_PADDED_SIZE * ABM_PADDED_SIZE * ABM_PADDED_SIZE)
+
+class ABMHandler
+{
+public:
+	ABMHandler(std::vector<ABMWithState> &abms,
+		const std::vector<std::vector<u32> > &abm_lookup,
+		float dtime_s, ServerEnvironment *env,
+		bool use_timers);
+
+	// Find out how many objects the given block and its neighbours contain.
+	// Returns the number of objects in the block, and also in 'wider' the
+	// number of objects in the block and all its neighbours. The latter
+	// may an estimate if any neighbours are unloaded.
+	u32 countObjects(MapBlock *block, Map *map, u32 &wider);
+
+	/*
+		Sets up the scan of a block. Returns false if no ABM can trigger
+		in it. Must be called on the server thread.
+	*/
+	bool prepare(MapBlock *block, ABMBlockScan &scan);
+
+	/*
+		Rolls the chances of the ABMs for every node of a prepared block
+		and records the nodes that trigger. Only reads the blocks of the
+		scan, so it may run on any thread while the map is not modified.
+		neighborhood is scratch space of ABM_PADDED_VOLUME entries.
+	*/
+	void scan(ABMBlockScan &scan, content_t *neighborhood) const;
+
+	/*
+		Calls the ABMs on the recorded triggers of a block in scan order.
+		Must be called on the server thread.
+	*/
+	void run(const ABMBlockScan &scan);
+
+	void apply(MapBlock *block);
+
+private:
+	// Copies the contents of the block and the border of its neighbours
+	// into neighborhood. Unloaded neighbours read as CONTENT_IGNORE.
+	static void fetchNeighborhood(const ABMBlockScan &scan,
+		content_t *neighborhood);
+
+	// Checks the 26 neighbours of p0 (relative to the block) against the
+	// required neighbor set of an ABM
+	static bool hasNeighbor(const content_t *neighborhood, v3s16 p0,
+		const std::vector<bool> &required_neighbors);
+
+	ServerEnvironment *m_env;
+	const std::vector<std::vector<u32> > &m_abm_lookup;
+	// Indexed like m_abms
+	std::vector<ActiveABM> m_aabms;
+	// Indexed by content_t; set if an ABM triggers on it in this interval
+	std::vector<bool> m_trigger_contents;
+	// Set if any ABM with required neighbors triggers in this interval
+	bool m_need_neighbors = false;
+	// Scratch space of apply()
+	content_t m_neighborhood[ABM_PADDED_VOLUME];
+};
+
+/*
+	Scans blocks for ABM triggers on several threads. The calling thread
+	takes part in every scan, so a pool of n threads runs n - 1 workers.
+*/
+class ABMScanPool
+{
+public:
+	ABMScanPool(u16 num_threads);
+	~ABMScanPool();
+
+	void scan(const ABMHandler &handler, std::vector<ABMBlockScan> &scans);
+
+private:
+	std::vector<ABMScanThread *> m_threads;
+	Semaphore m_done;
+	// Scratch space of the calling thread
+	content_t m_neighborhood[ABM_PADDED_VOLUME];
+};
+
+#endif
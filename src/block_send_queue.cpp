@@ -0,0 +1,212 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "block_send_queue.h"
+
+#include <algorithm>
+#include <cmath>
+#include "constants.h"
+#include "face_position_cache.h"
+#include "util/numeric.h"
+
+/*
+	The positions put aside are looked at again when the camera turned by
+	this part of the field of view.
+*/
+#define DEFERRED_TURN_FOV_PART 0.125f
+
+// Farther moves add the shells again instead of the positions that
+// came into range, as most of those are far away
+#define SHIFT_MAX_D 2
+
+void BlockSendQueue::update(v3s16 center, v3f camera_pos, v3f camera_dir,
+	f32 camera_fov, s16 d_max, u16 max_new_shells)
+{
+	m_camera_dir = camera_dir;
+	m_new_shells = max_new_shells;
+
+	bool moved = center != m_center || d_max != m_d_max;
+	if (moved) {
+		if (d_max == m_d_max && m_d_queued == m_d_max &&
+				getDistance(center) <= SHIFT_MAX_D)
+			shift(center);
+		else
+			startOver(center, d_max);
+	} else if (camera_dir.dotProduct(m_deferred_camera_dir) >=
+			std::cos(camera_fov * DEFERRED_TURN_FOV_PART)) {
+		return;
+	}
+
+	updatePriorities();
+
+	if (moved) {
+		for (std::unordered_map<v3s16, s16>::iterator i = m_kept.begin();
+				i != m_kept.end();) {
+			s16 d = getDistance(i->first);
+			if (d > m_d_max) {
+				// Added again with the shell that comes into range
+				i = m_kept.erase(i);
+			} else if (d <= i->second) {
+				push(i->first);
+				i = m_kept.erase(i);
+			} else {
+				++i;
+			}
+		}
+	}
+
+	// Same range as RemoteClient::GetNextBlocks()
+	f32 range = d_max * BS * MAP_BLOCKSIZE;
+	m_deferred_camera_dir = camera_dir;
+	for (std::unordered_set<v3s16>::iterator i = m_deferred.begin();
+			i != m_deferred.end();) {
+		v3s16 p = *i;
+		if (getDistance(p) > m_d_max) {
+			i = m_deferred.erase(i);
+		} else if (isBlockInSight(p, camera_pos, camera_dir, camera_fov,
+				range, NULL)) {
+			// Added with its shell if that is not there yet
+			i = m_deferred.erase(i);
+			push(p);
+		} else {
+			++i;
+		}
+	}
+}
+
+void BlockSendQueue::reset()
+{
+	m_queue.clear();
+	m_queued.clear();
+	m_deferred.clear();
+	m_kept.clear();
+	m_d_queued = -1;
+}
+
+bool BlockSendQueue::pop(v3s16 *pos, s16 *d)
+{
+	// The priorities of the positions of a shell are in [d, d + 1]
+	while (m_d_queued < m_d_max && m_new_shells > 0 && (m_queue.empty() ||
+			m_queue.front().priority >= m_d_queued + 1)) {
+		m_d_queued++;
+		m_new_shells--;
+
+		const std::vector<v3s16> &shell =
+			FacePositionCache::getFacePositions(m_d_queued);
+		for (std::vector<v3s16>::const_iterator i = shell.begin();
+				i != shell.end(); ++i)
+			addPosition(*i + m_center);
+	}
+
+	if (m_queue.empty())
+		return false;
+
+	std::pop_heap(m_queue.begin(), m_queue.end());
+	*pos = m_queue.back().pos;
+	*d = getDistance(*pos);
+	m_queue.pop_back();
+	m_queued.erase(*pos);
+	return true;
+}
+
+void BlockSendQueue::keep(v3s16 pos, s16 d)
+{
+	if (d >= 0)
+		m_kept[pos] = d;
+}
+
+void BlockSendQueue::push(v3s16 pos)
+{
+	// Positions farther away are added with their shell
+	if (getDistance(pos) > m_d_queued || !m_queued.insert(pos).second)
+		return;
+
+	Entry entry = {getPriority(pos), pos};
+	m_queue.push_back(entry);
+	std::push_heap(m_queue.begin(), m_queue.end());
+}
+
+s16 BlockSendQueue::getDistance(v3s16 pos) const
+{
+	v3s16 diff = pos - m_center;
+	return MYMAX(MYMAX(abs(diff.X), abs(diff.Y)), abs(diff.Z));
+}
+
+f32 BlockSendQueue::getPriority(v3s16 pos) const
+{
+	// Within a shell, the positions in front of the camera come first
+	s16 d = getDistance(pos);
+	if (d == 0)
+		return 0;
+	v3f dir = intToFloat(pos - m_center, 1.0f);
+	return d + 0.5f * (1.0f - m_camera_dir.dotProduct(dir) / dir.getLength());
+}
+
+void BlockSendQueue::addPosition(v3s16 pos)
+{
+	if (m_sent.find(pos) == m_sent.end() &&
+			m_deferred.find(pos) == m_deferred.end())
+		push(pos);
+}
+
+void BlockSendQueue::startOver(v3s16 center, s16 d_max)
+{
+	// Positions put aside out of sight are kept; they are looked at again
+	// right away. Those kept for their distance are added with the shells.
+	m_queue.clear();
+	m_queued.clear();
+	m_kept.clear();
+	m_center = center;
+	m_d_max = d_max;
+	m_d_queued = -1;
+}
+
+void BlockSendQueue::shift(v3s16 center)
+{
+	v3s16 old_center = m_center;
+	m_center = center;
+
+	// Add the positions that came into range
+	v3s16 p;
+	for (p.Z = center.Z - m_d_max; p.Z <= center.Z + m_d_max; p.Z++)
+	for (p.Y = center.Y - m_d_max; p.Y <= center.Y + m_d_max; p.Y++)
+	for (p.X = center.X - m_d_max; p.X <= center.X + m_d_max; p.X++) {
+		v3s16 diff = p - old_center;
+		if (abs(diff.X) > m_d_max || abs(diff.Y) > m_d_max ||
+				abs(diff.Z) > m_d_max)
+			addPosition(p);
+	}
+}
+
+void BlockSendQueue::updatePriorities()
+{
+	// Drop the positions out of range, if the queue was shifted
+	size_t count = 0;
+	for (size_t i = 0; i < m_queue.size(); i++) {
+		Entry &entry = m_queue[i];
+		if (getDistance(entry.pos) > m_d_max) {
+			m_queued.erase(entry.pos);
+			continue;
+		}
+		entry.priority = getPriority(entry.pos);
+		m_queue[count++] = entry;
+	}
+	m_queue.resize(count);
+	std::make_heap(m_queue.begin(), m_queue.end());
+}
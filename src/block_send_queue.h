@@ -0,0 +1,119 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BLOCK_SEND_QUEUE_HEADER
+#define BLOCK_SEND_QUEUE_HEADER
+
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "irr_v3d.h"
+
+/*
+	Positions of the blocks to send to a client, nearest first.
+
+	The shells of positions around the center block are only added when
+	the nearer ones have been looked at, and moving to a neighbouring
+	block only adds the positions that come into range, so that a call
+	costs about the number of positions it returns instead of the volume
+	of the viewing range. Positions that were not in sight are put aside
+	until the camera turns or moves, and those too far away for their
+	block to be sent until the center comes near enough.
+*/
+class BlockSendQueue
+{
+public:
+	// Positions in sent are not queued when their shell is added
+	BlockSendQueue(const std::set<v3s16> &sent): m_sent(sent) {}
+
+	/*
+		Follows the center block and the range, and queues again the
+		positions put aside that came into sight. At most max_new_shells
+		shells are added until the next call.
+	*/
+	void update(v3s16 center, v3f camera_pos, v3f camera_dir,
+		f32 camera_fov, s16 d_max, u16 max_new_shells);
+
+	// Drops all positions; the shells are added again from the center
+	void reset();
+
+	/*
+		Gets the queued position with the highest priority, adding the
+		next shells as needed. d is the distance of the position to the
+		center block.
+	*/
+	bool pop(v3s16 *pos, s16 *d);
+
+	// Queues a position again, e.g. because its block was modified
+	void push(v3s16 pos);
+
+	// Puts a position aside until it comes into sight
+	void defer(v3s16 pos) { m_deferred.insert(pos); }
+
+	// Puts a position aside until it is at most d from the center
+	void keep(v3s16 pos, s16 d);
+
+	size_t size() const { return m_queue.size(); }
+	size_t deferredCount() const { return m_deferred.size(); }
+	size_t keptCount() const { return m_kept.size(); }
+
+	// Whether all the shells were added and nothing is left in them
+	bool isDone() const { return m_queue.empty() && m_d_queued >= m_d_max; }
+
+private:
+	struct Entry
+	{
+		f32 priority;
+		v3s16 pos;
+
+		// Heap order: lower priority number means higher priority
+		bool operator < (const Entry &other) const
+		{
+			return priority > other.priority;
+		}
+	};
+
+	s16 getDistance(v3s16 pos) const;
+	f32 getPriority(v3s16 pos) const;
+	void addPosition(v3s16 pos);
+	void startOver(v3s16 center, s16 d_max);
+	void shift(v3s16 center);
+	void updatePriorities();
+
+	const std::set<v3s16> &m_sent;
+
+	// Heap of the queued positions, and the same positions for lookups
+	std::vector<Entry> m_queue;
+	std::unordered_set<v3s16> m_queued;
+	std::unordered_set<v3s16> m_deferred;
+	// Positions put aside with the distance they are queued again at
+	std::unordered_map<v3s16, s16> m_kept;
+
+	v3s16 m_center;
+	v3f m_camera_dir = v3f(0, 0, 1);
+	// Camera direction when m_deferred was last looked at
+	v3f m_deferred_camera_dir = v3f(0, 0, 1);
+	s16 m_d_max = -1;
+	// Distance of the farthest shell added
+	s16 m_d_queued = -1;
+	u16 m_new_shells = 0;
+};
+
+#endif
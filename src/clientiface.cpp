@@ -31,7 +31,6 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "log.h"
 #include "network/serveropcodes.h"
 #include "util/srp.h"
-#include "face_position_cache.h"
 
 const char *ClientInterface::statenames[] = {
 	"Invalid",
@@ -72,11 +71,21 @@ void RemoteClient::GetNextBlocks (
 
 	// Increment timers
 	m_nothing_to_send_pause_timer -= dtime;
-	m_nearest_unsent_reset_timer += dtime;
+	m_block_queue_reset_timer += dtime;
 
 	if(m_nothing_to_send_pause_timer >= 0)
 		return;
 
+	/*
+		Blocks selected last time that the server did not send are
+		queued again. Those that were sent are skipped by their
+		m_blocks_sending entry.
+	*/
+	for (std::vector<v3s16>::const_iterator i = m_blocks_selected.begin();
+			i != m_blocks_selected.end(); ++i)
+		m_block_queue.push(*i);
+	m_blocks_selected.clear();
+
 	RemotePlayer *player = env->getPlayer(peer_id);
 	// This can happen sometimes; clients and players are not in perfect sync.
 	if (!player)
@@ -115,33 +124,13 @@ void RemoteClient::GetNextBlocks (
 	/*infostream<<"camera_dir=("<<camera_dir.X<<","<<camera_dir.Y<<","
 			<<camera_dir.Z<<")"<<std::endl;*/
 
-	/*
-		Get the starting value of the block finder radius.
-	*/
-
-	if(m_last_center != center)
-	{
-		m_nearest_unsent_d = 0;
-		m_last_center = center;
-	}
-
-	/*infostream<<"m_nearest_unsent_reset_timer="
-			<<m_nearest_unsent_reset_timer<<std::endl;*/
-
 	// Reset periodically to workaround for some bugs or stuff
-	if(m_nearest_unsent_reset_timer > 20.0)
+	if(m_block_queue_reset_timer > 20.0)
 	{
-		m_nearest_unsent_reset_timer = 0;
-		m_nearest_unsent_d = 0;
-		//infostream<<"Resetting m_nearest_unsent_d for "
-		//		<<server->getPlayerName(peer_id)<<std::endl;
+		m_block_queue_reset_timer = 0;
+		m_block_queue.reset();
 	}
 
-	//s16 last_nearest_unsent_d = m_nearest_unsent_d;
-	s16 d_start = m_nearest_unsent_d;
-
-	//infostream<<"d_start="<<d_start<<std::endl;
-
 	u16 max_simul_sends_setting = g_settings->getU16
 			("max_simultaneous_block_sends_per_client");
 	u16 max_simul_sends_usually = max_simul_sends_setting;
@@ -164,15 +153,6 @@ void RemoteClient::GetNextBlocks (
 	*/
 	u32 num_blocks_selected = m_blocks_sending.size();
 
-	/*
-		next time d will be continued from the d from which the nearest
-		unsent block was found this time.
-
-		This is because not necessarily any of the blocks found this
-		time are actually sent.
-	*/
-	s32 new_nearest_unsent_d = -1;
-
 	// get view range and camera fov from the client
 	s16 wanted_range = sao->getWantedRange();
 	float camera_fov = sao->getFov();
@@ -185,192 +165,177 @@ void RemoteClient::GetNextBlocks (
 	const s16 d_blocks_in_sight = full_d_max * BS * MAP_BLOCKSIZE;
 	//infostream << "Fov from client " << camera_fov << " full_d_max " << full_d_max << std::endl;
 
-	s16 d_max = full_d_max;
 	s16 d_max_gen = MYMIN(g_settings->getS16("max_block_generate_distance"), wanted_range);
 
 	// Don't loop very much at a time
-	s16 max_d_increment_at_time = 2;
-	if(d_max > d_start + max_d_increment_at_time)
-		d_max = d_start + max_d_increment_at_time;
-
-	s32 nearest_emerged_d = -1;
-	s32 nearest_emergefull_d = -1;
-	s32 nearest_sent_d = -1;
-	//bool queue_is_full = false;
+	u16 max_d_increment_at_time = 2;
+	m_block_queue.update(center, camera_pos, camera_dir, camera_fov,
+			full_d_max, max_d_increment_at_time);
 
 	const v3s16 cam_pos_nodes = floatToInt(camera_pos, BS);
 	const bool occ_cull = g_settings->getBool("server_side_occlusion_culling");
 
+	// Whether blocks were selected or queued for emerging this time
+	bool found_blocks = false;
+
+	v3s16 p;
 	s16 d;
-	for(d = d_start; d <= d_max; d++) {
+	while (m_block_queue.pop(&p, &d)) {
 		/*
-			Get the border/face dot coordinates of a "d-radiused"
-			box
-		*/
-		std::vector<v3s16> list = FacePositionCache::getFacePositions(d);
+			Send throttling
+			- Don't allow too many simultaneous transfers
+			- EXCEPT when the blocks are very close
 
-		std::vector<v3s16>::iterator li;
-		for(li = list.begin(); li != list.end(); ++li) {
-			v3s16 p = *li + center;
+			Also, don't send blocks that are already flying.
+		*/
 
-			/*
-				Send throttling
-				- Don't allow too many simultaneous transfers
-				- EXCEPT when the blocks are very close
+		// Start with the usual maximum
+		u16 max_simul_dynamic = max_simul_sends_usually;
 
-				Also, don't send blocks that are already flying.
-			*/
+		// If block is very close, allow full maximum
+		if(d <= BLOCK_SEND_DISABLE_LIMITS_MAX_D)
+			max_simul_dynamic = max_simul_sends_setting;
 
-			// Start with the usual maximum
-			u16 max_simul_dynamic = max_simul_sends_usually;
+		// Don't select too many blocks for sending
+		if (num_blocks_selected >= max_simul_dynamic) {
+			m_block_queue.push(p);
+			break;
+		}
 
-			// If block is very close, allow full maximum
-			if(d <= BLOCK_SEND_DISABLE_LIMITS_MAX_D)
-				max_simul_dynamic = max_simul_sends_setting;
+		// Don't send blocks that are currently being transferred
+		if (m_blocks_sending.find(p) != m_blocks_sending.end())
+			continue;
 
-			// Don't select too many blocks for sending
-			if (num_blocks_selected >= max_simul_dynamic) {
-				//queue_is_full = true;
-				goto queue_full_break;
-			}
+		/*
+			Do not go over max mapgen limit
 
-			// Don't send blocks that are currently being transferred
-			if (m_blocks_sending.find(p) != m_blocks_sending.end())
-				continue;
+			These positions can never be sent, they are dropped.
+		*/
+		if (blockpos_over_max_limit(p))
+			continue;
 
-			/*
-				Do not go over max mapgen limit
-			*/
-			if (blockpos_over_max_limit(p))
-				continue;
+		// If this is true, inexistent block will be made from scratch
+		bool generate = d <= d_max_gen;
 
-			// If this is true, inexistent block will be made from scratch
-			bool generate = d <= d_max_gen;
+		/*
+			Don't generate or send if not in sight
+			FIXME This only works if the client uses a small enough
+			FOV setting. The default of 72 degrees is fine.
+		*/
 
-			/*
-				Don't generate or send if not in sight
-				FIXME This only works if the client uses a small enough
-				FOV setting. The default of 72 degrees is fine.
-			*/
+		f32 dist;
+		if (!isBlockInSight(p, camera_pos, camera_dir, camera_fov, d_blocks_in_sight, &dist)) {
+			m_block_queue.defer(p);
+			continue;
+		}
 
-			f32 dist;
-			if (!isBlockInSight(p, camera_pos, camera_dir, camera_fov, d_blocks_in_sight, &dist)) {
+		/*
+			Don't send already sent blocks
+		*/
+		{
+			if(m_blocks_sent.find(p) != m_blocks_sent.end())
+			{
 				continue;
 			}
+		}
 
-			/*
-				Don't send already sent blocks
-			*/
+		/*
+			Check if map has this block
+		*/
+		MapBlock *block = env->getMap().getBlockNoCreateNoEx(p);
+
+		bool surely_not_found_on_disk = false;
+		bool block_is_invalid = false;
+		if (block) {
+			// Reset usage timer, this block will be of use in the future.
+			block->resetUsageTimer();
+
+			// Block is dummy if data doesn't exist.
+			// It means it has been not found from disk and not generated
+			if(block->isDummy())
 			{
-				if(m_blocks_sent.find(p) != m_blocks_sent.end())
-				{
-					continue;
-				}
+				surely_not_found_on_disk = true;
 			}
 
-			/*
-				Check if map has this block
-			*/
-			MapBlock *block = env->getMap().getBlockNoCreateNoEx(p);
-
-			bool surely_not_found_on_disk = false;
-			bool block_is_invalid = false;
-			if (block) {
-				// Reset usage timer, this block will be of use in the future.
-				block->resetUsageTimer();
-
-				// Block is dummy if data doesn't exist.
-				// It means it has been not found from disk and not generated
-				if(block->isDummy())
-				{
-					surely_not_found_on_disk = true;
-				}
-
-				if(block->isGenerated() == false)
-					block_is_invalid = true;
+			if(block->isGenerated() == false)
+				block_is_invalid = true;
 
-				/*
-					If block is not close, don't send it unless it is near
-					ground level.
+			/*
+				If block is not close, don't send it unless it is near
+				ground level.
 
-					Block is near ground level if night-time mesh
-					differs from day-time mesh.
-				*/
-				if(d >= d_opt)
-				{
-					if(block->getDayNightDiff() == false)
-						continue;
-				}
+				Block is near ground level if night-time mesh
+				differs from day-time mesh.
 
-				if (occ_cull && !block_is_invalid &&
-						env->getMap().isBlockOccluded(block, cam_pos_nodes)) {
+				The block is queued again when it is modified or
+				comes within d_opt.
+			*/
+			if(d >= d_opt)
+			{
+				if(block->getDayNightDiff() == false) {
+					m_block_queue.keep(p, d_opt - 1);
 					continue;
 				}
 			}
 
-			/*
-				If block has been marked to not exist on disk (dummy)
-				and generating new ones is not wanted, skip block.
-			*/
-			if(generate == false && surely_not_found_on_disk == true)
-			{
-				// get next one.
+			if (occ_cull && !block_is_invalid &&
+					env->getMap().isBlockOccluded(block, cam_pos_nodes)) {
+				m_block_queue.defer(p);
 				continue;
 			}
+		}
 
-			/*
-				Add inexistent block to emerge queue.
-			*/
-			if(block == NULL || surely_not_found_on_disk || block_is_invalid)
-			{
-				if (emerge->enqueueBlockEmerge(peer_id, p, generate)) {
-					if (nearest_emerged_d == -1)
-						nearest_emerged_d = d;
-				} else {
-					if (nearest_emergefull_d == -1)
-						nearest_emergefull_d = d;
-					goto queue_full_break;
-				}
+		/*
+			If block has been marked to not exist on disk (dummy)
+			and generating new ones is not wanted, skip block.
 
-				// get next one.
-				continue;
-			}
+			It is generated when it comes within d_max_gen.
+		*/
+		if(generate == false && surely_not_found_on_disk == true)
+		{
+			m_block_queue.keep(p, d_max_gen);
+			// get next one.
+			continue;
+		}
 
-			if(nearest_sent_d == -1)
-				nearest_sent_d = d;
+		/*
+			Add inexistent block to emerge queue.
 
-			/*
-				Add block to send queue
-			*/
-			PrioritySortedBlockTransfer q((float)dist, p, peer_id);
+			Emerged blocks are set not sent, which queues them again.
+			Blocks only loaded from disk are tried again to be generated
+			when they come within d_max_gen, in case they were not found.
+		*/
+		if(block == NULL || surely_not_found_on_disk || block_is_invalid)
+		{
+			if (!emerge->enqueueBlockEmerge(peer_id, p, generate)) {
+				m_block_queue.push(p);
+				found_blocks = true;
+				break;
+			}
 
-			dest.push_back(q);
+			if (!generate)
+				m_block_queue.keep(p, d_max_gen);
+			found_blocks = true;
 
-			num_blocks_selected += 1;
-		}
-	}
-queue_full_break:
-
-	// If nothing was found for sending and nothing was queued for
-	// emerging, continue next time browsing from here
-	if(nearest_emerged_d != -1){
-		new_nearest_unsent_d = nearest_emerged_d;
-	} else if(nearest_emergefull_d != -1){
-		new_nearest_unsent_d = nearest_emergefull_d;
-	} else {
-		if(d > full_d_max){
-			new_nearest_unsent_d = 0;
-			m_nothing_to_send_pause_timer = 2.0;
-		} else {
-			if(nearest_sent_d != -1)
-				new_nearest_unsent_d = nearest_sent_d;
-			else
-				new_nearest_unsent_d = d;
+			// get next one.
+			continue;
 		}
+
+		/*
+			Add block to send queue
+		*/
+		PrioritySortedBlockTransfer q((float)dist, p, peer_id);
+
+		dest.push_back(q);
+		m_blocks_selected.push_back(p);
+
+		num_blocks_selected += 1;
+		found_blocks = true;
 	}
 
-	if(new_nearest_unsent_d != -1)
-		m_nearest_unsent_d = new_nearest_unsent_d;
+	// If nothing is left to send, pause until a block is set not sent
+	if (!found_blocks && m_block_queue.isDone())
+		m_nothing_to_send_pause_timer = 2.0;
 }
 
 void RemoteClient::GotBlock(v3s16 p)
@@ -399,19 +364,18 @@ void RemoteClient::SentBlock(v3s16 p)
 
 void RemoteClient::SetBlockNotSent(v3s16 p)
 {
-	m_nearest_unsent_d = 0;
-	m_nothing_to_send_pause_timer = 0;
-
 	if(m_blocks_sending.find(p) != m_blocks_sending.end())
 		m_blocks_sending.erase(p);
 	if(m_blocks_sent.find(p) != m_blocks_sent.end())
 		m_blocks_sent.erase(p);
+	m_nothing_to_send_pause_timer = 0;
+
 	m_blocks_modified.insert(p);
+	m_block_queue.push(p);
 }
 
 void RemoteClient::SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks)
 {
-	m_nearest_unsent_d = 0;
 	m_nothing_to_send_pause_timer = 0;
 
 	for(std::map<v3s16, MapBlock*>::iterator
@@ -420,6 +384,7 @@ void RemoteClient::SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks)
 	{
 		v3s16 p = i->first;
 		m_blocks_modified.insert(p);
+		m_block_queue.push(p);
 
 		if(m_blocks_sending.find(p) != m_blocks_sending.end())
 			m_blocks_sending.erase(p);
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"             // for SER_FMT_VER_INVALID
 #include "network/networkpacket.h"
 #include "porting.h"
+#include "block_send_queue.h"
 
 #include <list>
 #include <vector>
@@ -251,7 +252,7 @@ class RemoteClient
 	/*
 		Finds block that should be sent next to the client.
 		Environment should be locked when this is called.
-		dtime is used for resetting send radius at slow interval
+		dtime is used for resetting the block queue at slow interval
 	*/
 	void GetNextBlocks(ServerEnvironment *env, EmergeManager* emerge,
 			float dtime, std::vector<PrioritySortedBlockTransfer> &dest);
@@ -286,7 +287,7 @@ class RemoteClient
 		o<<"RemoteClient "<<peer_id<<": "
 				<<"m_blocks_sent.size()="<<m_blocks_sent.size()
 				<<", m_blocks_sending.size()="<<m_blocks_sending.size()
-				<<", m_nearest_unsent_d="<<m_nearest_unsent_d
+				<<", m_block_queue.size()="<<m_block_queue.size()
 				<<", m_excess_gotblocks="<<m_excess_gotblocks
 				<<std::endl;
 		m_excess_gotblocks = 0;
@@ -352,9 +353,19 @@ class RemoteClient
 		No MapBlock* is stored here because the blocks can get deleted.
 	*/
 	std::set<v3s16> m_blocks_sent;
-	s16 m_nearest_unsent_d = 0;
-	v3s16 m_last_center;
-	float m_nearest_unsent_reset_timer = 0.0f;
+
+	/*
+		Blocks that may be sent to the client, nearest first.
+		Blocks set not sent are queued again.
+	*/
+	BlockSendQueue m_block_queue{m_blocks_sent};
+	float m_block_queue_reset_timer = 0.0f;
+
+	/*
+		Blocks selected for sending by the last GetNextBlocks().
+		They are queued again if the server didn't send them.
+	*/
+	std::vector<v3s16> m_blocks_selected;
 
 	/*
 		Blocks that are currently on the line.
@@ -27,11 +27,13 @@ SQLite format specification:
 
 #include "database-sqlite3.h"
 
+#include "debug.h"
 #include "log.h"
 #include "filesys.h"
 #include "exceptions.h"
 #include "settings.h"
 #include "porting.h"
+#include "profiler.h"
 #include "util/string.h"
 #include "content_sao.h"
 #include "remoteplayer.h"
@@ -169,6 +171,10 @@ void Database_SQLite3::openDatabase()
 		"Failed to modify sqlite3 synchronous mode");
 	SQLOK(sqlite3_exec(m_database, "PRAGMA foreign_keys = ON", NULL, NULL, NULL),
 		"Failed to enable sqlite3 foreign key support");
+	if (m_wal) {
+		SQLOK(sqlite3_exec(m_database, "PRAGMA journal_mode = WAL", NULL, NULL, NULL),
+			"Failed to enable sqlite3 WAL journal mode");
+	}
 }
 
 void Database_SQLite3::verifyDatabase()
@@ -201,10 +207,27 @@ MapDatabaseSQLite3::MapDatabaseSQLite3(const std::string &savedir):
 	Database_SQLite3(savedir, "map"),
 	MapDatabase()
 {
+	if (g_settings->getBool("sqlite_async_save")) {
+		m_wal = true;
+		m_writer = new MapDatabaseSQLite3Writer(savedir);
+		m_writer->start();
+	}
+}
+
+MapDatabaseSQLite3::MapDatabaseSQLite3(const std::string &savedir, bool wal):
+	Database_SQLite3(savedir, "map"),
+	MapDatabase()
+{
+	m_wal = wal;
 }
 
 MapDatabaseSQLite3::~MapDatabaseSQLite3()
 {
+	if (m_writer) {
+		m_writer->stopAndWait();
+		delete m_writer;
+	}
+
 	FINALIZE_STATEMENT(m_stmt_read)
 	FINALIZE_STATEMENT(m_stmt_write)
 	FINALIZE_STATEMENT(m_stmt_list)
@@ -239,6 +262,33 @@ void MapDatabaseSQLite3::initStatements()
 	verbosestream << "ServerMap: SQLite3 database opened." << std::endl;
 }
 
+void MapDatabaseSQLite3::beginSave()
+{
+	if (m_writer)
+		m_writer->beginSave();
+	else
+		Database_SQLite3::beginSave();
+}
+
+void MapDatabaseSQLite3::endSave()
+{
+	if (m_writer)
+		m_writer->endSave();
+	else
+		Database_SQLite3::endSave();
+}
+
+void MapDatabaseSQLite3::verifyDatabase()
+{
+	if (Database_SQLite3::initialized())
+		return;
+
+	if (m_writer)
+		m_writer->verifyDatabase(this);
+	else
+		Database_SQLite3::verifyDatabase();
+}
+
 inline void MapDatabaseSQLite3::bindPos(sqlite3_stmt *stmt, const v3s16 &pos, int index)
 {
 	SQLOK(sqlite3_bind_int64(stmt, index, getBlockAsInteger(pos)),
@@ -247,6 +297,10 @@ inline void MapDatabaseSQLite3::bindPos(sqlite3_stmt *stmt, const v3s16 &pos, in
 
 bool MapDatabaseSQLite3::deleteBlock(const v3s16 &pos)
 {
+	// Don't let a queued save bring the block back
+	if (m_writer)
+		m_writer->flush();
+
 	verifyDatabase();
 
 	bindPos(m_stmt_delete, pos);
@@ -263,6 +317,11 @@ bool MapDatabaseSQLite3::deleteBlock(const v3s16 &pos)
 
 bool MapDatabaseSQLite3::saveBlock(const v3s16 &pos, const std::string &data)
 {
+	if (m_writer) {
+		m_writer->queueBlock(pos, data);
+		return true;
+	}
+
 	verifyDatabase();
 
 #ifdef __ANDROID__
@@ -290,6 +349,9 @@ bool MapDatabaseSQLite3::saveBlock(const v3s16 &pos, const std::string &data)
 
 void MapDatabaseSQLite3::loadBlock(const v3s16 &pos, std::string *block)
 {
+	if (m_writer && m_writer->getQueuedBlock(pos, block))
+		return;
+
 	verifyDatabase();
 
 	bindPos(m_stmt_read, pos);
@@ -311,6 +373,9 @@ void MapDatabaseSQLite3::loadBlock(const v3s16 &pos, std::string *block)
 
 void MapDatabaseSQLite3::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
+	if (m_writer)
+		m_writer->flush();
+
 	verifyDatabase();
 
 	while (sqlite3_step(m_stmt_list) == SQLITE_ROW)
@@ -319,6 +384,117 @@ void MapDatabaseSQLite3::listAllLoadableBlocks(std::vector<v3s16> &dst)
 	sqlite3_reset(m_stmt_list);
 }
 
+/*
+ * Map database writer thread
+ */
+
+MapDatabaseSQLite3Writer::MapDatabaseSQLite3Writer(const std::string &savedir):
+	Thread("SQLite3Writer"),
+	m_db(savedir, true)
+{
+}
+
+void MapDatabaseSQLite3Writer::queueBlock(const v3s16 &pos, const std::string &data)
+{
+	MutexAutoLock lock(m_mutex);
+	m_queued[pos] = data;
+	g_profiler->avg("SQLite3: save queue depth", m_queued.size());
+	if (!m_saving)
+		m_wake.post();
+}
+
+bool MapDatabaseSQLite3Writer::getQueuedBlock(const v3s16 &pos, std::string *data)
+{
+	MutexAutoLock lock(m_mutex);
+
+	std::unordered_map<v3s16, std::string>::const_iterator it = m_queued.find(pos);
+	if (it == m_queued.end()) {
+		it = m_writing.find(pos);
+		if (it == m_writing.end())
+			return false;
+	}
+	*data = it->second;
+	return true;
+}
+
+void MapDatabaseSQLite3Writer::beginSave()
+{
+	MutexAutoLock lock(m_mutex);
+	m_saving = true;
+}
+
+void MapDatabaseSQLite3Writer::endSave()
+{
+	MutexAutoLock lock(m_mutex);
+	m_saving = false;
+	g_profiler->avg("SQLite3: save queue depth", m_queued.size());
+	if (!m_queued.empty())
+		m_wake.post();
+}
+
+void MapDatabaseSQLite3Writer::verifyDatabase(MapDatabaseSQLite3 *db)
+{
+	MutexAutoLock lock(m_mutex);
+	db->Database_SQLite3::verifyDatabase();
+}
+
+void MapDatabaseSQLite3Writer::flush()
+{
+	MutexAutoLock lock(m_mutex);
+	if (!m_queued.empty())
+		m_wake.post();
+	while (!m_queued.empty() || !m_writing.empty())
+		m_flushed.wait(lock);
+}
+
+void MapDatabaseSQLite3Writer::stopAndWait()
+{
+	stop();
+	m_wake.post();
+	wait();
+}
+
+void *MapDatabaseSQLite3Writer::run()
+{
+	DSTACK(FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	verifyDatabase(&m_db);
+
+	for (;;) {
+		// Once stopping, write until the queue is empty
+		if (!stopRequested())
+			m_wake.wait();
+
+		{
+			MutexAutoLock lock(m_mutex);
+			if (m_queued.empty()) {
+				if (stopRequested())
+					break;
+				continue;
+			}
+			m_writing.swap(m_queued);
+		}
+
+		g_profiler->avg("SQLite3: blocks per save transaction", m_writing.size());
+		{
+			ScopeProfiler sp(g_profiler, "SQLite3: save flush duration", SPT_AVG);
+			m_db.beginSave();
+			for (std::unordered_map<v3s16, std::string>::const_iterator
+					it = m_writing.begin(); it != m_writing.end(); ++it)
+				m_db.saveBlock(it->first, it->second);
+			m_db.endSave();
+		}
+
+		MutexAutoLock lock(m_mutex);
+		m_writing.clear();
+		m_flushed.notify_all();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER
+	return NULL;
+}
+
 /*
  * Player Database
  */
@@ -20,10 +20,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef DATABASE_SQLITE3_HEADER
 #define DATABASE_SQLITE3_HEADER
 
+#include <condition_variable>
 #include <cstring>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include "database.h"
 #include "exceptions.h"
+#include "threading/semaphore.h"
+#include "threading/thread.h"
 
 extern "C" {
 #include "sqlite3.h"
@@ -114,6 +119,9 @@ class Database_SQLite3 : public Database
 	virtual void initStatements() = 0;
 
 	sqlite3 *m_database = nullptr;
+
+	// Use the WAL journal, so that readers don't wait for writers
+	bool m_wal = false;
 private:
 	// Open the database
 	void openDatabase();
@@ -131,6 +139,8 @@ class Database_SQLite3 : public Database
 	static int busyHandler(void *data, int count);
 };
 
+class MapDatabaseSQLite3Writer;
+
 class MapDatabaseSQLite3 : private Database_SQLite3, public MapDatabase
 {
 public:
@@ -142,15 +152,26 @@ class MapDatabaseSQLite3 : private Database_SQLite3, public MapDatabase
 	bool deleteBlock(const v3s16 &pos);
 	void listAllLoadableBlocks(std::vector<v3s16> &dst);
 
-	void beginSave() { Database_SQLite3::beginSave(); }
-	void endSave() { Database_SQLite3::endSave(); }
+	void beginSave();
+	void endSave();
 protected:
 	virtual void createDatabase();
 	virtual void initStatements();
 
 private:
+	friend class MapDatabaseSQLite3Writer;
+
+	// Database of the writer thread
+	MapDatabaseSQLite3(const std::string &savedir, bool wal);
+
 	void bindPos(sqlite3_stmt *stmt, const v3s16 &pos, int index = 1);
 
+	// Opens the connection through the writer if there is one
+	void verifyDatabase();
+
+	// Set if blocks are saved asynchronously (sqlite_async_save)
+	MapDatabaseSQLite3Writer *m_writer = nullptr;
+
 	// Map
 	sqlite3_stmt *m_stmt_read = nullptr;
 	sqlite3_stmt *m_stmt_write = nullptr;
@@ -158,6 +179,49 @@ class MapDatabaseSQLite3 : private Database_SQLite3, public MapDatabase
 	sqlite3_stmt *m_stmt_delete = nullptr;
 };
 
+/*
+	Writes the blocks saved to a MapDatabaseSQLite3 on a thread of its own,
+	through a second connection to the database. The blocks queued during a
+	save are written in a single transaction once it ends.
+*/
+class MapDatabaseSQLite3Writer : public Thread
+{
+public:
+	MapDatabaseSQLite3Writer(const std::string &savedir);
+
+	void queueBlock(const v3s16 &pos, const std::string &data);
+	// Looks up a block that is queued or being written
+	bool getQueuedBlock(const v3s16 &pos, std::string *data);
+
+	void beginSave();
+	void endSave();
+
+	// Opens a connection to the database under m_mutex. Both connections
+	// would otherwise create the tables of a new world at the same time.
+	void verifyDatabase(MapDatabaseSQLite3 *db);
+
+	// Waits until all queued blocks have been written
+	void flush();
+	// Writes the remaining blocks and stops the thread
+	void stopAndWait();
+
+protected:
+	void *run();
+
+private:
+	MapDatabaseSQLite3 m_db;
+
+	std::mutex m_mutex;
+	std::condition_variable m_flushed;
+	Semaphore m_wake;
+	bool m_saving = false;
+	// Blocks waiting for the next transaction
+	std::unordered_map<v3s16, std::string> m_queued;
+	// Blocks of the current transaction. Only changed under m_mutex by
+	// the writer thread, which reads it without locking.
+	std::unordered_map<v3s16, std::string> m_writing;
+};
+
 class PlayerDatabaseSQLite3 : private Database_SQLite3, public PlayerDatabase
 {
 public:
@@ -21,8 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "emerge.h"
 
+#include <algorithm>
 #include <iostream>
-#include <queue>
 
 #include "util/container.h"
 #include "util/thread.h"
@@ -30,6 +30,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "config.h"
 #include "constants.h"
+#include "emerge_queue.h"
 #include "environment.h"
 #include "log.h"
 #include "map.h"
@@ -39,6 +40,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mg_decoration.h"
 #include "mg_schematic.h"
 #include "nodedef.h"
+#include "porting.h"
 #include "profiler.h"
 #include "scripting_server.h"
 #include "server.h"
@@ -57,11 +59,6 @@ class EmergeThread : public Thread {
 	void *run();
 	void signal();
 
-	// Requires queue mutex held
-	bool pushBlock(v3s16 pos);
-
-	void cancelPendingItems();
-
 	static void runCompletionCallbacks(
 		v3s16 pos, EmergeAction action,
 		const EmergeCallbackList &callbacks);
@@ -73,12 +70,19 @@ class EmergeThread : public Thread {
 	Mapgen *m_mapgen;
 
 	Event m_queue_event;
-	std::queue<v3s16> m_block_queue;
+	// Requires queue mutex held
+	bool m_idle = false;
+
+	// Utilisation, reported to the profiler now and then
+	u64 m_report_time = 0;
+	u64 m_wait_time = 0;
+	u32 m_blocks_stolen = 0;
 
 	bool popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata);
+	void reportUtilisation();
 
-	EmergeAction getBlockOrStartGen(
-		v3s16 pos, bool allow_gen, MapBlock **block, BlockMakeData *data);
+	EmergeAction getBlockOrStartGen(v3s16 pos, const BlockEmergeData &bedata,
+		MapBlock **block, BlockMakeData *data, bool *deferred);
 	MapBlock *finishGen(v3s16 pos, BlockMakeData *bmdata,
 		std::map<v3s16, MapBlock *> *modified_blocks);
 
@@ -127,6 +131,7 @@ EmergeManager::EmergeManager(Server *server)
 	// EmergeThreads should be the ServerThread.
 
 	enable_mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
+	mapgen_noise_cache_size = g_settings->getU16("mapgen_noise_cache_size");
 
 	// If unspecified, leave a proc for the main thread and one for
 	// some other misc thread
@@ -150,6 +155,9 @@ EmergeManager::EmergeManager(Server *server)
 	if (m_qlimit_generate < 1)
 		m_qlimit_generate = 1;
 
+	// Leave some room for the prediction of the player position
+	m_cancel_distance = g_settings->getS16("max_block_send_distance") + 2;
+
 	for (s16 i = 0; i < nthreads; i++)
 		m_threads.push_back(new EmergeThread(server, i));
 
@@ -172,6 +180,8 @@ EmergeManager::~EmergeManager()
 		delete m_mapgens[i];
 	}
 
+	delete m_queue;
+	delete m_chunks_generating;
 	delete biomemgr;
 	delete oremgr;
 	delete decomgr;
@@ -185,6 +195,8 @@ bool EmergeManager::initMapgens(MapgenParams *params)
 		return false;
 
 	this->mgparams = params;
+	m_queue = new EmergeQueue(m_threads.size(), params->chunksize);
+	m_chunks_generating = new ChunkGenTracker(params->chunksize);
 
 	for (u32 i = 0; i != m_threads.size(); i++) {
 		Mapgen *mg = Mapgen::createMapgen(params->mgtype, i, params, this);
@@ -269,7 +281,7 @@ bool EmergeManager::enqueueBlockEmergeEx(
 	EmergeCompletionCallback callback,
 	void *callback_param)
 {
-	EmergeThread *thread = NULL;
+	std::vector<EmergeThread *> threads_to_signal;
 	bool entry_already_exists = false;
 
 	{
@@ -282,16 +294,59 @@ bool EmergeManager::enqueueBlockEmergeEx(
 		if (entry_already_exists)
 			return true;
 
-		thread = getOptimalThread();
-		thread->pushBlock(blockpos);
+		queueBlock(blockpos, &threads_to_signal);
 	}
 
-	thread->signal();
+	for (size_t i = 0; i != threads_to_signal.size(); i++)
+		threads_to_signal[i]->signal();
 
 	return true;
 }
 
 
+void EmergeManager::updatePlayerPositions(
+	const std::unordered_map<u16, v3s16> &positions)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	m_player_positions = positions;
+	if (!m_queue)
+		return;
+
+	std::vector<v3s16> blocks;
+	m_queue->getBlocks(&blocks);
+
+	u32 num_cancelled = 0;
+	for (size_t i = 0; i != blocks.size(); i++) {
+		const v3s16 &pos = blocks[i];
+		const BlockEmergeData &bedata = m_blocks_enqueued[pos];
+		// Others may be waiting for the block
+		if (bedata.peer_requested == PEER_ID_INEXISTENT ||
+				!bedata.callbacks.empty())
+			continue;
+
+		std::unordered_map<u16, v3s16>::const_iterator it =
+			positions.find(bedata.peer_requested);
+		if (it != positions.end()) {
+			v3s16 d = pos - it->second;
+			if (MYMAX(abs(d.X), MYMAX(abs(d.Y), abs(d.Z))) <= m_cancel_distance)
+				continue;
+		}
+
+		BlockEmergeData unused;
+		m_queue->remove(pos);
+		popBlockEmergeData(pos, &unused);
+		num_cancelled++;
+	}
+
+	m_queue->updatePriorities([this](v3s16 pos) {
+		return getBlockPriority(pos);
+	});
+
+	g_profiler->add("EmergeManager: blocks cancelled", num_cancelled);
+}
+
+
 //
 // Mapgen-related helper functions
 //
@@ -373,7 +428,7 @@ bool EmergeManager::pushBlockEmergeData(
 		}
 	}
 
-	std::pair<std::map<v3s16, BlockEmergeData>::iterator, bool> findres;
+	std::pair<std::unordered_map<v3s16, BlockEmergeData>::iterator, bool> findres;
 	findres = m_blocks_enqueued.insert(std::make_pair(pos, BlockEmergeData()));
 
 	BlockEmergeData &bedata = findres.first->second;
@@ -397,7 +452,7 @@ bool EmergeManager::pushBlockEmergeData(
 
 bool EmergeManager::popBlockEmergeData(v3s16 pos, BlockEmergeData *bedata)
 {
-	std::map<v3s16, BlockEmergeData>::iterator it;
+	std::unordered_map<v3s16, BlockEmergeData>::iterator it;
 	std::unordered_map<u16, u16>::iterator it2;
 
 	it = m_blocks_enqueued.find(pos);
@@ -420,24 +475,81 @@ bool EmergeManager::popBlockEmergeData(v3s16 pos, BlockEmergeData *bedata)
 }
 
 
-EmergeThread *EmergeManager::getOptimalThread()
+void EmergeManager::queueBlock(v3s16 pos,
+	std::vector<EmergeThread *> *threads_to_signal)
+{
+	size_t index = m_queue->push(pos, getBlockPriority(pos));
+
+	// Idle threads may steal the block
+	for (size_t i = 0; i != m_threads.size(); i++) {
+		if ((i == index || m_threads[i]->m_idle) &&
+				std::find(threads_to_signal->begin(), threads_to_signal->end(),
+					m_threads[i]) == threads_to_signal->end())
+			threads_to_signal->push_back(m_threads[i]);
+	}
+}
+
+
+bool EmergeManager::startChunkGen(v3s16 pos, const BlockEmergeData &bedata)
 {
-	size_t nthreads = m_threads.size();
+	MutexAutoLock queuelock(m_queue_mutex);
 
-	FATAL_ERROR_IF(nthreads == 0, "No emerge threads!");
+	if (m_chunks_generating->tryStart(getContainingChunk(pos), pos))
+		return true;
 
-	size_t index = 0;
-	size_t nitems_lowest = m_threads[0]->m_block_queue.size();
+	// Keep what was asked for the block until it is queued again, along
+	// with what was asked since it was taken
+	std::pair<std::unordered_map<v3s16, BlockEmergeData>::iterator, bool> findres;
+	findres = m_blocks_enqueued.insert(std::make_pair(pos, bedata));
+	if (findres.second) {
+		m_peer_queue_count[bedata.peer_requested]++;
+	} else {
+		BlockEmergeData &queued = findres.first->second;
+		queued.flags |= bedata.flags;
+		queued.callbacks.insert(queued.callbacks.begin(),
+			bedata.callbacks.begin(), bedata.callbacks.end());
+	}
 
-	for (size_t i = 1; i < nthreads; i++) {
-		size_t nitems = m_threads[i]->m_block_queue.size();
-		if (nitems < nitems_lowest) {
-			index = i;
-			nitems_lowest = nitems;
+	return false;
+}
+
+
+void EmergeManager::finishChunkGen(v3s16 pos)
+{
+	std::vector<EmergeThread *> threads_to_signal;
+
+	{
+		MutexAutoLock queuelock(m_queue_mutex);
+
+		std::vector<v3s16> waiting;
+		m_chunks_generating->finish(getContainingChunk(pos), &waiting);
+
+		for (size_t i = 0; i != waiting.size(); i++) {
+			// The block may have been emerged or cancelled meanwhile
+			if (m_blocks_enqueued.find(waiting[i]) != m_blocks_enqueued.end())
+				queueBlock(waiting[i], &threads_to_signal);
 		}
 	}
 
-	return m_threads[index];
+	for (size_t i = 0; i != threads_to_signal.size(); i++)
+		threads_to_signal[i]->signal();
+}
+
+
+float EmergeManager::getBlockPriority(v3s16 pos)
+{
+	// Without players, blocks are emerged in the order they were queued
+	float priority = 0.0f;
+	for (std::unordered_map<u16, v3s16>::const_iterator
+			it = m_player_positions.begin();
+			it != m_player_positions.end(); ++it) {
+		v3s16 d = pos - it->second;
+		float distance = v3f(d.X, d.Y, d.Z).getLength();
+		if (it == m_player_positions.begin() || distance < priority)
+			priority = distance;
+	}
+
+	return priority;
 }
 
 
@@ -459,7 +571,6 @@ EmergeThread::EmergeThread(Server *server, int ethreadid) :
 
 EmergeThread::~EmergeThread()
 {
-	//cancelPendingItems();
 }
 
 
@@ -469,31 +580,6 @@ void EmergeThread::signal()
 }
 
 
-bool EmergeThread::pushBlock(v3s16 pos)
-{
-	m_block_queue.push(pos);
-	return true;
-}
-
-
-void EmergeThread::cancelPendingItems()
-{
-	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
-
-	while (!m_block_queue.empty()) {
-		BlockEmergeData bedata;
-		v3s16 pos;
-
-		pos = m_block_queue.front();
-		m_block_queue.pop();
-
-		m_emerge->popBlockEmergeData(pos, &bedata);
-
-		runCompletionCallbacks(pos, EMERGE_CANCELLED, bedata.callbacks);
-	}
-}
-
-
 void EmergeThread::runCompletionCallbacks(
 	v3s16 pos,
 	EmergeAction action,
@@ -515,11 +601,15 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata)
 {
 	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
 
-	if (m_block_queue.empty())
+	bool stolen;
+	if (!m_emerge->m_queue->pop(id, pos, &stolen)) {
+		m_idle = true;
 		return false;
+	}
 
-	*pos = m_block_queue.front();
-	m_block_queue.pop();
+	m_idle = false;
+	if (stolen)
+		m_blocks_stolen++;
 
 	m_emerge->popBlockEmergeData(*pos, bedata);
 
@@ -527,11 +617,33 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata)
 }
 
 
-EmergeAction EmergeThread::getBlockOrStartGen(
-	v3s16 pos, bool allow_gen, MapBlock **block, BlockMakeData *bmdata)
+void EmergeThread::reportUtilisation()
+{
+	u64 now = porting::getTimeUs();
+	if (m_report_time == 0)
+		m_report_time = now;
+	if (now - m_report_time < 5000000)
+		return;
+
+	u64 wait_time = MYMIN(m_wait_time, now - m_report_time);
+	g_profiler->avg("EmergeThread: " + m_name + " busy %",
+		100.0f * (now - m_report_time - wait_time) / (now - m_report_time));
+	g_profiler->add("EmergeThread: blocks stolen", m_blocks_stolen);
+
+	m_report_time = now;
+	m_wait_time = 0;
+	m_blocks_stolen = 0;
+}
+
+
+EmergeAction EmergeThread::getBlockOrStartGen(v3s16 pos,
+	const BlockEmergeData &bedata, MapBlock **block, BlockMakeData *bmdata,
+	bool *deferred)
 {
 	MutexAutoLock envlock(m_server->m_env_mutex);
 
+	*deferred = false;
+
 	// 1). Attempt to fetch block from memory
 	*block = m_map->getBlockNoCreateNoEx(pos);
 	if (*block && !(*block)->isDummy()) {
@@ -545,8 +657,15 @@ EmergeAction EmergeThread::getBlockOrStartGen(
 	}
 
 	// 3). Attempt to start generation
-	if (allow_gen && m_map->initBlockMake(pos, bmdata))
-		return EMERGE_GENERATED;
+	if (bedata.flags & BLOCK_EMERGE_ALLOW_GEN) {
+		if (!m_emerge->startChunkGen(pos, bedata)) {
+			*deferred = true;
+			return EMERGE_CANCELLED;
+		}
+		if (m_map->initBlockMake(pos, bmdata))
+			return EMERGE_GENERATED;
+		m_emerge->finishChunkGen(pos);
+	}
 
 	// All attempts failed; cancel this block emerge
 	return EMERGE_CANCELLED;
@@ -624,8 +743,12 @@ void *EmergeThread::run()
 		EmergeAction action;
 		MapBlock *block;
 
+		reportUtilisation();
+
 		if (!popBlockEmerge(&pos, &bedata)) {
+			u64 wait_start = porting::getTimeUs();
 			m_queue_event.wait();
+			m_wait_time += porting::getTimeUs() - wait_start;
 			continue;
 		}
 
@@ -635,7 +758,14 @@ void *EmergeThread::run()
 		bool allow_gen = bedata.flags & BLOCK_EMERGE_ALLOW_GEN;
 		EMERGE_DBG_OUT("pos=" PP(pos) " allow_gen=" << allow_gen);
 
-		action = getBlockOrStartGen(pos, allow_gen, &block, &bmdata);
+		bool deferred;
+		action = getBlockOrStartGen(pos, bedata, &block, &bmdata, &deferred);
+		if (deferred) {
+			// Another thread is generating next to the block
+			g_profiler->add("EmergeThread: blocks deferred", 1);
+			continue;
+		}
+
 		if (action == EMERGE_GENERATED) {
 			{
 				ScopeProfiler sp(g_profiler,
@@ -648,7 +778,13 @@ void *EmergeThread::run()
 					t.stop(true); // Hide output
 			}
 
+			u32 hits, misses;
+			m_mapgen->noise_cache.takeStats(&hits, &misses);
+			g_profiler->add("EmergeThread: noise map cache hits", hits);
+			g_profiler->add("EmergeThread: noise map cache misses", misses);
+
 			block = finishGen(pos, &bmdata, &modified_blocks);
+			m_emerge->finishChunkGen(pos);
 		}
 
 		runCompletionCallbacks(pos, action, bedata.callbacks);
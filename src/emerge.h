@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <map>
 #include <mutex>
+#include <unordered_map>
 #include "irr_v3d.h"
 #include "util/container.h"
 #include "mapgen.h" // for MapgenParams
@@ -35,6 +36,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		infostream << "EmergeThread: " x << std::endl; \
 } while (0)
 
+class ChunkGenTracker;
+class EmergeQueue;
 class EmergeThread;
 class INodeDefManager;
 class Settings;
@@ -89,6 +92,7 @@ class EmergeManager {
 public:
 	INodeDefManager *ndef;
 	bool enable_mapgen_debug_info;
+	u16 mapgen_noise_cache_size;
 
 	// Generation Notify
 	u32 gen_notify_on = 0;
@@ -121,6 +125,7 @@ class EmergeManager {
 	void startThreads();
 	void stopThreads();
 	bool isRunning();
+	size_t getThreadCount() const { return m_threads.size(); }
 
 	bool enqueueBlockEmerge(
 		u16 peer_id,
@@ -144,6 +149,14 @@ class EmergeManager {
 	int getGroundLevelAtPoint(v2s16 p);
 	bool isBlockUnderground(v3s16 blockpos);
 
+	/*
+		Sets the block positions of the connected players, by peer id.
+		Queued blocks nearer to a player are emerged first; the blocks
+		queued for a peer that has left, or that moved too far from them,
+		are cancelled.
+	*/
+	void updatePlayerPositions(const std::unordered_map<u16, v3s16> &positions);
+
 	static v3s16 getContainingChunk(v3s16 blockpos, s16 chunksize);
 
 private:
@@ -152,15 +165,20 @@ class EmergeManager {
 	bool m_threads_active = false;
 
 	std::mutex m_queue_mutex;
-	std::map<v3s16, BlockEmergeData> m_blocks_enqueued;
+	std::unordered_map<v3s16, BlockEmergeData> m_blocks_enqueued;
 	std::unordered_map<u16, u16> m_peer_queue_count;
+	EmergeQueue *m_queue = nullptr;
+	ChunkGenTracker *m_chunks_generating = nullptr;
+	std::unordered_map<u16, v3s16> m_player_positions;
 
 	u16 m_qlimit_total;
 	u16 m_qlimit_diskonly;
 	u16 m_qlimit_generate;
+	// Distance in blocks past which the blocks a peer asked for are cancelled
+	s16 m_cancel_distance;
 
 	// Requires m_queue_mutex held
-	EmergeThread *getOptimalThread();
+	float getBlockPriority(v3s16 pos);
 
 	bool pushBlockEmergeData(
 		v3s16 pos,
@@ -172,6 +190,17 @@ class EmergeManager {
 
 	bool popBlockEmergeData(v3s16 pos, BlockEmergeData *bedata);
 
+	// Requires m_queue_mutex held
+	void queueBlock(v3s16 pos, std::vector<EmergeThread *> *threads_to_signal);
+
+	/*
+		Chunks are generated in parallel as long as the areas they modify
+		don't intersect.  If the chunk of the block can't be generated yet,
+		the block is queued again once the chunk in the way is done.
+	*/
+	bool startChunkGen(v3s16 pos, const BlockEmergeData &bedata);
+	void finishChunkGen(v3s16 pos);
+
 	friend class EmergeThread;
 };
 
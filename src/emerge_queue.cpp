@@ -0,0 +1,209 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "emerge_queue.h"
+
+#include <cstdlib>
+#include "emerge.h"
+
+EmergeQueue::EmergeQueue(size_t num_threads, s16 chunksize):
+	m_chunksize(chunksize),
+	m_queues(num_threads),
+	m_working_chunks(num_threads, std::make_pair(false, v3s16()))
+{
+}
+
+v3s16 EmergeQueue::getChunk(v3s16 pos) const
+{
+	return EmergeManager::getContainingChunk(pos, m_chunksize);
+}
+
+size_t EmergeQueue::push(v3s16 pos, float priority)
+{
+	std::unordered_map<v3s16, Block>::const_iterator b = m_blocks.find(pos);
+	if (b != m_blocks.end())
+		return b->second.thread;
+
+	size_t thread;
+	v3s16 chunkpos = getChunk(pos);
+	std::unordered_map<v3s16, Chunk>::iterator c = m_chunks.find(chunkpos);
+	if (c != m_chunks.end()) {
+		thread = c->second.thread;
+		c->second.count++;
+	} else {
+		thread = 0;
+		for (size_t i = 1; i < m_queues.size(); i++) {
+			if (m_queues[i].size() < m_queues[thread].size())
+				thread = i;
+		}
+		Chunk &chunk = m_chunks[chunkpos];
+		chunk.thread = thread;
+		chunk.count = 1;
+	}
+
+	Block &block = m_blocks[pos];
+	block.thread = thread;
+	block.priority = priority;
+	block.seq = m_next_seq++;
+
+	Item item = {priority, block.seq, pos};
+	m_queues[thread].insert(item);
+
+	return thread;
+}
+
+bool EmergeQueue::pop(size_t thread, v3s16 *pos, bool *stolen)
+{
+	bool stole = false;
+	if (m_queues[thread].empty()) {
+		if (!steal(thread))
+			return false;
+		stole = true;
+	}
+
+	std::set<Item>::iterator it = m_queues[thread].begin();
+	*pos = it->pos;
+	m_queues[thread].erase(it);
+
+	std::unordered_map<v3s16, Block>::iterator b = m_blocks.find(*pos);
+	releaseChunk(*pos);
+	m_blocks.erase(b);
+
+	m_working_chunks[thread] = std::make_pair(true, getChunk(*pos));
+	if (stolen)
+		*stolen = stole;
+
+	return true;
+}
+
+bool EmergeQueue::steal(size_t thread)
+{
+	size_t victim = thread;
+	for (size_t i = 0; i < m_queues.size(); i++) {
+		if (i != thread && !m_queues[i].empty() &&
+				(victim == thread ||
+				m_queues[i].size() > m_queues[victim].size()))
+			victim = i;
+	}
+	if (victim == thread)
+		return false;
+
+	// The blocks of the chunk the victim is working on are better left
+	// to it, they will be in memory soon
+	const std::pair<bool, v3s16> &working = m_working_chunks[victim];
+	std::set<Item> &from = m_queues[victim];
+	std::set<Item>::const_iterator it = from.begin();
+	v3s16 chunkpos;
+	for (; it != from.end(); ++it) {
+		chunkpos = getChunk(it->pos);
+		if (!working.first || chunkpos != working.second)
+			break;
+	}
+	if (it == from.end())
+		return false;
+
+	// Take the whole chunk
+	std::set<Item> &to = m_queues[thread];
+	for (it = from.begin(); it != from.end();) {
+		if (getChunk(it->pos) != chunkpos) {
+			++it;
+			continue;
+		}
+		m_blocks[it->pos].thread = thread;
+		to.insert(*it);
+		from.erase(it++);
+	}
+	m_chunks[chunkpos].thread = thread;
+
+	return true;
+}
+
+bool EmergeQueue::remove(v3s16 pos)
+{
+	std::unordered_map<v3s16, Block>::iterator b = m_blocks.find(pos);
+	if (b == m_blocks.end())
+		return false;
+
+	Item item = {b->second.priority, b->second.seq, pos};
+	m_queues[b->second.thread].erase(item);
+	releaseChunk(pos);
+	m_blocks.erase(b);
+
+	return true;
+}
+
+void EmergeQueue::releaseChunk(v3s16 pos)
+{
+	std::unordered_map<v3s16, Chunk>::iterator c = m_chunks.find(getChunk(pos));
+	if (--c->second.count == 0)
+		m_chunks.erase(c);
+}
+
+void EmergeQueue::updatePriorities(
+	const std::function<float(v3s16)> &get_priority)
+{
+	for (size_t i = 0; i < m_queues.size(); i++) {
+		std::set<Item> queue;
+		for (std::set<Item>::const_iterator it = m_queues[i].begin();
+				it != m_queues[i].end(); ++it) {
+			Item item = *it;
+			item.priority = get_priority(item.pos);
+			m_blocks[item.pos].priority = item.priority;
+			queue.insert(item);
+		}
+		m_queues[i].swap(queue);
+	}
+}
+
+void EmergeQueue::getBlocks(std::vector<v3s16> *blocks) const
+{
+	blocks->reserve(blocks->size() + m_blocks.size());
+	for (std::unordered_map<v3s16, Block>::const_iterator
+			it = m_blocks.begin(); it != m_blocks.end(); ++it)
+		blocks->push_back(it->first);
+}
+
+bool ChunkGenTracker::tryStart(v3s16 chunkpos, v3s16 pos)
+{
+	// The areas include one block around the chunks
+	s16 min_distance = m_chunksize + 2;
+	for (std::unordered_map<v3s16, std::vector<v3s16>>::iterator
+			it = m_chunks.begin(); it != m_chunks.end(); ++it) {
+		v3s16 d = chunkpos - it->first;
+		if (abs(d.X) < min_distance && abs(d.Y) < min_distance &&
+				abs(d.Z) < min_distance) {
+			it->second.push_back(pos);
+			return false;
+		}
+	}
+
+	m_chunks[chunkpos];
+	return true;
+}
+
+void ChunkGenTracker::finish(v3s16 chunkpos, std::vector<v3s16> *waiting)
+{
+	std::unordered_map<v3s16, std::vector<v3s16>>::iterator
+		it = m_chunks.find(chunkpos);
+	if (it == m_chunks.end())
+		return;
+
+	waiting->insert(waiting->end(), it->second.begin(), it->second.end());
+	m_chunks.erase(it);
+}
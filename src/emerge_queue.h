@@ -0,0 +1,131 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef EMERGE_QUEUE_HEADER
+#define EMERGE_QUEUE_HEADER
+
+#include <functional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "irr_v3d.h"
+
+/*
+	Blocks waiting to be emerged, split between the emerge threads.
+
+	A thread takes the block of lowest priority value from its own queue;
+	blocks of equal priority go in the order they were pushed.  The blocks
+	of a mapchunk are queued for the same thread, so that one thread
+	generates the chunk and the others load its blocks from memory.
+
+	A thread whose queue is empty steals the best chunk of the thread with
+	the most queued blocks, leaving alone the chunk that thread is working
+	on.
+
+	Not thread-safe.
+*/
+class EmergeQueue
+{
+public:
+	EmergeQueue(size_t num_threads, s16 chunksize);
+
+	// Returns the thread the block is queued for
+	size_t push(v3s16 pos, float priority);
+	// stolen is set if the block was queued for another thread
+	bool pop(size_t thread, v3s16 *pos, bool *stolen = NULL);
+	bool remove(v3s16 pos);
+
+	// Calls get_priority for every queued block
+	void updatePriorities(const std::function<float(v3s16)> &get_priority);
+
+	void getBlocks(std::vector<v3s16> *blocks) const;
+	size_t size() const { return m_blocks.size(); }
+	size_t size(size_t thread) const { return m_queues[thread].size(); }
+
+private:
+	struct Item
+	{
+		float priority;
+		u32 seq;
+		v3s16 pos;
+
+		bool operator<(const Item &other) const
+		{
+			if (priority != other.priority)
+				return priority < other.priority;
+			return seq < other.seq;
+		}
+	};
+
+	struct Block
+	{
+		size_t thread;
+		float priority;
+		u32 seq;
+	};
+
+	struct Chunk
+	{
+		size_t thread;
+		u32 count;
+	};
+
+	v3s16 getChunk(v3s16 pos) const;
+	bool steal(size_t thread);
+	void releaseChunk(v3s16 pos);
+
+	s16 m_chunksize;
+	u32 m_next_seq = 0;
+	std::vector<std::set<Item>> m_queues;
+	std::unordered_map<v3s16, Block> m_blocks;
+	// Chunks having queued blocks
+	std::unordered_map<v3s16, Chunk> m_chunks;
+	// Chunk of the last block taken by each thread
+	std::vector<std::pair<bool, v3s16>> m_working_chunks;
+};
+
+/*
+	Mapchunks being generated.
+
+	The generation of a chunk reads and writes the blocks of the chunk and
+	the blocks around it.  Chunks whose areas don't intersect can be
+	generated in parallel; a block of a chunk that can't be generated yet
+	waits for the chunk in the way.
+
+	Not thread-safe.
+*/
+class ChunkGenTracker
+{
+public:
+	ChunkGenTracker(s16 chunksize): m_chunksize(chunksize) {}
+
+	// Fails if the chunk intersects one being generated, then pos waits
+	bool tryStart(v3s16 chunkpos, v3s16 pos);
+	// Gives the blocks that waited for the chunk
+	void finish(v3s16 chunkpos, std::vector<v3s16> *waiting);
+
+	size_t size() const { return m_chunks.size(); }
+
+private:
+	s16 m_chunksize;
+	// Waiting blocks of each chunk being generated
+	std::unordered_map<v3s16, std::vector<v3s16>> m_chunks;
+};
+
+#endif
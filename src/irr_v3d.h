@@ -23,10 +23,23 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes.h"
 
 #include <vector3d.h>
+#include <functional>
 
 typedef core::vector3df v3f;
 typedef core::vector3d<s16> v3s16;
 typedef core::vector3d<u16> v3u16;
 typedef core::vector3d<s32> v3s32;
 
+// Allows v3s16 to be used as key of std::unordered_map / std::unordered_set
+namespace std {
+	template <> struct hash<v3s16>
+	{
+		size_t operator()(const v3s16 &p) const
+		{
+			return std::hash<u64>()(((u64)(u16)p.X << 32) |
+				((u64)(u16)p.Y << 16) | (u64)(u16)p.Z);
+		}
+	};
+}
+
 #endif
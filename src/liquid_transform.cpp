@@ -0,0 +1,520 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "liquid_transform.h"
+
+#include <atomic>
+#include "map.h"
+#include "mapblock.h"
+#include "util/directiontables.h"
+#include "util/string.h"
+#include "threading/thread.h"
+#include "debug.h"
+
+/*
+	LiquidQueue
+*/
+
+bool LiquidQueue::push_back(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	std::unordered_map<v3s16, Block>::iterator b = m_blocks.find(blockpos);
+	if (b == m_blocks.end()) {
+		b = m_blocks.insert(std::make_pair(blockpos, Block())).first;
+		m_order.push_back(blockpos);
+	}
+
+	v3s16 rel = p - blockpos * MAP_BLOCKSIZE;
+	u16 index = (rel.Z * MAP_BLOCKSIZE + rel.Y) * MAP_BLOCKSIZE + rel.X;
+	if (b->second.queued[index])
+		return false;
+	b->second.queued[index] = true;
+	b->second.nodes.push_back(index);
+	m_size++;
+	return true;
+}
+
+bool LiquidQueue::popBlock(v3s16 *blockpos, std::vector<u16> *nodes)
+{
+	if (m_order.empty())
+		return false;
+
+	*blockpos = m_order.front();
+	m_order.pop_front();
+	std::unordered_map<v3s16, Block>::iterator b = m_blocks.find(*blockpos);
+	nodes->swap(b->second.nodes);
+	m_size -= nodes->size();
+	m_blocks.erase(b);
+	return true;
+}
+
+void LiquidQueue::shrink(size_t max_size)
+{
+	while (m_size > max_size) {
+		std::unordered_map<v3s16, Block>::iterator b =
+			m_blocks.find(m_order.front());
+		std::vector<u16> &nodes = b->second.nodes;
+		size_t count = m_size - max_size;
+		if (count >= nodes.size()) {
+			m_size -= nodes.size();
+			m_blocks.erase(b);
+			m_order.pop_front();
+			continue;
+		}
+		for (size_t i = 0; i < count; i++)
+			b->second.queued[nodes[i]] = false;
+		nodes.erase(nodes.begin(), nodes.begin() + count);
+		m_size -= count;
+	}
+}
+
+/*
+	LiquidTransformer
+*/
+
+#define WATER_DROP_BOOST 4
+
+enum NeighborType {
+	NEIGHBOR_UPPER,
+	NEIGHBOR_SAME_LEVEL,
+	NEIGHBOR_LOWER
+};
+struct NodeNeighbor {
+	MapNode n;
+	NeighborType t;
+	v3s16 p;
+
+	NodeNeighbor()
+		: n(CONTENT_AIR)
+	{ }
+
+	NodeNeighbor(const MapNode &node, NeighborType n_type, v3s16 pos)
+		: n(node),
+		  t(n_type),
+		  p(pos)
+	{ }
+};
+
+// Reads a node of the block of a transform or of its neighbors,
+// x, y and z are relative to the block and in [-1, MAP_BLOCKSIZE]
+static inline MapNode get_node(const LiquidBlockTransform *transform,
+	s16 x, s16 y, s16 z)
+{
+	MapBlock *block = transform->blocks[
+		(z + MAP_BLOCKSIZE) / MAP_BLOCKSIZE * 9 +
+		(y + MAP_BLOCKSIZE) / MAP_BLOCKSIZE * 3 +
+		(x + MAP_BLOCKSIZE) / MAP_BLOCKSIZE];
+	if (block == NULL)
+		return MapNode(CONTENT_IGNORE);
+	return block->getData()[
+		((z & (MAP_BLOCKSIZE - 1)) * MAP_BLOCKSIZE +
+		(y & (MAP_BLOCKSIZE - 1))) * MAP_BLOCKSIZE +
+		(x & (MAP_BLOCKSIZE - 1))];
+}
+
+LiquidTransformer::LiquidTransformer(INodeDefManager *ndef)
+{
+	m_liquids.resize(MAX_REGISTERED_CONTENT + 1);
+	for (content_t c = 0; c < m_liquids.size(); c++) {
+		const ContentFeatures &f = ndef->get(c);
+		Liquid &liquid = m_liquids[c];
+		liquid.type = f.liquid_type;
+		liquid.floodable = f.floodable;
+		liquid.renewable = f.liquid_renewable;
+		liquid.range = MYMIN(f.liquid_range, LIQUID_LEVEL_MAX + 1);
+		liquid.viscosity = f.liquid_viscosity;
+		liquid.flowing = ndef->getId(f.liquid_alternative_flowing);
+		liquid.source = ndef->getId(f.liquid_alternative_source);
+	}
+}
+
+void LiquidTransformer::prepare(Map *map, LiquidBlockTransform *transform)
+{
+	u32 i = 0;
+	for (s16 z = -1; z <= 1; z++)
+	for (s16 y = -1; y <= 1; y++)
+	for (s16 x = -1; x <= 1; x++, i++) {
+		MapBlock *block = map->getBlockNoCreateNoEx(
+			transform->blockpos + v3s16(x, y, z));
+		transform->blocks[i] = block && !block->isDummy() ? block : NULL;
+	}
+}
+
+void LiquidTransformer::evaluate(LiquidBlockTransform *transform) const
+{
+	transform->changes.clear();
+	transform->queued.clear();
+	transform->reflow.clear();
+	if (transform->blocks[13] == NULL)
+		return;
+
+	for (size_t i = 0; i < transform->nodes.size(); i++)
+		evaluateNode(transform, transform->nodes[i]);
+}
+
+void LiquidTransformer::evaluateNode(LiquidBlockTransform *transform,
+	u16 index) const
+{
+	s16 rx = index % MAP_BLOCKSIZE;
+	s16 ry = index / MAP_BLOCKSIZE % MAP_BLOCKSIZE;
+	s16 rz = index / (MAP_BLOCKSIZE * MAP_BLOCKSIZE);
+	v3s16 p0 = transform->blockpos * MAP_BLOCKSIZE + v3s16(rx, ry, rz);
+	MapNode n0 = get_node(transform, rx, ry, rz);
+
+	/*
+		Collect information about current node
+	 */
+	s8 liquid_level = -1;
+	// The liquid node which will be placed there if
+	// the liquid flows into this node.
+	content_t liquid_kind = CONTENT_IGNORE;
+	// The node which will be placed there if liquid
+	// can't flow into this node.
+	content_t floodable_node = CONTENT_AIR;
+	const Liquid &cf = get(n0.getContent());
+	LiquidType liquid_type = cf.type;
+	switch (liquid_type) {
+		case LIQUID_SOURCE:
+			liquid_level = LIQUID_LEVEL_SOURCE;
+			liquid_kind = cf.flowing;
+			break;
+		case LIQUID_FLOWING:
+			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+			liquid_kind = n0.getContent();
+			break;
+		case LIQUID_NONE:
+			// if this node is 'floodable', it *could* be transformed
+			// into a liquid, otherwise, continue with the next node.
+			if (!cf.floodable)
+				return;
+			floodable_node = n0.getContent();
+			liquid_kind = CONTENT_AIR;
+			break;
+	}
+
+	/*
+		Collect information about the environment
+	 */
+	const v3s16 *dirs = g_6dirs;
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	int num_neutrals = 0; // nodes that are solid or another kind of liquid
+	bool flowing_down = false;
+	bool ignored_sources = false;
+	for (u16 i = 0; i < 6; i++) {
+		NeighborType nt = NEIGHBOR_SAME_LEVEL;
+		switch (i) {
+			case 1:
+				nt = NEIGHBOR_UPPER;
+				break;
+			case 4:
+				nt = NEIGHBOR_LOWER;
+				break;
+		}
+		v3s16 npos = p0 + dirs[i];
+		NodeNeighbor nb(get_node(transform, rx + dirs[i].X, ry + dirs[i].Y,
+			rz + dirs[i].Z), nt, npos);
+		const Liquid &cfnb = get(nb.n.getContent());
+		switch (cfnb.type) {
+			case LIQUID_NONE:
+				if (cfnb.floodable) {
+					airs[num_airs++] = nb;
+					// if the current node is a water source the neighbor
+					// should be enqueded for transformation regardless of whether the
+					// current node changes or not.
+					if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+						transform->queued.push_back(npos);
+					// if the current node happens to be a flowing node, it will start to flow down here.
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				} else {
+					num_neutrals++;
+					if (nb.n.getContent() == CONTENT_IGNORE) {
+						// If node below is ignore prevent water from
+						// spreading outwards and otherwise prevent from
+						// flowing away as ignore node might be the source
+						if (nb.t == NEIGHBOR_LOWER)
+							flowing_down = true;
+						else
+							ignored_sources = true;
+					}
+				}
+				break;
+			case LIQUID_SOURCE:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = cfnb.flowing;
+				if (cfnb.flowing != liquid_kind) {
+					num_neutrals++;
+				} else {
+					// Do not count bottom source, it will screw things up
+					if(dirs[i].Y != -1)
+						sources[num_sources++] = nb;
+				}
+				break;
+			case LIQUID_FLOWING:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = cfnb.flowing;
+				if (cfnb.flowing != liquid_kind) {
+					num_neutrals++;
+				} else {
+					flows[num_flows++] = nb;
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				}
+				break;
+		}
+	}
+
+	/*
+		decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+
+	const Liquid &kind = get(liquid_kind);
+	u8 range = kind.range;
+
+	if ((num_sources >= 2 && kind.renewable) || liquid_type == LIQUID_SOURCE) {
+		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+		// or the flowing alternative of the first of the surrounding sources (if it's air), so
+		// it's perfectly safe to use liquid_kind here to determine the new node content.
+		new_node_content = kind.source;
+	} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
+		// liquid_kind is set properly, see above
+		max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+		if (new_node_level >= (LIQUID_LEVEL_MAX + 1 - range))
+			new_node_content = liquid_kind;
+		else
+			new_node_content = floodable_node;
+	} else if (ignored_sources && liquid_level >= 0) {
+		// Maybe there are neighbouring sources that aren't loaded yet
+		// so prevent flowing away.
+		new_node_level = liquid_level;
+		new_node_content = liquid_kind;
+	} else {
+		// no surrounding sources, so get the maximum level that can flow into this node
+		for (u16 i = 0; i < num_flows; i++) {
+			u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+			switch (flows[i].t) {
+				case NEIGHBOR_UPPER:
+					if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
+						max_node_level = LIQUID_LEVEL_MAX;
+						if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+							max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+					} else if (nb_liquid_level > max_node_level) {
+						max_node_level = nb_liquid_level;
+					}
+					break;
+				case NEIGHBOR_LOWER:
+					break;
+				case NEIGHBOR_SAME_LEVEL:
+					if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+							nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level)
+						max_node_level = nb_liquid_level - 1;
+					break;
+			}
+		}
+
+		u8 viscosity = kind.viscosity;
+		if (viscosity > 1 && max_node_level != liquid_level) {
+			// amount to gain, limited by viscosity
+			// must be at least 1 in absolute value
+			s8 level_inc = max_node_level - liquid_level;
+			if (level_inc < -viscosity || level_inc > viscosity)
+				new_node_level = liquid_level + level_inc/viscosity;
+			else if (level_inc < 0)
+				new_node_level = liquid_level - 1;
+			else if (level_inc > 0)
+				new_node_level = liquid_level + 1;
+			if (new_node_level != max_node_level)
+				transform->reflow.push_back(p0);
+		} else {
+			new_node_level = max_node_level;
+		}
+
+		if (max_node_level >= (LIQUID_LEVEL_MAX + 1 - range))
+			new_node_content = liquid_kind;
+		else
+			new_node_content = floodable_node;
+
+	}
+
+	/*
+		check if anything has changed. if not, just continue with the next node.
+	 */
+	if (new_node_content == n0.getContent() &&
+			(liquid_type != LIQUID_FLOWING ||
+			((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+			((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+			== flowing_down)))
+		return;
+
+	/*
+		the new node
+	 */
+	LiquidChange change;
+	change.p = p0;
+	change.oldnode = n0;
+	change.flood = floodable_node != CONTENT_AIR;
+	LiquidType new_type = get(new_node_content).type;
+	if (new_type == LIQUID_FLOWING) {
+		// set level to last 3 bits, flowing down bit to 4th bit
+		n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	} else {
+		// set the liquid level and flow bit to 0
+		n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	}
+	n0.setContent(new_node_content);
+	change.newnode = n0;
+
+	/*
+		neighbors to enqueue for update once the node is changed
+	 */
+	change.num_neighbors = 0;
+	switch (new_type) {
+		case LIQUID_SOURCE:
+		case LIQUID_FLOWING:
+			// make sure source flows into all neighboring nodes
+			for (u16 i = 0; i < num_flows; i++)
+				if (flows[i].t != NEIGHBOR_UPPER)
+					change.neighbors[change.num_neighbors++] = flows[i].p;
+			for (u16 i = 0; i < num_airs; i++)
+				if (airs[i].t != NEIGHBOR_UPPER)
+					change.neighbors[change.num_neighbors++] = airs[i].p;
+			break;
+		case LIQUID_NONE:
+			// this flow has turned to air; neighboring flows might need to do the same
+			for (u16 i = 0; i < num_flows; i++)
+				change.neighbors[change.num_neighbors++] = flows[i].p;
+			break;
+	}
+	transform->changes.push_back(change);
+}
+
+/*
+	LiquidTransformPool
+*/
+
+/*
+	Block transforms shared between the threads of a LiquidTransformPool
+*/
+struct LiquidTransformBatch
+{
+	const LiquidTransformer *transformer;
+	std::vector<LiquidBlockTransform> *transforms;
+	std::atomic<size_t> next;
+
+	void work()
+	{
+		for (;;) {
+			size_t i = next++;
+			if (i >= transforms->size())
+				return;
+			transformer->evaluate(&(*transforms)[i]);
+		}
+	}
+};
+
+class LiquidTransformThread : public Thread
+{
+public:
+	LiquidTransformThread(int id, Semaphore &done):
+		Thread("Liquid" + itos(id)),
+		m_done(done)
+	{}
+
+	void startBatch(LiquidTransformBatch *batch)
+	{
+		m_batch = batch;
+		m_start.post();
+	}
+
+	void stopAndWait()
+	{
+		stop();
+		m_start.post();
+		wait();
+	}
+
+protected:
+	void *run();
+
+private:
+	Semaphore m_start;
+	Semaphore &m_done;
+	LiquidTransformBatch *m_batch = nullptr;
+};
+
+void *LiquidTransformThread::run()
+{
+	DSTACK(FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	for (;;) {
+		m_start.wait();
+		if (stopRequested())
+			break;
+		m_batch->work();
+		m_done.post();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER
+	return NULL;
+}
+
+LiquidTransformPool::LiquidTransformPool(u16 num_threads)
+{
+	for (u16 i = 1; i < num_threads; i++) {
+		LiquidTransformThread *thread = new LiquidTransformThread(i, m_done);
+		thread->start();
+		m_threads.push_back(thread);
+	}
+}
+
+LiquidTransformPool::~LiquidTransformPool()
+{
+	for (std::vector<LiquidTransformThread *>::iterator
+			i = m_threads.begin(); i != m_threads.end(); ++i) {
+		(*i)->stopAndWait();
+		delete *i;
+	}
+}
+
+void LiquidTransformPool::evaluate(const LiquidTransformer &transformer,
+	std::vector<LiquidBlockTransform> &transforms)
+{
+	LiquidTransformBatch batch;
+	batch.transformer = &transformer;
+	batch.transforms = &transforms;
+	batch.next = 0;
+
+	for (std::vector<LiquidTransformThread *>::iterator
+			i = m_threads.begin(); i != m_threads.end(); ++i)
+		(*i)->startBatch(&batch);
+	batch.work();
+	for (size_t i = 0; i < m_threads.size(); i++)
+		m_done.wait();
+}
@@ -0,0 +1,161 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef LIQUID_TRANSFORM_HEADER
+#define LIQUID_TRANSFORM_HEADER
+
+#include <bitset>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include "irr_v3d.h"
+#include "constants.h"
+#include "mapnode.h"
+#include "nodedef.h"
+#include "threading/semaphore.h"
+
+class Map;
+class MapBlock;
+class LiquidTransformThread;
+
+/*
+	Nodes waiting for a liquid transform, bucketed by map block.
+
+	Blocks are taken in the order they were first queued.  A node queued
+	after its block was taken waits for the next transform.
+
+	Not thread-safe.
+*/
+class LiquidQueue
+{
+public:
+	// Does nothing if the node is already queued
+	bool push_back(v3s16 p);
+	// Takes the nodes of the block queued first, as indices in the block
+	bool popBlock(v3s16 *blockpos, std::vector<u16> *nodes);
+	// Drops the oldest nodes until at most max_size are left
+	void shrink(size_t max_size);
+
+	size_t size() const { return m_size; }
+	size_t blockCount() const { return m_blocks.size(); }
+
+private:
+	struct Block
+	{
+		std::bitset<MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE> queued;
+		std::vector<u16> nodes;
+	};
+
+	std::unordered_map<v3s16, Block> m_blocks;
+	std::deque<v3s16> m_order;
+	size_t m_size = 0;
+};
+
+/*
+	A node changed by a liquid transform
+*/
+struct LiquidChange
+{
+	v3s16 p;
+	MapNode oldnode;
+	MapNode newnode;
+	// The old node is floodable, on_flood() is called
+	bool flood;
+	// Nodes to queue once the node is changed
+	u8 num_neighbors;
+	v3s16 neighbors[6];
+};
+
+/*
+	The liquid transform of the queued nodes of one map block.
+
+	The nodes are evaluated against the map as it was when the transform
+	started; the changes are applied afterwards, on the server thread.
+*/
+struct LiquidBlockTransform
+{
+	v3s16 blockpos;
+	std::vector<u16> nodes;
+	// The block and its 26 neighbors, NULL if not loaded:
+	// blocks[(z + 1) * 9 + (y + 1) * 3 + (x + 1)] is at blockpos + (x, y, z)
+	MapBlock *blocks[27];
+
+	// Results
+	std::vector<LiquidChange> changes;
+	// Nodes to queue whatever happens to the changes
+	std::vector<v3s16> queued;
+	// Nodes that did not reach their level because of viscosity
+	std::vector<v3s16> reflow;
+};
+
+/*
+	Decides how liquids flow, one map block at a time.
+*/
+class LiquidTransformer
+{
+public:
+	// The node definitions must not change afterwards
+	LiquidTransformer(INodeDefManager *ndef);
+
+	// Looks up the blocks of a transform, on the server thread
+	static void prepare(Map *map, LiquidBlockTransform *transform);
+	// Only reads the map, may run on any thread
+	void evaluate(LiquidBlockTransform *transform) const;
+
+private:
+	struct Liquid
+	{
+		LiquidType type;
+		bool floodable;
+		bool renewable;
+		u8 range;
+		u8 viscosity;
+		content_t flowing;
+		content_t source;
+	};
+
+	inline const Liquid &get(content_t c) const
+	{
+		return m_liquids[c < m_liquids.size() ? c : CONTENT_UNKNOWN];
+	}
+
+	void evaluateNode(LiquidBlockTransform *transform, u16 index) const;
+
+	std::vector<Liquid> m_liquids;
+};
+
+/*
+	Evaluates block transforms on several threads. The calling thread
+	takes part in every batch, so a pool of n threads runs n - 1 workers.
+*/
+class LiquidTransformPool
+{
+public:
+	LiquidTransformPool(u16 num_threads);
+	~LiquidTransformPool();
+
+	void evaluate(const LiquidTransformer &transformer,
+		std::vector<LiquidBlockTransform> &transforms);
+
+private:
+	std::vector<LiquidTransformThread *> m_threads;
+	Semaphore m_done;
+};
+
+#endif
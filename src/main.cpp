@@ -35,6 +35,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "httpfetch.h"
 #include "guiEngine.h"
 #include "map.h"
+#include "mapblock.h"
+#include "emerge.h"
+#include "profiler.h"
 #include "player.h"
 #include "mapsector.h"
 #include "fontengine.h"
@@ -104,6 +107,7 @@ static bool determine_subgame(GameParams *game_params);
 
 static bool run_dedicated_server(const GameParams &game_params, const Settings &cmd_args);
 static bool migrate_map_database(const GameParams &game_params, const Settings &cmd_args);
+static bool pregenerate_map(const GameParams &game_params, const Settings &cmd_args);
 
 /**********************************************************************/
 
@@ -277,6 +281,8 @@ static void set_allowed_options(OptionList *allowed_options)
 			_("Migrate from current map backend to another (Only works when using minetestserver or with --server)"))));
 	allowed_options->insert(std::make_pair("migrate-players", ValueSpec(VALUETYPE_STRING,
 		_("Migrate from current players backend to another (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("pregenerate", ValueSpec(VALUETYPE_STRING,
+		_("Generate the map between two block positions \"(x1,y1,z1) (x2,y2,z2)\" and exit (Only works when using minetestserver or with --server)"))));
 	allowed_options->insert(std::make_pair("terminal", ValueSpec(VALUETYPE_FLAG,
 			_("Feature an interactive terminal (Only works when using minetestserver or with --server)"))));
 #ifndef SERVER
@@ -817,6 +823,10 @@ static bool run_dedicated_server(const GameParams &game_params, const Settings &
 	else if (cmd_args.exists("migrate-players"))
 		return ServerEnvironment::migratePlayersDatabase(game_params, cmd_args);
 
+	// Map pregeneration
+	if (cmd_args.exists("pregenerate"))
+		return pregenerate_map(game_params, cmd_args);
+
 	if (cmd_args.exists("terminal")) {
 #if USE_CURSES
 		bool name_ok = true;
@@ -966,3 +976,206 @@ static bool migrate_map_database(const GameParams &game_params, const Settings &
 
 	return true;
 }
+
+struct PregenerateState
+{
+	std::mutex mutex;
+	u32 pending = 0;
+	u32 generated = 0;
+	u32 existing = 0;
+	u32 failed = 0;
+};
+
+static void pregenerate_callback(v3s16 blockpos, EmergeAction action, void *param)
+{
+	PregenerateState *state = (PregenerateState *)param;
+	MutexAutoLock lock(state->mutex);
+
+	state->pending--;
+	if (action == EMERGE_GENERATED)
+		state->generated++;
+	else if (action == EMERGE_FROM_DISK || action == EMERGE_FROM_MEMORY)
+		state->existing++;
+	else
+		state->failed++;
+}
+
+static bool pregenerate_map(const GameParams &game_params, const Settings &cmd_args)
+{
+	int c[6];
+	if (sscanf(cmd_args.get("pregenerate").c_str(), "(%d,%d,%d) (%d,%d,%d)",
+			&c[0], &c[1], &c[2], &c[3], &c[4], &c[5]) != 6) {
+		errorstream << "Invalid area to pregenerate, expected two block positions"
+			<< " \"(x1,y1,z1) (x2,y2,z2)\"" << std::endl;
+		return false;
+	}
+
+	s16 limit = MAX_MAP_GENERATION_LIMIT / MAP_BLOCKSIZE;
+	for (int i = 0; i < 6; i++)
+		c[i] = rangelim(c[i], -limit, limit);
+	v3s16 bpmin(MYMIN(c[0], c[3]), MYMIN(c[1], c[4]), MYMIN(c[2], c[5]));
+	v3s16 bpmax(MYMAX(c[0], c[3]), MYMAX(c[1], c[4]), MYMAX(c[2], c[5]));
+
+	std::ostringstream area;
+	area << PP(bpmin) << " " << PP(bpmax);
+
+	// Outlives the server, whose emerge threads run the callbacks
+	PregenerateState state;
+
+	try {
+		Server server(game_params.world_path, game_params.game_spec, false,
+			false, true);
+		EmergeManager *emerge = server.getEmergeManager();
+		s16 csize = emerge->mgparams->chunksize;
+		u32 blocks_per_chunk = csize * csize * csize;
+
+		// One block of each chunk in the area; the chunks of a column are
+		// generated one above the other, which reuses their 2D noise
+		std::vector<v3s16> chunks;
+		v3s16 cmin = EmergeManager::getContainingChunk(bpmin, csize);
+		v3s16 cmax = EmergeManager::getContainingChunk(bpmax, csize);
+		for (s16 x = cmin.X; x <= cmax.X; x += csize)
+		for (s16 z = cmin.Z; z <= cmax.Z; z += csize)
+		for (s16 y = cmin.Y; y <= cmax.Y; y += csize) {
+			v3s16 p(MYMAX(x, bpmin.X), MYMAX(y, bpmin.Y), MYMAX(z, bpmin.Z));
+			if (!blockpos_over_max_limit(p))
+				chunks.push_back(p);
+		}
+
+		// Resume where a previous run on the same area stopped
+		std::string progress_path = game_params.world_path + DIR_DELIM +
+			"pregenerate.txt";
+		Settings progress;
+		u32 done = 0;
+		if (progress.readConfigFile(progress_path.c_str()) &&
+				progress.exists("area") && progress.get("area") == area.str()) {
+			done = MYMIN(progress.getU32("chunks_done"), (u32)chunks.size());
+			actionstream << "Resuming pregeneration after " << done << " of "
+				<< chunks.size() << " chunks" << std::endl;
+		}
+		progress.set("area", area.str());
+
+		// Every batch is saved at once, then unloaded
+		u32 batch_size = MYMAX(emerge->getThreadCount(), (size_t)1) * 8;
+		u32 start_done = done;
+		u64 start_time = porting::getTimeMs();
+		u64 save_time = 0;
+		u64 last_update_time = 0;
+		bool &kill = *porting::signal_handler_killstatus();
+
+		g_profiler->clear();
+		emerge->startThreads();
+
+		while (done < chunks.size() && !kill) {
+			u32 batch_end = MYMIN(done + batch_size, (u32)chunks.size());
+			{
+				MutexAutoLock lock(state.mutex);
+				state.pending = batch_end - done;
+			}
+			for (u32 i = done; i < batch_end; i++) {
+				emerge->enqueueBlockEmergeEx(chunks[i], PEER_ID_INEXISTENT,
+					BLOCK_EMERGE_ALLOW_GEN | BLOCK_EMERGE_FORCE_QUEUE,
+					pregenerate_callback, &state);
+			}
+
+			for (;;) {
+				u32 pending;
+				{
+					MutexAutoLock lock(state.mutex);
+					pending = state.pending;
+				}
+				if (pending == 0 || kill)
+					break;
+
+				// Throws if an emerge thread failed
+				server.step(0.0f);
+
+				u64 now = porting::getTimeMs();
+				if (now - last_update_time >= 1000) {
+					u32 chunks_done = batch_end - pending - start_done;
+					std::cerr << " Pregenerated " << (batch_end - pending)
+						<< " of " << chunks.size() << " chunks, "
+						<< (1000.0f * chunks_done * blocks_per_chunk /
+							MYMAX(now - start_time, (u64)1))
+						<< " blocks/s\r";
+					last_update_time = now;
+				}
+				sleep_ms(10);
+			}
+
+			// The server steps don't run here, light the nodes changed by
+			// on_generated callbacks before the blocks are saved
+			{
+				MutexAutoLock envlock(server.m_env_mutex);
+				std::map<v3s16, MapBlock*> modified_blocks;
+				server.getMap().updateLighting(modified_blocks, 0);
+			}
+			if (kill)
+				break;
+
+			u64 save_start = porting::getTimeMs();
+			{
+				MutexAutoLock envlock(server.m_env_mutex);
+				server.getMap().unloadUnreferencedBlocks();
+			}
+			done = batch_end;
+			progress.setU64("chunks_done", done);
+			std::ostringstream os(std::ios_base::binary);
+			progress.writeLines(os);
+			if (!fs::safeWriteToFile(progress_path, os.str()))
+				errorstream << "Failed to write " << progress_path << std::endl;
+			save_time += porting::getTimeMs() - save_start;
+		}
+		std::cerr << std::endl;
+
+		float elapsed = (porting::getTimeMs() - start_time) / 1000.0f;
+		MutexAutoLock lock(state.mutex);
+		u32 blocks = state.generated * blocks_per_chunk;
+		actionstream << "Pregenerated " << state.generated << " chunks ("
+			<< blocks << " blocks) in " << elapsed << " s, "
+			<< (blocks / MYMAX(elapsed, 0.001f)) << " blocks/s with "
+			<< emerge->getThreadCount() << " emerge threads" << std::endl;
+		if (state.existing > 0)
+			actionstream << state.existing << " chunks were already generated"
+				<< std::endl;
+		if (state.failed > 0)
+			errorstream << state.failed << " chunks could not be generated"
+				<< std::endl;
+
+		if (state.generated > 0) {
+			// Summed over the threads
+			float make_chunk = g_profiler->getValue(
+				"EmergeThread: Mapgen::makeChunk") * 1000;
+			float caves = g_profiler->getValue(
+				"EmergeThread: mapgen caves") * 1000 / state.generated;
+			float ores = g_profiler->getValue(
+				"EmergeThread: mapgen ores") * 1000 / state.generated;
+			float decorations = g_profiler->getValue(
+				"EmergeThread: mapgen decorations") * 1000 / state.generated;
+			float lighting = g_profiler->getValue(
+				"EmergeThread: mapgen lighting update") * 1000;
+			float finish = g_profiler->getValue(
+				"EmergeThread: after Mapgen::makeChunk") * 1000;
+			float save = (float)save_time / state.generated;
+
+			actionstream << "Time per chunk in ms, by stage:" << std::endl
+				<< "  noise and terrain: "
+				<< MYMAX(make_chunk - caves - ores - decorations - lighting, 0.0f)
+				<< std::endl
+				<< "  caves:             " << caves << std::endl
+				<< "  ores:              " << ores << std::endl
+				<< "  decorations:       " << decorations << std::endl
+				<< "  lighting:          " << lighting << std::endl
+				<< "  blit back, Lua:    " << finish << std::endl
+				<< "  save:              " << save << std::endl;
+		}
+	} catch (const ModError &e) {
+		errorstream << "ModError: " << e.what() << std::endl;
+		return false;
+	} catch (const ServerError &e) {
+		errorstream << "ServerError: " << e.what() << std::endl;
+		return false;
+	}
+
+	return !*porting::signal_handler_killstatus();
+}
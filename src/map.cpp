@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "mapsector.h"
 #include "mapblock.h"
+#include "mapblock_serializer.h"
 #include "filesys.h"
 #include "voxel.h"
 #include "voxelalgorithms.h"
@@ -33,6 +34,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gamedef.h"
 #include "util/directiontables.h"
 #include "util/basic_macros.h"
+#include "threading/thread.h"
 #include "rollback_interface.h"
 #include "environment.h"
 #include "reflowscan.h"
@@ -45,6 +47,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "database-dummy.h"
 #include "database-sqlite3.h"
 #include "script/scripting_server.h"
+#include <atomic>
 #include <deque>
 #include <queue>
 #if USE_LEVELDB
@@ -79,6 +82,9 @@ Map::~Map()
 	{
 		delete i->second;
 	}
+
+	delete m_liquid_pool;
+	delete m_liquid_transformer;
 }
 
 void Map::addEventReceiver(MapEventReceiver *event_receiver)
@@ -136,13 +142,70 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 	return sector;
 }
 
+/*
+	Per-thread cache of the blocks last looked up by getBlockNoCreateNoEx(),
+	most recently used first. Adding or removing a block anywhere bumps
+	g_block_index_generation, which empties the caches of all threads.
+*/
+#define BLOCK_LOOKUP_CACHE_SIZE 4
+
+struct BlockLookupCache
+{
+	const Map *map;
+	u32 generation;
+	u32 count;
+	v3s16 pos[BLOCK_LOOKUP_CACHE_SIZE];
+	MapBlock *block[BLOCK_LOOKUP_CACHE_SIZE];
+};
+
+static std::atomic<u32> g_block_index_generation(0);
+static thread_local BlockLookupCache t_block_lookup_cache;
+
+void Map::indexBlock(MapBlock *block)
+{
+	m_blocks[block->getPos()] = block;
+	g_block_index_generation++;
+}
+
+void Map::unindexBlock(v3s16 blockpos)
+{
+	m_blocks.erase(blockpos);
+	g_block_index_generation++;
+}
+
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
+	BlockLookupCache &cache = t_block_lookup_cache;
+	u32 generation = g_block_index_generation;
+	if (cache.map != this || cache.generation != generation) {
+		cache.map = this;
+		cache.generation = generation;
+		cache.count = 0;
+	}
+
+	MapBlock *block;
+	u32 i = 0;
+	while (i < cache.count && cache.pos[i] != p3d)
+		i++;
+	if (i < cache.count) {
+		block = cache.block[i];
+	} else {
+		std::unordered_map<v3s16, MapBlock *>::const_iterator n =
+			m_blocks.find(p3d);
+		block = (n != m_blocks.end() ? n->second : NULL);
+		if (cache.count < BLOCK_LOOKUP_CACHE_SIZE)
+			cache.count++;
+		i = cache.count - 1;
+	}
+
+	// Move to front
+	for (; i > 0; i--) {
+		cache.pos[i] = cache.pos[i - 1];
+		cache.block[i] = cache.block[i - 1];
+	}
+	cache.pos[0] = p3d;
+	cache.block[0] = block;
+
 	return block;
 }
 
@@ -253,9 +316,17 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	setNode(p, n);
 
 	// Update lighting
-	std::vector<std::pair<v3s16, MapNode> > oldnodes;
-	oldnodes.push_back(std::pair<v3s16, MapNode>(p, oldnode));
-	voxalgo::update_lighting_nodes(this, oldnodes, modified_blocks);
+	if (m_lighting_deferred) {
+		m_lighting_queue.push(p, oldnode);
+		// Keep the block loaded until its update
+		MapBlock *block = getBlockNoCreateNoEx(getNodeBlockPos(p));
+		block->resetUsageTimer();
+		modified_blocks[block->getPos()] = block;
+	} else {
+		std::vector<std::pair<v3s16, MapNode> > oldnodes;
+		oldnodes.push_back(std::pair<v3s16, MapNode>(p, oldnode));
+		voxalgo::update_lighting_nodes(this, oldnodes, modified_blocks);
+	}
 
 	for(std::map<v3s16, MapBlock*>::iterator
 			i = modified_blocks.begin();
@@ -299,6 +370,20 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	}
 }
 
+void Map::updateLighting(std::map<v3s16, MapBlock*> &modified_blocks,
+		u32 max_time_ms)
+{
+	std::map<v3s16, MapBlock*> lighting_modified_blocks;
+	m_lighting_queue.update(this, max_time_ms, lighting_modified_blocks);
+
+	for (std::map<v3s16, MapBlock*>::iterator
+			i = lighting_modified_blocks.begin();
+			i != lighting_modified_blocks.end(); ++i) {
+		i->second->expireDayNightDiff();
+		modified_blocks[i->first] = i->second;
+	}
+}
+
 void Map::removeNodeAndUpdate(v3s16 p,
 		std::map<v3s16, MapBlock*> &modified_blocks)
 {
@@ -544,30 +629,6 @@ void Map::PrintInfo(std::ostream &out)
 	out<<"Map: ";
 }
 
-#define WATER_DROP_BOOST 4
-
-enum NeighborType {
-	NEIGHBOR_UPPER,
-	NEIGHBOR_SAME_LEVEL,
-	NEIGHBOR_LOWER
-};
-struct NodeNeighbor {
-	MapNode n;
-	NeighborType t;
-	v3s16 p;
-	bool l; //can liquid
-
-	NodeNeighbor()
-		: n(CONTENT_AIR)
-	{ }
-
-	NodeNeighbor(const MapNode &node, NeighborType n_type, v3s16 pos)
-		: n(node),
-		  t(n_type),
-		  p(pos)
-	{ }
-};
-
 void Map::transforming_liquid_add(v3s16 p) {
         m_transforming_liquid.push_back(p);
 }
@@ -576,337 +637,144 @@ s32 Map::transforming_liquid_size() {
         return m_transforming_liquid.size();
 }
 
+void Map::setLiquidTransformThreads(u16 num_threads)
+{
+	delete m_liquid_pool;
+	m_liquid_pool = NULL;
+	if (num_threads > 1)
+		m_liquid_pool = new LiquidTransformPool(num_threads);
+}
+
 void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks,
 		ServerEnvironment *env)
 {
 	DSTACK(FUNCTION_NAME);
 	//TimeTaker timer("transformLiquids()");
 
-	u32 loopcount = 0;
-	u32 initial_size = m_transforming_liquid.size();
-
-	/*if(initial_size != 0)
-		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
-
-	// list of nodes that due to viscosity have not reached their max level height
-	std::deque<v3s16> must_reflow;
-
-	std::vector<std::pair<v3s16, MapNode> > changed_nodes;
-
 	u32 liquid_loop_max = g_settings->getS32("liquid_loop_max");
-	u32 loop_max = liquid_loop_max;
 
-#if 0
+	g_profiler->avg("Map: liquid queue size", m_transforming_liquid.size());
 
-	/* If liquid_loop_max is not keeping up with the queue size increase
-	 * loop_max up to a maximum of liquid_loop_max * dedicated_server_step.
+	/*
+		Take whole blocks of queued nodes, at least one block
 	 */
-	if (m_transforming_liquid.size() > loop_max * 2) {
-		// "Burst" mode
-		float server_step = g_settings->getFloat("dedicated_server_step");
-		if (m_transforming_liquid_loop_count_multiplier - 1.0 < server_step)
-			m_transforming_liquid_loop_count_multiplier *= 1.0 + server_step / 10;
-	} else {
-		m_transforming_liquid_loop_count_multiplier = 1.0;
-	}
-
-	loop_max *= m_transforming_liquid_loop_count_multiplier;
-#endif
-
-	while (m_transforming_liquid.size() != 0)
-	{
-		// This should be done here so that it is done when continue is used
-		if (loopcount >= initial_size || loopcount >= loop_max)
+	std::vector<LiquidBlockTransform> transforms;
+	u32 loopcount = 0;
+	while (loopcount < liquid_loop_max || transforms.empty()) {
+		LiquidBlockTransform transform;
+		if (!m_transforming_liquid.popBlock(&transform.blockpos, &transform.nodes))
 			break;
-		loopcount++;
-
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.front();
-		m_transforming_liquid.pop_front();
-
-		MapNode n0 = getNodeNoEx(p0);
+		loopcount += transform.nodes.size();
+		LiquidTransformer::prepare(this, &transform);
+		transforms.push_back(transform);
+	}
 
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		// The liquid node which will be placed there if
-		// the liquid flows into this node.
-		content_t liquid_kind = CONTENT_IGNORE;
-		// The node which will be placed there if liquid
-		// can't flow into this node.
-		content_t floodable_node = CONTENT_AIR;
-		const ContentFeatures &cf = m_nodedef->get(n0);
-		LiquidType liquid_type = cf.liquid_type;
-		switch (liquid_type) {
-			case LIQUID_SOURCE:
-				liquid_level = LIQUID_LEVEL_SOURCE;
-				liquid_kind = m_nodedef->getId(cf.liquid_alternative_flowing);
-				break;
-			case LIQUID_FLOWING:
-				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-				liquid_kind = n0.getContent();
-				break;
-			case LIQUID_NONE:
-				// if this node is 'floodable', it *could* be transformed
-				// into a liquid, otherwise, continue with the next node.
-				if (!cf.floodable)
-					continue;
-				floodable_node = n0.getContent();
-				liquid_kind = CONTENT_AIR;
-				break;
-		}
+	/*
+		Decide on the new nodes. Nothing writes to the map meanwhile, so
+		the blocks can be evaluated in parallel.
+	 */
+	u64 t0 = porting::getTimeUs();
+	if (!transforms.empty()) {
+		if (!m_liquid_transformer)
+			m_liquid_transformer = new LiquidTransformer(m_nodedef);
+		if (m_liquid_pool)
+			m_liquid_pool->evaluate(*m_liquid_transformer, transforms);
+		else
+			for (size_t i = 0; i < transforms.size(); i++)
+				m_liquid_transformer->evaluate(&transforms[i]);
+	}
 
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		bool ignored_sources = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 1:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 4:
-					nt = NEIGHBOR_LOWER;
-					break;
-			}
-			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb(getNodeNoEx(npos), nt, npos);
-			const ContentFeatures &cfnb = m_nodedef->get(nb.n);
-			switch (m_nodedef->get(nb.n.getContent()).liquid_type) {
-				case LIQUID_NONE:
-					if (cfnb.floodable) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
-					} else {
-						neutrals[num_neutrals++] = nb;
-						if (nb.n.getContent() == CONTENT_IGNORE) {
-							// If node below is ignore prevent water from
-							// spreading outwards and otherwise prevent from
-							// flowing away as ignore node might be the source
-							if (nb.t == NEIGHBOR_LOWER)
-								flowing_down = true;
-							else
-								ignored_sources = true;
-						}
-					}
-					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = m_nodedef->getId(cfnb.liquid_alternative_flowing);
-					if (m_nodedef->getId(cfnb.liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						// Do not count bottom source, it will screw things up
-						if(dirs[i].Y != -1)
-							sources[num_sources++] = nb;
-					}
-					break;
-				case LIQUID_FLOWING:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = m_nodedef->getId(cfnb.liquid_alternative_flowing);
-					if (m_nodedef->getId(cfnb.liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
-					}
-					break;
+	/*
+		Apply the changes
+	 */
+	std::vector<std::pair<v3s16, MapNode> > changed_nodes;
+	for (size_t i = 0; i < transforms.size(); i++) {
+		LiquidBlockTransform &transform = transforms[i];
+		for (size_t j = 0; j < transform.queued.size(); j++)
+			m_transforming_liquid.push_back(transform.queued[j]);
+
+		for (size_t j = 0; j < transform.changes.size(); j++) {
+			const LiquidChange &change = transform.changes[j];
+			v3s16 p0 = change.p;
+
+			// An on_flood() callback changed the node, do it again
+			MapNode n0 = getNodeNoEx(p0);
+			if (n0.getContent() != change.oldnode.getContent() ||
+					n0.param2 != change.oldnode.param2) {
+				m_transforming_liquid.push_back(p0);
+				continue;
 			}
-		}
 
-		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-
-		u8 range = m_nodedef->get(liquid_kind).liquid_range;
-		if (range > LIQUID_LEVEL_MAX + 1)
-			range = LIQUID_LEVEL_MAX + 1;
-
-		if ((num_sources >= 2 && m_nodedef->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = m_nodedef->getId(m_nodedef->get(liquid_kind).liquid_alternative_source);
-		} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-			if (new_node_level >= (LIQUID_LEVEL_MAX + 1 - range))
-				new_node_content = liquid_kind;
-			else
-				new_node_content = floodable_node;
-		} else if (ignored_sources && liquid_level >= 0) {
-			// Maybe there are neighbouring sources that aren't loaded yet
-			// so prevent flowing away.
-			new_node_level = liquid_level;
-			new_node_content = liquid_kind;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-				switch (flows[i].t) {
-					case NEIGHBOR_UPPER:
-						if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
-							max_node_level = LIQUID_LEVEL_MAX;
-							if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-								max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-						} else if (nb_liquid_level > max_node_level) {
-							max_node_level = nb_liquid_level;
-						}
-						break;
-					case NEIGHBOR_LOWER:
-						break;
-					case NEIGHBOR_SAME_LEVEL:
-						if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-								nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level)
-							max_node_level = nb_liquid_level - 1;
-						break;
-				}
+			// on_flood() the node
+			n0 = change.newnode;
+			if (change.flood) {
+				if (env->getScriptIface()->node_on_flood(p0, change.oldnode, n0))
+					continue;
 			}
 
-			u8 viscosity = m_nodedef->get(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
+			// Ignore light (because calling voxalgo::update_lighting_nodes)
+			n0.setLight(LIGHTBANK_DAY, 0, m_nodedef);
+			n0.setLight(LIGHTBANK_NIGHT, 0, m_nodedef);
+
+			// Find out whether there is a suspect for this action
+			std::string suspect;
+			if (m_gamedef->rollback())
+				suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
+
+			if (m_gamedef->rollback() && !suspect.empty()) {
+				// Blame suspect
+				RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
+				// Get old node for rollback
+				RollbackNode rollback_oldnode(this, p0, m_gamedef);
+				// Set node
+				setNode(p0, n0);
+				// Report
+				RollbackNode rollback_newnode(this, p0, m_gamedef);
+				RollbackAction action;
+				action.setSetNode(p0, rollback_oldnode, rollback_newnode);
+				m_gamedef->rollback()->reportAction(action);
 			} else {
-				new_node_level = max_node_level;
+				// Set node
+				setNode(p0, n0);
 			}
 
-			if (max_node_level >= (LIQUID_LEVEL_MAX + 1 - range))
-				new_node_content = liquid_kind;
-			else
-				new_node_content = floodable_node;
+			v3s16 blockpos = getNodeBlockPos(p0);
+			MapBlock *block = getBlockNoCreateNoEx(blockpos);
+			if (block != NULL) {
+				modified_blocks[blockpos] =  block;
+				changed_nodes.push_back(std::pair<v3s16, MapNode>(p0, change.oldnode));
+			}
 
+			// enqueue neighbors for update if neccessary
+			for (u8 k = 0; k < change.num_neighbors; k++)
+				m_transforming_liquid.push_back(change.neighbors[k]);
 		}
+	}
 
-		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() &&
-				(m_nodedef->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-				((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-				((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-				== flowing_down)))
-			continue;
-
-
-		/*
-			update the current node
-		 */
-		MapNode n00 = n0;
-		//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
-		if (m_nodedef->get(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bit to 0
-			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
-		}
-
-		// change the node.
-		n0.setContent(new_node_content);
-
-		// on_flood() the node
-		if (floodable_node != CONTENT_AIR) {
-			if (env->getScriptIface()->node_on_flood(p0, n00, n0))
-				continue;
-		}
+	// nodes that due to viscosity have not reached their max level height
+	for (size_t i = 0; i < transforms.size(); i++)
+		for (size_t j = 0; j < transforms[i].reflow.size(); j++)
+			m_transforming_liquid.push_back(transforms[i].reflow[j]);
 
-		// Ignore light (because calling voxalgo::update_lighting_nodes)
-		n0.setLight(LIGHTBANK_DAY, 0, m_nodedef);
-		n0.setLight(LIGHTBANK_NIGHT, 0, m_nodedef);
-
-		// Find out whether there is a suspect for this action
-		std::string suspect;
-		if (m_gamedef->rollback())
-			suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
-
-		if (m_gamedef->rollback() && !suspect.empty()) {
-			// Blame suspect
-			RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
-			// Get old node for rollback
-			RollbackNode rollback_oldnode(this, p0, m_gamedef);
-			// Set node
-			setNode(p0, n0);
-			// Report
-			RollbackNode rollback_newnode(this, p0, m_gamedef);
-			RollbackAction action;
-			action.setSetNode(p0, rollback_oldnode, rollback_newnode);
-			m_gamedef->rollback()->reportAction(action);
-		} else {
-			// Set node
-			setNode(p0, n0);
-		}
+	u64 t1 = porting::getTimeUs();
+	g_profiler->avg("Map: liquid nodes transformed", loopcount);
+	if (loopcount > 0)
+		g_profiler->avg("Map: liquid nodes per ms",
+			loopcount * 1000.0f / MYMAX(t1 - t0, 1));
+	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if (block != NULL) {
-			modified_blocks[blockpos] =  block;
-			changed_nodes.push_back(std::pair<v3s16, MapNode>(p0, n00));
-		}
-
-		/*
-			enqueue neighbors for update if neccessary
-		 */
-		switch (m_nodedef->get(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
-				break;
+	if (m_lighting_deferred) {
+		for (size_t i = 0; i < changed_nodes.size(); i++) {
+			m_lighting_queue.push(changed_nodes[i].first, changed_nodes[i].second);
+			// Keep the block loaded until its update
+			MapBlock *block = getBlockNoCreateNoEx(
+				getNodeBlockPos(changed_nodes[i].first));
+			if (block)
+				block->resetUsageTimer();
 		}
+	} else {
+		voxalgo::update_lighting_nodes(this, changed_nodes, modified_blocks);
 	}
-	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
-
-	for (std::deque<v3s16>::iterator iter = must_reflow.begin(); iter != must_reflow.end(); ++iter)
-		m_transforming_liquid.push_back(*iter);
-
-	voxalgo::update_lighting_nodes(this, changed_nodes, modified_blocks);
 
 
 	/* ----------------------------------------------------------------------
@@ -950,8 +818,7 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks,
 		infostream << "transformLiquids(): DUMPING " << dump_qty
 		           << " blocks from the queue" << std::endl;
 
-		while (dump_qty--)
-			m_transforming_liquid.pop_front();
+		m_transforming_liquid.shrink(liquid_loop_max);
 
 		m_queue_size_timer_started = false; // optimistically assume we can keep up now
 		m_unprocessed_count = m_transforming_liquid.size();
@@ -1200,6 +1067,33 @@ ServerMap::ServerMap(const std::string &savedir, IGameDef *gamedef,
 	std::string backend = conf.get("backend");
 	dbase = createDatabase(backend, savedir, conf);
 
+	// Worlds keep zlib unless told otherwise, so that they stay readable
+	// by builds without zstd
+	if (!conf.exists("map_compression"))
+		conf.set("map_compression", "zlib");
+	std::string compression = conf.get("map_compression");
+	CompressionCodec codec;
+	if (!parseCompressionCodec(compression, &codec))
+		throw BaseException(std::string("Map compression ") + compression +
+			" not supported.");
+	m_block_ser_version = codec == COMPRESSION_ZLIB ?
+		SER_FMT_VER_HIGHEST_ZLIB : SER_FMT_VER_HIGHEST_WRITE;
+
+	// If unspecified or 0, serialize blocks on all processors
+	s16 num_serialize_threads = 0;
+	if (!g_settings->getS16NoEx("num_block_serialize_threads", num_serialize_threads) ||
+			num_serialize_threads <= 0)
+		num_serialize_threads = Thread::getNumberOfProcessors();
+	m_block_serializer = new MapBlockSerializer(gamedef,
+		MYMAX(num_serialize_threads, 1));
+
+	// If unspecified or 0, evaluate liquid flow on all processors
+	s16 num_liquid_threads = 0;
+	if (!g_settings->getS16NoEx("num_liquid_threads", num_liquid_threads) ||
+			num_liquid_threads <= 0)
+		num_liquid_threads = Thread::getNumberOfProcessors();
+	setLiquidTransformThreads(MYMAX(num_liquid_threads, 1));
+
 	if (!conf.updateConfigFile(conf_path.c_str()))
 		errorstream << "ServerMap::ServerMap(): Failed to update world.mt!" << std::endl;
 
@@ -1261,6 +1155,10 @@ ServerMap::~ServerMap()
 {
 	verbosestream<<FUNCTION_NAME<<std::endl;
 
+	// Light the nodes changed since the last update before saving them
+	std::map<v3s16, MapBlock*> modified_blocks;
+	updateLighting(modified_blocks);
+
 	try
 	{
 		if(m_map_saving_enabled)
@@ -1280,6 +1178,8 @@ ServerMap::~ServerMap()
 				<<", exception: "<<e.what()<<std::endl;
 	}
 
+	delete m_block_serializer;
+
 	/*
 		Close database if it was opened
 	*/
@@ -1439,7 +1339,7 @@ void ServerMap::finishBlockMake(BlockMakeData *data,
 		Copy transforming liquid information
 	*/
 	while (data->transforming_liquid.size()) {
-		m_transforming_liquid.push_back(data->transforming_liquid.front());
+		transforming_liquid_add(data->transforming_liquid.front());
 		data->transforming_liquid.pop_front();
 	}
 
@@ -1964,6 +1864,9 @@ void ServerMap::save(ModifiedState save_level)
 	// Don't do anything with sqlite unless something is really saved
 	bool save_started = false;
 
+	// Blocks are serialized in batches, on all block serializer threads
+	MapBlockVect save_blocks;
+
 	for(std::map<v2s16, MapSector*>::iterator i = m_sectors.begin();
 		i != m_sectors.end(); ++i) {
 		ServerMapSector *sector = (ServerMapSector*)i->second;
@@ -1992,7 +1895,11 @@ void ServerMap::save(ModifiedState save_level)
 
 				modprofiler.add(block->getModifiedReasonString(), 1);
 
-				saveBlock(block);
+				save_blocks.push_back(block);
+				if (save_blocks.size() >= 256) {
+					saveBlocks(save_blocks);
+					save_blocks.clear();
+				}
 				block_count++;
 
 				/*infostream<<"ServerMap: Written block ("
@@ -2004,6 +1911,8 @@ void ServerMap::save(ModifiedState save_level)
 		}
 	}
 
+	saveBlocks(save_blocks);
+
 	if(save_started)
 		endSave();
 
@@ -2265,10 +2174,10 @@ void ServerMap::endSave()
 
 bool ServerMap::saveBlock(MapBlock *block)
 {
-	return saveBlock(block, dbase);
+	return saveBlock(block, dbase, m_block_ser_version);
 }
 
-bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db)
+bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db, u8 version)
 {
 	v3s16 p3d = block->getPos();
 
@@ -2279,9 +2188,6 @@ bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db)
 		return true;
 	}
 
-	// Format used for writing
-	u8 version = SER_FMT_VER_HIGHEST_WRITE;
-
 	/*
 		[0] u8 serialization version
 		[1] data
@@ -2299,6 +2205,39 @@ bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db)
 	return ret;
 }
 
+void ServerMap::saveBlocks(const std::vector<MapBlock *> &blocks)
+{
+	u8 version = m_block_ser_version;
+
+	std::vector<std::shared_ptr<const std::string>> serialized;
+	m_block_serializer->serialize(blocks, version, true, &serialized);
+
+	for (size_t i = 0; i < blocks.size(); i++) {
+		MapBlock *block = blocks[i];
+
+		// Dummy blocks are not written
+		if (!serialized[i]) {
+			warningstream << "saveBlocks: Not writing dummy block "
+				<< PP(block->getPos()) << std::endl;
+			continue;
+		}
+
+		/*
+			[0] u8 serialization version
+			[1] data
+		*/
+		std::string data;
+		data.reserve(1 + serialized[i]->size());
+		data.push_back((char)version);
+		data.append(*serialized[i]);
+
+		if (dbase->saveBlock(block->getPos(), data)) {
+			// We just wrote it to the disk so clear modified flag
+			block->resetModified();
+		}
+	}
+}
+
 void ServerMap::loadBlock(const std::string &sectordir, const std::string &blockfile,
 		MapSector *sector, bool save_after_load)
 {
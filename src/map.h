@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <map>
 #include <list>
+#include <unordered_map>
 
 #include "irrlichttypes_bloated.h"
 #include "mapnode.h"
@@ -34,6 +35,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/container.h"
 #include "nodetimer.h"
 #include "map_settings_manager.h"
+#include "serialization.h" // For SER_FMT_VER_*
+#include "voxelalgorithms.h"
+#include "liquid_transform.h"
 
 class Settings;
 class MapDatabase;
@@ -45,6 +49,7 @@ class NodeMetadata;
 class IGameDef;
 class IRollbackManager;
 class EmergeManager;
+class MapBlockSerializer;
 class ServerEnvironment;
 struct BlockMakeData;
 
@@ -208,6 +213,17 @@ class Map /*: public NodeContainer*/
 	void removeNodeAndUpdate(v3s16 p,
 			std::map<v3s16, MapBlock*> &modified_blocks);
 
+	/*
+		When lighting is deferred, the above and transformLiquids() queue
+		the changed nodes, and updateLighting() updates their lighting.
+		Nodes changed in the same area meanwhile are updated together.
+	*/
+	void setLightingDeferred(bool deferred) { m_lighting_deferred = deferred; }
+	bool isLightingUpdatePending() const { return !m_lighting_queue.empty(); }
+	// Updates for at most max_time_ms milliseconds, 0 updates all nodes
+	void updateLighting(std::map<v3s16, MapBlock*> &modified_blocks,
+			u32 max_time_ms = 0);
+
 	/*
 		Wrappers for the latter ones.
 		These emit events.
@@ -296,10 +312,19 @@ class Map /*: public NodeContainer*/
 
 	void transforming_liquid_add(v3s16 p);
 	s32 transforming_liquid_size();
+	// Evaluates liquid flow on that many threads, 1 for none
+	void setLiquidTransformThreads(u16 num_threads);
 
 	bool isBlockOccluded(MapBlock *block, v3s16 cam_pos_nodes);
 protected:
 	friend class LuaVoxelManip;
+	friend class MapSector;
+
+	/*
+		Keep m_blocks in sync with the sectors. Only called by MapSector.
+	*/
+	void indexBlock(MapBlock *block);
+	void unindexBlock(v3s16 blockpos);
 
 	std::ostream &m_dout; // A bit deprecated, could be removed
 
@@ -313,8 +338,17 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache = nullptr;
 	v2s16 m_sector_cache_p;
 
+	// The blocks of all sectors by position, for getBlockNoCreateNoEx()
+	std::unordered_map<v3s16, MapBlock *> m_blocks;
+
 	// Queued transforming water nodes
-	UniqueQueue<v3s16> m_transforming_liquid;
+	LiquidQueue m_transforming_liquid;
+	LiquidTransformer *m_liquid_transformer = nullptr;
+	LiquidTransformPool *m_liquid_pool = nullptr;
+
+	// Changed nodes waiting for their lighting update
+	voxalgo::LightingUpdateQueue m_lighting_queue;
+	bool m_lighting_deferred = false;
 
 	// This stores the properties of the nodes on the map.
 	INodeDefManager *m_nodedef;
@@ -323,7 +357,6 @@ class Map /*: public NodeContainer*/
 			float start_off, float end_off, u32 needed_count);
 
 private:
-	f32 m_transforming_liquid_loop_count_multiplier = 1.0f;
 	u32 m_unprocessed_count = 0;
 	u64 m_inc_trending_up_start_time = 0; // milliseconds
 	bool m_queue_size_timer_started = false;
@@ -437,7 +470,11 @@ class ServerMap : public Map
 	bool loadSectorMeta(v2s16 p2d);
 
 	bool saveBlock(MapBlock *block);
-	static bool saveBlock(MapBlock *block, MapDatabase *db);
+	static bool saveBlock(MapBlock *block, MapDatabase *db, u8 version);
+	// Serializes the blocks on all block serializer threads
+	void saveBlocks(const std::vector<MapBlock *> &blocks);
+
+	MapBlockSerializer *getBlockSerializer() { return m_block_serializer; }
 	// This will generate a sector with getSector if not found.
 	void loadBlock(const std::string &sectordir, const std::string &blockfile,
 			MapSector *sector, bool save_after_load=false);
@@ -490,6 +527,9 @@ class ServerMap : public Map
 	*/
 	bool m_map_metadata_changed = true;
 	MapDatabase *dbase = nullptr;
+	MapBlockSerializer *m_block_serializer = nullptr;
+	// Format blocks are saved in, per the map_compression of the world
+	u8 m_block_ser_version = SER_FMT_VER_HIGHEST_ZLIB;
 };
 
 
@@ -20,6 +20,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <algorithm>
+#include <atomic>
 #include "map.h"
 #include "light.h"
 #include "nodedef.h"
@@ -65,11 +67,15 @@ static const char *modified_reason_strings[] = {
 	MapBlock
 */
 
+// Start of the modification counter range of the next block
+static std::atomic<u64> g_next_mod_counter(0);
+
 MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_parent(parent),
 		m_pos(pos),
 		m_pos_relative(pos * MAP_BLOCKSIZE),
-		m_gamedef(gamedef)
+		m_gamedef(gamedef),
+		m_mod_counter(g_next_mod_counter.fetch_add((u64)1 << 32))
 {
 	if(dummy == false)
 		reallocate();
@@ -347,6 +353,8 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+	m_contents_expired = true;
+	m_mod_counter++;
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -361,6 +369,29 @@ void MapBlock::actuallyUpdateDayNightDiff()
 		return;
 	}
 
+	/*
+		A block of only air is treated as not differing, and only nodes
+		with light in param1 can differ at all; use the content summary
+		to avoid scanning blocks where neither can happen
+	*/
+	if (isUniform(CONTENT_AIR)) {
+		m_day_night_differs = false;
+		return;
+	}
+	bool has_light_param = false;
+	const std::vector<content_t> &contents = getContents();
+	for (std::vector<content_t>::const_iterator it = contents.begin();
+			it != contents.end(); ++it) {
+		if (nodemgr->get(*it).param_type == CPT_LIGHT) {
+			has_light_param = true;
+			break;
+		}
+	}
+	if (!has_light_param) {
+		m_day_night_differs = false;
+		return;
+	}
+
 	bool differs = false;
 
 	/*
@@ -381,23 +412,6 @@ void MapBlock::actuallyUpdateDayNightDiff()
 		previous_n = n;
 	}
 
-	/*
-		If some lighting values differ, check if the whole thing is
-		just air. If it is just air, differs = false
-	*/
-	if (differs) {
-		bool only_air = true;
-		for (u32 i = 0; i < nodecount; i++) {
-			MapNode &n = data[i];
-			if (n.getContent() != CONTENT_AIR) {
-				only_air = false;
-				break;
-			}
-		}
-		if (only_air)
-			differs = false;
-	}
-
 	// Set member variable
 	m_day_night_differs = differs;
 }
@@ -413,6 +427,65 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+void MapBlock::updateContents()
+{
+	m_contents_expired = false;
+	m_contents.clear();
+	m_content_counts.clear();
+
+	if (!data)
+		return;
+
+	content_t ids[nodecount];
+	for (u32 i = 0; i < nodecount; i++)
+		ids[i] = data[i].getContent();
+	std::sort(ids, ids + nodecount);
+
+	for (u32 i = 0; i < nodecount; ) {
+		u32 run_end = i + 1;
+		while (run_end < nodecount && ids[run_end] == ids[i])
+			run_end++;
+		m_contents.push_back(ids[i]);
+		m_content_counts.push_back(run_end - i);
+		i = run_end;
+	}
+}
+
+void MapBlock::changeContentCount(content_t old_c, content_t new_c)
+{
+	std::vector<content_t>::iterator it =
+		std::lower_bound(m_contents.begin(), m_contents.end(), old_c);
+	if (it == m_contents.end() || *it != old_c) {
+		// Out of sync, should never happen
+		m_contents_expired = true;
+		return;
+	}
+	size_t i = it - m_contents.begin();
+	if (--m_content_counts[i] == 0) {
+		m_contents.erase(it);
+		m_content_counts.erase(m_content_counts.begin() + i);
+	}
+
+	it = std::lower_bound(m_contents.begin(), m_contents.end(), new_c);
+	i = it - m_contents.begin();
+	if (it != m_contents.end() && *it == new_c) {
+		m_content_counts[i]++;
+	} else {
+		m_contents.insert(it, new_c);
+		m_content_counts.insert(m_content_counts.begin() + i, 1);
+	}
+}
+
+u16 MapBlock::getContentCount(content_t c)
+{
+	const std::vector<content_t> &contents = getContents();
+	std::vector<content_t>::const_iterator it =
+		std::lower_bound(contents.begin(), contents.end(), c);
+	if (it == contents.end() || *it != c)
+		return 0;
+	return m_content_counts[it - contents.begin()];
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -448,11 +521,13 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 // sure we can handle all content ids. But it's absolutely worth it as it's
 // a speedup of 4 for one of the major time consuming functions on storing
 // mapblocks.
-static content_t getBlockNodeIdMapping_mapping[USHRT_MAX + 1];
+// The memory is per thread, as blocks are serialized on several threads.
+static thread_local content_t getBlockNodeIdMapping_mapping[USHRT_MAX + 1];
 static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 		INodeDefManager *nodedef)
 {
-	memset(getBlockNodeIdMapping_mapping, 0xFF, (USHRT_MAX + 1) * sizeof(content_t));
+	content_t *mapping = getBlockNodeIdMapping_mapping;
+	memset(mapping, 0xFF, (USHRT_MAX + 1) * sizeof(content_t));
 
 	std::set<content_t> unknown_contents;
 	content_t id_counter = 0;
@@ -461,14 +536,14 @@ static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 		content_t id = CONTENT_IGNORE;
 
 		// Try to find an existing mapping
-		if (getBlockNodeIdMapping_mapping[global_id] != 0xFFFF) {
-			id = getBlockNodeIdMapping_mapping[global_id];
+		if (mapping[global_id] != 0xFFFF) {
+			id = mapping[global_id];
 		}
 		else
 		{
 			// We have to assign a new mapping
 			id = id_counter++;
-			getBlockNodeIdMapping_mapping[global_id] = id;
+			mapping[global_id] = id;
 
 			const ContentFeatures &f = nodedef->get(global_id);
 			const std::string &name = f.name;
@@ -554,6 +629,13 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 }
 
 void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+{
+	MapBlockSnapshot snap;
+	snapshot(&snap, version, disk);
+	snap.serialize(os, m_gamedef->ndef());
+}
+
+void MapBlock::snapshot(MapBlockSnapshot *snap, u8 version, bool disk)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -563,54 +645,75 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 
 	FATAL_ERROR_IF(version < SER_FMT_VER_LOWEST_WRITE, "Serialisation version error");
 
-	// First byte
-	u8 flags = 0;
+	snap->pos = m_pos;
+	snap->version = version;
+	snap->disk = disk;
+
+	snap->flags = 0;
 	if(is_underground)
-		flags |= 0x01;
+		snap->flags |= 0x01;
 	if(getDayNightDiff())
-		flags |= 0x02;
+		snap->flags |= 0x02;
 	if(m_generated == false)
-		flags |= 0x08;
+		snap->flags |= 0x08;
+	snap->lighting_complete = m_lighting_complete;
+
+	snap->nodes.assign(data, data + nodecount);
+
+	std::ostringstream oss(std::ios_base::binary);
+	m_node_metadata.serialize(oss, version, disk);
+	snap->node_metadata = oss.str();
+
+	if (disk) {
+		std::ostringstream timers_os(std::ios_base::binary);
+		m_node_timers.serialize(timers_os, version);
+		snap->node_timers = timers_os.str();
+
+		std::ostringstream objects_os(std::ios_base::binary);
+		m_static_objects.serialize(objects_os);
+		snap->static_objects = objects_os.str();
+
+		snap->timestamp = getTimestamp();
+	}
+}
+
+/*
+	MapBlockSnapshot
+*/
+
+void MapBlockSnapshot::serialize(std::ostream &os, INodeDefManager *nodedef) const
+{
+	// First byte
 	writeU8(os, flags);
 	if (version >= 27) {
-		writeU16(os, m_lighting_complete);
+		writeU16(os, lighting_complete);
 	}
 
 	/*
 		Bulk node data
 	*/
 	NameIdMapping nimap;
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
 	if(disk)
 	{
-		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
-		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
-
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
+		std::vector<MapNode> tmp_nodes(nodes);
+		getBlockNodeIdMapping(&nimap, &tmp_nodes[0], nodedef);
+		MapNode::serializeBulk(os, version, &tmp_nodes[0], MapBlock::nodecount,
 				content_width, params_width, true);
-		delete[] tmp_nodes;
 	}
 	else
 	{
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
+		MapNode::serializeBulk(os, version, &nodes[0], MapBlock::nodecount,
 				content_width, params_width, true);
 	}
 
 	/*
 		Node metadata
 	*/
-	std::ostringstream oss(std::ios_base::binary);
-	m_node_metadata.serialize(oss, version, disk);
-	compressZlib(oss.str(), os);
+	compressWith(getCompressionCodec(version), node_metadata, os);
 
 	/*
 		Data that goes to disk, but not the network
@@ -619,21 +722,21 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	{
 		if(version <= 24){
 			// Node timers
-			m_node_timers.serialize(os, version);
+			os << node_timers;
 		}
 
 		// Static objects
-		m_static_objects.serialize(os);
+		os << static_objects;
 
 		// Timestamp
-		writeU32(os, getTimestamp());
+		writeU32(os, timestamp);
 
 		// Write block-specific node definition id mapping
 		nimap.serialize(os);
 
 		if(version >= 25){
 			// Node timers
-			m_node_timers.serialize(os, version);
+			os << node_timers;
 		}
 	}
 }
@@ -657,6 +760,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
 
 	m_day_night_differs_expired = false;
+	m_contents_expired = true;
+	m_mod_counter++;
 
 	if(version <= 21)
 	{
@@ -695,7 +800,7 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	// Ignore errors
 	try {
 		std::ostringstream oss(std::ios_base::binary);
-		decompressZlib(is, oss);
+		decompressWith(getCompressionCodec(version), is, oss);
 		std::istringstream iss(oss.str(), std::ios_base::binary);
 		if (version >= 23)
 			m_node_metadata.deSerialize(iss, m_gamedef->idef());
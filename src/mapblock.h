@@ -39,6 +39,7 @@ class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
 class VoxelManipulator;
+class INodeDefManager;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
@@ -67,6 +68,37 @@ class VoxelManipulator;
 #define MOD_REASON_EXPIRE_DAYNIGHTDIFF       (1 << 18)
 #define MOD_REASON_UNKNOWN                   (1 << 19)
 
+////
+//// Serialization snapshot
+////
+
+/*
+	Everything MapBlock::serialize() writes, copied out of the block.
+	Turning it into bytes doesn't touch the block anymore, so the costly
+	part (id mapping and compression) can run on any thread while the
+	block itself keeps changing.
+*/
+struct MapBlockSnapshot
+{
+	v3s16 pos;
+	u8 version = 0;
+	bool disk = false;
+
+	u8 flags = 0;
+	u16 lighting_complete = 0;
+	std::vector<MapNode> nodes;
+	// Uncompressed node metadata
+	std::string node_metadata;
+
+	// Disk only
+	std::string node_timers;
+	std::string static_objects;
+	u32 timestamp = 0;
+
+	// Writes the same bytes as MapBlock::serialize() would have
+	void serialize(std::ostream &os, INodeDefManager *nodedef) const;
+};
+
 ////
 //// MapBlock itself
 ////
@@ -94,6 +126,7 @@ class MapBlock
 		for (u32 i = 0; i < nodecount; i++)
 			data[i] = MapNode(CONTENT_IGNORE);
 
+		m_contents_expired = true;
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_REALLOCATE);
 	}
 
@@ -107,6 +140,7 @@ class MapBlock
 	////
 	void raiseModified(u32 mod, u32 reason=MOD_REASON_UNKNOWN)
 	{
+		m_mod_counter++;
 		if (mod > m_modified) {
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -129,6 +163,14 @@ class MapBlock
 
 	std::string getModifiedReasonString();
 
+	// Changes whenever the block changes, and is never the same for two
+	// different blocks, even ones loaded at the same position one after
+	// the other.
+	inline u64 getModCounter()
+	{
+		return m_mod_counter;
+	}
+
 	inline void resetModified()
 	{
 		m_modified = MOD_STATE_CLEAN;
@@ -278,7 +320,10 @@ class MapBlock
 		if (!isValidPosition(x, y, z))
 			throw InvalidPositionException();
 
-		data[z * zstride + y * ystride + x] = n;
+		MapNode &old_n = data[z * zstride + y * ystride + x];
+		if (!m_contents_expired && old_n.getContent() != n.getContent())
+			changeContentCount(old_n.getContent(), n.getContent());
+		old_n = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE);
 	}
 
@@ -326,7 +371,10 @@ class MapBlock
 		if (!data)
 			throw InvalidPositionException();
 
-		data[z * zstride + y * ystride + x] = n;
+		MapNode &old_n = data[z * zstride + y * ystride + x];
+		if (!m_contents_expired && old_n.getContent() != n.getContent())
+			changeContentCount(old_n.getContent(), n.getContent());
+		old_n = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE_NO_CHECK);
 	}
 
@@ -375,6 +423,36 @@ class MapBlock
 		return m_day_night_differs;
 	}
 
+	////
+	//// Content summary
+	////
+
+	// Returns the sorted list of distinct content ids in the block.
+	// Kept up to date by setNode(); bulk changes (deserialization,
+	// VoxelManipulator blits) make it recount on the next query.
+	// Empty for dummy blocks.
+	inline const std::vector<content_t> &getContents()
+	{
+		if (m_contents_expired)
+			updateContents();
+		return m_contents;
+	}
+
+	// Returns the number of nodes of content c in the block
+	u16 getContentCount(content_t c);
+
+	inline bool containsContent(content_t c)
+	{
+		return getContentCount(c) != 0;
+	}
+
+	// Whether the block contains nothing but content c
+	inline bool isUniform(content_t c)
+	{
+		const std::vector<content_t> &contents = getContents();
+		return contents.size() == 1 && contents[0] == c;
+	}
+
 	////
 	//// Miscellaneous stuff
 	////
@@ -492,6 +570,10 @@ class MapBlock
 
 	void serializeNetworkSpecific(std::ostream &os);
 	void deSerializeNetworkSpecific(std::istream &is);
+
+	// Copies what serialize() would write, for MapBlockSnapshot::serialize()
+	// Has the same preconditions as serialize()
+	void snapshot(MapBlockSnapshot *snapshot, u8 version, bool disk);
 private:
 	/*
 		Private methods
@@ -499,6 +581,9 @@ class MapBlock
 
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
 
+	void updateContents();
+	void changeContentCount(content_t old_c, content_t new_c);
+
 	/*
 		Used only internally, because changes can't be tracked
 	*/
@@ -568,6 +653,12 @@ class MapBlock
 	u32 m_modified = MOD_STATE_WRITE_NEEDED;
 	u32 m_modified_reason = MOD_REASON_INITIAL;
 
+	/*
+		Increased by every change. Each block starts in its own range of
+		2^32 values, see MapBlock::MapBlock().
+	*/
+	u64 m_mod_counter;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
@@ -594,6 +685,12 @@ class MapBlock
 
 	bool m_generated = false;
 
+	// Distinct content ids in data, sorted, and the number of nodes
+	// of each of them. See getContents().
+	std::vector<content_t> m_contents;
+	std::vector<u16> m_content_counts;
+	bool m_contents_expired = true;
+
 	/*
 		When block is removed from active blocks, this is set to gametime.
 		Value BLOCK_TIMESTAMP_UNDEFINED=0xffffffff means there is no timestamp.
@@ -0,0 +1,198 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapblock_serializer.h"
+
+#include <atomic>
+#include <sstream>
+#include <unordered_map>
+#include "mapblock.h"
+#include "gamedef.h"
+#include "debug.h"
+#include "util/string.h"
+#include "threading/thread.h"
+
+// Bounds the memory taken by snapshots to about 4 MiB
+#define SNAPSHOTS_PER_BATCH 256
+
+/*
+	Snapshots shared between the threads of a MapBlockSerializer
+*/
+struct MapBlockSerializeBatch
+{
+	INodeDefManager *nodedef;
+	const std::vector<MapBlockSnapshot> *snapshots;
+	std::vector<std::shared_ptr<const std::string>> *results;
+	size_t count;
+	std::atomic<size_t> next;
+
+	void work()
+	{
+		for (;;) {
+			size_t i = next++;
+			if (i >= count)
+				return;
+			std::ostringstream os(std::ios_base::binary);
+			(*snapshots)[i].serialize(os, nodedef);
+			(*results)[i] = std::make_shared<const std::string>(os.str());
+		}
+	}
+};
+
+class MapBlockSerializeThread : public Thread
+{
+public:
+	MapBlockSerializeThread(int id, Semaphore &done):
+		Thread("BlockSerialize" + itos(id)),
+		m_done(done)
+	{}
+
+	void startBatch(MapBlockSerializeBatch *batch)
+	{
+		m_batch = batch;
+		m_start.post();
+	}
+
+	void stopAndWait()
+	{
+		stop();
+		m_start.post();
+		wait();
+	}
+
+protected:
+	void *run();
+
+private:
+	Semaphore m_start;
+	Semaphore &m_done;
+	MapBlockSerializeBatch *m_batch = nullptr;
+};
+
+void *MapBlockSerializeThread::run()
+{
+	DSTACK(FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	for (;;) {
+		m_start.wait();
+		if (stopRequested())
+			break;
+		m_batch->work();
+		m_done.post();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER
+	return NULL;
+}
+
+/*
+	MapBlockSerializer
+*/
+
+MapBlockSerializer::MapBlockSerializer(IGameDef *gamedef, u16 num_threads):
+	m_gamedef(gamedef)
+{
+	for (u16 i = 1; i < num_threads; i++) {
+		MapBlockSerializeThread *thread = new MapBlockSerializeThread(i, m_done);
+		thread->start();
+		m_threads.push_back(thread);
+	}
+}
+
+MapBlockSerializer::~MapBlockSerializer()
+{
+	for (std::vector<MapBlockSerializeThread *>::iterator
+			i = m_threads.begin(); i != m_threads.end(); ++i) {
+		(*i)->stopAndWait();
+		delete *i;
+	}
+}
+
+void MapBlockSerializer::serialize(const std::vector<MapBlock *> &blocks,
+	u8 version, bool disk,
+	std::vector<std::shared_ptr<const std::string>> *results)
+{
+	results->assign(blocks.size(), nullptr);
+
+	// Kept between batches, so that the node arrays are reused
+	std::vector<MapBlockSnapshot> snapshots;
+	std::vector<std::shared_ptr<const std::string>> serialized;
+	// Snapshot index of each block of the batch; a block can be listed
+	// more than once, e.g. when sending it to several clients
+	std::unordered_map<MapBlock *, size_t> block_snapshots;
+	// (result index, snapshot index) pairs of the batch
+	std::vector<std::pair<size_t, size_t>> result_snapshots;
+
+	size_t i = 0;
+	while (i < blocks.size()) {
+		size_t count = 0;
+		block_snapshots.clear();
+		result_snapshots.clear();
+
+		for (; i < blocks.size() && count < SNAPSHOTS_PER_BATCH; i++) {
+			MapBlock *block = blocks[i];
+			if (block->isDummy())
+				continue;
+
+			std::unordered_map<MapBlock *, size_t>::const_iterator it =
+				block_snapshots.find(block);
+			if (it != block_snapshots.end()) {
+				result_snapshots.emplace_back(i, it->second);
+				continue;
+			}
+
+			if (snapshots.size() == count)
+				snapshots.emplace_back();
+			block->snapshot(&snapshots[count], version, disk);
+			block_snapshots[block] = count;
+			result_snapshots.emplace_back(i, count);
+			count++;
+		}
+
+		if (count == 0)
+			continue;
+
+		serialized.assign(count, nullptr);
+
+		MapBlockSerializeBatch batch;
+		batch.nodedef = m_gamedef->ndef();
+		batch.snapshots = &snapshots;
+		batch.results = &serialized;
+		batch.count = count;
+		batch.next = 0;
+
+		// Waking up the pool is not worth it for a single block
+		bool use_pool = count > 1;
+		if (use_pool) {
+			for (std::vector<MapBlockSerializeThread *>::iterator
+					t = m_threads.begin(); t != m_threads.end(); ++t)
+				(*t)->startBatch(&batch);
+		}
+		batch.work();
+		if (use_pool) {
+			for (size_t t = 0; t < m_threads.size(); t++)
+				m_done.wait();
+		}
+
+		for (std::vector<std::pair<size_t, size_t>>::const_iterator
+				r = result_snapshots.begin(); r != result_snapshots.end(); ++r)
+			(*results)[r->first] = serialized[r->second];
+	}
+}
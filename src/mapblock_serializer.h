@@ -0,0 +1,61 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPBLOCK_SERIALIZER_HEADER
+#define MAPBLOCK_SERIALIZER_HEADER
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "irrlichttypes.h"
+#include "threading/semaphore.h"
+
+class IGameDef;
+class MapBlock;
+class MapBlockSerializeThread;
+
+/*
+	Serializes map blocks on several threads.
+
+	The blocks are only touched by the calling thread, which copies them
+	into MapBlockSnapshots; the id mapping and zlib compression of the
+	snapshots is shared between the calling thread and the pool.
+*/
+class MapBlockSerializer
+{
+public:
+	// A pool of num_threads threads runs num_threads - 1 workers
+	MapBlockSerializer(IGameDef *gamedef, u16 num_threads);
+	~MapBlockSerializer();
+
+	/*
+		Fills results with what MapBlock::serialize() writes for each of
+		the blocks, in the same order. Dummy blocks give NULL. A block
+		listed several times is serialized once.
+	*/
+	void serialize(const std::vector<MapBlock *> &blocks, u8 version,
+		bool disk, std::vector<std::shared_ptr<const std::string>> *results);
+
+private:
+	IGameDef *m_gamedef;
+	std::vector<MapBlockSerializeThread *> m_threads;
+	Semaphore m_done;
+};
+
+#endif
@@ -128,6 +128,8 @@ Mapgen::Mapgen(int mapgenid, MapgenParams *params, EmergeManager *emerge) :
 	seed = (s32)params->seed;
 
 	ndef      = emerge->ndef;
+
+	noise_cache.setMaxMaps(emerge->mapgen_noise_cache_size);
 }
 
 
@@ -574,6 +576,7 @@ MapgenBasic::MapgenBasic(int mapgenid, MapgenParams *params, EmergeManager *emer
 	//// Initialize biome generator
 	// TODO(hmmmm): should we have a way to disable biomemanager biomes?
 	biomegen = m_bmgr->createBiomeGen(BIOMEGEN_ORIGINAL, params->bparams, csize);
+	biomegen->noise_cache = &noise_cache;
 	biomemap = biomegen->biomemap;
 
 	//// Look up some commonly used content
@@ -631,7 +634,7 @@ MgStoneType MapgenBasic::generateBiomes(s16 biome_zero_level)
 	u32 index = 0;
 	MgStoneType stone_type = MGSTONE_STONE;
 
-	noise_filler_depth->perlinMap2D(node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_filler_depth, node_min.X, node_min.Z);
 
 	for (s16 z = node_min.Z; z <= node_max.Z; z++)
 	for (s16 x = node_min.X; x <= node_max.X; x++, index++) {
@@ -811,6 +814,8 @@ void MapgenBasic::dustTopNodes()
 
 void MapgenBasic::generateCaves(s16 max_stone_y, s16 large_cave_depth)
 {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen caves", SPT_ADD);
+
 	if (max_stone_y < node_min.Y)
 		return;
 
@@ -835,6 +840,8 @@ void MapgenBasic::generateCaves(s16 max_stone_y, s16 large_cave_depth)
 
 bool MapgenBasic::generateCaverns(s16 max_stone_y)
 {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen caves", SPT_ADD);
+
 	if (node_min.Y > max_stone_y || node_min.Y > cavern_limit)
 		return false;
 
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MAPGEN_HEADER
 
 #include "noise.h"
+#include "noise_cache.h"
 #include "nodedef.h"
 #include "mapnode.h"
 #include "util/string.h"
@@ -182,6 +183,10 @@ class Mapgen {
 	BiomeGen *biomegen = nullptr;
 	GenerateNotifier gennotify;
 
+	// 2D noise maps of recently generated chunks; there is one mapgen per
+	// emerge thread, so this is never shared between threads
+	NoiseMapCache noise_cache;
+
 	Mapgen();
 	Mapgen(int mapgenid, MapgenParams *params, EmergeManager *emerge);
 	virtual ~Mapgen();
@@ -369,17 +369,17 @@ int MapgenCarpathian::generateTerrain()
 	u32 index3d = 0;
 
 	// Calculate noise for terrain generation
-	noise_base->perlinMap2D(node_min.X, node_min.Z);
-	noise_height1->perlinMap2D(node_min.X, node_min.Z);
-	noise_height2->perlinMap2D(node_min.X, node_min.Z);
-	noise_height3->perlinMap2D(node_min.X, node_min.Z);
-	noise_height4->perlinMap2D(node_min.X, node_min.Z);
-	noise_hills_terrain->perlinMap2D(node_min.X, node_min.Z);
-	noise_ridge_terrain->perlinMap2D(node_min.X, node_min.Z);
-	noise_step_terrain->perlinMap2D(node_min.X, node_min.Z);
-	noise_hills->perlinMap2D(node_min.X, node_min.Z);
-	noise_ridge_mnt->perlinMap2D(node_min.X, node_min.Z);
-	noise_step_mnt->perlinMap2D(node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_base, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_height1, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_height2, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_height3, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_height4, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_hills_terrain, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_ridge_terrain, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_step_terrain, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_hills, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_ridge_mnt, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_step_mnt, node_min.X, node_min.Z);
 	noise_mnt_var->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
 
 	//// Place nodes
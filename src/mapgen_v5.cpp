@@ -255,8 +255,8 @@ int MapgenV5::generateBaseTerrain()
 	u32 index2d = 0;
 	int stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
 
-	noise_factor->perlinMap2D(node_min.X, node_min.Z);
-	noise_height->perlinMap2D(node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_factor, node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_height, node_min.X, node_min.Z);
 	noise_ground->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
 
 	for (s16 z=node_min.Z; z<=node_max.Z; z++) {
@@ -468,24 +468,23 @@ int MapgenV7::generateTerrain()
 	MapNode n_water(c_water_source);
 
 	//// Calculate noise for terrain generation
-	noise_terrain_persist->perlinMap2D(node_min.X, node_min.Z);
-	float *persistmap = noise_terrain_persist->result;
-
-	noise_terrain_base->perlinMap2D(node_min.X, node_min.Z, persistmap);
-	noise_terrain_alt->perlinMap2D(node_min.X, node_min.Z, persistmap);
-	noise_height_select->perlinMap2D(node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_terrain_base, node_min.X, node_min.Z,
+		noise_terrain_persist);
+	noise_cache.perlinMap2D(noise_terrain_alt, node_min.X, node_min.Z,
+		noise_terrain_persist);
+	noise_cache.perlinMap2D(noise_height_select, node_min.X, node_min.Z);
 
 	if ((spflags & MGV7_MOUNTAINS) || (spflags & MGV7_FLOATLANDS)) {
 		noise_mountain->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
 	}
 
 	if (spflags & MGV7_MOUNTAINS) {
-		noise_mount_height->perlinMap2D(node_min.X, node_min.Z);
+		noise_cache.perlinMap2D(noise_mount_height, node_min.X, node_min.Z);
 	}
 
 	if (spflags & MGV7_FLOATLANDS) {
-		noise_floatland_base->perlinMap2D(node_min.X, node_min.Z);
-		noise_float_base_height->perlinMap2D(node_min.X, node_min.Z);
+		noise_cache.perlinMap2D(noise_floatland_base, node_min.X, node_min.Z);
+		noise_cache.perlinMap2D(noise_float_base_height, node_min.X, node_min.Z);
 	}
 
 	//// Place nodes
@@ -548,7 +547,7 @@ void MapgenV7::generateRidgeTerrain()
 		return;
 
 	noise_ridge->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
-	noise_ridge_uwater->perlinMap2D(node_min.X, node_min.Z);
+	noise_cache.perlinMap2D(noise_ridge_uwater, node_min.X, node_min.Z);
 
 	MapNode n_water(c_water_source);
 	MapNode n_air(CONTENT_AIR);
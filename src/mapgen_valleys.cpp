@@ -47,7 +47,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 //#include "assert.h"
 
 //#include "util/timetaker.h"
-//#include "profiler.h"
+#include "profiler.h"
 
 
 //static Profiler mapgen_prof;
@@ -288,11 +288,11 @@ void MapgenValleys::calculateNoise()
 
 	//TimeTaker tcn("actualNoise");
 
-	noise_inter_valley_slope->perlinMap2D(x, z);
-	noise_rivers->perlinMap2D(x, z);
-	noise_terrain_height->perlinMap2D(x, z);
-	noise_valley_depth->perlinMap2D(x, z);
-	noise_valley_profile->perlinMap2D(x, z);
+	noise_cache.perlinMap2D(noise_inter_valley_slope, x, z);
+	noise_cache.perlinMap2D(noise_rivers, x, z);
+	noise_cache.perlinMap2D(noise_terrain_height, x, z);
+	noise_cache.perlinMap2D(noise_valley_depth, x, z);
+	noise_cache.perlinMap2D(noise_valley_profile, x, z);
 
 	noise_inter_valley_fill->perlinMap3D(x, y, z);
 
@@ -585,6 +585,8 @@ int MapgenValleys::generateTerrain()
 
 void MapgenValleys::generateCaves(s16 max_stone_y, s16 large_cave_depth)
 {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen caves", SPT_ADD);
+
 	if (max_stone_y < node_min.Y)
 		return;
 
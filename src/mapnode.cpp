@@ -688,7 +688,7 @@ void MapNode::serializeBulk(std::ostream &os, int version,
 	*/
 
 	if (compressed)
-		compressZlib(databuf, databuf_size, os);
+		compressWith(getCompressionCodec(version), databuf, databuf_size, os);
 	else
 		os.write((const char*) &databuf[0], databuf_size);
 
@@ -714,7 +714,7 @@ void MapNode::deSerializeBulk(std::istream &is, int version,
 	if(compressed)
 	{
 		std::ostringstream os(std::ios_base::binary);
-		decompressZlib(is, os);
+		decompressWith(getCompressionCodec(version), is, os);
 		std::string s = os.str();
 		if(s.size() != len)
 			throw SerializationError("deSerializeBulkNodes: "
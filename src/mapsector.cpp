@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "mapsector.h"
+#include "map.h"
 #include "exceptions.h"
 #include "mapblock.h"
 #include "serialization.h"
@@ -42,6 +43,8 @@ void MapSector::deleteBlocks()
 	// Delete all
 	for (std::unordered_map<s16, MapBlock*>::iterator i = m_blocks.begin();
 		 	i != m_blocks.end(); ++i) {
+		if (m_parent)
+			m_parent->unindexBlock(i->second->getPos());
 		delete i->second;
 	}
 
@@ -89,6 +92,8 @@ MapBlock * MapSector::createBlankBlock(s16 y)
 	MapBlock *block = createBlankBlockNoInsert(y);
 
 	m_blocks[y] = block;
+	if (m_parent)
+		m_parent->indexBlock(block);
 
 	return block;
 }
@@ -107,6 +112,8 @@ void MapSector::insertBlock(MapBlock *block)
 
 	// Insert into container
 	m_blocks[block_y] = block;
+	if (m_parent)
+		m_parent->indexBlock(block);
 }
 
 void MapSector::deleteBlock(MapBlock *block)
@@ -118,6 +125,8 @@ void MapSector::deleteBlock(MapBlock *block)
 
 	// Remove from container
 	m_blocks.erase(block_y);
+	if (m_parent)
+		m_parent->unindexBlock(block->getPos());
 
 	// Delete
 	delete block;
@@ -27,6 +27,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include "porting.h"
 #include "settings.h"
+#include <algorithm>
+#include <cfloat>
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -130,6 +132,8 @@ BiomeGenOriginal::BiomeGenOriginal(BiomeManager *biomemgr,
 	heatmap  = noise_heat->result;
 	humidmap = noise_humidity->result;
 	biomemap = new biome_t[m_csize.X * m_csize.Z];
+
+	updateLookup();
 }
 
 BiomeGenOriginal::~BiomeGenOriginal()
@@ -156,14 +160,33 @@ Biome *BiomeGenOriginal::calcBiomeAtPoint(v3s16 pos) const
 }
 
 
+void BiomeGenOriginal::updateLookup()
+{
+	std::vector<Biome *> biomes(m_bmgr->getNumObjects());
+	for (size_t i = 0; i < biomes.size(); i++)
+		biomes[i] = (Biome *)m_bmgr->getRaw(i);
+
+	if (biomes != m_lookup.getBiomes())
+		m_lookup.update(biomes);
+}
+
+
 void BiomeGenOriginal::calcBiomeNoise(v3s16 pmin)
 {
 	m_pmin = pmin;
-
-	noise_heat->perlinMap2D(pmin.X, pmin.Z);
-	noise_humidity->perlinMap2D(pmin.X, pmin.Z);
-	noise_heat_blend->perlinMap2D(pmin.X, pmin.Z);
-	noise_humidity_blend->perlinMap2D(pmin.X, pmin.Z);
+	updateLookup();
+
+	if (noise_cache) {
+		noise_cache->perlinMap2D(noise_heat, pmin.X, pmin.Z);
+		noise_cache->perlinMap2D(noise_humidity, pmin.X, pmin.Z);
+		noise_cache->perlinMap2D(noise_heat_blend, pmin.X, pmin.Z);
+		noise_cache->perlinMap2D(noise_humidity_blend, pmin.X, pmin.Z);
+	} else {
+		noise_heat->perlinMap2D(pmin.X, pmin.Z);
+		noise_humidity->perlinMap2D(pmin.X, pmin.Z);
+		noise_heat_blend->perlinMap2D(pmin.X, pmin.Z);
+		noise_humidity_blend->perlinMap2D(pmin.X, pmin.Z);
+	}
 
 	for (s32 i = 0; i < m_csize.X * m_csize.Z; i++) {
 		noise_heat->result[i]     += noise_heat_blend->result[i];
@@ -205,12 +228,170 @@ Biome *BiomeGenOriginal::getBiomeAtIndex(size_t index, s16 y) const
 
 
 Biome *BiomeGenOriginal::calcBiomeFromNoise(float heat, float humidity, s16 y) const
+{
+	Biome *biome = m_lookup.find(heat, humidity, y);
+
+	return biome ? biome : (Biome *)m_bmgr->getRaw(BIOME_NONE);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Cells per side of the grids
+#define BIOME_GRID_SIZE 32
+// Ranges with fewer biomes are searched without grid
+#define BIOME_GRID_MIN_BIOMES 5
+
+static inline Biome *closest_biome(Biome *const *begin, Biome *const *end,
+	float heat, float humidity)
+{
+	Biome *biome_closest = NULL;
+	float dist_min = FLT_MAX;
+
+	for (; begin != end; ++begin) {
+		Biome *b = *begin;
+		float d_heat     = heat     - b->heat_point;
+		float d_humidity = humidity - b->humidity_point;
+		float dist = (d_heat * d_heat) +
+					 (d_humidity * d_humidity);
+		if (dist < dist_min) {
+			dist_min = dist;
+			biome_closest = b;
+		}
+	}
+
+	return biome_closest;
+}
+
+
+void BiomeLookup::update(const std::vector<Biome *> &biomes)
+{
+	m_biomes = biomes;
+	m_ranges.clear();
+
+	// The biomes that apply only change at these heights
+	std::vector<s32> bounds;
+	bounds.push_back(S16_MIN);
+	for (size_t i = 1; i < biomes.size(); i++) {
+		if (!biomes[i])
+			continue;
+		bounds.push_back(biomes[i]->y_min);
+		bounds.push_back((s32)biomes[i]->y_max + 1);
+	}
+	std::sort(bounds.begin(), bounds.end());
+	bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+	for (size_t j = 0; j < bounds.size() && bounds[j] <= S16_MAX; j++) {
+		Range range;
+		range.y_min = bounds[j];
+		for (size_t i = 1; i < biomes.size(); i++) {
+			Biome *b = biomes[i];
+			if (b && range.y_min >= b->y_min && range.y_min <= b->y_max)
+				range.biomes.push_back(b);
+		}
+		if (range.biomes.size() >= BIOME_GRID_MIN_BIOMES)
+			makeGrid(&range);
+
+		m_ranges.push_back(range);
+	}
+
+	m_range_at_y.resize((s32)S16_MAX - S16_MIN + 1);
+	for (size_t j = 0; j < m_ranges.size(); j++) {
+		s32 y_end = j + 1 < m_ranges.size() ? m_ranges[j + 1].y_min : S16_MAX + 1;
+		for (s32 y = m_ranges[j].y_min; y < y_end; y++)
+			m_range_at_y[y - S16_MIN] = j;
+	}
+}
+
+
+void BiomeLookup::makeGrid(Range *range)
+{
+	const std::vector<Biome *> &biomes = range->biomes;
+
+	float heat_min = FLT_MAX, heat_max = -FLT_MAX;
+	float humidity_min = FLT_MAX, humidity_max = -FLT_MAX;
+	for (size_t i = 0; i < biomes.size(); i++) {
+		heat_min     = MYMIN(heat_min, biomes[i]->heat_point);
+		heat_max     = MYMAX(heat_max, biomes[i]->heat_point);
+		humidity_min = MYMIN(humidity_min, biomes[i]->humidity_point);
+		humidity_max = MYMAX(humidity_max, biomes[i]->humidity_point);
+	}
+
+	// Heat and humidity go somewhat past the biome points, further ones
+	// are searched without grid
+	float heat_extent     = MYMAX(heat_max - heat_min, 1.0f);
+	float humidity_extent = MYMAX(humidity_max - humidity_min, 1.0f);
+	range->heat_min       = heat_min - heat_extent / 2;
+	range->humidity_min   = humidity_min - humidity_extent / 2;
+	range->heat_scale     = BIOME_GRID_SIZE / (2 * heat_extent);
+	range->humidity_scale = BIOME_GRID_SIZE / (2 * humidity_extent);
+
+	double cell_heat     = 1.0 / range->heat_scale;
+	double cell_humidity = 1.0 / range->humidity_scale;
+
+	range->cells.reserve(BIOME_GRID_SIZE * BIOME_GRID_SIZE + 1);
+	for (int y = 0; y < BIOME_GRID_SIZE; y++)
+	for (int x = 0; x < BIOME_GRID_SIZE; x++) {
+		range->cells.push_back(range->cell_biomes.size());
+
+		// Made a bit larger against rounding when the cell is picked
+		double x0 = range->heat_min + (x - 0.01) * cell_heat;
+		double x1 = range->heat_min + (x + 1.01) * cell_heat;
+		double y0 = range->humidity_min + (y - 0.01) * cell_humidity;
+		double y1 = range->humidity_min + (y + 1.01) * cell_humidity;
+
+		// No point of the cell is further than this from its closest biome
+		double bound = DBL_MAX;
+		for (size_t i = 0; i < biomes.size(); i++) {
+			double dx = MYMAX(fabs(biomes[i]->heat_point - x0),
+				fabs(biomes[i]->heat_point - x1));
+			double dy = MYMAX(fabs(biomes[i]->humidity_point - y0),
+				fabs(biomes[i]->humidity_point - y1));
+			bound = MYMIN(bound, dx * dx + dy * dy);
+		}
+		// Against the rounding of the distances in find()
+		bound = bound * (1 + 1e-5) + 1e-5;
+
+		for (size_t i = 0; i < biomes.size(); i++) {
+			double dx = MYMAX(MYMAX(x0 - biomes[i]->heat_point,
+				biomes[i]->heat_point - x1), 0.0);
+			double dy = MYMAX(MYMAX(y0 - biomes[i]->humidity_point,
+				biomes[i]->humidity_point - y1), 0.0);
+			if (dx * dx + dy * dy <= bound)
+				range->cell_biomes.push_back(biomes[i]);
+		}
+	}
+	range->cells.push_back(range->cell_biomes.size());
+}
+
+
+Biome *BiomeLookup::find(float heat, float humidity, s16 y) const
+{
+	const Range &range = m_ranges[m_range_at_y[(s32)y - S16_MIN]];
+
+	if (!range.cells.empty()) {
+		float x = (heat - range.heat_min) * range.heat_scale;
+		float z = (humidity - range.humidity_min) * range.humidity_scale;
+		if (x >= 0 && x < BIOME_GRID_SIZE && z >= 0 && z < BIOME_GRID_SIZE) {
+			size_t cell = (size_t)z * BIOME_GRID_SIZE + (size_t)x;
+			Biome *const *biomes = range.cell_biomes.data();
+			return closest_biome(biomes + range.cells[cell],
+				biomes + range.cells[cell + 1], heat, humidity);
+		}
+	}
+
+	return closest_biome(range.biomes.data(),
+		range.biomes.data() + range.biomes.size(), heat, humidity);
+}
+
+
+Biome *BiomeLookup::findLinear(float heat, float humidity, s16 y) const
 {
 	Biome *b, *biome_closest = NULL;
 	float dist_min = FLT_MAX;
 
-	for (size_t i = 1; i < m_bmgr->getNumObjects(); i++) {
-		b = (Biome *)m_bmgr->getRaw(i);
+	for (size_t i = 1; i < m_biomes.size(); i++) {
+		b = m_biomes[i];
 		if (!b || y > b->y_max || y < b->y_min)
 			continue;
 
@@ -224,7 +405,7 @@ Biome *BiomeGenOriginal::calcBiomeFromNoise(float heat, float humidity, s16 y) c
 		}
 	}
 
-	return biome_closest ? biome_closest : (Biome *)m_bmgr->getRaw(BIOME_NONE);
+	return biome_closest;
 }
 
 
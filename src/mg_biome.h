@@ -28,6 +28,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 class Server;
 class Settings;
 class BiomeManager;
+class NoiseMapCache;
 
 ////
 //// Biome
@@ -73,6 +74,54 @@ class Biome : public ObjDef, public NodeResolver {
 };
 
 
+////
+//// BiomeLookup
+////
+
+/*
+	Finds the biome of closest heat and humidity point among the biomes that
+	include a height.  Gives the same biome as comparing with every biome,
+	the first one of lowest index on ties.
+
+	Heights are split into ranges over which the same biomes apply.  Ranges
+	with more than a few biomes have a grid over heat and humidity, each cell
+	listing the biomes that can be the closest to a point inside it.
+*/
+class BiomeLookup {
+public:
+	// biomes[i] is the biome of index i or NULL, biomes[0] is left out
+	void update(const std::vector<Biome *> &biomes);
+	const std::vector<Biome *> &getBiomes() const { return m_biomes; }
+
+	// NULL if no biome includes y
+	Biome *find(float heat, float humidity, s16 y) const;
+	// Same as find(), comparing with every biome
+	Biome *findLinear(float heat, float humidity, s16 y) const;
+
+private:
+	struct Range {
+		s32 y_min;
+		std::vector<Biome *> biomes;
+
+		// Left empty with few biomes
+		float heat_min;
+		float humidity_min;
+		float heat_scale;
+		float humidity_scale;
+		// Biomes of cell i are cell_biomes[cells[i]] to cell_biomes[cells[i + 1]]
+		std::vector<u32> cells;
+		std::vector<Biome *> cell_biomes;
+	};
+
+	void makeGrid(Range *range);
+
+	std::vector<Biome *> m_biomes;
+	std::vector<Range> m_ranges;
+	// Range of each height, from S16_MIN
+	std::vector<u16> m_range_at_y;
+};
+
+
 ////
 //// BiomeGen
 ////
@@ -119,6 +168,9 @@ class BiomeGen {
 	// Result of calcBiomes bulk computation.
 	biome_t *biomemap = nullptr;
 
+	// Cache of the noise maps, owned by the mapgen; may be NULL
+	NoiseMapCache *noise_cache = nullptr;
+
 protected:
 	BiomeManager *m_bmgr = nullptr;
 	v3s16 m_pmin;
@@ -173,7 +225,11 @@ class BiomeGenOriginal : public BiomeGen {
 	float *humidmap;
 
 private:
+	// Follows the registered biomes
+	void updateLookup();
+
 	BiomeParamsOriginal *m_params;
+	BiomeLookup m_lookup;
 
 	Noise *noise_heat;
 	Noise *noise_humidity;
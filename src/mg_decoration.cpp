@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "noise.h"
 #include "map.h"
 #include "log.h"
+#include "profiler.h"
 #include "util/numeric.h"
 #include <algorithm>
 
@@ -50,6 +51,7 @@ DecorationManager::DecorationManager(IGameDef *gamedef) :
 size_t DecorationManager::placeAllDecos(Mapgen *mg, u32 blockseed,
 	v3s16 nmin, v3s16 nmax, s16 deco_zero_level)
 {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen decorations", SPT_ADD);
 	size_t nplaced = 0;
 
 	for (size_t i = 0; i != m_objects.size(); i++) {
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "noise.h"
 #include "map.h"
 #include "log.h"
+#include "profiler.h"
 #include <algorithm>
 
 
@@ -46,6 +47,7 @@ OreManager::OreManager(IGameDef *gamedef) :
 size_t OreManager::placeAllOres(Mapgen *mg, u32 blockseed,
 	v3s16 nmin, v3s16 nmax, s16 ore_zero_level)
 {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen ores", SPT_ADD);
 	size_t nplaced = 0;
 
 	for (size_t i = 0; i != m_objects.size(); i++) {
@@ -83,6 +85,25 @@ void Ore::resolveNodeNames()
 {
 	getIdFromNrBacklog(&c_ore, "", CONTENT_AIR);
 	getIdsFromNrBacklog(&c_wherein);
+	updateFilters();
+}
+
+
+void Ore::updateFilters()
+{
+	content_t max_id = 0;
+	for (size_t i = 0; i < c_wherein.size(); i++)
+		max_id = MYMAX(max_id, c_wherein[i]);
+
+	m_wherein.assign(c_wherein.empty() ? 0 : max_id + 1, false);
+	for (size_t i = 0; i < c_wherein.size(); i++)
+		m_wherein[c_wherein[i]] = true;
+
+	m_biomes.reset();
+	for (std::unordered_set<u8>::const_iterator it = biomes.begin();
+			it != biomes.end(); ++it)
+		m_biomes.set(*it);
+	m_any_biome = biomes.empty();
 }
 
 
@@ -140,24 +161,20 @@ void OreScatter::generate(MMVManip *vm, int mapseed, u32 blockseed,
 			(NoisePerlin3D(&np, x0, y0, z0, mapseed) < nthresh))
 			continue;
 
-		if (biomemap && !biomes.empty()) {
-			u32 index = sizex * (z0 - nmin.Z) + (x0 - nmin.X);
-			std::unordered_set<u8>::const_iterator it = biomes.find(biomemap[index]);
-			if (it == biomes.end())
-				continue;
-		}
+		if (!isInBiome(biomemap, sizex * (z0 - nmin.Z) + (x0 - nmin.X)))
+			continue;
 
 		for (u32 z1 = 0; z1 != csize; z1++)
-		for (u32 y1 = 0; y1 != csize; y1++)
-		for (u32 x1 = 0; x1 != csize; x1++) {
-			if (pr.range(1, cvolume) > clust_num_ores)
-				continue;
-
-			u32 i = vm->m_area.index(x0 + x1, y0 + y1, z0 + z1);
-			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
-				continue;
-
-			vm->m_data[i] = n_ore;
+		for (u32 y1 = 0; y1 != csize; y1++) {
+			u32 i = vm->m_area.index(x0, y0 + y1, z0 + z1);
+			for (u32 x1 = 0; x1 != csize; x1++, i++) {
+				if (pr.range(1, cvolume) > clust_num_ores)
+					continue;
+				if (!isWherein(vm->m_data[i].getContent()))
+					continue;
+
+				vm->m_data[i] = n_ore;
+			}
 		}
 	}
 }
@@ -188,6 +205,7 @@ void OreSheet::generate(MMVManip *vm, int mapseed, u32 blockseed,
 	noise->seed = mapseed + y_start;
 	noise->perlinMap2D(nmin.X, nmin.Z);
 
+	u32 ystride = vm->m_area.getExtent().X;
 	size_t index = 0;
 	for (int z = nmin.Z; z <= nmax.Z; z++)
 	for (int x = nmin.X; x <= nmax.X; x++, index++) {
@@ -195,22 +213,19 @@ void OreSheet::generate(MMVManip *vm, int mapseed, u32 blockseed,
 		if (noiseval < nthresh)
 			continue;
 
-		if (biomemap && !biomes.empty()) {
-			std::unordered_set<u8>::const_iterator it = biomes.find(biomemap[index]);
-			if (it == biomes.end())
-				continue;
-		}
+		if (!isInBiome(biomemap, index))
+			continue;
 
 		u16 height = pr.range(column_height_min, column_height_max);
 		int ymidpoint = y_start + noiseval;
 		int y0 = MYMAX(nmin.Y, ymidpoint - height * (1 - column_midpoint_factor));
 		int y1 = MYMIN(nmax.Y, y0 + height - 1);
 
-		for (int y = y0; y <= y1; y++) {
-			u32 i = vm->m_area.index(x, y, z);
+		u32 i = vm->m_area.index(x, y0, z);
+		for (int y = y0; y <= y1; y++, i += ystride) {
 			if (!vm->m_area.contains(i))
 				continue;
-			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
+			if (!isWherein(vm->m_data[i].getContent()))
 				continue;
 
 			vm->m_data[i] = n_ore;
@@ -254,6 +269,7 @@ void OrePuff::generate(MMVManip *vm, int mapseed, u32 blockseed,
 	noise->perlinMap2D(nmin.X, nmin.Z);
 	bool noise_generated = false;
 
+	u32 ystride = vm->m_area.getExtent().X;
 	size_t index = 0;
 	for (int z = nmin.Z; z <= nmax.Z; z++)
 	for (int x = nmin.X; x <= nmax.X; x++, index++) {
@@ -261,11 +277,8 @@ void OrePuff::generate(MMVManip *vm, int mapseed, u32 blockseed,
 		if (noiseval < nthresh)
 			continue;
 
-		if (biomemap && !biomes.empty()) {
-			std::unordered_set<u8>::const_iterator it = biomes.find(biomemap[index]);
-			if (it == biomes.end())
-				continue;
-		}
+		if (!isInBiome(biomemap, index))
+			continue;
 
 		if (!noise_generated) {
 			noise_generated = true;
@@ -291,11 +304,11 @@ void OrePuff::generate(MMVManip *vm, int mapseed, u32 blockseed,
 		if ((flags & OREFLAG_PUFF_ADDITIVE) && (y0 > y1))
 			SWAP(int, y0, y1);
 
-		for (int y = y0; y <= y1; y++) {
-			u32 i = vm->m_area.index(x, y, z);
+		u32 i = vm->m_area.index(x, y0, z);
+		for (int y = y0; y <= y1; y++, i += ystride) {
 			if (!vm->m_area.contains(i))
 				continue;
-			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
+			if (!isWherein(vm->m_data[i].getContent()))
 				continue;
 
 			vm->m_data[i] = n_ore;
@@ -328,43 +341,40 @@ void OreBlob::generate(MMVManip *vm, int mapseed, u32 blockseed,
 		int y0 = pr.range(nmin.Y, nmax.Y - csize + 1);
 		int z0 = pr.range(nmin.Z, nmax.Z - csize + 1);
 
-		if (biomemap && !biomes.empty()) {
-			u32 bmapidx = sizex * (z0 - nmin.Z) + (x0 - nmin.X);
-			std::unordered_set<u8>::const_iterator it = biomes.find(biomemap[bmapidx]);
-			if (it == biomes.end())
-				continue;
-		}
+		if (!isInBiome(biomemap, sizex * (z0 - nmin.Z) + (x0 - nmin.X)))
+			continue;
 
 		bool noise_generated = false;
 		noise->seed = blockseed + i;
 
 		size_t index = 0;
 		for (u32 z1 = 0; z1 != csize; z1++)
-		for (u32 y1 = 0; y1 != csize; y1++)
-		for (u32 x1 = 0; x1 != csize; x1++, index++) {
-			u32 i = vm->m_area.index(x0 + x1, y0 + y1, z0 + z1);
-			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
-				continue;
+		for (u32 y1 = 0; y1 != csize; y1++) {
+			u32 i = vm->m_area.index(x0, y0 + y1, z0 + z1);
+			for (u32 x1 = 0; x1 != csize; x1++, index++, i++) {
+				if (!isWherein(vm->m_data[i].getContent()))
+					continue;
 
-			// Lazily generate noise only if there's a chance of ore being placed
-			// This simple optimization makes calls 6x faster on average
-			if (!noise_generated) {
-				noise_generated = true;
-				noise->perlinMap3D(x0, y0, z0);
-			}
+				// Lazily generate noise only if there's a chance of ore being placed
+				// This simple optimization makes calls 6x faster on average
+				if (!noise_generated) {
+					noise_generated = true;
+					noise->perlinMap3D(x0, y0, z0);
+				}
 
-			float noiseval = noise->result[index];
+				float noiseval = noise->result[index];
 
-			float xdist = (s32)x1 - (s32)csize / 2;
-			float ydist = (s32)y1 - (s32)csize / 2;
-			float zdist = (s32)z1 - (s32)csize / 2;
+				float xdist = (s32)x1 - (s32)csize / 2;
+				float ydist = (s32)y1 - (s32)csize / 2;
+				float zdist = (s32)z1 - (s32)csize / 2;
 
-			noiseval -= (sqrt(xdist * xdist + ydist * ydist + zdist * zdist) / csize);
+				noiseval -= (sqrt(xdist * xdist + ydist * ydist + zdist * zdist) / csize);
 
-			if (noiseval < nthresh)
-				continue;
+				if (noiseval < nthresh)
+					continue;
 
-			vm->m_data[i] = n_ore;
+				vm->m_data[i] = n_ore;
+			}
 		}
 	}
 }
@@ -403,35 +413,32 @@ void OreVein::generate(MMVManip *vm, int mapseed, u32 blockseed,
 
 	size_t index = 0;
 	for (int z = nmin.Z; z <= nmax.Z; z++)
-	for (int y = nmin.Y; y <= nmax.Y; y++)
-	for (int x = nmin.X; x <= nmax.X; x++, index++) {
-		u32 i = vm->m_area.index(x, y, z);
-		if (!vm->m_area.contains(i))
-			continue;
-		if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
-			continue;
-
-		if (biomemap && !biomes.empty()) {
-			u32 bmapidx = sizex * (z - nmin.Z) + (x - nmin.X);
-			std::unordered_set<u8>::const_iterator it = biomes.find(biomemap[bmapidx]);
-			if (it == biomes.end())
+	for (int y = nmin.Y; y <= nmax.Y; y++) {
+		u32 i = vm->m_area.index(nmin.X, y, z);
+		u32 bmapidx = sizex * (z - nmin.Z);
+		for (int x = nmin.X; x <= nmax.X; x++, index++, i++, bmapidx++) {
+			if (!vm->m_area.contains(i))
+				continue;
+			if (!isWherein(vm->m_data[i].getContent()))
+				continue;
+			if (!isInBiome(biomemap, bmapidx))
 				continue;
-		}
 
-		// Same lazy generation optimization as in OreBlob
-		if (!noise_generated) {
-			noise_generated = true;
-			noise->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
-			noise2->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
-		}
+			// Same lazy generation optimization as in OreBlob
+			if (!noise_generated) {
+				noise_generated = true;
+				noise->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
+				noise2->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
+			}
 
-		// randval ranges from -1..1
-		float randval   = (float)pr.next() / (pr.RANDOM_RANGE / 2) - 1.f;
-		float noiseval  = contour(noise->result[index]);
-		float noiseval2 = contour(noise2->result[index]);
-		if (noiseval * noiseval2 + randval * random_factor < nthresh)
-			continue;
+			// randval ranges from -1..1
+			float randval   = (float)pr.next() / (pr.RANDOM_RANGE / 2) - 1.f;
+			float noiseval  = contour(noise->result[index]);
+			float noiseval2 = contour(noise2->result[index]);
+			if (noiseval * noiseval2 + randval * random_factor < nthresh)
+				continue;
 
-		vm->m_data[i] = n_ore;
+			vm->m_data[i] = n_ore;
+		}
 	}
 }
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef MG_ORE_HEADER
 #define MG_ORE_HEADER
 
+#include <bitset>
 #include <unordered_set>
 #include "objdef.h"
 #include "noise.h"
@@ -70,10 +71,30 @@ class Ore : public ObjDef, public NodeResolver {
 
 	virtual void resolveNodeNames();
 
+	// Builds the lookup tables of c_wherein and biomes, call it after
+	// changing them
+	void updateFilters();
+
+	inline bool isWherein(content_t c) const
+	{
+		return c < m_wherein.size() && m_wherein[c];
+	}
+
+	inline bool isInBiome(const u8 *biomemap, u32 index) const
+	{
+		return !biomemap || m_any_biome || m_biomes[biomemap[index]];
+	}
+
 	size_t placeOre(Mapgen *mg, u32 blockseed,
 		v3s16 nmin, v3s16 nmax, s16 ore_zero_level);
 	virtual void generate(MMVManip *vm, int mapseed, u32 blockseed,
 		v3s16 nmin, v3s16 nmax, u8 *biomemap) = 0;
+
+protected:
+	// One bit per content id, set for the nodes of c_wherein
+	std::vector<bool> m_wherein;
+	std::bitset<256> m_biomes;
+	bool m_any_biome = true;
 };
 
 class OreScatter : public Ore {
@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <cstring>
 #include <fstream>
 #include <typeinfo>
 #include "mg_schematic.h"
@@ -89,13 +90,25 @@ void Schematic::resolveNodeNames()
 		content_t c_new = c_nodes[c_original];
 		schemdata[i].setContent(c_new);
 	}
+
+	prepareRotations();
 }
 
 
-void Schematic::blitToVManip(MMVManip *vm, v3s16 p, Rotation rot, bool force_place)
+void Schematic::prepareRotations()
 {
 	sanity_check(m_ndef != NULL);
 
+	for (int rot = ROTATE_0; rot <= ROTATE_270; rot++)
+		prepareRotation((Rotation)rot);
+	m_rotations_prepared = true;
+}
+
+
+void Schematic::prepareRotation(Rotation rot)
+{
+	RotatedSchematic &r = m_rotations[rot];
+
 	int xstride = 1;
 	int ystride = size.X;
 	int zstride = size.X * size.Y;
@@ -129,43 +142,109 @@ void Schematic::blitToVManip(MMVManip *vm, v3s16 p, Rotation rot, bool force_pla
 			i_step_z = zstride;
 	}
 
-	s16 y_map = p.Y;
-	for (s16 y = 0; y != sy; y++) {
-		if ((slice_probs[y] != MTSCHEM_PROB_ALWAYS) &&
-			(slice_probs[y] <= myrand_range(1, MTSCHEM_PROB_ALWAYS)))
-			continue;
+	r.size = v3s16(sx, sy, sz);
+	r.nodes.resize(sx * sy * sz);
+	r.params.resize(sx * sy * sz);
+	r.spans.clear();
+	r.row_spans.clear();
 
-		for (s16 z = 0; z != sz; z++) {
-			u32 i = z * i_step_z + y * ystride + i_start;
-			for (s16 x = 0; x != sx; x++, i += i_step_x) {
-				u32 vi = vm->m_area.index(p.X + x, y_map, p.Z + z);
-				if (!vm->m_area.contains(vi))
+	u32 ri = 0;
+	for (s16 z = 0; z != sz; z++)
+	for (s16 y = 0; y != sy; y++) {
+		r.row_spans.push_back(r.spans.size());
+
+		u32 i = z * i_step_z + y * ystride + i_start;
+		for (s16 x = 0; x != sx; x++, i += i_step_x, ri++) {
+			r.nodes[ri] = schemdata[i];
+			r.nodes[ri].param1 = 0;
+			if (rot)
+				r.nodes[ri].rotateAlongYAxis(m_ndef, rot);
+			r.params[ri] = schemdata[i].param1;
+
+			u8 placement_prob = schemdata[i].param1 & MTSCHEM_PROB_MASK;
+			if (schemdata[i].getContent() == CONTENT_IGNORE ||
+					placement_prob == MTSCHEM_PROB_NEVER)
+				continue;
+
+			u8 type = SPAN_PROB;
+			if (placement_prob == MTSCHEM_PROB_ALWAYS)
+				type = (schemdata[i].param1 & MTSCHEM_FORCE_PLACE) ?
+					SPAN_FORCE : SPAN_ALWAYS;
+
+			if (r.spans.size() > r.row_spans.back()) {
+				Span &last = r.spans.back();
+				if (last.x + last.length == x && last.type == type) {
+					last.length++;
 					continue;
+				}
+			}
 
-				if (schemdata[i].getContent() == CONTENT_IGNORE)
-					continue;
+			Span span = {(u16)x, 1, type};
+			r.spans.push_back(span);
+		}
+	}
+	r.row_spans.push_back(r.spans.size());
+}
 
-				u8 placement_prob     = schemdata[i].param1 & MTSCHEM_PROB_MASK;
-				bool force_place_node = schemdata[i].param1 & MTSCHEM_FORCE_PLACE;
 
-				if (placement_prob == MTSCHEM_PROB_NEVER)
-					continue;
+void Schematic::blitToVManip(MMVManip *vm, v3s16 p, Rotation rot, bool force_place)
+{
+	sanity_check(m_ndef != NULL);
+	sanity_check(rot <= ROTATE_270);
 
-				if (!force_place && !force_place_node) {
-					content_t c = vm->m_data[vi].getContent();
-					if (c != CONTENT_AIR && c != CONTENT_IGNORE)
-						continue;
+	if (!m_rotations_prepared)
+		prepareRotations();
+
+	const RotatedSchematic &r = m_rotations[rot];
+	const s32 volume = vm->m_area.getVolume();
+
+	s16 y_map = p.Y;
+	for (s16 y = 0; y != r.size.Y; y++) {
+		if ((slice_probs[y] != MTSCHEM_PROB_ALWAYS) &&
+			(slice_probs[y] <= myrand_range(1, MTSCHEM_PROB_ALWAYS)))
+			continue;
+
+		for (s16 z = 0; z != r.size.Z; z++) {
+			u32 row = z * r.size.Y + y;
+			s32 vi_row = vm->m_area.index(p.X, y_map, p.Z + z);
+
+			for (u32 k = r.row_spans[row]; k != r.row_spans[row + 1]; k++) {
+				const Span &span = r.spans[k];
+
+				// Nodes out of the VoxelManip are skipped the same way
+				// as VoxelArea::contains(s32) does
+				s32 vi = vi_row + span.x;
+				s32 vi_end = MYMIN(vi + span.length, volume);
+				u32 i = row * r.size.X + span.x;
+				if (vi < 0) {
+					i -= vi;
+					vi = 0;
 				}
+				if (vi >= vi_end)
+					continue;
 
-				if ((placement_prob != MTSCHEM_PROB_ALWAYS) &&
-					(placement_prob <= myrand_range(1, MTSCHEM_PROB_ALWAYS)))
+				if (span.type == SPAN_FORCE ||
+						(span.type == SPAN_ALWAYS && force_place)) {
+					memcpy(&vm->m_data[vi], &r.nodes[i],
+						(vi_end - vi) * sizeof(MapNode));
 					continue;
+				}
 
-				vm->m_data[vi] = schemdata[i];
-				vm->m_data[vi].param1 = 0;
+				for (; vi != vi_end; vi++, i++) {
+					bool force_place_node = r.params[i] & MTSCHEM_FORCE_PLACE;
+					if (!force_place && !force_place_node) {
+						content_t c = vm->m_data[vi].getContent();
+						if (c != CONTENT_AIR && c != CONTENT_IGNORE)
+							continue;
+					}
+
+					u8 placement_prob = r.params[i] & MTSCHEM_PROB_MASK;
+					if ((placement_prob != MTSCHEM_PROB_ALWAYS) &&
+						(placement_prob <= myrand_range(1, MTSCHEM_PROB_ALWAYS)))
+						continue;
 
-				if (rot)
-					vm->m_data[vi].rotateAlongYAxis(m_ndef, rot);
+					vm->m_data[vi] = r.nodes[i];
+				}
 			}
 		}
 		y_map++;
@@ -304,7 +383,8 @@ bool Schematic::deserializeFromMts(std::istream *is,
 	delete []schemdata;
 	schemdata = new MapNode[nodecount];
 
-	MapNode::deSerializeBulk(ss, SER_FMT_VER_HIGHEST_READ, schemdata,
+	// Schematic files always compress node data with zlib
+	MapNode::deSerializeBulk(ss, SER_FMT_VER_HIGHEST_ZLIB, schemdata,
 		nodecount, 2, 2, true);
 
 	// Fix probability values for nodes that were ignore; removed in v2
@@ -346,7 +426,7 @@ bool Schematic::serializeToMts(std::ostream *os,
 		ss << serializeString(names[i]); // node names
 
 	// compressed bulk node data
-	MapNode::serializeBulk(ss, SER_FMT_VER_HIGHEST_WRITE,
+	MapNode::serializeBulk(ss, SER_FMT_VER_HIGHEST_ZLIB,
 		schemdata, size.X * size.Y * size.Z, 2, 2, true);
 
 	return true;
@@ -98,6 +98,10 @@ class Schematic : public ObjDef, public NodeResolver {
 
 	virtual void resolveNodeNames();
 
+	// Makes the copies of the schematic used for placement, resolving the
+	// node names does it; call it after changing schemdata otherwise
+	void prepareRotations();
+
 	bool loadSchematicFromFile(const std::string &filename, INodeDefManager *ndef,
 		StringMap *replace_names=NULL);
 	bool saveSchematicToFile(const std::string &filename, INodeDefManager *ndef);
@@ -121,6 +125,41 @@ class Schematic : public ObjDef, public NodeResolver {
 	v3s16 size;
 	MapNode *schemdata = nullptr;
 	u8 *slice_probs = nullptr;
+
+private:
+	enum SpanType {
+		// Nodes always placed
+		SPAN_FORCE,
+		// Nodes placed in air and ignore, or always with force_place
+		SPAN_ALWAYS,
+		// Nodes with a placement probability or mixed flags
+		SPAN_PROB,
+	};
+
+	// Adjacent nodes of a row that can be placed, of the same type
+	struct Span {
+		u16 x;
+		u16 length;
+		u8 type;
+	};
+
+	// The schematic rotated around the Y axis, laid out along the map axes
+	struct RotatedSchematic {
+		v3s16 size;
+		// Nodes as they are placed: param1 cleared and param2 rotated
+		std::vector<MapNode> nodes;
+		// param1 of the nodes in schemdata
+		std::vector<u8> params;
+		// Spans of each row, the rows going by Z then Y
+		std::vector<Span> spans;
+		// First span of each row, and the end of the spans
+		std::vector<u32> row_spans;
+	};
+
+	void prepareRotation(Rotation rot);
+
+	RotatedSchematic m_rotations[4];
+	bool m_rotations_prepared = false;
 };
 
 class SchematicManager : public ObjDefManager {
@@ -321,7 +321,8 @@ void Client::handleCommand_BlockData(NetworkPacket* pkt)
 	}
 
 	if (m_localdb) {
-		ServerMap::saveBlock(block, m_localdb);
+		// zlib, so that the cache stays readable by builds without zstd
+		ServerMap::saveBlock(block, m_localdb, SER_FMT_VER_HIGHEST_ZLIB);
 	}
 
 	/*
@@ -0,0 +1,173 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "congestioncontrol.h"
+#include "util/basic_macros.h"
+#include "util/numeric.h"
+
+namespace con
+{
+
+// Round trip time until one is measured
+#define CC_INITIAL_RTT 0.1f
+// Seconds the lowest round trip time is kept
+#define CC_MIN_RTT_TIME 10.0
+// Shortest round, so that the delivery rates are measured on some acks
+#define CC_MIN_ROUND_TIME 0.02f
+// Packets sent at once in addition to those of the pacing rate of a
+// millisecond, as the send thread doesn't wake up more often
+#define CC_BURST 2.0f
+
+// Gain doubling the delivery rate each round
+#define CC_STARTUP_GAIN 2.885f
+#define CC_WINDOW_GAIN 2.0f
+// The startup ends when the bandwidth didn't grow by that much
+// in as many rounds
+#define CC_FULL_BANDWIDTH_GROWTH 1.25f
+#define CC_FULL_BANDWIDTH_ROUNDS 3
+
+// Pacing gains of the rounds after the startup
+static const float probe_gains[] = {1.25f, 0.75f, 1, 1, 1, 1, 1, 1};
+
+CongestionControl::CongestionControl(u32 min_window, u32 max_window) :
+	m_min_window(min_window),
+	m_max_window(max_window),
+	m_window(min_window)
+{
+	update();
+}
+
+float CongestionControl::getRTT() const
+{
+	return m_min_rtt > 0.0f ? m_min_rtt : CC_INITIAL_RTT;
+}
+
+void CongestionControl::update()
+{
+	float pacing_gain = 1.0f;
+	float window_gain = CC_WINDOW_GAIN;
+	switch (m_state) {
+	case STARTUP:
+		pacing_gain = CC_STARTUP_GAIN;
+		window_gain = CC_STARTUP_GAIN;
+		break;
+	case DRAIN:
+		pacing_gain = 1.0f / CC_STARTUP_GAIN;
+		window_gain = CC_STARTUP_GAIN;
+		break;
+	case PROBE_BW:
+		pacing_gain = probe_gains[m_cycle];
+		break;
+	}
+
+	// The minimum window, sent in a round trip until a rate is measured
+	if (m_bandwidth <= 0.0f) {
+		m_pacing_rate = pacing_gain * m_min_window / getRTT();
+		m_window = m_min_window;
+		return;
+	}
+
+	m_pacing_rate = pacing_gain * m_bandwidth;
+	float window = window_gain * m_bandwidth * getRTT();
+	m_window = rangelim(window, m_min_window, m_max_window);
+}
+
+bool CongestionControl::canSend(double now, u32 in_flight)
+{
+	if (in_flight >= m_window)
+		return false;
+
+	float max_tokens = CC_BURST + m_pacing_rate * 0.001f;
+	if (m_tokens_time < 0.0)
+		m_tokens = max_tokens;
+	else
+		m_tokens = MYMIN(m_tokens + (now - m_tokens_time) * m_pacing_rate,
+			max_tokens);
+	m_tokens_time = now;
+
+	return m_tokens >= 1.0f;
+}
+
+void CongestionControl::onSend()
+{
+	m_tokens -= 1.0f;
+}
+
+double CongestionControl::getNextSendTime() const
+{
+	if (m_tokens >= 1.0f || m_pacing_rate <= 0.0f)
+		return m_tokens_time;
+	return m_tokens_time + (1.0f - m_tokens) / m_pacing_rate;
+}
+
+void CongestionControl::onAck(double now, float rtt, u32 in_flight)
+{
+	if (rtt > 0.0f && (m_min_rtt < 0.0f || rtt <= m_min_rtt ||
+			now - m_min_rtt_time > CC_MIN_RTT_TIME)) {
+		m_min_rtt = rtt;
+		m_min_rtt_time = now;
+	}
+
+	if (m_round_start < 0.0)
+		m_round_start = now;
+	m_round_acked++;
+	if (now - m_round_start >= MYMAX(getRTT(), CC_MIN_ROUND_TIME))
+		endRound(now);
+
+	// Leave the queue built up by the startup
+	if (m_state == DRAIN && in_flight <= m_bandwidth * getRTT()) {
+		m_state = PROBE_BW;
+		m_cycle = 0;
+		update();
+	}
+}
+
+void CongestionControl::endRound(double now)
+{
+	float rate = m_round_acked / (now - m_round_start);
+
+	// Rounds with little to send don't tell the bandwidth, unless it
+	// was higher than thought
+	u32 round = m_round % CC_BANDWIDTH_ROUNDS;
+	if (!m_round_app_limited || rate > m_samples[round])
+		m_samples[round] = rate;
+	m_round++;
+
+	m_bandwidth = 0.0f;
+	for (u32 i = 0; i < CC_BANDWIDTH_ROUNDS; i++)
+		m_bandwidth = MYMAX(m_bandwidth, m_samples[i]);
+
+	if (m_state == STARTUP && !m_round_app_limited) {
+		if (m_bandwidth >= m_full_bandwidth * CC_FULL_BANDWIDTH_GROWTH) {
+			m_full_bandwidth = m_bandwidth;
+			m_full_rounds = 0;
+		} else if (++m_full_rounds >= CC_FULL_BANDWIDTH_ROUNDS) {
+			m_state = DRAIN;
+		}
+	} else if (m_state == PROBE_BW) {
+		m_cycle = (m_cycle + 1) % ARRLEN(probe_gains);
+	}
+
+	m_round_start = now;
+	m_round_acked = 0;
+	m_round_app_limited = false;
+	update();
+}
+
+}
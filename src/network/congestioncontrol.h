@@ -0,0 +1,115 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef CONGESTIONCONTROL_HEADER
+#define CONGESTIONCONTROL_HEADER
+
+#include "irrlichttypes.h"
+
+namespace con
+{
+
+#define CC_BANDWIDTH_ROUNDS 10
+
+/*
+	Paces the reliable packets sent to a peer and limits the packets in
+	flight, from the bandwidth and the round trip time measured with the
+	acks, in the way of BBR:
+	- the bandwidth is the highest delivery rate of the last rounds, a
+	  round lasting about a round trip,
+	- the round trip time is the lowest of the last seconds,
+	- the packets are sent at the bandwidth, faster at first to find it,
+	  then now and then a bit faster or slower to probe for more,
+	- at most twice the packets the link holds are in flight.
+
+	Packet losses don't change the rates, the pacing keeps the links
+	from overflowing.
+
+	Times are in seconds, from any origin. Not thread-safe.
+*/
+class CongestionControl
+{
+public:
+	CongestionControl(u32 min_window, u32 max_window);
+
+	// Whether a packet can be sent now, in_flight packets are not acked yet
+	bool canSend(double now, u32 in_flight);
+	// A packet was sent, it uses up one token of the pacing
+	void onSend();
+	// A packet was acked, rtt is its round trip time or negative if unknown
+	void onAck(double now, float rtt, u32 in_flight);
+	// There was nothing left to send though more packets could be sent
+	void onAppLimited() { m_round_app_limited = true; }
+
+	// When the next packet can be sent
+	double getNextSendTime() const;
+
+	// Packets that can be in flight
+	u32 getWindow() const { return m_window; }
+	// Packets per second
+	float getPacingRate() const { return m_pacing_rate; }
+	float getBandwidth() const { return m_bandwidth; }
+	float getMinRTT() const { return m_min_rtt; }
+	bool isStartingUp() const { return m_state == STARTUP; }
+
+private:
+	enum State
+	{
+		STARTUP,
+		DRAIN,
+		PROBE_BW,
+	};
+
+	void endRound(double now);
+	void update();
+	float getRTT() const;
+
+	u32 m_min_window;
+	u32 m_max_window;
+
+	State m_state = STARTUP;
+	u32 m_cycle = 0;
+
+	float m_min_rtt = -1.0f;
+	double m_min_rtt_time = 0.0;
+
+	// Delivery rates of the last rounds
+	float m_samples[CC_BANDWIDTH_ROUNDS] = {};
+	u32 m_round = 0;
+	double m_round_start = -1.0;
+	u32 m_round_acked = 0;
+	bool m_round_app_limited = false;
+
+	// The bandwidth at the end of the startup and the rounds since it
+	// grew last
+	float m_full_bandwidth = 0.0f;
+	u32 m_full_rounds = 0;
+
+	float m_bandwidth = 0.0f;
+	float m_pacing_rate = 0.0f;
+	u32 m_window;
+
+	// Packets that can be sent at once, refilled at the pacing rate
+	float m_tokens = 0.0f;
+	double m_tokens_time = -1.0;
+};
+
+}
+
+#endif
@@ -17,6 +17,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <cmath>
 #include <iomanip>
 #include <errno.h>
 #include "connection.h"
@@ -201,111 +202,140 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	for (size_t i = 0; i < m_slots.size(); i++)
+		delete m_slots[i].packet;
+}
+
 void ReliablePacketBuffer::print()
 {
-	MutexAutoLock listlock(m_list_mutex);
+	MutexAutoLock lock(m_mutex);
 	LOG(dout_con<<"Dump of ReliablePacketBuffer:" << std::endl);
 	unsigned int index = 0;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end();
-		++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
+	for (u32 i = 0; i < m_span; i++) {
+		u16 s = m_first + i;
+		if (!holds(s))
+			continue;
 		LOG(dout_con<<index<< ":" << s << std::endl);
 		index++;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
-	MutexAutoLock listlock(m_list_mutex);
-	return m_list.empty();
+	MutexAutoLock lock(m_mutex);
+	return m_size == 0;
 }
 
 u32 ReliablePacketBuffer::size()
 {
-	return m_list_size;
+	return m_size;
 }
 
 bool ReliablePacketBuffer::containsPacket(u16 seqnum)
 {
-	return !(findPacket(seqnum) == m_list.end());
+	MutexAutoLock lock(m_mutex);
+	return holds(seqnum);
 }
 
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+bool ReliablePacketBuffer::holds(u16 seqnum)
 {
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if (s == seqnum)
-			break;
+	// All the seqnums of the span have a slot of their own
+	if ((u16)(seqnum - m_first) >= m_span)
+		return false;
+	return getSlot(seqnum).packet != NULL;
+}
+
+bool ReliablePacketBuffer::isLastSent(const SentPacket &sent)
+{
+	return holds(sent.seqnum) && getSlot(sent.seqnum).sent_time == sent.time;
+}
+
+BufferedPacket ReliablePacketBuffer::take(u16 seqnum)
+{
+	Slot &slot = getSlot(seqnum);
+	BufferedPacket p = *slot.packet;
+	p.time = m_time - slot.sent_time;
+	p.totaltime = m_time - slot.buffered_time;
+	delete slot.packet;
+	slot.packet = NULL;
+	--m_size;
+
+	if (m_size == 0) {
+		m_span = 0;
+		m_sent_order.clear();
+		// Give back the memory of a burst of packets
+		if (m_slots.size() > MIN_RELIABLE_WINDOW_SIZE)
+			std::vector<Slot>(MIN_RELIABLE_WINDOW_SIZE).swap(m_slots);
+		return p;
 	}
-	return i;
+
+	// Skip the seqnums left without a packet at either end of the span
+	if (seqnum == m_first) {
+		do {
+			m_first++;
+			m_span--;
+		} while (!getSlot(m_first).packet);
+	} else if ((u16)(seqnum - m_first) == m_span - 1) {
+		do {
+			m_span--;
+		} while (!getSlot(m_first + m_span - 1).packet);
+	}
+
+	while (!m_sent_order.empty() && !isLastSent(m_sent_order.front()))
+		m_sent_order.pop_front();
+
+	return p;
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+
+void ReliablePacketBuffer::grow(u32 span)
 {
-	return m_list.end();
+	if (span <= m_slots.size())
+		return;
+	sanity_check(span <= SEQNUM_MAX + 1);
+
+	size_t size = m_slots.size();
+	while (size < span)
+		size *= 2;
+
+	std::vector<Slot> slots(size);
+	for (u32 i = 0; i < m_span; i++) {
+		u16 seqnum = m_first + i;
+		if (holds(seqnum))
+			slots[seqnum & (size - 1)] = getSlot(seqnum);
+	}
+	m_slots.swap(slots);
 }
+
 bool ReliablePacketBuffer::getFirstSeqnum(u16& result)
 {
-	MutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	MutexAutoLock lock(m_mutex);
+	if (m_size == 0)
 		return false;
-	BufferedPacket p = *m_list.begin();
-	result = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	result = m_first;
 	return true;
 }
 
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
-	MutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	MutexAutoLock lock(m_mutex);
+	if (m_size == 0)
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
-
-	if (m_list_size == 0) {
-		m_oldest_non_answered_ack = 0;
-	} else {
-		m_oldest_non_answered_ack =
-				readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
-	}
-	return p;
+	return take(m_first);
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
-	MutexAutoLock listlock(m_list_mutex);
-	RPBSearchResult r = findPacket(seqnum);
-	if (r == notFound()) {
+	MutexAutoLock lock(m_mutex);
+	if (!holds(seqnum)) {
 		LOG(dout_con<<"Sequence number: " << seqnum
 				<< " not found in reliable buffer"<<std::endl);
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-
-
-	RPBSearchResult next = r;
-	++next;
-	if (next != notFound()) {
-		u16 s = readU16(&(next->data[BASE_HEADER_SIZE+1]));
-		m_oldest_non_answered_ack = s;
-	}
-
-	m_list.erase(r);
-	--m_list_size;
-
-	if (m_list_size == 0)
-	{ m_oldest_non_answered_ack = 0; }
-	else
-	{ m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);	}
-	return p;
+	return take(seqnum);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 {
-	MutexAutoLock listlock(m_list_mutex);
+	MutexAutoLock lock(m_mutex);
 	if (p.data.getSize() < BASE_HEADER_SIZE + 3) {
 		errorstream << "ReliablePacketBuffer::insert(): Invalid data size for "
 			"reliable packet" << std::endl;
@@ -330,57 +360,34 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 		return;
 	}
 
-	++m_list_size;
-	sanity_check(m_list_size <= SEQNUM_MAX+1);	// FIXME: Handle the error?
-
-	// Find the right place for the packet and insert it there
-	// If list is empty, just add it
-	if (m_list.empty())
-	{
-		m_list.push_back(p);
-		m_oldest_non_answered_ack = seqnum;
-		// Done.
-		return;
-	}
-
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-
-	/* case seqnum is smaller then next_expected seqnum */
-	/* this is true e.g. on wrap around */
-	if (seqnum < next_expected) {
-		while(((s < seqnum) || (s >= next_expected)) && (i != m_list.end())) {
-			++i;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-	/* non wrap around case (at least for incoming and next_expected */
-	else
-	{
-		while(((s < seqnum) && (s >= next_expected)) && (i != m_list.end())) {
-			++i;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-
-	if (s == seqnum) {
-		if (
-			(readU16(&(i->data[BASE_HEADER_SIZE+1])) != seqnum) ||
-			(i->data.getSize() != p.data.getSize()) ||
-			(i->address != p.address)
-			)
+	if (m_size == 0) {
+		if (m_slots.empty())
+			m_slots.resize(MIN_RELIABLE_WINDOW_SIZE);
+		m_first = seqnum;
+		m_span = 1;
+	} else if (seqnum_higher(m_first, seqnum)) {
+		// Before the first packet, this is true e.g. on wrap around
+		u32 span = m_span + (u16)(m_first - seqnum);
+		grow(span);
+		m_first = seqnum;
+		m_span = span;
+	} else if ((u16)(seqnum - m_first) >= m_span) {
+		// After the last packet
+		u32 span = (u16)(seqnum - m_first) + 1;
+		grow(span);
+		m_span = span;
+	} else if (holds(seqnum)) {
+		BufferedPacket *old = getSlot(seqnum).packet;
+		if ((old->data.getSize() != p.data.getSize()) ||
+				(old->address != p.address))
 		{
 			/* if this happens your maximum transfer window may be to big */
 			fprintf(stderr,
 					"Duplicated seqnum %d non matching packet detected:\n",
 					seqnum);
 			fprintf(stderr, "Old: seqnum: %05d size: %04d, address: %s\n",
-					readU16(&(i->data[BASE_HEADER_SIZE+1])),i->data.getSize(),
-					i->address.serializeString().c_str());
+					readU16(&(old->data[BASE_HEADER_SIZE+1])),old->data.getSize(),
+					old->address.serializeString().c_str());
 			fprintf(stderr, "New: seqnum: %05d size: %04u, address: %s\n",
 					readU16(&(p.data[BASE_HEADER_SIZE+1])),p.data.getSize(),
 					p.address.serializeString().c_str());
@@ -389,47 +396,52 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 
 		/* nothing to do this seems to be a resent packet */
 		/* for paranoia reason data should be compared */
-		--m_list_size;
-	}
-	/* insert or push back */
-	else if (i != m_list.end()) {
-		m_list.insert(i, p);
-	}
-	else {
-		m_list.push_back(p);
+		return;
 	}
 
-	/* update last packet number */
-	m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
+	Slot &slot = getSlot(seqnum);
+	slot.packet = new BufferedPacket(p);
+	slot.buffered_time = m_time - p.totaltime;
+	slot.sent_time = m_time - p.time;
+	m_sent_order.push_back(SentPacket{seqnum, slot.sent_time});
+	++m_size;
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
-	MutexAutoLock listlock(m_list_mutex);
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
-	{
-		i->time += dtime;
-		i->totaltime += dtime;
-	}
+	MutexAutoLock lock(m_mutex);
+	m_time += dtime;
 }
 
 std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
 													unsigned int max_packets)
 {
-	MutexAutoLock listlock(m_list_mutex);
+	MutexAutoLock lock(m_mutex);
 	std::list<BufferedPacket> timed_outs;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
-	{
-		if (i->time >= timeout) {
-			timed_outs.push_back(*i);
 
-			//this packet will be sent right afterwards reset timeout here
-			i->time = 0.0;
-			if (timed_outs.size() >= max_packets)
-				break;
+	// Only the packets sent first can have timed out
+	size_t count = m_sent_order.size();
+	for (size_t i = 0; i < count; i++) {
+		SentPacket sent = m_sent_order.front();
+		if (!isLastSent(sent)) {
+			m_sent_order.pop_front();
+			continue;
 		}
+		if (m_time - sent.time < timeout)
+			break;
+
+		Slot &slot = getSlot(sent.seqnum);
+		BufferedPacket p = *slot.packet;
+		p.time = m_time - slot.sent_time;
+		p.totaltime = m_time - slot.buffered_time;
+		timed_outs.push_back(p);
+
+		//this packet will be sent right afterwards reset timeout here
+		m_sent_order.pop_front();
+		slot.sent_time = m_time;
+		m_sent_order.push_back(SentPacket{sent.seqnum, m_time});
+		if (timed_outs.size() >= max_packets)
+			break;
 	}
 	return timed_outs;
 }
@@ -679,7 +691,7 @@ void Channel::UpdatePacketTooLateCounter()
 	current_packet_too_late++;
 }
 
-void Channel::UpdateTimers(float dtime,bool legacy_peer)
+void Channel::UpdateTimers(float dtime,bool fixed_window)
 {
 	bpm_counter += dtime;
 	packet_loss_counter += dtime;
@@ -709,8 +721,9 @@ void Channel::UpdateTimers(float dtime,bool legacy_peer)
 			current_packet_successfull = 0;
 		}
 
-		/* dynamic window size is only available for non legacy peers */
-		if (!legacy_peer) {
+		/* dynamic window size is only available for non legacy peers
+		 * without a congestion control */
+		if (!fixed_window) {
 			float successfull_to_lost_ratio = 0.0;
 			bool done = false;
 
@@ -958,11 +971,30 @@ void Peer::Drop()
 	delete this;
 }
 
+// Clock of the congestion controls, in seconds
+static double getPacingTime()
+{
+	return porting::getTimeUs() / 1000000.0;
+}
+
 UDPPeer::UDPPeer(u16 a_id, Address a_address, Connection* connection) :
 	Peer(a_address,a_id,connection)
 {
 }
 
+UDPPeer::~UDPPeer()
+{
+	if (m_congestion) {
+		std::ostringstream prefix;
+		prefix << "RUDP peer " << id << ": ";
+		g_profiler->remove(prefix.str() + "cwnd");
+		g_profiler->remove(prefix.str() + "min rtt (ms)");
+		g_profiler->remove(prefix.str() + "bandwidth (pkt/s)");
+		g_profiler->remove(prefix.str() + "pacing rate (pkt/s)");
+	}
+	delete m_congestion;
+}
+
 bool UDPPeer::getAddress(MTProtocols type,Address& toset)
 {
 	if ((type == MTP_UDP) || (type == MTP_MINETEST_RELIABLE_UDP) || (type == MTP_PRIMARY))
@@ -981,6 +1013,82 @@ void UDPPeer::setNonLegacyPeer()
 	{
 		channels->setWindowSize(g_settings->getU16("max_packets_per_iteration"));
 	}
+
+	MutexAutoLock lock(m_congestion_mutex);
+	if (!m_congestion && g_settings->get("congestion_control") == "bbr") {
+		m_congestion = new CongestionControl(MIN_RELIABLE_WINDOW_SIZE,
+			MAX_RELIABLE_WINDOW_SIZE);
+		// The congestion control limits the packets in flight instead
+		for (Channel &channel : channels)
+			channel.setWindowSize(MAX_RELIABLE_WINDOW_SIZE);
+	}
+}
+
+u32 UDPPeer::getReliablesInFlight()
+{
+	u32 in_flight = 0;
+	for (Channel &channel : channels)
+		in_flight += channel.outgoing_reliables_sent.size();
+	return in_flight;
+}
+
+bool UDPPeer::canSendReliable(double now)
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	if (!m_congestion)
+		return true;
+	return m_congestion->canSend(now, getReliablesInFlight());
+}
+
+void UDPPeer::onReliableSent()
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	if (m_congestion)
+		m_congestion->onSend();
+}
+
+void UDPPeer::onReliableAcked(double now, float rtt)
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	if (m_congestion)
+		m_congestion->onAck(now, rtt, getReliablesInFlight());
+}
+
+void UDPPeer::onReliableAppLimited()
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	if (m_congestion)
+		m_congestion->onAppLimited();
+}
+
+double UDPPeer::getNextReliableSendTime()
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	if (!m_congestion || getReliablesInFlight() >= m_congestion->getWindow())
+		return -1.0;
+	return m_congestion->getNextSendTime();
+}
+
+void UDPPeer::reportCongestion(float dtime)
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	if (!m_congestion)
+		return;
+
+	m_congestion_report_timer += dtime;
+	if (m_congestion_report_timer < 1.0f)
+		return;
+	m_congestion_report_timer = 0.0f;
+
+	std::ostringstream prefix;
+	prefix << "RUDP peer " << id << ": ";
+	g_profiler->avg(prefix.str() + "cwnd", m_congestion->getWindow());
+	g_profiler->avg(prefix.str() + "min rtt (ms)",
+		MYMAX(m_congestion->getMinRTT(), 0.0f) * 1000.0f);
+	g_profiler->avg(prefix.str() + "bandwidth (pkt/s)",
+		m_congestion->getBandwidth());
+	g_profiler->avg(prefix.str() + "pacing rate (pkt/s)",
+		m_congestion->getPacingRate());
 }
 
 void UDPPeer::reportRTT(float rtt)
@@ -1201,8 +1309,10 @@ SharedBuffer<u8> UDPPeer::addSpiltPacket(u8 channel,
 /******************************************************************************/
 
 ConnectionSendThread::ConnectionSendThread(unsigned int max_packet_size,
-		float timeout) :
-	Thread("ConnectionSend"),
+		float timeout, u16 shard) :
+	Thread(shard == 0 ? std::string("ConnectionSend") :
+		"ConnectionSend" + itos(shard)),
+	m_shard(shard),
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
 	m_max_data_packets_per_iteration(g_settings->getU16("max_packets_per_iteration"))
@@ -1228,10 +1338,18 @@ void * ConnectionSendThread::run()
 		BEGIN_DEBUG_EXCEPTION_HANDLER
 		PROFILE(ScopeProfiler sp(g_profiler, ThreadIdentifier.str(), SPT_AVG));
 
+		// The threads of all shards share the packets of an iteration
+		m_max_data_packets_per_iteration = m_connection->getShardShare(m_shard,
+			g_settings->getU16("max_packets_per_iteration"));
 		m_iteration_packets_avaialble = m_max_data_packets_per_iteration;
 
-		/* wait for trigger or timeout */
-		m_send_sleep_semaphore.wait(50);
+		/* wait for trigger or timeout, or until a paced peer can send */
+		unsigned int wait_ms = 50;
+		if (m_next_pacing_time >= 0.0) {
+			double until = (m_next_pacing_time - getPacingTime()) * 1000.0;
+			wait_ms = rangelim(std::ceil(until), 1.0, 50.0);
+		}
+		m_send_sleep_semaphore.wait(wait_ms);
 
 		/* remove all triggers */
 		while(m_send_sleep_semaphore.wait(0)) {}
@@ -1244,7 +1362,7 @@ void * ConnectionSendThread::run()
 		runTimeouts(dtime);
 
 		/* translate commands to packets */
-		ConnectionCommand c = m_connection->m_command_queue.pop_frontNoEx(0);
+		ConnectionCommand c = m_command_queue.pop_frontNoEx(0);
 		while(c.type != CONNCMD_NONE)
 				{
 			if (c.reliable)
@@ -1252,12 +1370,15 @@ void * ConnectionSendThread::run()
 			else
 				processNonReliableCommand(c);
 
-			c = m_connection->m_command_queue.pop_frontNoEx(0);
+			c = m_command_queue.pop_frontNoEx(0);
 		}
 
 		/* send non reliable packets */
 		sendPackets(dtime);
 
+		/* all packets of the iteration go to the socket together */
+		flushSendBatch();
+
 		END_DEBUG_EXCEPTION_HANDLER
 	}
 
@@ -1270,9 +1391,20 @@ void ConnectionSendThread::Trigger()
 	m_send_sleep_semaphore.post();
 }
 
+void ConnectionSendThread::putCommand(const ConnectionCommand &c)
+{
+	m_command_queue.push_back(c);
+	Trigger();
+}
+
+std::list<u16> ConnectionSendThread::getPeerIDs()
+{
+	return m_connection->getPeerIDs(m_shard);
+}
+
 bool ConnectionSendThread::packetsQueued()
 {
-	std::list<u16> peerIds = m_connection->getPeerIDs();
+	std::list<u16> peerIds = getPeerIDs();
 
 	if (!m_outgoing_queue.empty() && !peerIds.empty())
 		return true;
@@ -1304,7 +1436,7 @@ bool ConnectionSendThread::packetsQueued()
 void ConnectionSendThread::runTimeouts(float dtime)
 {
 	std::list<u16> timeouted_peers;
-	std::list<u16> peerIds = m_connection->getPeerIDs();
+	std::list<u16> peerIds = getPeerIDs();
 
 	for(std::list<u16>::iterator j = peerIds.begin();
 		j != peerIds.end(); ++j)
@@ -1356,7 +1488,7 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			// Increment reliable packet times
 			channel->outgoing_reliables_sent.incrementTimeouts(dtime);
 
-			unsigned int numpeers = m_connection->m_peers.size();
+			unsigned int numpeers = peerIds.size();
 
 			if (numpeers == 0)
 				return;
@@ -1407,9 +1539,13 @@ void ConnectionSendThread::runTimeouts(float dtime)
 				break; /* no need to check other channels if we already did timeout */
 			}
 
-			channel->UpdateTimers(dtime,dynamic_cast<UDPPeer*>(&peer)->getLegacyPeer());
+			channel->UpdateTimers(dtime,
+					dynamic_cast<UDPPeer*>(&peer)->getLegacyPeer() ||
+					dynamic_cast<UDPPeer*>(&peer)->hasCongestionControl());
 		}
 
+		dynamic_cast<UDPPeer*>(&peer)->reportCongestion(dtime);
+
 		/* skip to next peer if we did timeout */
 		if (retry_count_exceeded)
 			continue;
@@ -1444,17 +1580,36 @@ void ConnectionSendThread::runTimeouts(float dtime)
 
 void ConnectionSendThread::rawSend(const BufferedPacket &packet)
 {
-	try{
-		m_connection->m_udpSocket.Send(packet.address, *packet.data,
-				packet.data.getSize());
-		LOG(dout_con <<m_connection->getDesc()
-				<< " rawSend: " << packet.data.getSize()
-				<< " bytes sent" << std::endl);
-	} catch(SendFailedException &e) {
+	m_send_batch.push_back(packet);
+	if (m_send_batch.size() >= UDP_BATCH_SIZE)
+		flushSendBatch();
+}
+
+void ConnectionSendThread::flushSendBatch()
+{
+	if (m_send_batch.empty())
+		return;
+
+	m_send_datagrams.resize(m_send_batch.size());
+	for (size_t i = 0; i < m_send_batch.size(); i++) {
+		const BufferedPacket &packet = m_send_batch[i];
+		m_send_datagrams[i].address = packet.address;
+		m_send_datagrams[i].data = *packet.data;
+		m_send_datagrams[i].size = packet.data.getSize();
+	}
+
+	int failed = m_connection->m_udpSocket.SendBatch(&m_send_datagrams[0],
+			m_send_datagrams.size());
+	LOG(dout_con <<m_connection->getDesc()
+			<< " rawSend: " << m_send_datagrams.size() - failed
+			<< " packets sent" << std::endl);
+	if (failed > 0) {
 		LOG(derr_con<<m_connection->getDesc()
-				<<"Connection::rawSend(): SendFailedException: "
-				<<packet.address.serializeString()<<std::endl);
+				<<"Connection::rawSend(): failed to send "
+				<<failed<<" packets"<<std::endl);
 	}
+
+	m_send_batch.clear();
 }
 
 void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* channel)
@@ -1509,13 +1664,16 @@ bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
 				channelnum);
 
 		// first check if our send window is already maxed out
-		if (channel->outgoing_reliables_sent.size()
-				< channel->getWindowSize()) {
+		double now = getPacingTime();
+		if ((channel->outgoing_reliables_sent.size()
+				< channel->getWindowSize()) &&
+				dynamic_cast<UDPPeer*>(&peer)->canSendReliable(now)) {
 			LOG(dout_con<<m_connection->getDesc()
 					<<" INFO: sending a reliable packet to peer_id " << peer_id
 					<<" channel: " << channelnum
 					<<" seqnum: " << seqnum << std::endl);
 			sendAsPacketReliable(p,channel);
+			dynamic_cast<UDPPeer*>(&peer)->onReliableSent();
 			return true;
 		}
 		else {
@@ -1715,7 +1873,7 @@ void ConnectionSendThread::disconnect()
 
 
 	// Send to all
-	std::list<u16> peerids = m_connection->getPeerIDs();
+	std::list<u16> peerids = getPeerIDs();
 
 	for (std::list<u16>::iterator i = peerids.begin();
 			i != peerids.end();
@@ -1795,7 +1953,7 @@ void ConnectionSendThread::sendReliable(ConnectionCommand &c)
 
 void ConnectionSendThread::sendToAll(u8 channelnum, SharedBuffer<u8> data)
 {
-	std::list<u16> peerids = m_connection->getPeerIDs();
+	std::list<u16> peerids = getPeerIDs();
 
 	for (std::list<u16>::iterator i = peerids.begin();
 			i != peerids.end();
@@ -1807,7 +1965,7 @@ void ConnectionSendThread::sendToAll(u8 channelnum, SharedBuffer<u8> data)
 
 void ConnectionSendThread::sendToAllReliable(ConnectionCommand &c)
 {
-	std::list<u16> peerids = m_connection->getPeerIDs();
+	std::list<u16> peerids = getPeerIDs();
 
 	for (std::list<u16>::iterator i = peerids.begin();
 			i != peerids.end();
@@ -1824,9 +1982,11 @@ void ConnectionSendThread::sendToAllReliable(ConnectionCommand &c)
 
 void ConnectionSendThread::sendPackets(float dtime)
 {
-	std::list<u16> peerIds = m_connection->getPeerIDs();
+	std::list<u16> peerIds = getPeerIDs();
 	std::list<u16> pendingDisconnect;
 	std::map<u16,bool> pending_unreliable;
+	double now = getPacingTime();
+	m_next_pacing_time = -1.0;
 
 	for(std::list<u16>::iterator
 			j = peerIds.begin();
@@ -1838,7 +1998,7 @@ void ConnectionSendThread::sendPackets(float dtime)
 			LOG(dout_con<<m_connection->getDesc()<< " Peer not found: peer_id=" << *j << std::endl);
 			continue;
 		}
-		peer->m_increment_packets_remaining = m_iteration_packets_avaialble/m_connection->m_peers.size();
+		peer->m_increment_packets_remaining = m_iteration_packets_avaialble/peerIds.size();
 
 		if (dynamic_cast<UDPPeer*>(&peer) == 0)
 		{
@@ -1889,7 +2049,8 @@ void ConnectionSendThread::sendPackets(float dtime)
 			while ((dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.size() > 0) &&
 					(dynamic_cast<UDPPeer*>(&peer)->channels[i].outgoing_reliables_sent.size()
 							< dynamic_cast<UDPPeer*>(&peer)->channels[i].getWindowSize())&&
-							(peer->m_increment_packets_remaining > 0))
+							(peer->m_increment_packets_remaining > 0) &&
+							dynamic_cast<UDPPeer*>(&peer)->canSendReliable(now))
 			{
 				BufferedPacket p = dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.front();
 				dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.pop();
@@ -1900,9 +2061,29 @@ void ConnectionSendThread::sendPackets(float dtime)
 						<<", seqnum: " << readU16(&p.data[BASE_HEADER_SIZE+1])
 						<< std::endl);
 				sendAsPacketReliable(p,channel);
+				dynamic_cast<UDPPeer*>(&peer)->onReliableSent();
 				peer->m_increment_packets_remaining--;
 			}
 		}
+
+		// Wake up again when the pacing lets the queued packets go
+		if (dynamic_cast<UDPPeer*>(&peer)->hasCongestionControl()) {
+			bool queued = false;
+			for (unsigned int i=0; i < CHANNEL_COUNT; i++) {
+				Channel &channel = dynamic_cast<UDPPeer*>(&peer)->channels[i];
+				queued |= !channel.queued_reliables.empty() ||
+						!channel.queued_commands.empty();
+			}
+
+			if (!queued) {
+				dynamic_cast<UDPPeer*>(&peer)->onReliableAppLimited();
+			} else if (peer->m_increment_packets_remaining > 0) {
+				double next = dynamic_cast<UDPPeer*>(&peer)->getNextReliableSendTime();
+				if (next >= 0.0 && (m_next_pacing_time < 0.0 ||
+						next < m_next_pacing_time))
+					m_next_pacing_time = next;
+			}
+		}
 	}
 
 	if (m_outgoing_queue.size())
@@ -1969,9 +2150,17 @@ void ConnectionSendThread::sendAsPacket(u16 peer_id, u8 channelnum,
 	m_outgoing_queue.push(packet);
 }
 
-ConnectionReceiveThread::ConnectionReceiveThread(unsigned int max_packet_size) :
-	Thread("ConnectionReceive")
+ConnectionReceiveThread::ConnectionReceiveThread(unsigned int max_packet_size,
+		u16 shard) :
+	Thread(shard == 0 ? std::string("ConnectionReceive") :
+		"ConnectionReceive" + itos(shard)),
+	m_shard(shard)
 {
+	// use IPv6 minimum allowed MTU as receive buffer size as this is
+	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
+	// infrastructure
+	for (int i = 0; i < UDP_BATCH_SIZE; i++)
+		m_batch_buffers.push_back(SharedBuffer<u8>(1500));
 }
 
 void * ConnectionReceiveThread::run()
@@ -2001,7 +2190,10 @@ void * ConnectionReceiveThread::run()
 #endif
 
 		/* receive packets */
-		receive();
+		if (m_shard == 0)
+			receive();
+		else
+			receiveQueued();
 
 #ifdef DEBUG_CONNECTION_KBPS
 		debug_print_timer += dtime;
@@ -2065,12 +2257,6 @@ void * ConnectionReceiveThread::run()
 // Receive packets from the network and buffers and create ConnectionEvents
 void ConnectionReceiveThread::receive()
 {
-	// use IPv6 minimum allowed MTU as receive buffer size as this is
-	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
-	// infrastructure
-	unsigned int packet_maxsize = 1500;
-	SharedBuffer<u8> packetdata(packet_maxsize);
-
 	bool packet_queued = true;
 
 	unsigned int loop_count = 0;
@@ -2078,31 +2264,32 @@ void ConnectionReceiveThread::receive()
 	/* first of all read packets from socket */
 	/* check for incoming data available */
 	while( (loop_count < 10) &&
-			(m_connection->m_udpSocket.WaitData(50))) {
+			(m_batch_next < m_batch_count ||
+			m_connection->m_udpSocket.WaitData(50))) {
 		loop_count++;
 		try {
 			if (packet_queued) {
-				bool data_left = true;
-				u16 peer_id;
-				SharedBuffer<u8> resultdata;
-				while(data_left) {
-					try {
-						data_left = getFromBuffers(peer_id, resultdata);
-						if (data_left) {
-							ConnectionEvent e;
-							e.dataReceived(peer_id, resultdata);
-							m_connection->putEvent(e);
-						}
-					}
-					catch(ProcessedSilentlyException &e) {
-						/* try reading again */
-					}
-				}
+				processBuffers();
 				packet_queued = false;
 			}
 
-			Address sender;
-			s32 received_size = m_connection->m_udpSocket.Receive(sender, *packetdata, packet_maxsize);
+			/* read all datagrams available at once */
+			if (m_batch_next >= m_batch_count) {
+				for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+					m_batch[i].data = *m_batch_buffers[i];
+					m_batch[i].size = m_batch_buffers[i].getSize();
+				}
+				m_batch_count = m_connection->m_udpSocket.ReceiveBatch(
+						m_batch, UDP_BATCH_SIZE);
+				m_batch_next = 0;
+				if (m_batch_count == 0)
+					continue;
+			}
+
+			Address sender = m_batch[m_batch_next].address;
+			s32 received_size = m_batch[m_batch_next].size;
+			SharedBuffer<u8> &packetdata = m_batch_buffers[m_batch_next];
+			m_batch_next++;
 
 			if ((received_size < BASE_HEADER_SIZE) ||
 				(readU32(&packetdata[0]) != m_connection->GetProtocolID()))
@@ -2138,90 +2325,165 @@ void ConnectionReceiveThread::receive()
 				peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
 			}
 
-			PeerHelper peer = m_connection->getPeerNoEx(peer_id);
-
-			if (!peer) {
-				LOG(dout_con<<m_connection->getDesc()
-						<<" got packet from unknown peer_id: "
-						<<peer_id<<" Ignoring."<<std::endl);
+			/* Peers of other shards are handled by their own thread */
+			ConnectionReceiveThread *thread =
+					m_connection->getReceiveThread(peer_id);
+			if (thread != this) {
+				IncomingDatagram datagram;
+				datagram.sender = sender;
+				datagram.peer_id = peer_id;
+				datagram.data = Buffer<u8>(*packetdata, received_size);
+				thread->putDatagram(datagram);
 				continue;
 			}
 
-			// Validate peer address
+			if (processDatagram(sender, peer_id, *packetdata, received_size))
+				packet_queued = true;
+		}
+		catch(InvalidIncomingDataException &e) {
+		}
+		catch(ProcessedSilentlyException &e) {
+		}
+	}
+}
 
-			Address peer_address;
+// Receive packets passed by the thread reading the socket
+void ConnectionReceiveThread::receiveQueued()
+{
+	bool packet_queued = true;
 
-			if (peer->getAddress(MTP_UDP, peer_address)) {
-				if (peer_address != sender) {
-					LOG(derr_con<<m_connection->getDesc()
-							<<m_connection->getDesc()
-							<<" Peer "<<peer_id<<" sending from different address."
-							" Ignoring."<<std::endl);
-					continue;
-				}
-			}
-			else {
-
-				bool invalid_address = true;
-				if (invalid_address) {
-					LOG(derr_con<<m_connection->getDesc()
-							<<m_connection->getDesc()
-							<<" Peer "<<peer_id<<" unknown."
-							" Ignoring."<<std::endl);
-					continue;
-				}
+	for (unsigned int loop_count = 0; loop_count < 10; loop_count++) {
+		try {
+			if (packet_queued) {
+				processBuffers();
+				packet_queued = false;
 			}
 
-			peer->ResetTimeout();
+			IncomingDatagram datagram =
+					m_incoming.pop_frontNoEx(loop_count == 0 ? 50 : 0);
+			if (datagram.data.getSize() == 0)
+				break;
 
-			Channel *channel = 0;
+			if (processDatagram(datagram.sender, datagram.peer_id,
+					*datagram.data, datagram.data.getSize()))
+				packet_queued = true;
+		}
+		catch(InvalidIncomingDataException &e) {
+		}
+		catch(ProcessedSilentlyException &e) {
+		}
+	}
+}
 
-			if (dynamic_cast<UDPPeer*>(&peer) != 0)
-			{
-				channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[channelnum]);
-			}
+std::list<u16> ConnectionReceiveThread::getPeerIDs()
+{
+	return m_connection->getPeerIDs(m_shard);
+}
 
-			if (channel != 0) {
-				channel->UpdateBytesReceived(received_size);
+void ConnectionReceiveThread::processBuffers()
+{
+	bool data_left = true;
+	u16 peer_id;
+	SharedBuffer<u8> resultdata;
+	while(data_left) {
+		try {
+			data_left = getFromBuffers(peer_id, resultdata);
+			if (data_left) {
+				ConnectionEvent e;
+				e.dataReceived(peer_id, resultdata);
+				m_connection->putEvent(e);
 			}
+		}
+		catch(ProcessedSilentlyException &e) {
+			/* try reading again */
+		}
+	}
+}
 
-			// Throw the received packet to channel->processPacket()
+bool ConnectionReceiveThread::processDatagram(const Address &sender,
+		u16 peer_id, u8 *packetdata, s32 received_size)
+{
+	u8 channelnum = readChannel(packetdata);
 
-			// Make a new SharedBuffer from the data without the base headers
-			SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-			memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-					strippeddata.getSize());
+	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 
-			try{
-				// Process it (the result is some data with no headers made by us)
-				SharedBuffer<u8> resultdata = processPacket
-						(channel, strippeddata, peer_id, channelnum, false);
+	if (!peer) {
+		LOG(dout_con<<m_connection->getDesc()
+				<<" got packet from unknown peer_id: "
+				<<peer_id<<" Ignoring."<<std::endl);
+		return false;
+	}
 
-				LOG(dout_con<<m_connection->getDesc()
-						<<" ProcessPacket from peer_id: " << peer_id
-						<< ",channel: " << (channelnum & 0xFF) << ", returned "
-						<< resultdata.getSize() << " bytes" <<std::endl);
+	// Validate peer address
 
-				ConnectionEvent e;
-				e.dataReceived(peer_id, resultdata);
-				m_connection->putEvent(e);
-			}
-			catch(ProcessedSilentlyException &e) {
-			}
-			catch(ProcessedQueued &e) {
-				packet_queued = true;
-			}
-		}
-		catch(InvalidIncomingDataException &e) {
+	Address peer_address;
+
+	if (peer->getAddress(MTP_UDP, peer_address)) {
+		if (peer_address != sender) {
+			LOG(derr_con<<m_connection->getDesc()
+					<<m_connection->getDesc()
+					<<" Peer "<<peer_id<<" sending from different address."
+					" Ignoring."<<std::endl);
+			return false;
 		}
-		catch(ProcessedSilentlyException &e) {
+	}
+	else {
+
+		bool invalid_address = true;
+		if (invalid_address) {
+			LOG(derr_con<<m_connection->getDesc()
+					<<m_connection->getDesc()
+					<<" Peer "<<peer_id<<" unknown."
+					" Ignoring."<<std::endl);
+			return false;
 		}
 	}
+
+	peer->ResetTimeout();
+
+	Channel *channel = 0;
+
+	if (dynamic_cast<UDPPeer*>(&peer) != 0)
+	{
+		channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[channelnum]);
+	}
+
+	if (channel != 0) {
+		channel->UpdateBytesReceived(received_size);
+	}
+
+	// Throw the received packet to channel->processPacket()
+
+	// Make a new SharedBuffer from the data without the base headers
+	SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
+	memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
+			strippeddata.getSize());
+
+	try{
+		// Process it (the result is some data with no headers made by us)
+		SharedBuffer<u8> resultdata = processPacket
+				(channel, strippeddata, peer_id, channelnum, false);
+
+		LOG(dout_con<<m_connection->getDesc()
+				<<" ProcessPacket from peer_id: " << peer_id
+				<< ",channel: " << (channelnum & 0xFF) << ", returned "
+				<< resultdata.getSize() << " bytes" <<std::endl);
+
+		ConnectionEvent e;
+		e.dataReceived(peer_id, resultdata);
+		m_connection->putEvent(e);
+	}
+	catch(ProcessedSilentlyException &e) {
+	}
+	catch(ProcessedQueued &e) {
+		return true;
+	}
+	return false;
 }
 
 bool ConnectionReceiveThread::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst)
 {
-	std::list<u16> peerids = m_connection->getPeerIDs();
+	std::list<u16> peerids = getPeerIDs();
 
 	for(std::list<u16>::iterator j = peerids.begin();
 		j != peerids.end(); ++j)
@@ -2325,6 +2587,7 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 			try{
 				BufferedPacket p =
 						channel->outgoing_reliables_sent.popSeqnum(seqnum);
+				float acked_rtt = -1.0f;
 
 				// only calculate rtt from straight sent packets
 				if (p.resend_count == 0) {
@@ -2336,6 +2599,7 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 					if (current_time > p.absolute_send_time)
 					{
 						float rtt = (current_time - p.absolute_send_time) / 1000.0;
+						acked_rtt = rtt;
 
 						// Let peer calculate stuff according to it
 						// (avg_rtt and resend_timeout)
@@ -2344,6 +2608,7 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 					else if (p.totaltime > 0)
 					{
 						float rtt = p.totaltime;
+						acked_rtt = rtt;
 
 						// Let peer calculate stuff according to it
 						// (avg_rtt and resend_timeout)
@@ -2352,9 +2617,15 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 				}
 				//put bytes for max bandwidth calculation
 				channel->UpdateBytesSent(p.data.getSize(),1);
-				if (channel->outgoing_reliables_sent.size() == 0)
+
+				dynamic_cast<UDPPeer*>(&peer)->onReliableAcked(
+						getPacingTime(), acked_rtt);
+
+				// the acks open the window of a congestion control
+				if (channel->outgoing_reliables_sent.size() == 0 ||
+						dynamic_cast<UDPPeer*>(&peer)->hasCongestionControl())
 				{
-					m_connection->TriggerSend();
+					m_connection->TriggerSend(peer_id);
 				}
 			}
 			catch(NotFoundException &e) {
@@ -2612,22 +2883,39 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 */
 
 Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
-		bool ipv6, PeerHandler *peerhandler) :
+		bool ipv6, PeerHandler *peerhandler, u16 num_threads) :
 	m_udpSocket(ipv6),
 	m_protocol_id(protocol_id),
-	m_sendThread(max_packet_size, timeout),
-	m_receiveThread(max_packet_size),
 	m_bc_peerhandler(peerhandler)
 
 {
 	m_udpSocket.setTimeoutMs(5);
 
-	m_sendThread.setParent(this);
-	m_receiveThread.setParent(this);
+	num_threads = MYMAX(num_threads, 1);
+	for (u16 i = 0; i < num_threads; i++) {
+		m_send_threads.push_back(
+				new ConnectionSendThread(max_packet_size, timeout, i));
+		m_receive_threads.push_back(
+				new ConnectionReceiveThread(max_packet_size, i));
+	}
+
+	for (u16 i = 0; i < num_threads; i++) {
+		m_send_threads[i]->setParent(this);
+		m_receive_threads[i]->setParent(this);
 
-	m_sendThread.start();
-	m_receiveThread.start();
+		m_send_threads[i]->start();
+		m_receive_threads[i]->start();
+	}
+}
 
+u16 Connection::getServerThreadCount()
+{
+	// If unspecified or 0, use all processors
+	s16 num_threads = 0;
+	if (!g_settings->getS16NoEx("num_connection_threads", num_threads) ||
+			num_threads <= 0)
+		num_threads = Thread::getNumberOfProcessors();
+	return MYMAX(num_threads, 1);
 }
 
 
@@ -2635,17 +2923,24 @@ Connection::~Connection()
 {
 	m_shutting_down = true;
 	// request threads to stop
-	m_sendThread.stop();
-	m_receiveThread.stop();
+	for (size_t i = 0; i < m_send_threads.size(); i++) {
+		m_send_threads[i]->stop();
+		m_receive_threads[i]->stop();
 
-	//TODO for some unkonwn reason send/receive threads do not exit as they're
-	// supposed to be but wait on peer timeout. To speed up shutdown we reduce
-	// timeout to half a second.
-	m_sendThread.setPeerTimeout(0.5);
+		//TODO for some unkonwn reason send/receive threads do not exit as they're
+		// supposed to be but wait on peer timeout. To speed up shutdown we reduce
+		// timeout to half a second.
+		m_send_threads[i]->setPeerTimeout(0.5);
+	}
 
 	// wait for threads to finish
-	m_sendThread.wait();
-	m_receiveThread.wait();
+	for (size_t i = 0; i < m_send_threads.size(); i++) {
+		m_send_threads[i]->wait();
+		m_receive_threads[i]->wait();
+
+		delete m_send_threads[i];
+		delete m_receive_threads[i];
+	}
 
 	// Delete peers
 	for(std::map<u16, Peer*>::iterator
@@ -2771,9 +3066,22 @@ ConnectionEvent Connection::waitEvent(u32 timeout_ms)
 
 void Connection::putCommand(ConnectionCommand &c)
 {
-	if (!m_shutting_down) {
-		m_command_queue.push_back(c);
-		m_sendThread.Trigger();
+	if (m_shutting_down)
+		return;
+
+	switch (c.type) {
+	case CONNCMD_SERVE:
+	case CONNCMD_CONNECT:
+		m_send_threads[0]->putCommand(c);
+		break;
+	case CONNCMD_DISCONNECT:
+	case CONNCMD_SEND_TO_ALL:
+		// Each thread handles the peers of its shard
+		for (size_t i = 0; i < m_send_threads.size(); i++)
+			m_send_threads[i]->putCommand(c);
+		break;
+	default:
+		getSendThread(c.peer_id)->putCommand(c);
 	}
 }
 
@@ -3019,7 +3327,6 @@ void Connection::sendAck(u16 peer_id, u8 channelnum, u16 seqnum)
 
 	c.ack(peer_id, channelnum, ack);
 	putCommand(c);
-	m_sendThread.Trigger();
 }
 
 UDPPeer* Connection::createServerPeer(Address& address)
@@ -25,14 +25,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "exceptions.h"
 #include "constants.h"
 #include "network/networkpacket.h"
+#include "network/congestioncontrol.h"
 #include "util/pointer.h"
 #include "util/container.h"
 #include "util/thread.h"
 #include "util/numeric.h"
 #include <iostream>
 #include <fstream>
+#include <deque>
 #include <list>
 #include <map>
+#include <vector>
 
 class NetworkPacket;
 
@@ -308,16 +311,18 @@ with a buffer in the receiving and transmitting end.
 #define SEQNUM_INITIAL 65500
 
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
-*/
+	A buffer which stores reliable packets by seqnum, for fast access to
+	the smallest one and to any other.
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
+	The packets are kept in a ring indexed by seqnum, which grows to hold
+	the seqnums from the smallest packet to the largest one.
+*/
 
 class ReliablePacketBuffer
 {
 public:
 	ReliablePacketBuffer() {};
+	~ReliablePacketBuffer();
 
 	bool getFirstSeqnum(u16& result);
 
@@ -332,19 +337,44 @@ class ReliablePacketBuffer
 	void print();
 	bool empty();
 	bool containsPacket(u16 seqnum);
-	RPBSearchResult notFound();
 	u32 size();
 
 
 private:
-	RPBSearchResult findPacket(u16 seqnum);
-
-	std::list<BufferedPacket> m_list;
-	u32 m_list_size = 0;
-
-	u16 m_oldest_non_answered_ack;
+	struct Slot
+	{
+		BufferedPacket *packet = nullptr;
+		// Values of m_time when the packet was buffered and last sent
+		double buffered_time = 0.0;
+		double sent_time = 0.0;
+	};
 
-	std::mutex m_list_mutex;
+	struct SentPacket
+	{
+		u16 seqnum;
+		double time;
+	};
+
+	Slot &getSlot(u16 seqnum) { return m_slots[seqnum & (m_slots.size() - 1)]; }
+	bool holds(u16 seqnum);
+	bool isLastSent(const SentPacket &sent);
+	BufferedPacket take(u16 seqnum);
+	void grow(u32 span);
+
+	// The size is a power of two, not smaller than m_span
+	std::vector<Slot> m_slots;
+	u16 m_first = 0;
+	// Seqnums from the first packet to the last one
+	u32 m_span = 0;
+	u32 m_size = 0;
+
+	// Seconds spent, for the timeouts of the packets
+	double m_time = 0.0;
+	// The packets in the order they were sent, a resent packet is queued
+	// again.  Entries of packets taken or resent since are skipped.
+	std::deque<SentPacket> m_sent_order;
+
+	std::mutex m_mutex;
 };
 
 /*
@@ -519,7 +549,8 @@ class Channel
 	void UpdateBytesLost(unsigned int bytes);
 	void UpdateBytesReceived(unsigned int bytes);
 
-	void UpdateTimers(float dtime, bool legacy_peer);
+	// The window size only changes with the packet losses if not fixed
+	void UpdateTimers(float dtime, bool fixed_window);
 
 	const float getCurrentDownloadRateKB()
 		{ MutexAutoLock lock(m_internal_mutex); return cur_kbps; };
@@ -774,7 +805,7 @@ class UDPPeer : public Peer
 	friend class Connection;
 
 	UDPPeer(u16 a_id, Address a_address, Connection* connection);
-	virtual ~UDPPeer() {};
+	virtual ~UDPPeer();
 
 	void PutReliableSendCommand(ConnectionCommand &c,
 							unsigned int max_packet_size);
@@ -813,12 +844,36 @@ class UDPPeer : public Peer
 		{ MutexAutoLock lock(m_exclusive_access_mutex); resend_timeout = timeout; }
 	bool Ping(float dtime,SharedBuffer<u8>& data);
 
+	/*
+		Congestion control of the reliable packets, see the
+		congestion_control setting. Without it the window sizes of
+		the channels change with the packet losses.
+	*/
+	bool hasCongestionControl()
+		{ MutexAutoLock lock(m_congestion_mutex); return m_congestion != NULL; }
+	bool canSendReliable(double now);
+	void onReliableSent();
+	// rtt is negative for resent packets
+	void onReliableAcked(double now, float rtt);
+	void onReliableAppLimited();
+	// When the next reliable packet can be sent, or a negative time if
+	// the window is full until more packets are acked
+	double getNextReliableSendTime();
+	// Adds the rates of the congestion control to the profiler
+	void reportCongestion(float dtime);
+
 	Channel channels[CHANNEL_COUNT];
 	bool m_pending_disconnect = false;
 private:
 	// This is changed dynamically
 	float resend_timeout = 0.5;
 
+	u32 getReliablesInFlight();
+
+	CongestionControl *m_congestion = nullptr;
+	std::mutex m_congestion_mutex;
+	float m_congestion_report_timer = 0.0f;
+
 	bool processReliableSendCommand(
 					ConnectionCommand &c,
 					unsigned int max_packet_size);
@@ -895,11 +950,13 @@ class ConnectionSendThread : public Thread {
 public:
 	friend class UDPPeer;
 
-	ConnectionSendThread(unsigned int max_packet_size, float timeout);
+	ConnectionSendThread(unsigned int max_packet_size, float timeout,
+			u16 shard = 0);
 
 	void *run();
 
 	void Trigger();
+	void putCommand(const ConnectionCommand &c);
 
 	void setParent(Connection* parent) {
 		assert(parent != NULL); // Pre-condition
@@ -910,8 +967,13 @@ class ConnectionSendThread : public Thread {
 		{ m_timeout = peer_timeout; }
 
 private:
+	// The peers handled by this thread
+	std::list<u16> getPeerIDs();
+
 	void runTimeouts    (float dtime);
+	// Queues the packet in the send batch
 	void rawSend        (const BufferedPacket &packet);
+	void flushSendBatch ();
 	bool rawSendAsPacket(u16 peer_id, u8 channelnum,
 							SharedBuffer<u8> data, bool reliable);
 
@@ -938,20 +1000,43 @@ class ConnectionSendThread : public Thread {
 	bool packetsQueued();
 
 	Connection           *m_connection = nullptr;
+	u16                   m_shard;
 	unsigned int          m_max_packet_size;
 	float                 m_timeout;
+	MutexedQueue<ConnectionCommand> m_command_queue;
 	std::queue<OutgoingPacket> m_outgoing_queue;
 	Semaphore             m_send_sleep_semaphore;
 
 	unsigned int          m_iteration_packets_avaialble;
 	unsigned int          m_max_commands_per_iteration = 1;
+	// Share of max_packets_per_iteration of the peers of this shard,
+	// updated every iteration
 	unsigned int          m_max_data_packets_per_iteration;
 	unsigned int          m_max_packets_requeued = 256;
+
+	// When the first peer held back by its pacing can send again,
+	// negative if none is
+	double                m_next_pacing_time = -1.0;
+
+	// Packets to send at the end of the iteration
+	std::vector<BufferedPacket> m_send_batch;
+	std::vector<UDPDatagram>    m_send_datagrams;
+};
+
+/*
+	A datagram passed by the thread reading the socket to the receive
+	thread of its peer
+*/
+struct IncomingDatagram
+{
+	Address sender;
+	u16 peer_id = PEER_ID_INEXISTENT;
+	Buffer<u8> data;
 };
 
 class ConnectionReceiveThread : public Thread {
 public:
-	ConnectionReceiveThread(unsigned int max_packet_size);
+	ConnectionReceiveThread(unsigned int max_packet_size, u16 shard = 0);
 
 	void *run();
 
@@ -960,8 +1045,24 @@ class ConnectionReceiveThread : public Thread {
 		m_connection = parent;
 	}
 
+	void putDatagram(const IncomingDatagram &datagram)
+		{ m_incoming.push_back(datagram); }
+
 private:
+	// Reads the socket, only done by the thread of shard 0
 	void receive();
+	// Handles the datagrams passed by the thread of shard 0
+	void receiveQueued();
+
+	// The peers handled by this thread
+	std::list<u16> getPeerIDs();
+
+	// Turns the reliable packets that can be processed now into events
+	void processBuffers();
+	// Processes a datagram of a peer of this thread.
+	// Returns true if a reliable packet was buffered.
+	bool processDatagram(const Address &sender, u16 peer_id,
+			u8 *packetdata, s32 received_size);
 
 	// Returns next data from a buffer if possible
 	// If found, returns true; if not, false.
@@ -985,6 +1086,15 @@ class ConnectionReceiveThread : public Thread {
 
 
 	Connection *m_connection = nullptr;
+	u16 m_shard;
+	MutexedQueue<IncomingDatagram> m_incoming;
+
+	// Datagrams received at once, the next one to process is
+	// m_batch[m_batch_next]
+	std::vector<SharedBuffer<u8> > m_batch_buffers;
+	UDPDatagram m_batch[UDP_BATCH_SIZE];
+	int m_batch_count = 0;
+	int m_batch_next = 0;
 };
 
 class Connection
@@ -993,10 +1103,16 @@ class Connection
 	friend class ConnectionSendThread;
 	friend class ConnectionReceiveThread;
 
+	// Peers are split between num_threads pairs of send and receive
+	// threads, see getServerThreadCount()
 	Connection(u32 protocol_id, u32 max_packet_size, float timeout, bool ipv6,
-			PeerHandler *peerhandler);
+			PeerHandler *peerhandler, u16 num_threads = 1);
 	~Connection();
 
+	// Number of threads of the server connection (num_connection_threads).
+	// A client has a single peer, so it always uses one thread.
+	static u16 getServerThreadCount();
+
 	/* Interface */
 	ConnectionEvent waitEvent(u32 timeout_ms);
 	void putCommand(ConnectionCommand &c);
@@ -1038,13 +1154,51 @@ class Connection
 		return m_peer_ids;
 	}
 
+	// The part of total that falls to a shard, by its share of the peers
+	u32 getShardShare(u16 shard, u32 total)
+	{
+		MutexAutoLock peerlock(m_peers_mutex);
+		if (m_send_threads.size() <= 1 || m_peer_ids.empty())
+			return total;
+
+		u32 shard_peers = 0;
+		for (u16 peer_id : m_peer_ids) {
+			if (peer_id % m_send_threads.size() == shard)
+				shard_peers++;
+		}
+		return MYMAX(total * shard_peers / m_peer_ids.size(), 1);
+	}
+
+	// The peers handled by the threads of a shard
+	std::list<u16> getPeerIDs(u16 shard)
+	{
+		MutexAutoLock peerlock(m_peers_mutex);
+		if (m_send_threads.size() <= 1)
+			return m_peer_ids;
+
+		std::list<u16> peer_ids;
+		for (u16 peer_id : m_peer_ids) {
+			if (peer_id % m_send_threads.size() == shard)
+				peer_ids.push_back(peer_id);
+		}
+		return peer_ids;
+	}
+
 	UDPSocket m_udpSocket;
-	MutexedQueue<ConnectionCommand> m_command_queue;
 
 	void putEvent(ConnectionEvent &e);
 
-	void TriggerSend()
-		{ m_sendThread.Trigger(); }
+	/*
+		Peers are split in shards by their id, each shard has a send
+		and a receive thread
+	*/
+	ConnectionSendThread *getSendThread(u16 peer_id)
+		{ return m_send_threads[peer_id % m_send_threads.size()]; }
+	ConnectionReceiveThread *getReceiveThread(u16 peer_id)
+		{ return m_receive_threads[peer_id % m_receive_threads.size()]; }
+
+	void TriggerSend(u16 peer_id)
+		{ getSendThread(peer_id)->Trigger(); }
 private:
 	std::list<Peer*> getPeers();
 
@@ -1057,8 +1211,8 @@ class Connection
 	std::list<u16> m_peer_ids;
 	std::mutex m_peers_mutex;
 
-	ConnectionSendThread m_sendThread;
-	ConnectionReceiveThread m_receiveThread;
+	std::vector<ConnectionSendThread *> m_send_threads;
+	std::vector<ConnectionReceiveThread *> m_receive_threads;
 
 	std::mutex m_info_mutex;
 
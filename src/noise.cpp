@@ -26,6 +26,7 @@
 #include <math.h>
 #include "noise.h"
 #include <iostream>
+#include <vector>
 #include <string.h> // memset
 #include "debug.h"
 #include "util/numeric.h"
@@ -37,6 +38,16 @@
 #define NOISE_MAGIC_Z    52591
 #define NOISE_MAGIC_SEED 1013
 
+// The SIMD kernels may read a few floats past the end of a lattice row
+#define NOISE_BUF_PADDING 8
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define NOISE_SIMD_X86 1
+	#include <immintrin.h>
+#else
+	#define NOISE_SIMD_X86 0
+#endif
+
 typedef float (*Interp2dFxn)(
 		float v00, float v10, float v01, float v11,
 		float x, float y);
@@ -526,13 +537,498 @@ void Noise::resizeNoiseBuf(bool is3d)
 
 	delete[] noise_buf;
 	try {
-		noise_buf = new float[nlx * nly * nlz];
+		noise_buf = new float[nlx * nly * nlz + NOISE_BUF_PADDING];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
 }
 
 
+/*
+ * Kernels of the bulk noise functions
+ *
+ * The points of a row share their lattice points in y and z, and their
+ * lattice x index and x weight are the same for all the rows, so a row is
+ * interpolated from a few rows of the lattice.  The kernels do the
+ * operations of the interpolation functions above in the same order, so
+ * they all give the same results.
+ */
+
+struct NoiseKernels {
+	void (*interpolateRow2D)(float *out,
+		const float *row0, const float *row1,
+		const u32 *lx, const float *tx, float ty, u32 count);
+	void (*interpolateRow3D)(float *out,
+		const float *row00, const float *row10,
+		const float *row01, const float *row11,
+		const u32 *lx, const float *tx, float ty, float tz, u32 count);
+	void (*addOctave)(float *result, const float *gradient,
+		float g, bool absvalue, size_t count);
+	void (*addOctavePersist)(float *result, const float *gradient,
+		float *gmap, const float *persistence_map, bool absvalue, size_t count);
+};
+
+
+static void interpolateRow2D_scalar(float *out,
+	const float *row0, const float *row1,
+	const u32 *lx, const float *tx, float ty, u32 count)
+{
+	for (u32 i = 0; i != count; i++) {
+		u32 l = lx[i];
+		out[i] = biLinearInterpolationNoEase(
+			row0[l], row0[l + 1], row1[l], row1[l + 1], tx[i], ty);
+	}
+}
+
+
+static void interpolateRow3D_scalar(float *out,
+	const float *row00, const float *row10,
+	const float *row01, const float *row11,
+	const u32 *lx, const float *tx, float ty, float tz, u32 count)
+{
+	for (u32 i = 0; i != count; i++) {
+		u32 l = lx[i];
+		out[i] = triLinearInterpolationNoEase(
+			row00[l], row00[l + 1], row10[l], row10[l + 1],
+			row01[l], row01[l + 1], row11[l], row11[l + 1],
+			tx[i], ty, tz);
+	}
+}
+
+
+// This looks very ugly, but it is 50-70% faster than having
+// conditional statements inside the loop
+static void addOctave_scalar(float *result, const float *gradient,
+	float g, bool absvalue, size_t count)
+{
+	if (absvalue) {
+		for (size_t i = 0; i != count; i++)
+			result[i] += g * fabs(gradient[i]);
+	} else {
+		for (size_t i = 0; i != count; i++)
+			result[i] += g * gradient[i];
+	}
+}
+
+
+static void addOctavePersist_scalar(float *result, const float *gradient,
+	float *gmap, const float *persistence_map, bool absvalue, size_t count)
+{
+	if (absvalue) {
+		for (size_t i = 0; i != count; i++) {
+			result[i] += gmap[i] * fabs(gradient[i]);
+			gmap[i] *= persistence_map[i];
+		}
+	} else {
+		for (size_t i = 0; i != count; i++) {
+			result[i] += gmap[i] * gradient[i];
+			gmap[i] *= persistence_map[i];
+		}
+	}
+}
+
+
+static const NoiseKernels noise_kernels_scalar = {
+	interpolateRow2D_scalar,
+	interpolateRow3D_scalar,
+	addOctave_scalar,
+	addOctavePersist_scalar,
+};
+
+
+#if NOISE_SIMD_X86
+
+/*
+ * The x86 kernels are compiled for their instruction set whatever the
+ * compiler flags are, and only used if the CPU supports it.  FMA is not
+ * used, and -ffast-math must not reassociate the vector operations, as
+ * either would round differently than the scalar code.
+ */
+#ifdef __clang__
+#define SSE2_FUNCTION __attribute__((target("sse2")))
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#else
+#define SSE2_FUNCTION \
+	__attribute__((target("sse2"), optimize("no-associative-math")))
+#define AVX2_FUNCTION \
+	__attribute__((target("avx2"), optimize("no-associative-math")))
+#endif
+
+SSE2_FUNCTION
+static inline __m128 lerp_sse2(__m128 v0, __m128 v1, __m128 t)
+{
+	return _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), t));
+}
+
+
+SSE2_FUNCTION
+static inline __m128 gather_sse2(const float *row, const u32 *lx)
+{
+	// Points mostly share their lattice index with their neighbours
+	if (lx[0] == lx[3])
+		return _mm_set1_ps(row[lx[0]]);
+	return _mm_setr_ps(row[lx[0]], row[lx[1]], row[lx[2]], row[lx[3]]);
+}
+
+
+SSE2_FUNCTION
+static void interpolateRow2D_sse2(float *out,
+	const float *row0, const float *row1,
+	const u32 *lx, const float *tx, float ty, u32 count)
+{
+	__m128 vty = _mm_set1_ps(ty);
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 vtx = _mm_loadu_ps(tx + i);
+		__m128 u = lerp_sse2(gather_sse2(row0, lx + i),
+			gather_sse2(row0 + 1, lx + i), vtx);
+		__m128 v = lerp_sse2(gather_sse2(row1, lx + i),
+			gather_sse2(row1 + 1, lx + i), vtx);
+		_mm_storeu_ps(out + i, lerp_sse2(u, v, vty));
+	}
+	interpolateRow2D_scalar(out + i, row0, row1, lx + i, tx + i, ty, count - i);
+}
+
+
+SSE2_FUNCTION
+static void interpolateRow3D_sse2(float *out,
+	const float *row00, const float *row10,
+	const float *row01, const float *row11,
+	const u32 *lx, const float *tx, float ty, float tz, u32 count)
+{
+	__m128 vty = _mm_set1_ps(ty);
+	__m128 vtz = _mm_set1_ps(tz);
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 vtx = _mm_loadu_ps(tx + i);
+		__m128 u0 = lerp_sse2(gather_sse2(row00, lx + i),
+			gather_sse2(row00 + 1, lx + i), vtx);
+		__m128 v0 = lerp_sse2(gather_sse2(row10, lx + i),
+			gather_sse2(row10 + 1, lx + i), vtx);
+		__m128 u1 = lerp_sse2(gather_sse2(row01, lx + i),
+			gather_sse2(row01 + 1, lx + i), vtx);
+		__m128 v1 = lerp_sse2(gather_sse2(row11, lx + i),
+			gather_sse2(row11 + 1, lx + i), vtx);
+		_mm_storeu_ps(out + i, lerp_sse2(
+			lerp_sse2(u0, v0, vty), lerp_sse2(u1, v1, vty), vtz));
+	}
+	interpolateRow3D_scalar(out + i, row00, row10, row01, row11,
+		lx + i, tx + i, ty, tz, count - i);
+}
+
+
+SSE2_FUNCTION
+static void addOctave_sse2(float *result, const float *gradient,
+	float g, bool absvalue, size_t count)
+{
+	__m128 vg = _mm_set1_ps(g);
+	// Clearing the sign bit gives the absolute value
+	__m128 mask = _mm_castsi128_ps(_mm_set1_epi32(absvalue ? 0x7fffffff : -1));
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 grad = _mm_and_ps(_mm_loadu_ps(gradient + i), mask);
+		_mm_storeu_ps(result + i, _mm_add_ps(_mm_loadu_ps(result + i),
+			_mm_mul_ps(vg, grad)));
+	}
+	addOctave_scalar(result + i, gradient + i, g, absvalue, count - i);
+}
+
+
+SSE2_FUNCTION
+static void addOctavePersist_sse2(float *result, const float *gradient,
+	float *gmap, const float *persistence_map, bool absvalue, size_t count)
+{
+	__m128 mask = _mm_castsi128_ps(_mm_set1_epi32(absvalue ? 0x7fffffff : -1));
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 grad = _mm_and_ps(_mm_loadu_ps(gradient + i), mask);
+		__m128 vgmap = _mm_loadu_ps(gmap + i);
+		_mm_storeu_ps(result + i, _mm_add_ps(_mm_loadu_ps(result + i),
+			_mm_mul_ps(vgmap, grad)));
+		_mm_storeu_ps(gmap + i,
+			_mm_mul_ps(vgmap, _mm_loadu_ps(persistence_map + i)));
+	}
+	addOctavePersist_scalar(result + i, gradient + i, gmap + i,
+		persistence_map + i, absvalue, count - i);
+}
+
+
+static const NoiseKernels noise_kernels_sse2 = {
+	interpolateRow2D_sse2,
+	interpolateRow3D_sse2,
+	addOctave_sse2,
+	addOctavePersist_sse2,
+};
+
+
+AVX2_FUNCTION
+static inline __m256 lerp_avx2(__m256 v0, __m256 v1, __m256 t)
+{
+	return _mm256_add_ps(v0, _mm256_mul_ps(_mm256_sub_ps(v1, v0), t));
+}
+
+
+/*
+ * Gets the values of a row at the lattice x indices of 8 points, and at
+ * the indices after them.  The indices of neighbouring points are close,
+ * so the values are usually permuted from 8 consecutive floats of the
+ * row, which is much faster than a gather.  noise_buf is padded for this.
+ */
+struct LatticeIndicesAVX2 {
+	bool packed;
+	u32 base;
+	__m256i rel;
+	__m256i rel1;
+	const u32 *lx;
+};
+
+
+AVX2_FUNCTION
+static inline void loadIndices_avx2(LatticeIndicesAVX2 *ind, const u32 *lx)
+{
+	ind->lx = lx;
+	ind->base = lx[0];
+	ind->packed = lx[7] - lx[0] < 7;
+	if (ind->packed) {
+		ind->rel = _mm256_sub_epi32(
+			_mm256_loadu_si256((const __m256i *)lx),
+			_mm256_set1_epi32(ind->base));
+		ind->rel1 = _mm256_add_epi32(ind->rel, _mm256_set1_epi32(1));
+	}
+}
+
+
+AVX2_FUNCTION
+static inline void gather_avx2(const float *row,
+	const LatticeIndicesAVX2 &ind, __m256 *v0, __m256 *v1)
+{
+	if (ind.packed) {
+		__m256 r = _mm256_loadu_ps(row + ind.base);
+		*v0 = _mm256_permutevar8x32_ps(r, ind.rel);
+		*v1 = _mm256_permutevar8x32_ps(r, ind.rel1);
+	} else {
+		const u32 *lx = ind.lx;
+		*v0 = _mm256_setr_ps(row[lx[0]], row[lx[1]], row[lx[2]], row[lx[3]],
+			row[lx[4]], row[lx[5]], row[lx[6]], row[lx[7]]);
+		row++;
+		*v1 = _mm256_setr_ps(row[lx[0]], row[lx[1]], row[lx[2]], row[lx[3]],
+			row[lx[4]], row[lx[5]], row[lx[6]], row[lx[7]]);
+	}
+}
+
+
+AVX2_FUNCTION
+static void interpolateRow2D_avx2(float *out,
+	const float *row0, const float *row1,
+	const u32 *lx, const float *tx, float ty, u32 count)
+{
+	__m256 vty = _mm256_set1_ps(ty);
+	LatticeIndicesAVX2 ind;
+	__m256 a0, a1, b0, b1;
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		loadIndices_avx2(&ind, lx + i);
+		__m256 vtx = _mm256_loadu_ps(tx + i);
+		gather_avx2(row0, ind, &a0, &a1);
+		gather_avx2(row1, ind, &b0, &b1);
+		__m256 u = lerp_avx2(a0, a1, vtx);
+		__m256 v = lerp_avx2(b0, b1, vtx);
+		_mm256_storeu_ps(out + i, lerp_avx2(u, v, vty));
+	}
+	// GCC leaves it out before tail calls, slowing down the SSE code after
+	_mm256_zeroupper();
+	interpolateRow2D_scalar(out + i, row0, row1, lx + i, tx + i, ty, count - i);
+}
+
+
+AVX2_FUNCTION
+static void interpolateRow3D_avx2(float *out,
+	const float *row00, const float *row10,
+	const float *row01, const float *row11,
+	const u32 *lx, const float *tx, float ty, float tz, u32 count)
+{
+	__m256 vty = _mm256_set1_ps(ty);
+	__m256 vtz = _mm256_set1_ps(tz);
+	LatticeIndicesAVX2 ind;
+	__m256 a0, a1, b0, b1, c0, c1, d0, d1;
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		loadIndices_avx2(&ind, lx + i);
+		__m256 vtx = _mm256_loadu_ps(tx + i);
+		gather_avx2(row00, ind, &a0, &a1);
+		gather_avx2(row10, ind, &b0, &b1);
+		gather_avx2(row01, ind, &c0, &c1);
+		gather_avx2(row11, ind, &d0, &d1);
+		__m256 u0 = lerp_avx2(a0, a1, vtx);
+		__m256 v0 = lerp_avx2(b0, b1, vtx);
+		__m256 u1 = lerp_avx2(c0, c1, vtx);
+		__m256 v1 = lerp_avx2(d0, d1, vtx);
+		_mm256_storeu_ps(out + i, lerp_avx2(
+			lerp_avx2(u0, v0, vty), lerp_avx2(u1, v1, vty), vtz));
+	}
+	// GCC leaves it out before tail calls, slowing down the SSE code after
+	_mm256_zeroupper();
+	interpolateRow3D_scalar(out + i, row00, row10, row01, row11,
+		lx + i, tx + i, ty, tz, count - i);
+}
+
+
+AVX2_FUNCTION
+static void addOctave_avx2(float *result, const float *gradient,
+	float g, bool absvalue, size_t count)
+{
+	__m256 vg = _mm256_set1_ps(g);
+	__m256 mask = _mm256_castsi256_ps(
+		_mm256_set1_epi32(absvalue ? 0x7fffffff : -1));
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 grad = _mm256_and_ps(_mm256_loadu_ps(gradient + i), mask);
+		_mm256_storeu_ps(result + i, _mm256_add_ps(
+			_mm256_loadu_ps(result + i), _mm256_mul_ps(vg, grad)));
+	}
+	// GCC leaves it out before tail calls, slowing down the SSE code after
+	_mm256_zeroupper();
+	addOctave_scalar(result + i, gradient + i, g, absvalue, count - i);
+}
+
+
+AVX2_FUNCTION
+static void addOctavePersist_avx2(float *result, const float *gradient,
+	float *gmap, const float *persistence_map, bool absvalue, size_t count)
+{
+	__m256 mask = _mm256_castsi256_ps(
+		_mm256_set1_epi32(absvalue ? 0x7fffffff : -1));
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 grad = _mm256_and_ps(_mm256_loadu_ps(gradient + i), mask);
+		__m256 vgmap = _mm256_loadu_ps(gmap + i);
+		_mm256_storeu_ps(result + i, _mm256_add_ps(
+			_mm256_loadu_ps(result + i), _mm256_mul_ps(vgmap, grad)));
+		_mm256_storeu_ps(gmap + i,
+			_mm256_mul_ps(vgmap, _mm256_loadu_ps(persistence_map + i)));
+	}
+	// GCC leaves it out before tail calls, slowing down the SSE code after
+	_mm256_zeroupper();
+	addOctavePersist_scalar(result + i, gradient + i, gmap + i,
+		persistence_map + i, absvalue, count - i);
+}
+
+
+static const NoiseKernels noise_kernels_avx2 = {
+	interpolateRow2D_avx2,
+	interpolateRow3D_avx2,
+	addOctave_avx2,
+	addOctavePersist_avx2,
+};
+
+#endif
+
+
+static bool isNoiseSIMDSupported(NoiseSIMD simd)
+{
+	switch (simd) {
+	case NOISE_SIMD_NONE:
+		return true;
+#if NOISE_SIMD_X86
+	case NOISE_SIMD_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2");
+	case NOISE_SIMD_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+
+static const NoiseKernels *getNoiseKernels(NoiseSIMD simd)
+{
+	switch (simd) {
+#if NOISE_SIMD_X86
+	case NOISE_SIMD_SSE2:
+		return &noise_kernels_sse2;
+	case NOISE_SIMD_AVX2:
+		return &noise_kernels_avx2;
+#endif
+	default:
+		return &noise_kernels_scalar;
+	}
+}
+
+
+static NoiseSIMD detectNoiseSIMD()
+{
+	if (isNoiseSIMDSupported(NOISE_SIMD_AVX2))
+		return NOISE_SIMD_AVX2;
+	if (isNoiseSIMDSupported(NOISE_SIMD_SSE2))
+		return NOISE_SIMD_SSE2;
+	return NOISE_SIMD_NONE;
+}
+
+
+static NoiseSIMD noise_simd = detectNoiseSIMD();
+static const NoiseKernels *noise_kernels = getNoiseKernels(noise_simd);
+
+
+NoiseSIMD getNoiseSIMD()
+{
+	return noise_simd;
+}
+
+
+bool setNoiseSIMD(NoiseSIMD simd)
+{
+	if (!isNoiseSIMDSupported(simd))
+		return false;
+
+	noise_simd = simd;
+	noise_kernels = getNoiseKernels(simd);
+	return true;
+}
+
+
+const char *getNoiseSIMDName(NoiseSIMD simd)
+{
+	switch (simd) {
+	case NOISE_SIMD_SSE2:
+		return "sse2";
+	case NOISE_SIMD_AVX2:
+		return "avx2";
+	default:
+		return "none";
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+/*
+ * Fills lattice_x and weight_x with the lattice x index and the x weight
+ * of the points of a row, in the way the points are stepped through.
+ */
+static void stepLatticeX(float u, float step_x, u32 sx, bool eased,
+	std::vector<u32> *lattice_x, std::vector<float> *weight_x)
+{
+	lattice_x->resize(sx);
+	weight_x->resize(sx);
+
+	u32 noisex = 0;
+	for (u32 i = 0; i != sx; i++) {
+		(*lattice_x)[i] = noisex;
+		(*weight_x)[i] = eased ? easeCurve(u) : u;
+
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+}
+
+
 /*
  * NB:  This algorithm is not optimal in terms of space complexity.  The entire
  * integer lattice of noise points could be done as 2 lines instead, and for 3D,
@@ -550,20 +1046,19 @@ void Noise::gradientMap2D(
 		float step_x, float step_y,
 		s32 seed)
 {
-	float v00, v01, v10, v11, u, v, orig_u;
-	u32 index, i, j, noisex, noisey;
+	static thread_local std::vector<u32> lattice_x;
+	static thread_local std::vector<float> weight_x;
+	float u, v;
+	u32 index, i, j, noisey;
 	u32 nlx, nly;
 	s32 x0, y0;
 
 	bool eased = np.flags & (NOISE_FLAG_DEFAULTS | NOISE_FLAG_EASED);
-	Interp2dFxn interpolate = eased ?
-		biLinearInterpolation : biLinearInterpolationNoEase;
 
 	x0 = floor(x);
 	y0 = floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
 	//calculate noise point lattice
 	nlx = (u32)(u + sx * step_x) + 2;
@@ -574,29 +1069,14 @@ void Noise::gradientMap2D(
 			noise_buf[index++] = noise2d(x0 + i, y0 + j, seed);
 
 	//calculate interpolations
+	stepLatticeX(u, step_x, sx, eased, &lattice_x, &weight_x);
 	index  = 0;
 	noisey = 0;
 	for (j = 0; j != sy; j++) {
-		v00 = noise_buf[idx(0, noisey)];
-		v10 = noise_buf[idx(1, noisey)];
-		v01 = noise_buf[idx(0, noisey + 1)];
-		v11 = noise_buf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			gradient_buf[index++] = interpolate(v00, v10, v01, v11, u, v);
-
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noise_buf[idx(noisex + 1, noisey)];
-				v11 = noise_buf[idx(noisex + 1, noisey + 1)];
-			}
-		}
+		noise_kernels->interpolateRow2D(&gradient_buf[index],
+			&noise_buf[idx(0, noisey)], &noise_buf[idx(0, noisey + 1)],
+			&lattice_x[0], &weight_x[0], eased ? easeCurve(v) : v, sx);
+		index += sx;
 
 		v += step_y;
 		if (v >= 1.0) {
@@ -614,15 +1094,14 @@ void Noise::gradientMap3D(
 		float step_x, float step_y, float step_z,
 		s32 seed)
 {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	u32 index, i, j, k, noisex, noisey, noisez;
+	static thread_local std::vector<u32> lattice_x;
+	static thread_local std::vector<float> weight_x;
+	float u, v, w, orig_v;
+	u32 index, i, j, k, noisey, noisez;
 	u32 nlx, nly, nlz;
 	s32 x0, y0, z0;
 
-	Interp3dFxn interpolate = (np.flags & NOISE_FLAG_EASED) ?
-		triLinearInterpolation : triLinearInterpolationNoEase;
+	bool eased = np.flags & NOISE_FLAG_EASED;
 
 	x0 = floor(x);
 	y0 = floor(y);
@@ -630,7 +1109,6 @@ void Noise::gradientMap3D(
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
 	orig_v = v;
 
 	//calculate noise point lattice
@@ -644,44 +1122,22 @@ void Noise::gradientMap3D(
 				noise_buf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
 
 	//calculate interpolations
+	stepLatticeX(u, step_x, sx, eased, &lattice_x, &weight_x);
 	index  = 0;
 	noisey = 0;
 	noisez = 0;
 	for (k = 0; k != sz; k++) {
+		float tz = eased ? easeCurve(w) : w;
 		v = orig_v;
 		noisey = 0;
 		for (j = 0; j != sy; j++) {
-			v000 = noise_buf[idx(0, noisey,     noisez)];
-			v100 = noise_buf[idx(1, noisey,     noisez)];
-			v010 = noise_buf[idx(0, noisey + 1, noisez)];
-			v110 = noise_buf[idx(1, noisey + 1, noisez)];
-			v001 = noise_buf[idx(0, noisey,     noisez + 1)];
-			v101 = noise_buf[idx(1, noisey,     noisez + 1)];
-			v011 = noise_buf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noise_buf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				gradient_buf[index++] = interpolate(
-					v000, v100, v010, v110,
-					v001, v101, v011, v111,
-					u, v, w);
-
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noise_buf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noise_buf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noise_buf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noise_buf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
-			}
+			noise_kernels->interpolateRow3D(&gradient_buf[index],
+				&noise_buf[idx(0, noisey,     noisez)],
+				&noise_buf[idx(0, noisey + 1, noisez)],
+				&noise_buf[idx(0, noisey,     noisez + 1)],
+				&noise_buf[idx(0, noisey + 1, noisez + 1)],
+				&lattice_x[0], &weight_x[0], eased ? easeCurve(v) : v, tz, sx);
+			index += sx;
 
 			v += step_y;
 			if (v >= 1.0) {
@@ -777,27 +1233,11 @@ float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map)
 void Noise::updateResults(float g, float *gmap,
 	float *persistence_map, size_t bufsize)
 {
-	// This looks very ugly, but it is 50-70% faster than having
-	// conditional statements inside the loop
-	if (np.flags & NOISE_FLAG_ABSVALUE) {
-		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
-				result[i] += gmap[i] * fabs(gradient_buf[i]);
-				gmap[i] *= persistence_map[i];
-			}
-		} else {
-			for (size_t i = 0; i != bufsize; i++)
-				result[i] += g * fabs(gradient_buf[i]);
-		}
+	bool absvalue = np.flags & NOISE_FLAG_ABSVALUE;
+	if (persistence_map) {
+		noise_kernels->addOctavePersist(result, gradient_buf, gmap,
+			persistence_map, absvalue, bufsize);
 	} else {
-		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
-				result[i] += gmap[i] * gradient_buf[i];
-				gmap[i] *= persistence_map[i];
-			}
-		} else {
-			for (size_t i = 0; i != bufsize; i++)
-				result[i] += g * gradient_buf[i];
-		}
+		noise_kernels->addOctave(result, gradient_buf, g, absvalue, bufsize);
 	}
 }
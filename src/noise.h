@@ -128,6 +128,21 @@ struct NoiseParams {
 	}
 };
 
+/*
+	Instruction sets the bulk noise functions can use.
+	The best one the CPU supports is used unless another one is set.
+*/
+enum NoiseSIMD {
+	NOISE_SIMD_NONE,
+	NOISE_SIMD_SSE2,
+	NOISE_SIMD_AVX2,
+};
+
+NoiseSIMD getNoiseSIMD();
+// Fails if the CPU doesn't support it; not to be called while noise is used
+bool setNoiseSIMD(NoiseSIMD simd);
+const char *getNoiseSIMDName(NoiseSIMD simd);
+
 class Noise {
 public:
 	NoiseParams np;
@@ -0,0 +1,140 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "noise_cache.h"
+
+#include <iterator>
+#include <string.h>
+
+static bool noise_params_equal(const NoiseParams &a, const NoiseParams &b)
+{
+	return a.offset == b.offset && a.scale == b.scale &&
+		a.spread == b.spread && a.seed == b.seed &&
+		a.octaves == b.octaves && a.persist == b.persist &&
+		a.lacunarity == b.lacunarity && a.flags == b.flags;
+}
+
+static inline size_t hash_combine(size_t h, u32 value)
+{
+	return h ^ (value + 0x9e3779b9 + (h << 6) + (h >> 2));
+}
+
+static inline u32 float_bits(float f)
+{
+	u32 bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+bool NoiseMapCache::Key::operator==(const Key &other) const
+{
+	if (seed != other.seed || x != other.x || y != other.y ||
+			sx != other.sx || sy != other.sy ||
+			has_persist != other.has_persist ||
+			!noise_params_equal(np, other.np))
+		return false;
+
+	return !has_persist || (persist_seed == other.persist_seed &&
+		noise_params_equal(persist_np, other.persist_np));
+}
+
+size_t NoiseMapCache::KeyHash::operator()(const Key &key) const
+{
+	// The position and the noise seed tell most maps apart
+	size_t h = float_bits(key.x);
+	h = hash_combine(h, float_bits(key.y));
+	h = hash_combine(h, key.np.seed);
+	h = hash_combine(h, key.seed);
+	return hash_combine(h, key.sx);
+}
+
+float *NoiseMapCache::perlinMap2D(Noise *noise, float x, float y,
+	Noise *persist_noise)
+{
+	if (m_max_maps == 0) {
+		float *persistence_map = NULL;
+		if (persist_noise)
+			persistence_map = persist_noise->perlinMap2D(x, y);
+		return noise->perlinMap2D(x, y, persistence_map);
+	}
+
+	Key key;
+	key.np = noise->np;
+	key.seed = noise->seed;
+	key.x = x;
+	key.y = y;
+	key.sx = noise->sx;
+	key.sy = noise->sy;
+	key.has_persist = persist_noise != NULL;
+	if (persist_noise) {
+		key.persist_np = persist_noise->np;
+		key.persist_seed = persist_noise->seed;
+	} else {
+		key.persist_seed = 0;
+	}
+
+	size_t size = noise->sx * noise->sy;
+
+	std::unordered_map<Key, std::list<Entry>::iterator, KeyHash>::iterator
+		it = m_entries.find(key);
+	if (it != m_entries.end()) {
+		m_hits++;
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		memcpy(noise->result, &it->second->map[0], size * sizeof(float));
+		return noise->result;
+	}
+
+	m_misses++;
+	float *persistence_map = NULL;
+	if (persist_noise)
+		persistence_map = perlinMap2D(persist_noise, x, y);
+	noise->perlinMap2D(x, y, persistence_map);
+
+	// Reuse the least recently used map when full
+	if (m_lru.size() >= m_max_maps) {
+		m_entries.erase(m_lru.back().key);
+		m_lru.splice(m_lru.begin(), m_lru, std::prev(m_lru.end()));
+	} else {
+		m_lru.emplace_front();
+	}
+
+	Entry &entry = m_lru.front();
+	entry.key = key;
+	entry.map.assign(noise->result, noise->result + size);
+	m_entries[key] = m_lru.begin();
+
+	return noise->result;
+}
+
+void NoiseMapCache::setMaxMaps(size_t max_maps)
+{
+	m_max_maps = max_maps;
+	while (m_lru.size() > m_max_maps) {
+		m_entries.erase(m_lru.back().key);
+		m_lru.pop_back();
+	}
+}
+
+void NoiseMapCache::takeStats(u32 *hits, u32 *misses)
+{
+	*hits = m_hits;
+	*misses = m_misses;
+	m_hits = 0;
+	m_misses = 0;
+}
@@ -0,0 +1,89 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef NOISE_CACHE_HEADER
+#define NOISE_CACHE_HEADER
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "noise.h"
+
+/*
+	Least recently used 2D noise maps of a mapgen.
+
+	Chunks stacked along Y have the same XZ area, so they need the same 2D
+	maps; these are copied from the cache instead of being computed again.
+	Not thread-safe: each mapgen, thus each emerge thread, has its own.
+*/
+class NoiseMapCache
+{
+public:
+	// A cache of 0 maps computes every map
+	NoiseMapCache(size_t max_maps = 0): m_max_maps(max_maps) {}
+
+	/*
+		Same as noise->perlinMap2D(x, y), with the persistence map of
+		persist_noise at (x, y) if it is given. The maps are left in the
+		result arrays of the noises, which can then be modified.
+	*/
+	float *perlinMap2D(Noise *noise, float x, float y,
+		Noise *persist_noise = NULL);
+
+	void setMaxMaps(size_t max_maps);
+	size_t size() const { return m_lru.size(); }
+
+	// Counts since the last call
+	void takeStats(u32 *hits, u32 *misses);
+
+private:
+	struct Key
+	{
+		NoiseParams np;
+		s32 seed;
+		float x, y;
+		u32 sx, sy;
+		bool has_persist;
+		NoiseParams persist_np;
+		s32 persist_seed;
+
+		bool operator==(const Key &other) const;
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key &key) const;
+	};
+
+	struct Entry
+	{
+		Key key;
+		std::vector<float> map;
+	};
+
+	size_t m_max_maps;
+	// Most recently used first
+	std::list<Entry> m_lru;
+	std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> m_entries;
+
+	u32 m_hits = 0;
+	u32 m_misses = 0;
+};
+
+#endif
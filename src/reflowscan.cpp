@@ -30,7 +30,7 @@ ReflowScan::ReflowScan(Map *map, INodeDefManager *ndef) :
 {
 }
 
-void ReflowScan::scan(MapBlock *block, UniqueQueue<v3s16> *liquid_queue)
+void ReflowScan::scan(MapBlock *block, LiquidQueue *liquid_queue)
 {
 	m_block_pos = block->getPos();
 	m_rel_block_pos = block->getPosRelative();
@@ -20,17 +20,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef REFLOWSCAN_H
 #define REFLOWSCAN_H
 
-#include "util/container.h"
 #include "irrlichttypes_bloated.h"
 
 class INodeDefManager;
+class LiquidQueue;
 class Map;
 class MapBlock;
 
 class ReflowScan {
 public:
 	ReflowScan(Map *map, INodeDefManager *ndef);
-	void scan(MapBlock *block, UniqueQueue<v3s16> *liquid_queue);
+	void scan(MapBlock *block, LiquidQueue *liquid_queue);
 
 private:
 	MapBlock *lookupBlock(int x, int y, int z);
@@ -42,7 +42,7 @@ class ReflowScan {
 	Map *m_map = nullptr;
 	INodeDefManager *m_ndef = nullptr;
 	v3s16 m_block_pos, m_rel_block_pos;
-	UniqueQueue<v3s16> *m_liquid_queue = nullptr;
+	LiquidQueue *m_liquid_queue = nullptr;
 	MapBlock *m_lookup[3 * 3 * 3];
 	u32 m_lookup_state_bitset;
 };
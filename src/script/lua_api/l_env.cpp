@@ -35,6 +35,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_sao.h"
 #include "treegen.h"
 #include "emerge.h"
+#include "mapblock.h"
+#include "voxel.h"
 #include "pathfinder.h"
 #include "face_position_cache.h"
 
@@ -790,13 +792,54 @@ int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
 
 	std::unordered_map<content_t, u32> individual_count;
 
+	/*
+		Look up the blocks of the area once and use their content
+		summary to skip the ones that contain nothing of the filter.
+		Positions in missing blocks read as CONTENT_IGNORE.
+	*/
+	Map &map = env->getMap();
+	v3s16 bpmin = getNodeBlockPos(minp);
+	v3s16 bpmax = getNodeBlockPos(maxp);
+	VoxelArea block_area(bpmin, bpmax);
+	std::vector<MapBlock *> blocks(block_area.getVolume(), NULL);
+	std::vector<bool> block_matches(block_area.getVolume(), false);
+	bool ignore_matches = filter.count(CONTENT_IGNORE) != 0;
+	for (s16 x = bpmin.X; x <= bpmax.X; x++)
+	for (s16 y = bpmin.Y; y <= bpmax.Y; y++)
+	for (s16 z = bpmin.Z; z <= bpmax.Z; z++) {
+		u32 bi = block_area.index(x, y, z);
+		MapBlock *block = map.getBlockNoCreateNoEx(v3s16(x, y, z));
+		if (!block || block->isDummy()) {
+			block_matches[bi] = ignore_matches;
+			continue;
+		}
+		blocks[bi] = block;
+		const std::vector<content_t> &contents = block->getContents();
+		for (std::vector<content_t>::const_iterator it = contents.begin();
+				it != contents.end(); ++it) {
+			if (filter.count(*it) != 0) {
+				block_matches[bi] = true;
+				break;
+			}
+		}
+	}
+
 	lua_newtable(L);
 	u64 i = 0;
 	for (s16 x = minp.X; x <= maxp.X; x++)
 	for (s16 y = minp.Y; y <= maxp.Y; y++)
 	for (s16 z = minp.Z; z <= maxp.Z; z++) {
 		v3s16 p(x, y, z);
-		content_t c = env->getMap().getNodeNoEx(p).getContent();
+		v3s16 blockpos, relpos;
+		getNodeBlockPosWithOffset(p, blockpos, relpos);
+		u32 bi = block_area.index(blockpos);
+		if (!block_matches[bi]) {
+			// Skip the rest of the block's column segment
+			z = MYMIN(maxp.Z, blockpos.Z * MAP_BLOCKSIZE + MAP_BLOCKSIZE - 1);
+			continue;
+		}
+		content_t c = blocks[bi] ?
+			blocks[bi]->getNodeUnsafe(relpos).getContent() : CONTENT_IGNORE;
 		if (filter.count(c) != 0) {
 			push_v3s16(L, p);
 			lua_rawseti(L, -2, ++i);
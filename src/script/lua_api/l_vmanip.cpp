@@ -174,8 +174,13 @@ int LuaVoxelManip::l_update_liquids(lua_State *L)
 	mg.vm   = vm;
 	mg.ndef = ndef;
 
-	mg.updateLiquid(&map->m_transforming_liquid,
+	UniqueQueue<v3s16> transforming_liquid;
+	mg.updateLiquid(&transforming_liquid,
 			vm->m_area.MinEdge, vm->m_area.MaxEdge);
+	while (transforming_liquid.size()) {
+		map->transforming_liquid_add(transforming_liquid.front());
+		transforming_liquid.pop_front();
+	}
 
 	return 0;
 }
@@ -336,6 +341,33 @@ int LuaVoxelManip::l_set_param2_data(lua_State *L)
 	return 0;
 }
 
+int LuaVoxelManip::l_get_data_buffer(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	checkobject(L, 1);
+	return LuaVoxelManipBuffer::create_object(L, 1,
+		LuaVoxelManipBuffer::FIELD_CONTENT);
+}
+
+int LuaVoxelManip::l_get_light_buffer(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	checkobject(L, 1);
+	return LuaVoxelManipBuffer::create_object(L, 1,
+		LuaVoxelManipBuffer::FIELD_PARAM1);
+}
+
+int LuaVoxelManip::l_get_param2_buffer(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	checkobject(L, 1);
+	return LuaVoxelManipBuffer::create_object(L, 1,
+		LuaVoxelManipBuffer::FIELD_PARAM2);
+}
+
 int LuaVoxelManip::l_update_map(lua_State *L)
 {
 	return 0;
@@ -465,7 +497,142 @@ const luaL_Reg LuaVoxelManip::methods[] = {
 	luamethod(LuaVoxelManip, set_light_data),
 	luamethod(LuaVoxelManip, get_param2_data),
 	luamethod(LuaVoxelManip, set_param2_data),
+	luamethod(LuaVoxelManip, get_data_buffer),
+	luamethod(LuaVoxelManip, get_light_buffer),
+	luamethod(LuaVoxelManip, get_param2_buffer),
 	luamethod(LuaVoxelManip, was_modified),
 	luamethod(LuaVoxelManip, get_emerged_area),
 	{0,0}
 };
+
+// garbage collector
+int LuaVoxelManipBuffer::gc_object(lua_State *L)
+{
+	LuaVoxelManipBuffer *o = *(LuaVoxelManipBuffer **)(lua_touserdata(L, 1));
+	delete o;
+
+	return 0;
+}
+
+// The metamethods are only called on buffers, they don't check the object
+
+int LuaVoxelManipBuffer::l_index(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipBuffer *o = *(LuaVoxelManipBuffer **)(lua_touserdata(L, 1));
+	MMVManip *vm = o->m_vm->vm;
+
+	// Like a table: nil out of the array
+	lua_Integer i = lua_tointeger(L, 2) - 1;
+	if (i < 0 || i >= vm->m_area.getVolume()) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	switch (o->m_field) {
+	case FIELD_CONTENT:
+		lua_pushinteger(L, vm->m_data[i].getContent());
+		break;
+	case FIELD_PARAM1:
+		lua_pushinteger(L, vm->m_data[i].param1);
+		break;
+	case FIELD_PARAM2:
+		lua_pushinteger(L, vm->m_data[i].param2);
+		break;
+	}
+	return 1;
+}
+
+int LuaVoxelManipBuffer::l_newindex(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipBuffer *o = *(LuaVoxelManipBuffer **)(lua_touserdata(L, 1));
+	MMVManip *vm = o->m_vm->vm;
+
+	lua_Integer i = lua_tointeger(L, 2) - 1;
+	if (i < 0 || i >= vm->m_area.getVolume())
+		return luaL_error(L, "VoxelManipBuffer: index out of range");
+
+	lua_Integer value = lua_tointeger(L, 3);
+	switch (o->m_field) {
+	case FIELD_CONTENT:
+		vm->m_data[i].setContent(value);
+		break;
+	case FIELD_PARAM1:
+		vm->m_data[i].param1 = value;
+		break;
+	case FIELD_PARAM2:
+		vm->m_data[i].param2 = value;
+		break;
+	}
+	return 0;
+}
+
+int LuaVoxelManipBuffer::l_len(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipBuffer *o = *(LuaVoxelManipBuffer **)(lua_touserdata(L, 1));
+	lua_pushinteger(L, o->m_vm->vm->m_area.getVolume());
+	return 1;
+}
+
+LuaVoxelManipBuffer::LuaVoxelManipBuffer(LuaVoxelManip *vm, Field field) :
+	m_vm(vm),
+	m_field(field)
+{
+}
+
+int LuaVoxelManipBuffer::create_object(lua_State *L, int vm_index, Field field)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *vm = LuaVoxelManip::checkobject(L, vm_index);
+	if (vm_index < 0)
+		vm_index = lua_gettop(L) + 1 + vm_index;
+
+	LuaVoxelManipBuffer *o = new LuaVoxelManipBuffer(vm, field);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+
+	// The environment of the buffer references the VoxelManip
+	lua_newtable(L);
+	lua_pushvalue(L, vm_index);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+void LuaVoxelManipBuffer::Register(lua_State *L)
+{
+	luaL_newmetatable(L, className);
+	int metatable = lua_gettop(L);
+
+	lua_pushliteral(L, "__metatable");
+	lua_pushstring(L, className);
+	lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+	lua_pushliteral(L, "__index");
+	lua_pushcfunction(L, l_index);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__newindex");
+	lua_pushcfunction(L, l_newindex);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__len");
+	lua_pushcfunction(L, l_len);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__gc");
+	lua_pushcfunction(L, gc_object);
+	lua_settable(L, metatable);
+
+	lua_pop(L, 1);  // drop metatable
+}
+
+const char LuaVoxelManipBuffer::className[] = "VoxelManipBuffer";
@@ -61,6 +61,10 @@ class LuaVoxelManip : public ModApiBase
 	static int l_get_param2_data(lua_State *L);
 	static int l_set_param2_data(lua_State *L);
 
+	static int l_get_data_buffer(lua_State *L);
+	static int l_get_light_buffer(lua_State *L);
+	static int l_get_param2_buffer(lua_State *L);
+
 	static int l_was_modified(lua_State *L);
 	static int l_get_emerged_area(lua_State *L);
 
@@ -81,4 +85,42 @@ class LuaVoxelManip : public ModApiBase
 	static void Register(lua_State *L);
 };
 
+/*
+  VoxelManipBuffer
+
+  The content ids, light or param2 of the nodes of a VoxelManip, indexed
+  like the arrays of get_data() and friends. Reads and writes go straight
+  to the VoxelManip, which is kept alive by the buffer.
+ */
+class LuaVoxelManipBuffer : public ModApiBase
+{
+public:
+	enum Field {
+		FIELD_CONTENT,
+		FIELD_PARAM1,
+		FIELD_PARAM2,
+	};
+
+private:
+	LuaVoxelManip *m_vm;
+	Field m_field;
+
+	static const char className[];
+
+	static int gc_object(lua_State *L);
+
+	static int l_index(lua_State *L);
+	static int l_newindex(lua_State *L);
+	static int l_len(lua_State *L);
+
+public:
+	LuaVoxelManipBuffer(LuaVoxelManip *vm, Field field);
+
+	// Creates a buffer of the VoxelManip at vm_index and leaves it on top
+	// of stack
+	static int create_object(lua_State *L, int vm_index, Field field);
+
+	static void Register(lua_State *L);
+};
+
 #endif /* L_VMANIP_H_ */
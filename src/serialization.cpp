@@ -24,6 +24,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	#define ZLIB_WINAPI
 #endif
 #include "zlib.h"
+#if USE_ZSTD
+#include <zstd.h>
+#include <memory>
+#endif
 
 /* report a zlib or i/o error */
 void zerr(int ret)
@@ -185,11 +189,158 @@ void decompressZlib(std::istream &is, std::ostream &os)
 	inflateEnd(&z);
 }
 
+#if USE_ZSTD
+// Contexts are expensive to set up, so every thread keeps its own
+struct ZstdCCtxDeleter { void operator()(ZSTD_CCtx *c) { ZSTD_freeCCtx(c); } };
+struct ZstdDCtxDeleter { void operator()(ZSTD_DCtx *d) { ZSTD_freeDCtx(d); } };
+static thread_local std::unique_ptr<ZSTD_CCtx, ZstdCCtxDeleter> zstd_cctx;
+static thread_local std::unique_ptr<ZSTD_DCtx, ZstdDCtxDeleter> zstd_dctx;
+
+void compressZstd(const u8 *data, size_t data_size, std::ostream &os, int level)
+{
+	if (!zstd_cctx) {
+		zstd_cctx.reset(ZSTD_createCCtx());
+		if (!zstd_cctx)
+			throw SerializationError("compressZstd: could not create context");
+	}
+
+	std::string buffer(ZSTD_compressBound(data_size), '\0');
+	size_t ret = ZSTD_compressCCtx(zstd_cctx.get(), &buffer[0], buffer.size(),
+			data, data_size, level);
+	if (ZSTD_isError(ret))
+		throw SerializationError(std::string("compressZstd: ") +
+				ZSTD_getErrorName(ret));
+	os.write(buffer.c_str(), ret);
+}
+
+void compressZstd(const std::string &data, std::ostream &os, int level)
+{
+	compressZstd((u8*)data.c_str(), data.size(), os, level);
+}
+
+void decompressZstd(std::istream &is, std::ostream &os)
+{
+	if (!zstd_dctx) {
+		zstd_dctx.reset(ZSTD_createDCtx());
+		if (!zstd_dctx)
+			throw SerializationError("decompressZstd: could not create context");
+	}
+	ZSTD_DCtx *dctx = zstd_dctx.get();
+	ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+	const s32 bufsize = 16384;
+	char input_buffer[bufsize];
+	char output_buffer[bufsize];
+
+	ZSTD_inBuffer input = { input_buffer, 0, 0 };
+	bool output_full = false;
+	for (;;) {
+		// A full output buffer may hold back output of the current input
+		if (input.pos == input.size && !output_full) {
+			is.read(input_buffer, bufsize);
+			input.size = is.gcount();
+			input.pos = 0;
+			if (input.size == 0)
+				throw SerializationError("decompressZstd: "
+						"unexpected end of data");
+		}
+
+		ZSTD_outBuffer output = { output_buffer, bufsize, 0 };
+		size_t ret = ZSTD_decompressStream(dctx, &output, &input);
+		if (ZSTD_isError(ret))
+			throw SerializationError(std::string("decompressZstd: ") +
+					ZSTD_getErrorName(ret));
+		os.write(output_buffer, output.pos);
+
+		// The frame is complete and all its output flushed
+		if (ret == 0)
+			break;
+		output_full = output.pos == output.size;
+	}
+
+	// Unget all the data that the frame didn't take
+	is.clear(); // Just in case EOF is set
+	for (size_t i = input.pos; i < input.size; i++) {
+		is.unget();
+		if (is.fail() || is.bad())
+			throw SerializationError("decompressZstd: unget failed");
+	}
+}
+#endif
+
+bool parseCompressionCodec(const std::string &name, CompressionCodec *codec)
+{
+	if (name == "zlib") {
+		*codec = COMPRESSION_ZLIB;
+		return true;
+	}
+#if USE_ZSTD
+	if (name == "zstd") {
+		*codec = COMPRESSION_ZSTD;
+		return true;
+	}
+#endif
+	return false;
+}
+
+const char *getCompressionCodecName(CompressionCodec codec)
+{
+	switch (codec) {
+	case COMPRESSION_ZLIB:
+		return "zlib";
+	case COMPRESSION_ZSTD:
+		return "zstd";
+	}
+	return "unknown";
+}
+
+void compressWith(CompressionCodec codec, const u8 *data, size_t data_size,
+		std::ostream &os, int level)
+{
+	switch (codec) {
+	case COMPRESSION_ZLIB:
+		compressZlib(data, data_size, os, level);
+		return;
+	case COMPRESSION_ZSTD:
+#if USE_ZSTD
+		// 0 is the default level of zstd
+		compressZstd(data, data_size, os, level == -1 ? 0 : level);
+		return;
+#else
+		break;
+#endif
+	}
+	throw SerializationError("compressWith: codec not supported");
+}
+
+void compressWith(CompressionCodec codec, const std::string &data,
+		std::ostream &os, int level)
+{
+	compressWith(codec, (u8*)data.c_str(), data.size(), os, level);
+}
+
+void decompressWith(CompressionCodec codec, std::istream &is, std::ostream &os)
+{
+	switch (codec) {
+	case COMPRESSION_ZLIB:
+		decompressZlib(is, os);
+		return;
+	case COMPRESSION_ZSTD:
+#if USE_ZSTD
+		decompressZstd(is, os);
+		return;
+#else
+		break;
+#endif
+	}
+	throw SerializationError("decompressWith: codec not supported");
+}
+
 void compress(const SharedBuffer<u8> &data, std::ostream &os, u8 version)
 {
 	if(version >= 11)
 	{
-		compressZlib(*data ,data.getSize(), os);
+		compressWith(getCompressionCodec(version), *data, data.getSize(), os);
 		return;
 	}
 
@@ -232,7 +383,7 @@ void decompress(std::istream &is, std::ostream &os, u8 version)
 {
 	if(version >= 11)
 	{
-		decompressZlib(is, os);
+		decompressWith(getCompressionCodec(version), is, os);
 		return;
 	}
 
@@ -22,7 +22,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irrlichttypes.h"
 #include "exceptions.h"
+#include "config.h"
 #include <iostream>
+#include <string>
 #include "util/pointer.h"
 
 /*
@@ -64,13 +66,21 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	26: Never written; read the same as 25
 	27: Added light spreading flags to blocks
 	28: Added "private" flag to NodeMetadata
+	29: Node data and node metadata compressed with zstd (only when
+	    built with zstd)
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
+#if USE_ZSTD
+#define SER_FMT_VER_HIGHEST_READ 29
+#else
 #define SER_FMT_VER_HIGHEST_READ 28
+#endif
 // Saved on disk version
-#define SER_FMT_VER_HIGHEST_WRITE 28
+#define SER_FMT_VER_HIGHEST_WRITE SER_FMT_VER_HIGHEST_READ
+// Highest serialization version compressing with zlib
+#define SER_FMT_VER_HIGHEST_ZLIB 28
 // Lowest supported serialization version
 #define SER_FMT_VER_LOWEST_READ 0
 // Lowest serialization version for writing
@@ -82,6 +92,33 @@ inline bool ser_ver_supported(s32 v) {
 	return v >= SER_FMT_VER_LOWEST_READ && v <= SER_FMT_VER_HIGHEST_READ;
 }
 
+/*
+	Compression codecs
+*/
+
+enum CompressionCodec
+{
+	COMPRESSION_ZLIB,
+	COMPRESSION_ZSTD,
+};
+
+// Codec used for map data by a serialization version >= 11
+inline CompressionCodec getCompressionCodec(u8 version)
+{
+	return version >= 29 ? COMPRESSION_ZSTD : COMPRESSION_ZLIB;
+}
+
+// Returns false for unknown names, or codecs not built in
+bool parseCompressionCodec(const std::string &name, CompressionCodec *codec);
+const char *getCompressionCodecName(CompressionCodec codec);
+
+// A level of -1 uses the default level of the codec
+void compressWith(CompressionCodec codec, const u8 *data, size_t data_size,
+		std::ostream &os, int level = -1);
+void compressWith(CompressionCodec codec, const std::string &data,
+		std::ostream &os, int level = -1);
+void decompressWith(CompressionCodec codec, std::istream &is, std::ostream &os);
+
 /*
 	Misc. serialization functions
 */
@@ -90,7 +127,13 @@ void compressZlib(const u8 *data, size_t data_size, std::ostream &os, int level
 void compressZlib(const std::string &data, std::ostream &os, int level = -1);
 void decompressZlib(std::istream &is, std::ostream &os);
 
-// These choose between zlib and a self-made one according to version
+#if USE_ZSTD
+void compressZstd(const u8 *data, size_t data_size, std::ostream &os, int level = 0);
+void compressZstd(const std::string &data, std::ostream &os, int level = 0);
+void decompressZstd(std::istream &is, std::ostream &os);
+#endif
+
+// These choose between zlib, zstd and a self-made one according to version
 void compress(const SharedBuffer<u8> &data, std::ostream &os, u8 version);
 //void compress(const std::string &data, std::ostream &os, u8 version);
 void decompress(std::istream &is, std::ostream &os, u8 version);
@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "version.h"
 #include "filesys.h"
 #include "mapblock.h"
+#include "mapblock_serializer.h"
 #include "serverobject.h"
 #include "genericobject.h"
 #include "settings.h"
@@ -140,6 +141,47 @@ v3f ServerSoundParams::getPos(ServerEnvironment *env, bool *pos_exists) const
 
 
 
+/*
+	BlockDataCache
+*/
+
+std::shared_ptr<const std::string> BlockDataCache::get(MapBlock *block,
+	u8 version)
+{
+	Key key = {block->getPos(), version};
+	std::unordered_map<Key, Entry, KeyHash>::iterator it = m_entries.find(key);
+	if (it == m_entries.end())
+		return nullptr;
+
+	if (it->second.mod_counter != block->getModCounter()) {
+		m_entries.erase(it);
+		return nullptr;
+	}
+
+	return it->second.payload;
+}
+
+void BlockDataCache::set(MapBlock *block, u8 version,
+	std::shared_ptr<const std::string> payload)
+{
+	Key key = {block->getPos(), version};
+	Entry &entry = m_entries[key];
+	entry.mod_counter = block->getModCounter();
+	entry.payload = payload;
+}
+
+void BlockDataCache::prune(Map *map)
+{
+	for (std::unordered_map<Key, Entry, KeyHash>::iterator
+			it = m_entries.begin(); it != m_entries.end();) {
+		MapBlock *block = map->getBlockNoCreateNoEx(it->first.pos);
+		if (!block || block->getModCounter() != it->second.mod_counter)
+			it = m_entries.erase(it);
+		else
+			++it;
+	}
+}
+
 /*
 	Server
 */
@@ -161,7 +203,8 @@ Server::Server(
 			512,
 			CONNECTION_TIMEOUT,
 			ipv6,
-			this),
+			this,
+			con::Connection::getServerThreadCount()),
 	m_itemdef(createItemDefManager()),
 	m_nodedef(createNodeDefManager()),
 	m_craftdef(createCraftDefManager()),
@@ -297,6 +340,8 @@ Server::Server(
 	}
 
 	m_liquid_transform_every = g_settings->getFloat("liquid_update");
+	m_lighting_update_max_time = g_settings->getU32("lighting_update_max_time");
+	servermap->setLightingDeferred(m_lighting_update_max_time > 0);
 	m_max_chatmessage_length = g_settings->getU16("chat_message_max_size");
 	m_csm_flavour_limits = g_settings->getU64("csm_flavour_limits");
 	m_csm_noderange_limit = g_settings->getU32("csm_flavour_noderange_limit");
@@ -553,23 +598,6 @@ void Server::AsyncRunStep(bool initial_step)
 
 		std::map<v3s16, MapBlock*> modified_blocks;
 		m_env->getMap().transformLiquids(modified_blocks, m_env);
-#if 0
-		/*
-			Update lighting
-		*/
-		core::map<v3s16, MapBlock*> lighting_modified_blocks;
-		ServerMap &map = ((ServerMap&)m_env->getMap());
-		map.updateLighting(modified_blocks, lighting_modified_blocks);
-
-		// Add blocks modified by lighting to modified_blocks
-		for(core::map<v3s16, MapBlock*>::Iterator
-				i = lighting_modified_blocks.getIterator();
-				i.atEnd() == false; i++)
-		{
-			MapBlock *block = i.getNode()->getValue();
-			modified_blocks.insert(block->getPos(), block);
-		}
-#endif
 		/*
 			Set the modified blocks unsent for all the clients
 		*/
@@ -578,6 +606,21 @@ void Server::AsyncRunStep(bool initial_step)
 			SetBlocksNotSent(modified_blocks);
 		}
 	}
+
+	/* Update the lighting of the changed nodes */
+	{
+		MutexAutoLock lock(m_env_mutex);
+
+		if (m_env->getMap().isLightingUpdatePending()) {
+			ScopeProfiler sp(g_profiler, "Server: lighting update");
+
+			std::map<v3s16, MapBlock*> modified_blocks;
+			m_env->getMap().updateLighting(modified_blocks,
+				m_lighting_update_max_time);
+			if (!modified_blocks.empty())
+				SetBlocksNotSent(modified_blocks);
+		}
+	}
 	m_clients.step(dtime);
 
 	m_lag += (m_lag > dtime ? -1 : 1) * dtime/100;
@@ -957,6 +1000,34 @@ void Server::AsyncRunStep(bool initial_step)
 		}
 	}
 
+	/*
+		Let the emerge threads know where the players are, so that they
+		emerge the nearest blocks first
+	*/
+	{
+		float &counter = m_emerge_player_positions_timer;
+		counter += dtime;
+		if (counter >= 0.5) {
+			counter = 0.0;
+
+			std::unordered_map<u16, v3s16> positions;
+			{
+				MutexAutoLock envlock(m_env_mutex);
+				std::vector<u16> clients = m_clients.getClientIDs();
+				for (std::vector<u16>::const_iterator i = clients.begin();
+						i != clients.end(); ++i) {
+					RemotePlayer *player = m_env->getPlayer(*i);
+					PlayerSAO *sao = player ? player->getPlayerSAO() : NULL;
+					if (!sao)
+						continue;
+					positions[*i] = getNodeBlockPos(
+						floatToInt(sao->getBasePosition(), BS));
+				}
+			}
+			m_emerge->updatePlayerPositions(positions);
+		}
+	}
+
 	// Save map, players and auth stuff
 	{
 		float &counter = m_savemap_timer;
@@ -2256,25 +2327,22 @@ void Server::setBlockNotSent(v3s16 p)
 	m_clients.unlock();
 }
 
-void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version)
+std::string Server::makeBlockData(MapBlock *block,
+	const std::string &serialized)
 {
-	DSTACK(FUNCTION_NAME);
-
-	v3s16 p = block->getPos();
-
-	/*
-		Create a packet with the block in the right format
-	*/
-
 	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
+	writeV3S16(os, block->getPos());
+	os << serialized;
 	block->serializeNetworkSpecific(os);
-	std::string s = os.str();
+	return os.str();
+}
 
-	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + 2 + s.size(), peer_id);
+void Server::SendBlockNoLock(u16 peer_id, const std::string &payload)
+{
+	DSTACK(FUNCTION_NAME);
 
-	pkt << p;
-	pkt.putRawString(s.c_str(), s.size());
+	NetworkPacket pkt(TOCLIENT_BLOCKDATA, payload.size(), peer_id);
+	pkt.putRawString(payload.c_str(), payload.size());
 	Send(&pkt);
 }
 
@@ -2315,6 +2383,10 @@ void Server::SendBlocks(float dtime)
 	// Lowest is most important.
 	std::sort(queue.begin(), queue.end());
 
+	std::vector<PrioritySortedBlockTransfer> sends;
+	std::vector<MapBlock *> send_blocks;
+	std::vector<u8> send_versions;
+
 	m_clients.lock();
 	for(u32 i=0; i<queue.size(); i++)
 	{
@@ -2340,12 +2412,81 @@ void Server::SendBlocks(float dtime)
 		if(!client)
 			continue;
 
-		SendBlockNoLock(q.peer_id, block, client->serialization_version, client->net_proto_version);
+		sends.push_back(q);
+		send_blocks.push_back(block);
+		send_versions.push_back(client->serialization_version);
 
 		client->SentBlock(q.pos);
 		total_sending++;
 	}
+
+	/*
+		Take what can be from the cache. The rest is serialized together,
+		on all block serializer threads. Clients normally all use the same
+		serialization version.
+	*/
+	std::vector<std::shared_ptr<const std::string>> payloads(sends.size());
+	std::map<u8, std::vector<size_t>> misses;
+	u32 hit_count = 0;
+	for (size_t i = 0; i < sends.size(); i++) {
+		payloads[i] = m_block_data_cache.get(send_blocks[i], send_versions[i]);
+		if (payloads[i])
+			hit_count++;
+		else
+			misses[send_versions[i]].push_back(i);
+	}
+
+	u32 serialized_count = 0;
+	for (std::map<u8, std::vector<size_t>>::const_iterator
+			v = misses.begin(); v != misses.end(); ++v) {
+		const std::vector<size_t> &indices = v->second;
+		std::vector<MapBlock *> blocks;
+		for (size_t i = 0; i < indices.size(); i++)
+			blocks.push_back(send_blocks[indices[i]]);
+
+		std::vector<std::shared_ptr<const std::string>> results;
+		m_env->getServerMap().getBlockSerializer()->serialize(blocks, v->first,
+			false, &results);
+
+		for (size_t i = 0; i < indices.size(); i++) {
+			// Dummy blocks are never sent
+			if (!results[i])
+				continue;
+			// The block may be listed for several clients
+			payloads[indices[i]] = m_block_data_cache.get(blocks[i], v->first);
+			if (payloads[indices[i]]) {
+				hit_count++;
+				continue;
+			}
+			payloads[indices[i]] = std::make_shared<const std::string>(
+				makeBlockData(blocks[i], *results[i]));
+			m_block_data_cache.set(blocks[i], v->first, payloads[indices[i]]);
+			serialized_count++;
+		}
+	}
+
+	// Dummy blocks are neither hits nor misses
+	if (hit_count + serialized_count > 0) {
+		g_profiler->avg("Server: block data cache hit rate",
+			(float)hit_count / (hit_count + serialized_count));
+		g_profiler->add("Server: block data cache hits", hit_count);
+		g_profiler->add("Server: block data cache misses", serialized_count);
+	}
+
+	for (size_t i = 0; i < sends.size(); i++) {
+		if (payloads[i])
+			SendBlockNoLock(sends[i].peer_id, *payloads[i]);
+	}
 	m_clients.unlock();
+
+	// Forget blocks that changed or got unloaded now and then
+	m_block_data_cache_prune_timer += dtime;
+	if (m_block_data_cache_prune_timer >= 10.0f) {
+		m_block_data_cache_prune_timer = 0.0f;
+		m_block_data_cache.prune(&m_env->getMap());
+		g_profiler->avg("Server: block data cache size",
+			m_block_data_cache.size());
+	}
 }
 
 void Server::fillMediaCache()
@@ -42,6 +42,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string>
 #include <list>
 #include <map>
+#include <memory>
 #include <vector>
 
 class IWritableItemDefManager;
@@ -104,6 +105,53 @@ struct ServerPlayingSound
 	std::unordered_set<u16> clients; // peer ids
 };
 
+/*
+	Ready to send TOCLIENT_BLOCKDATA payloads, shared by all clients using
+	the same serialization version. An entry stays valid as long as the
+	block keeps the modification counter it was made with.
+*/
+class BlockDataCache
+{
+public:
+	// Returns NULL if there is no up to date payload for the block
+	std::shared_ptr<const std::string> get(MapBlock *block, u8 version);
+	void set(MapBlock *block, u8 version,
+		std::shared_ptr<const std::string> payload);
+
+	// Drops the entries of blocks that changed or are no longer loaded
+	void prune(Map *map);
+
+	size_t size() const { return m_entries.size(); }
+
+private:
+	struct Key
+	{
+		v3s16 pos;
+		u8 version;
+
+		bool operator==(const Key &other) const
+		{
+			return pos == other.pos && version == other.version;
+		}
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key &key) const
+		{
+			return std::hash<v3s16>()(key.pos) ^ key.version;
+		}
+	};
+
+	struct Entry
+	{
+		u64 mod_counter;
+		std::shared_ptr<const std::string> payload;
+	};
+
+	std::unordered_map<Key, Entry, KeyHash> m_entries;
+};
+
 class Server : public con::PeerHandler, public MapEventReceiver,
 		public InventoryManager, public IGameDef
 {
@@ -403,7 +451,11 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void setBlockNotSent(v3s16 p);
 
 	// Environment and Connection must be locked when called
-	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version);
+	// payload comes from makeBlockData()
+	void SendBlockNoLock(u16 peer_id, const std::string &payload);
+	// serialized is what MapBlock::serialize() wrote for the client
+	static std::string makeBlockData(MapBlock *block,
+		const std::string &serialized);
 
 	// Sends blocks to clients (locks env and con on its own)
 	void SendBlocks(float dtime);
@@ -501,8 +553,10 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Some timers
 	float m_liquid_transform_timer = 0.0f;
 	float m_liquid_transform_every = 1.0f;
+	u32 m_lighting_update_max_time = 0;
 	float m_masterserver_timer = 0.0f;
 	float m_emergethread_trigger_timer = 0.0f;
+	float m_emerge_player_positions_timer = 0.0f;
 	float m_savemap_timer = 0.0f;
 	IntervalLimiter m_map_timer_and_unload_interval;
 
@@ -569,6 +623,10 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	 */
 	ClientInterface m_clients;
 
+	// Blocks recently sent to clients (behind m_env_mutex)
+	BlockDataCache m_block_data_cache;
+	float m_block_data_cache_prune_timer = 0.0f;
+
 	/*
 		Peer change queue.
 		Queues stuff from peerAdded() and deletingPeer() to
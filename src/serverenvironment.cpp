@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "serverenvironment.h"
+#include "abmscan.h"
 #include "content_sao.h"
 #include "settings.h"
 #include "log.h"
@@ -34,6 +35,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/basic_macros.h"
 #include "util/pointedthing.h"
 #include "threading/mutex_auto_lock.h"
+#include "threading/thread.h"
 #include "filesys.h"
 #include "gameparams.h"
 #include "database-dummy.h"
@@ -252,6 +254,25 @@ void LBMManager::applyLBMs(ServerEnvironment *env, MapBlock *block, u32 stamp)
 	MapNode n;
 	content_t c;
 	lbm_lookup_map::const_iterator it = getLBMsIntroducedAfter(stamp);
+	if (it == m_lbm_lookup.end() || block->isDummy())
+		return;
+
+	// Skip the node scan if no content of the block has an LBM
+	bool has_lbm_content = false;
+	const std::vector<content_t> &contents = block->getContents();
+	for (std::vector<content_t>::const_iterator ci = contents.begin();
+			ci != contents.end() && !has_lbm_content; ++ci) {
+		for (LBMManager::lbm_lookup_map::const_iterator iit = it;
+				iit != m_lbm_lookup.end(); ++iit) {
+			if (iit->second.lookup(*ci)) {
+				has_lbm_content = true;
+				break;
+			}
+		}
+	}
+	if (!has_lbm_content)
+		return;
+
 	for (pos.X = 0; pos.X < MAP_BLOCKSIZE; pos.X++)
 		for (pos.Y = 0; pos.Y < MAP_BLOCKSIZE; pos.Y++)
 			for (pos.Z = 0; pos.Z < MAP_BLOCKSIZE; pos.Z++)
@@ -343,6 +364,104 @@ void ActiveBlockList::update(std::vector<v3s16> &active_positions,
 	}
 }
 
+/*
+	ActiveObjectGrid
+*/
+
+// Limits a coordinate to the map, so that it fits into s16 when converted
+// to nodes. Also maps NaN to the limit.
+static inline f32 limitObjectCoord(f32 f)
+{
+	const f32 limit = MAX_MAP_GENERATION_LIMIT * BS;
+	return MYMAX(MYMIN(f, limit), -limit);
+}
+
+// Objects beyond the map edge and the far corners of huge query boxes land
+// in the blocks at the edge
+static inline v3s16 getObjectBlockPos(v3f pos)
+{
+	v3f limited(limitObjectCoord(pos.X), limitObjectCoord(pos.Y),
+		limitObjectCoord(pos.Z));
+	return getNodeBlockPos(floatToInt(limited, BS));
+}
+
+void ActiveObjectGrid::insert(u16 id, v3f pos)
+{
+	v3s16 blockpos = getObjectBlockPos(pos);
+	m_object_blocks[id] = blockpos;
+	m_blocks[blockpos].push_back(id);
+}
+
+void ActiveObjectGrid::remove(u16 id)
+{
+	std::unordered_map<u16, v3s16>::iterator n = m_object_blocks.find(id);
+	if (n == m_object_blocks.end())
+		return;
+
+	std::unordered_map<v3s16, std::vector<u16>>::iterator b =
+		m_blocks.find(n->second);
+	m_object_blocks.erase(n);
+	if (b == m_blocks.end())
+		return;
+
+	std::vector<u16> &ids = b->second;
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (ids[i] != id)
+			continue;
+		ids[i] = ids.back();
+		ids.pop_back();
+		break;
+	}
+	if (ids.empty())
+		m_blocks.erase(b);
+}
+
+void ActiveObjectGrid::update(u16 id, v3f pos)
+{
+	std::unordered_map<u16, v3s16>::iterator n = m_object_blocks.find(id);
+	if (n == m_object_blocks.end())
+		return;
+
+	v3s16 blockpos = getObjectBlockPos(pos);
+	if (n->second == blockpos)
+		return;
+
+	remove(id);
+	insert(id, pos);
+}
+
+void ActiveObjectGrid::getObjectsInArea(std::vector<u16> &objects,
+	const aabb3f &box) const
+{
+	v3s16 minp = getObjectBlockPos(box.MinEdge);
+	v3s16 maxp = getObjectBlockPos(box.MaxEdge);
+
+	// For huge areas it is cheaper to walk the occupied blocks
+	s64 area_blocks = (s64)(maxp.X - minp.X + 1) *
+		(maxp.Y - minp.Y + 1) * (maxp.Z - minp.Z + 1);
+	if (area_blocks > (s64)m_blocks.size()) {
+		for (std::unordered_map<v3s16, std::vector<u16>>::const_iterator
+				i = m_blocks.begin(); i != m_blocks.end(); ++i) {
+			const v3s16 &p = i->first;
+			if (p.X < minp.X || p.Y < minp.Y || p.Z < minp.Z ||
+					p.X > maxp.X || p.Y > maxp.Y || p.Z > maxp.Z)
+				continue;
+			objects.insert(objects.end(), i->second.begin(), i->second.end());
+		}
+		return;
+	}
+
+	v3s16 p;
+	for (p.X = minp.X; p.X <= maxp.X; p.X++)
+	for (p.Y = minp.Y; p.Y <= maxp.Y; p.Y++)
+	for (p.Z = minp.Z; p.Z <= maxp.Z; p.Z++) {
+		std::unordered_map<v3s16, std::vector<u16>>::const_iterator i =
+			m_blocks.find(p);
+		if (i != m_blocks.end())
+			objects.insert(objects.end(), i->second.begin(), i->second.end());
+	}
+}
+
 /*
 	ServerEnvironment
 */
@@ -377,10 +496,23 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	std::string name = "";
 	conf.getNoEx("player_backend", name);
 	m_player_database = openPlayerDatabase(name, path_world, conf);
+
+	// If unspecified or 0, scan active blocks on all processors
+	s16 num_abm_threads = 0;
+	if (!g_settings->getS16NoEx("num_abm_threads", num_abm_threads) ||
+			num_abm_threads <= 0)
+		num_abm_threads = Thread::getNumberOfProcessors();
+	if (num_abm_threads > 1) {
+		m_abm_scan_pool = new ABMScanPool(num_abm_threads);
+		infostream << "ServerEnvironment: scanning ABMs on "
+			<< num_abm_threads << " threads" << std::endl;
+	}
 }
 
 ServerEnvironment::~ServerEnvironment()
 {
+	delete m_abm_scan_pool;
+
 	// Clear active block list.
 	// This makes the next one delete all active objects.
 	m_active_blocks.clear();
@@ -663,193 +795,6 @@ void ServerEnvironment::loadDefaultMeta()
 	m_lbm_mgr.loadIntroductionTimes("", m_server, m_game_time);
 }
 
-struct ActiveABM
-{
-	ActiveBlockModifier *abm;
-	int chance;
-	std::set<content_t> required_neighbors;
-};
-
-class ABMHandler
-{
-private:
-	ServerEnvironment *m_env;
-	std::vector<std::vector<ActiveABM> *> m_aabms;
-public:
-	ABMHandler(std::vector<ABMWithState> &abms,
-		float dtime_s, ServerEnvironment *env,
-		bool use_timers):
-		m_env(env)
-	{
-		if(dtime_s < 0.001)
-			return;
-		INodeDefManager *ndef = env->getGameDef()->ndef();
-		for(std::vector<ABMWithState>::iterator
-			i = abms.begin(); i != abms.end(); ++i) {
-			ActiveBlockModifier *abm = i->abm;
-			float trigger_interval = abm->getTriggerInterval();
-			if(trigger_interval < 0.001)
-				trigger_interval = 0.001;
-			float actual_interval = dtime_s;
-			if(use_timers){
-				i->timer += dtime_s;
-				if(i->timer < trigger_interval)
-					continue;
-				i->timer -= trigger_interval;
-				actual_interval = trigger_interval;
-			}
-			float chance = abm->getTriggerChance();
-			if(chance == 0)
-				chance = 1;
-			ActiveABM aabm;
-			aabm.abm = abm;
-			if (abm->getSimpleCatchUp()) {
-				float intervals = actual_interval / trigger_interval;
-				if(intervals == 0)
-					continue;
-				aabm.chance = chance / intervals;
-				if(aabm.chance == 0)
-					aabm.chance = 1;
-			} else {
-				aabm.chance = chance;
-			}
-
-			// Trigger neighbors
-			const std::set<std::string> &required_neighbors_s =
-				abm->getRequiredNeighbors();
-			for (std::set<std::string>::iterator rn = required_neighbors_s.begin();
-					rn != required_neighbors_s.end(); ++rn) {
-				ndef->getIds(*rn, aabm.required_neighbors);
-			}
-
-			// Trigger contents
-			const std::set<std::string> &contents_s = abm->getTriggerContents();
-			for (std::set<std::string>::iterator cs = contents_s.begin();
-					cs != contents_s.end(); ++cs) {
-				std::set<content_t> ids;
-				ndef->getIds(*cs, ids);
-				for (std::set<content_t>::const_iterator k = ids.begin();
-						k != ids.end(); ++k) {
-					content_t c = *k;
-					if (c >= m_aabms.size())
-						m_aabms.resize(c + 256, NULL);
-					if (!m_aabms[c])
-						m_aabms[c] = new std::vector<ActiveABM>;
-					m_aabms[c]->push_back(aabm);
-				}
-			}
-		}
-	}
-
-	~ABMHandler()
-	{
-		for (size_t i = 0; i < m_aabms.size(); i++)
-			delete m_aabms[i];
-	}
-
-	// Find out how many objects the given block and its neighbours contain.
-	// Returns the number of objects in the block, and also in 'wider' the
-	// number of objects in the block and all its neighbours. The latter
-	// may an estimate if any neighbours are unloaded.
-	u32 countObjects(MapBlock *block, ServerMap * map, u32 &wider)
-	{
-		wider = 0;
-		u32 wider_unknown_count = 0;
-		for(s16 x=-1; x<=1; x++)
-			for(s16 y=-1; y<=1; y++)
-				for(s16 z=-1; z<=1; z++)
-				{
-					MapBlock *block2 = map->getBlockNoCreateNoEx(
-						block->getPos() + v3s16(x,y,z));
-					if(block2==NULL){
-						wider_unknown_count++;
-						continue;
-					}
-					wider += block2->m_static_objects.m_active.size()
-						+ block2->m_static_objects.m_stored.size();
-				}
-		// Extrapolate
-		u32 active_object_count = block->m_static_objects.m_active.size();
-		u32 wider_known_count = 3*3*3 - wider_unknown_count;
-		wider += wider_unknown_count * wider / wider_known_count;
-		return active_object_count;
-
-	}
-	void apply(MapBlock *block)
-	{
-		if(m_aabms.empty() || block->isDummy())
-			return;
-
-		ServerMap *map = &m_env->getServerMap();
-
-		u32 active_object_count_wider;
-		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
-		m_env->m_added_objects = 0;
-
-		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-		{
-			const MapNode &n = block->getNodeUnsafe(p0);
-			content_t c = n.getContent();
-
-			if (c >= m_aabms.size() || !m_aabms[c])
-				continue;
-
-			v3s16 p = p0 + block->getPosRelative();
-			for(std::vector<ActiveABM>::iterator
-				i = m_aabms[c]->begin(); i != m_aabms[c]->end(); ++i) {
-				if(myrand() % i->chance != 0)
-					continue;
-
-				// Check neighbors
-				if(!i->required_neighbors.empty())
-				{
-					v3s16 p1;
-					for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
-					for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
-					for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
-					{
-						if(p1 == p0)
-							continue;
-						content_t c;
-						if (block->isValidPosition(p1)) {
-							// if the neighbor is found on the same map block
-							// get it straight from there
-							const MapNode &n = block->getNodeUnsafe(p1);
-							c = n.getContent();
-						} else {
-							// otherwise consult the map
-							MapNode n = map->getNodeNoEx(p1 + block->getPosRelative());
-							c = n.getContent();
-						}
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
-							goto neighbor_found;
-						}
-					}
-					// No required neighbor found
-					continue;
-				}
-				neighbor_found:
-
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-					active_object_count, active_object_count_wider);
-
-				// Count surrounding objects again if the abms added any
-				if(m_env->m_added_objects > 0) {
-					active_object_count = countObjects(block, map, active_object_count_wider);
-					m_env->m_added_objects = 0;
-				}
-			}
-		}
-	}
-};
-
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
 	// Reset usage timer immediately, otherwise a block that becomes active
@@ -904,13 +849,60 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	}
 
 	/* Handle ActiveBlockModifiers */
-	ABMHandler abmhandler(m_abms, dtime_s, this, false);
+	compileABMs();
+	ABMHandler abmhandler(m_abms, m_abm_lookup, dtime_s, this, false);
 	abmhandler.apply(block);
 }
 
 void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
 {
 	m_abms.push_back(ABMWithState(abm));
+	m_abms_compiled = false;
+}
+
+void ServerEnvironment::compileABMs()
+{
+	if (m_abms_compiled)
+		return;
+	m_abms_compiled = true;
+
+	INodeDefManager *ndef = m_server->ndef();
+	m_abm_lookup.clear();
+	for (u32 k = 0; k < m_abms.size(); k++) {
+		ABMWithState &abm = m_abms[k];
+
+		// Required neighbors, as a bitset over content ids
+		std::set<content_t> neighbor_ids;
+		const std::set<std::string> &required_neighbors_s =
+			abm.abm->getRequiredNeighbors();
+		for (std::set<std::string>::const_iterator
+				rn = required_neighbors_s.begin();
+				rn != required_neighbors_s.end(); ++rn)
+			ndef->getIds(*rn, neighbor_ids);
+
+		abm.required_neighbors.clear();
+		if (!neighbor_ids.empty()) {
+			abm.required_neighbors.resize(*neighbor_ids.rbegin() + 1, false);
+			for (std::set<content_t>::const_iterator c = neighbor_ids.begin();
+					c != neighbor_ids.end(); ++c)
+				abm.required_neighbors[*c] = true;
+		}
+
+		// Trigger contents
+		std::set<content_t> trigger_ids;
+		const std::set<std::string> &contents_s = abm.abm->getTriggerContents();
+		for (std::set<std::string>::const_iterator cs = contents_s.begin();
+				cs != contents_s.end(); ++cs)
+			ndef->getIds(*cs, trigger_ids);
+
+		abm.trigger_contents.assign(trigger_ids.begin(), trigger_ids.end());
+		for (std::set<content_t>::const_iterator c = trigger_ids.begin();
+				c != trigger_ids.end(); ++c) {
+			if (*c >= m_abm_lookup.size())
+				m_abm_lookup.resize(*c + 256);
+			m_abm_lookup[*c].push_back(k);
+		}
+	}
 }
 
 void ServerEnvironment::addLoadingBlockModifierDef(LoadingBlockModifierDef *lbm)
@@ -984,14 +976,40 @@ bool ServerEnvironment::swapNode(v3s16 p, const MapNode &n)
 void ServerEnvironment::getObjectsInsideRadius(std::vector<u16> &objects, v3f pos,
 	float radius)
 {
-	for (ServerActiveObjectMap::iterator i = m_active_objects.begin();
-		i != m_active_objects.end(); ++i) {
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
+	ScopeProfiler sp(g_profiler, "SEnv: objects inside radius avg", SPT_AVG);
+
+	std::vector<u16> candidates;
+	m_active_object_grid.getObjectsInArea(candidates,
+		aabb3f(pos - v3f(radius), pos + v3f(radius)));
+	g_profiler->avg("SEnv: objects inside radius candidates",
+		candidates.size());
+
+	for (std::vector<u16>::iterator i = candidates.begin();
+		i != candidates.end(); ++i) {
+		ServerActiveObject *obj = getActiveObject(*i);
+		if (!obj)
+			continue;
 		v3f objectpos = obj->getBasePosition();
 		if (objectpos.getDistanceFrom(pos) > radius)
 			continue;
-		objects.push_back(id);
+		objects.push_back(*i);
+	}
+}
+
+void ServerEnvironment::getObjectsInArea(std::vector<u16> &objects,
+	const aabb3f &box)
+{
+	ScopeProfiler sp(g_profiler, "SEnv: objects in area avg", SPT_AVG);
+
+	std::vector<u16> candidates;
+	m_active_object_grid.getObjectsInArea(candidates, box);
+
+	for (std::vector<u16>::iterator i = candidates.begin();
+		i != candidates.end(); ++i) {
+		ServerActiveObject *obj = getActiveObject(*i);
+		if (!obj || !box.isPointInside(obj->getBasePosition()))
+			continue;
+		objects.push_back(*i);
 	}
 }
 
@@ -1039,6 +1057,7 @@ void ServerEnvironment::clearObjects(ClearObjectsMode mode)
 	for (std::vector<u16>::iterator i = objects_to_remove.begin();
 		i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 
 	// Get list of loaded blocks
@@ -1325,26 +1344,54 @@ void ServerEnvironment::step(float dtime)
 			TimeTaker timer("modify in active blocks per interval");
 
 			// Initialize handling of ActiveBlockModifiers
-			ABMHandler abmhandler(m_abms, m_cache_abm_interval, this, true);
+			compileABMs();
+			ABMHandler abmhandler(m_abms, m_abm_lookup,
+				m_cache_abm_interval, this, true);
+
+			if (m_abm_scan_pool) {
+				/*
+					Scan the blocks on the pool, then run the triggers
+					on this thread in block order
+				*/
+				std::vector<ABMBlockScan> scans;
+				scans.reserve(m_active_blocks.m_list.size());
+				for (std::set<v3s16>::iterator
+						i = m_active_blocks.m_list.begin();
+						i != m_active_blocks.m_list.end(); ++i) {
+					MapBlock *block = m_map->getBlockNoCreateNoEx(*i);
+					if (block == NULL)
+						continue;
 
-			for(std::set<v3s16>::iterator
-				i = m_active_blocks.m_list.begin();
-				i != m_active_blocks.m_list.end(); ++i)
-			{
-				v3s16 p = *i;
+					// Set current time as timestamp
+					block->setTimestampNoChangedFlag(m_game_time);
 
-				/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-						<<") being handled"<<std::endl;*/
+					scans.push_back(ABMBlockScan());
+					if (!abmhandler.prepare(block, scans.back()))
+						scans.pop_back();
+				}
 
-				MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-				if(block == NULL)
-					continue;
+				{
+					ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg", SPT_AVG);
+					m_abm_scan_pool->scan(abmhandler, scans);
+				}
 
-				// Set current time as timestamp
-				block->setTimestampNoChangedFlag(m_game_time);
+				for (std::vector<ABMBlockScan>::const_iterator
+						i = scans.begin(); i != scans.end(); ++i)
+					abmhandler.run(*i);
+			} else {
+				for (std::set<v3s16>::iterator
+						i = m_active_blocks.m_list.begin();
+						i != m_active_blocks.m_list.end(); ++i) {
+					MapBlock *block = m_map->getBlockNoCreateNoEx(*i);
+					if (block == NULL)
+						continue;
+
+					// Set current time as timestamp
+					block->setTimestampNoChangedFlag(m_game_time);
 
-				/* Handle ActiveBlockModifiers */
-				abmhandler.apply(block);
+					/* Handle ActiveBlockModifiers */
+					abmhandler.apply(block);
+				}
 			}
 
 			u32 time_ms = timer.stop(true);
@@ -1525,18 +1572,32 @@ void ServerEnvironment::getAddedActiveObjects(PlayerSAO *playersao, s16 radius,
 	if (player_radius_f < 0)
 		player_radius_f = 0;
 	/*
-		Go through the object list,
+		Go through the objects near the player and the player list,
 		- discard m_removed objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for (ServerActiveObjectMap::iterator i = m_active_objects.begin();
-		i != m_active_objects.end(); ++i) {
-		u16 id = i->first;
+	v3f pos = playersao->getBasePosition();
+	std::vector<u16> objects;
+	m_active_object_grid.getObjectsInArea(objects,
+		aabb3f(pos - v3f(radius_f), pos + v3f(radius_f)));
+
+	// Players have their own radius (0 = unlimited), so they are
+	// taken from the player list instead of the grid query
+	size_t grid_count = objects.size();
+	for (std::vector<RemotePlayer *>::iterator i = m_players.begin();
+		i != m_players.end(); ++i) {
+		PlayerSAO *sao = (*i)->getPlayerSAO();
+		if (sao && sao->getId() != 0)
+			objects.push_back(sao->getId());
+	}
+
+	for (size_t i = 0; i < objects.size(); i++) {
+		u16 id = objects[i];
 
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if (object == NULL)
 			continue;
 
@@ -1544,9 +1605,10 @@ void ServerEnvironment::getAddedActiveObjects(PlayerSAO *playersao, s16 radius,
 		if(object->m_removed || object->m_pending_deactivation)
 			continue;
 
-		f32 distance_f = object->getBasePosition().
-			getDistanceFrom(playersao->getBasePosition());
+		f32 distance_f = object->getBasePosition().getDistanceFrom(pos);
 		if (object->getType() == ACTIVEOBJECT_TYPE_PLAYER) {
+			if (i < grid_count)
+				continue;
 			// Discard if too far
 			if (distance_f > player_radius_f && player_radius_f != 0)
 				continue;
@@ -1731,6 +1793,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 
 	m_active_objects[object->getId()] = object;
+	m_active_object_grid.insert(object->getId(), object->getBasePosition());
 
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 		<<"Added id="<<object->getId()<<"; there are now "
@@ -1857,6 +1920,7 @@ void ServerEnvironment::removeRemovedObjects()
 	for(std::vector<u16>::iterator i = objects_to_remove.begin();
 		i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 }
 
@@ -2222,6 +2286,7 @@ void ServerEnvironment::deactivateFarObjects(bool _force_delete)
 	for(std::vector<u16>::iterator i = objects_to_remove.begin();
 		i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 }
 
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapnode.h"
 #include "mapblock.h"
 #include <set>
+#include <unordered_map>
 
 class IGameDef;
 class ServerMap;
@@ -36,6 +37,7 @@ class ActiveBlockModifier;
 class ServerActiveObject;
 class Server;
 class ServerScripting;
+class ABMScanPool;
 
 /*
 	{Active, Loading} block modifier interface.
@@ -72,6 +74,11 @@ struct ABMWithState
 	ActiveBlockModifier *abm;
 	float timer = 0.0f;
 
+	// Resolved once by ServerEnvironment::compileABMs()
+	std::vector<content_t> trigger_contents;
+	// Indexed by content_t; empty = do not check neighbors
+	std::vector<bool> required_neighbors;
+
 	ABMWithState(ActiveBlockModifier *abm_);
 };
 
@@ -169,6 +176,40 @@ class ActiveBlockList
 private:
 };
 
+/*
+	Spatial index of active objects, used by ServerEnvironment.
+
+	Objects are bucketed by the MapBlock their base position lies in,
+	so that area queries only look at the objects of nearby blocks
+	instead of walking every active object.
+*/
+
+class ActiveObjectGrid
+{
+public:
+	void insert(u16 id, v3f pos);
+	void remove(u16 id);
+	// Moves the object to another bucket if it crossed a block border.
+	// Objects that were never inserted are ignored.
+	void update(u16 id, v3f pos);
+
+	// Appends the ids of all objects in the blocks touched by box.
+	// The result is a superset, callers have to check exact positions.
+	void getObjectsInArea(std::vector<u16> &objects, const aabb3f &box) const;
+
+	void clear()
+	{
+		m_blocks.clear();
+		m_object_blocks.clear();
+	}
+
+	u32 size() const { return m_object_blocks.size(); }
+
+private:
+	std::unordered_map<v3s16, std::vector<u16>> m_blocks;
+	std::unordered_map<u16, v3s16> m_object_blocks;
+};
+
 /*
 	Operation mode for ServerEnvironment::clearObjects()
 */
@@ -316,6 +357,14 @@ class ServerEnvironment : public Environment
 	// Find all active objects inside a radius around a point
 	void getObjectsInsideRadius(std::vector<u16> &objects, v3f pos, float radius);
 
+	// Find all active objects whose base position is inside box
+	void getObjectsInArea(std::vector<u16> &objects, const aabb3f &box);
+
+	// Called by ServerActiveObject::setBasePosition to keep
+	// the spatial index of active objects up to date
+	void updateActiveObjectPosition(u16 id, v3f pos)
+	{ m_active_object_grid.update(id, pos); }
+
 	// Clear objects, loading and going through every MapBlock
 	void clearObjects(ClearObjectsMode mode);
 
@@ -384,6 +433,12 @@ class ServerEnvironment : public Environment
 	*/
 	void deactivateFarObjects(bool force_delete);
 
+	/*
+		Resolve the node names of the ABMs to content ids and build
+		m_abm_lookup. Does nothing if nothing changed since the last call.
+	*/
+	void compileABMs();
+
 	/*
 		Member variables
 	*/
@@ -398,6 +453,8 @@ class ServerEnvironment : public Environment
 	const std::string m_path_world;
 	// Active object list
 	ServerActiveObjectMap m_active_objects;
+	// Active objects bucketed by MapBlock, for area queries
+	ActiveObjectGrid m_active_object_grid;
 	// Outgoing network message buffer for active objects
 	std::queue<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -419,6 +476,12 @@ class ServerEnvironment : public Environment
 	u32 m_last_clear_objects_time = 0;
 	// Active block modifiers
 	std::vector<ABMWithState> m_abms;
+	// Indices into m_abms by trigger content, in registration order
+	std::vector<std::vector<u32> > m_abm_lookup;
+	bool m_abms_compiled = false;
+	// Threads scanning active blocks for ABM triggers, NULL if the
+	// server thread scans them alone
+	ABMScanPool *m_abm_scan_pool = nullptr;
 	LBMManager m_lbm_mgr;
 	// An interval for generally sending object positions and stuff
 	float m_recommended_send_interval = 0.1f;
@@ -527,6 +527,141 @@ int UDPSocket::Receive(Address & sender, void *data, int size)
 	return received;
 }
 
+/*
+	Batched I/O: Linux can send and receive several datagrams in a system
+	call. Elsewhere, and when packets are printed or dropped for debugging,
+	the batches go through Send() and Receive().
+*/
+
+#ifdef __linux__
+union SocketAddress
+{
+	struct sockaddr_in ipv4;
+	struct sockaddr_in6 ipv6;
+};
+#endif
+
+int UDPSocket::SendBatch(const UDPDatagram *datagrams, int count)
+{
+	int failed = 0;
+
+#ifdef __linux__
+	if (!INTERNET_SIMULATOR && !socket_enable_debug_output) {
+		struct mmsghdr msgs[UDP_BATCH_SIZE];
+		struct iovec iovecs[UDP_BATCH_SIZE];
+		SocketAddress addresses[UDP_BATCH_SIZE];
+
+		int i = 0;
+		while (i < count) {
+			int n = 0;
+			for (; i < count && n < UDP_BATCH_SIZE; i++) {
+				const UDPDatagram &datagram = datagrams[i];
+				if (datagram.address.getFamily() != m_addr_family) {
+					failed++;
+					continue;
+				}
+
+				memset(&msgs[n], 0, sizeof(msgs[n]));
+				if (m_addr_family == AF_INET6) {
+					addresses[n].ipv6 = datagram.address.getAddress6();
+					addresses[n].ipv6.sin6_port = htons(datagram.address.getPort());
+					msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+				} else {
+					addresses[n].ipv4 = datagram.address.getAddress();
+					addresses[n].ipv4.sin_port = htons(datagram.address.getPort());
+					msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+				}
+				msgs[n].msg_hdr.msg_name = &addresses[n];
+				iovecs[n].iov_base = datagram.data;
+				iovecs[n].iov_len = datagram.size;
+				msgs[n].msg_hdr.msg_iov = &iovecs[n];
+				msgs[n].msg_hdr.msg_iovlen = 1;
+				n++;
+			}
+
+			int sent = 0;
+			while (sent < n) {
+				int result = sendmmsg(m_handle, &msgs[sent], n - sent, 0);
+				if (result < 0) {
+					if (errno == EINTR)
+						continue;
+					// The first datagram failed, go on with the next one
+					failed++;
+					sent++;
+				} else {
+					sent += result;
+				}
+			}
+		}
+		return failed;
+	}
+#endif
+
+	for (int i = 0; i < count; i++) {
+		try {
+			Send(datagrams[i].address, datagrams[i].data, datagrams[i].size);
+		} catch (SendFailedException &e) {
+			failed++;
+		}
+	}
+	return failed;
+}
+
+int UDPSocket::ReceiveBatch(UDPDatagram *datagrams, int count)
+{
+	if (count <= 0)
+		return 0;
+
+#ifdef __linux__
+	if (!socket_enable_debug_output) {
+		// Return on timeout
+		if (WaitData(m_timeout_ms) == false)
+			return 0;
+
+		struct mmsghdr msgs[UDP_BATCH_SIZE];
+		struct iovec iovecs[UDP_BATCH_SIZE];
+		SocketAddress addresses[UDP_BATCH_SIZE];
+
+		count = MYMIN(count, UDP_BATCH_SIZE);
+		memset(msgs, 0, sizeof(msgs[0]) * count);
+		for (int i = 0; i < count; i++) {
+			iovecs[i].iov_base = datagrams[i].data;
+			iovecs[i].iov_len = datagrams[i].size;
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int received = recvmmsg(m_handle, msgs, count, MSG_DONTWAIT, NULL);
+		if (received <= 0)
+			return 0;
+
+		for (int i = 0; i < received; i++) {
+			datagrams[i].size = msgs[i].msg_len;
+			if (m_addr_family == AF_INET6) {
+				IPv6AddressBytes bytes;
+				memcpy(bytes.bytes, addresses[i].ipv6.sin6_addr.s6_addr, 16);
+				datagrams[i].address = Address(&bytes,
+					ntohs(addresses[i].ipv6.sin6_port));
+			} else {
+				datagrams[i].address = Address(
+					ntohl(addresses[i].ipv4.sin_addr.s_addr),
+					ntohs(addresses[i].ipv4.sin_port));
+			}
+		}
+		return received;
+	}
+#endif
+
+	int received = Receive(datagrams[0].address, datagrams[0].data,
+		datagrams[0].size);
+	if (received < 0)
+		return 0;
+	datagrams[0].size = received;
+	return 1;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
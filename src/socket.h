@@ -109,6 +109,20 @@ class Address
 	u16 m_port = 0; // Port is separate from sockaddr structures
 };
 
+// Max. number of datagrams passed to the system at once by a batch
+#define UDP_BATCH_SIZE 64
+
+/*
+	A datagram of UDPSocket::SendBatch() or UDPSocket::ReceiveBatch()
+*/
+struct UDPDatagram
+{
+	Address address;
+	u8 *data = nullptr;
+	// Size of the data; size of the buffer when receiving
+	int size = 0;
+};
+
 class UDPSocket
 {
 public:
@@ -124,6 +138,12 @@ class UDPSocket
 	void Send(const Address & destination, const void * data, int size);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	// Sends the datagrams in as few system calls as possible.
+	// Returns the number of datagrams that could not be sent.
+	int SendBatch(const UDPDatagram *datagrams, int count);
+	// Receives up to count datagrams, sets their size and sender.
+	// Returns the number of datagrams received, 0 if there is no data.
+	int ReceiveBatch(UDPDatagram *datagrams, int count);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
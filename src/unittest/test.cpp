@@ -22,6 +22,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h"
 #include "itemdef.h"
 #include "gamedef.h"
+#include "mapblock.h"
+#include "mapsector.h"
 #include "mods.h"
 
 content_t t_CONTENT_STONE;
@@ -313,6 +315,46 @@ std::string TestBase::getTestTempFile()
 	return getTestTempDirectory() + DIR_DELIM + buf + ".tmp";
 }
 
+////
+//// TestMapBase
+////
+
+TestMapBase::TestMapBase(IGameDef *gamedef) :
+	Map(dstream, gamedef)
+{
+}
+
+TestMapBase::TestMapBase(IGameDef *gamedef, const VoxelArea &blocks_,
+		MapNode n) :
+	Map(dstream, gamedef),
+	blocks(blocks_)
+{
+	for (s16 z = blocks.MinEdge.Z; z <= blocks.MaxEdge.Z; z++)
+	for (s16 y = blocks.MinEdge.Y; y <= blocks.MaxEdge.Y; y++)
+	for (s16 x = blocks.MinEdge.X; x <= blocks.MaxEdge.X; x++) {
+		MapBlock *block = createBlock(v3s16(x, y, z));
+		for (u32 i = 0; i < MapBlock::nodecount; i++)
+			block->getData()[i] = n;
+	}
+}
+
+MapBlock *TestMapBase::createBlock(v3s16 p)
+{
+	v2s16 p2d(p.X, p.Z);
+	MapSector *sector = getSectorNoGenerateNoEx(p2d);
+	if (!sector) {
+		sector = new ServerMapSector(this, p2d, m_gamedef);
+		m_sectors[p2d] = sector;
+	}
+	return sector->createBlankBlock(p.Y);
+}
+
+VoxelArea TestMapBase::getNodeArea() const
+{
+	return VoxelArea(blocks.MinEdge * MAP_BLOCKSIZE,
+		(blocks.MaxEdge + v3s16(1, 1, 1)) * MAP_BLOCKSIZE - v3s16(1, 1, 1));
+}
+
 
 /*
 	NOTE: These tests became non-working then NodeContainer was removed.
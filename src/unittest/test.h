@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes_extrabloated.h"
 #include "porting.h"
 #include "filesys.h"
+#include "map.h"
 #include "mapnode.h"
 
 class TestFailedException : public std::exception {
@@ -142,6 +143,22 @@ extern content_t t_CONTENT_WATER;
 extern content_t t_CONTENT_LAVA;
 extern content_t t_CONTENT_BRICK;
 
+// A plain Map for the tests, that blank blocks can be added to directly
+class TestMapBase : public Map {
+public:
+	TestMapBase(IGameDef *gamedef);
+	// Fills the area of blocks with blank blocks full of node n
+	TestMapBase(IGameDef *gamedef, const VoxelArea &blocks_, MapNode n);
+
+	MapBlock *createBlock(v3s16 p);
+
+	// The nodes of the blocks the map was filled with
+	VoxelArea getNodeArea() const;
+
+	// The blocks the map was filled with, in block coordinates
+	VoxelArea blocks;
+};
+
 bool run_tests();
 
 #endif
@@ -0,0 +1,190 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "abmscan.h"
+#include "mapblock.h"
+#include "noise.h"
+#include "serverenvironment.h"
+
+// An ABM that is never run, only its trigger settings are used
+class TestABM : public ActiveBlockModifier {
+public:
+	TestABM(u32 chance) : m_chance(chance) {}
+
+	const std::set<std::string> &getTriggerContents() const
+	{ return m_empty; }
+	const std::set<std::string> &getRequiredNeighbors() const
+	{ return m_empty; }
+	float getTriggerInterval() { return 1.0f; }
+	u32 getTriggerChance() { return m_chance; }
+	bool getSimpleCatchUp() { return false; }
+
+private:
+	u32 m_chance;
+	std::set<std::string> m_empty;
+};
+
+class TestABMScan : public TestBase {
+public:
+	TestABMScan() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestABMScan"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testParallelScan(IGameDef *gamedef);
+
+	static void addABM(std::vector<ABMWithState> &abms,
+		std::vector<std::vector<u32> > &abm_lookup, ActiveBlockModifier *abm,
+		const std::vector<content_t> &trigger_contents,
+		const std::vector<content_t> &required_neighbors);
+	static u32 scanBlocks(const ABMHandler &handler, u16 num_threads,
+		std::vector<ABMBlockScan> &scans);
+};
+
+static TestABMScan g_test_instance;
+
+void TestABMScan::runTests(IGameDef *gamedef)
+{
+	TEST(testParallelScan, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestABMScan::addABM(std::vector<ABMWithState> &abms,
+	std::vector<std::vector<u32> > &abm_lookup, ActiveBlockModifier *abm,
+	const std::vector<content_t> &trigger_contents,
+	const std::vector<content_t> &required_neighbors)
+{
+	// Resolved by hand, ServerEnvironment::compileABMs() needs a server
+	u32 id = abms.size();
+	abms.push_back(ABMWithState(abm));
+	ABMWithState &abm_state = abms.back();
+
+	abm_state.trigger_contents = trigger_contents;
+	for (size_t i = 0; i < trigger_contents.size(); i++) {
+		content_t c = trigger_contents[i];
+		if (c >= abm_lookup.size())
+			abm_lookup.resize(c + 256);
+		abm_lookup[c].push_back(id);
+	}
+
+	for (size_t i = 0; i < required_neighbors.size(); i++) {
+		content_t c = required_neighbors[i];
+		if (c >= abm_state.required_neighbors.size())
+			abm_state.required_neighbors.resize(c + 1, false);
+		abm_state.required_neighbors[c] = true;
+	}
+}
+
+// Scans all blocks of the map, returns the total number of triggers
+u32 TestABMScan::scanBlocks(const ABMHandler &handler, u16 num_threads,
+	std::vector<ABMBlockScan> &scans)
+{
+	ABMScanPool pool(num_threads);
+	pool.scan(handler, scans);
+
+	u32 num_triggers = 0;
+	for (size_t i = 0; i < scans.size(); i++)
+		num_triggers += scans[i].triggers.size();
+	return num_triggers;
+}
+
+void TestABMScan::testParallelScan(IGameDef *gamedef)
+{
+	const VoxelArea blocks(v3s16(-2, -2, -2), v3s16(2, 2, 2));
+	TestMapBase map(gamedef, blocks, MapNode(t_CONTENT_STONE));
+
+	// Scatter grass, water and brick through the stone
+	PcgRandom pr(1234);
+	const VoxelArea nodes = map.getNodeArea();
+	for (u32 i = 0; i < 3000; i++) {
+		v3s16 p(pr.range(nodes.MinEdge.X, nodes.MaxEdge.X),
+			pr.range(nodes.MinEdge.Y, nodes.MaxEdge.Y),
+			pr.range(nodes.MinEdge.Z, nodes.MaxEdge.Z));
+		const content_t contents[] =
+			{t_CONTENT_GRASS, t_CONTENT_WATER, t_CONTENT_BRICK};
+		MapNode n(contents[i % 3]);
+		map.setNode(p, n);
+	}
+
+	TestABM abm_grass(3);
+	TestABM abm_stone_by_water(2);
+	TestABM abm_by_brick(1);
+
+	std::vector<ABMWithState> abms;
+	std::vector<std::vector<u32> > abm_lookup;
+	addABM(abms, abm_lookup, &abm_grass,
+		std::vector<content_t>(1, t_CONTENT_GRASS),
+		std::vector<content_t>());
+	addABM(abms, abm_lookup, &abm_stone_by_water,
+		std::vector<content_t>(1, t_CONTENT_STONE),
+		std::vector<content_t>(1, t_CONTENT_WATER));
+	std::vector<content_t> stone_and_grass;
+	stone_and_grass.push_back(t_CONTENT_STONE);
+	stone_and_grass.push_back(t_CONTENT_GRASS);
+	addABM(abms, abm_lookup, &abm_by_brick, stone_and_grass,
+		std::vector<content_t>(1, t_CONTENT_BRICK));
+
+	// The handler is only used to scan, it never needs the environment
+	ABMHandler handler(abms, abm_lookup, 1.0f, NULL, false);
+
+	std::vector<ABMBlockScan> serial_scans;
+	for (s16 z = blocks.MinEdge.Z; z <= blocks.MaxEdge.Z; z++)
+	for (s16 y = blocks.MinEdge.Y; y <= blocks.MaxEdge.Y; y++)
+	for (s16 x = blocks.MinEdge.X; x <= blocks.MaxEdge.X; x++) {
+		MapBlock *block = map.getBlockNoCreateNoEx(v3s16(x, y, z));
+		UASSERT(block != NULL);
+		serial_scans.push_back(ABMBlockScan());
+		UASSERT(handler.prepare(block, serial_scans.back()));
+	}
+	UASSERTEQ(size_t, serial_scans.size(), (size_t)blocks.getVolume());
+
+	// Same blocks and seeds, so both scans must roll the same chances
+	std::vector<ABMBlockScan> parallel_scans = serial_scans;
+
+	u32 serial_triggers = scanBlocks(handler, 1, serial_scans);
+	u32 parallel_triggers = scanBlocks(handler, 4, parallel_scans);
+
+	UASSERT(serial_triggers > 0);
+	UASSERTEQ(u32, parallel_triggers, serial_triggers);
+
+	u32 triggers_per_abm[3] = {0, 0, 0};
+	for (size_t i = 0; i < serial_scans.size(); i++) {
+		const ABMBlockScan &serial = serial_scans[i];
+		const ABMBlockScan &parallel = parallel_scans[i];
+		UASSERT(parallel.blockpos == serial.blockpos);
+		UASSERTEQ(size_t, parallel.triggers.size(), serial.triggers.size());
+
+		for (size_t k = 0; k < serial.triggers.size(); k++) {
+			const ABMTrigger &t = serial.triggers[k];
+			UASSERTEQ(u32, parallel.triggers[k].abm_id, t.abm_id);
+			UASSERT(parallel.triggers[k].p0 == t.p0);
+			UASSERTEQ(content_t, parallel.triggers[k].n.getContent(),
+				t.n.getContent());
+			triggers_per_abm[t.abm_id]++;
+		}
+	}
+
+	// Every ABM must have triggered, or the neighbor checks went untested
+	UASSERT(triggers_per_abm[0] > 0);
+	UASSERT(triggers_per_abm[1] > 0);
+	UASSERT(triggers_per_abm[2] > 0);
+}
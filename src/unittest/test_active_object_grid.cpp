@@ -0,0 +1,156 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <algorithm>
+#include "serverenvironment.h"
+#include "util/basic_macros.h"
+
+class TestActiveObjectGrid : public TestBase {
+public:
+	TestActiveObjectGrid() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestActiveObjectGrid"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testInsertRemove();
+	void testUpdate();
+	void testHugeArea();
+	void testBeyondMapEdge();
+};
+
+static TestActiveObjectGrid g_test_instance;
+
+void TestActiveObjectGrid::runTests(IGameDef *gamedef)
+{
+	TEST(testInsertRemove);
+	TEST(testUpdate);
+	TEST(testHugeArea);
+	TEST(testBeyondMapEdge);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static aabb3f radius_box(v3f pos, float radius)
+{
+	return aabb3f(pos - v3f(radius), pos + v3f(radius));
+}
+
+static bool contains(const std::vector<u16> &objects, u16 id)
+{
+	return std::find(objects.begin(), objects.end(), id) != objects.end();
+}
+
+void TestActiveObjectGrid::testInsertRemove()
+{
+	ActiveObjectGrid grid;
+	grid.insert(1, v3f(0, 0, 0));
+	grid.insert(2, v3f(5 * BS, 0, 0));
+	grid.insert(3, v3f(100 * BS, 0, 0));
+	UASSERTEQ(u32, grid.size(), 3);
+
+	std::vector<u16> objects;
+	grid.getObjectsInArea(objects, radius_box(v3f(0, 0, 0), 10 * BS));
+	UASSERT(contains(objects, 1));
+	UASSERT(contains(objects, 2));
+	UASSERT(!contains(objects, 3));
+
+	grid.remove(2);
+	grid.remove(2);
+	UASSERTEQ(u32, grid.size(), 2);
+	objects.clear();
+	grid.getObjectsInArea(objects, radius_box(v3f(0, 0, 0), 10 * BS));
+	UASSERT(contains(objects, 1));
+	UASSERT(!contains(objects, 2));
+
+	grid.clear();
+	UASSERTEQ(u32, grid.size(), 0);
+	objects.clear();
+	grid.getObjectsInArea(objects, radius_box(v3f(0, 0, 0), 10 * BS));
+	UASSERT(objects.empty());
+}
+
+void TestActiveObjectGrid::testUpdate()
+{
+	ActiveObjectGrid grid;
+	grid.insert(1, v3f(0, 0, 0));
+
+	grid.update(1, v3f(200 * BS, 0, 0));
+	std::vector<u16> objects;
+	grid.getObjectsInArea(objects, radius_box(v3f(0, 0, 0), 10 * BS));
+	UASSERT(!contains(objects, 1));
+	grid.getObjectsInArea(objects, radius_box(v3f(200 * BS, 0, 0), BS));
+	UASSERT(contains(objects, 1));
+
+	// Objects that were never inserted are ignored
+	grid.update(2, v3f(0, 0, 0));
+	UASSERTEQ(u32, grid.size(), 1);
+}
+
+void TestActiveObjectGrid::testHugeArea()
+{
+	ActiveObjectGrid grid;
+	grid.insert(1, v3f(0, 0, 0));
+	grid.insert(2, v3f(-30000 * BS, 100 * BS, 30000 * BS));
+	grid.insert(3, v3f(12345 * BS, -20000 * BS, 7 * BS));
+
+	// Mods ask for every object with a radius far beyond the map, like
+	// minetest.get_objects_inside_radius(pos, 1e5)
+	const float radii[] = {1e5f * BS, 1e9f * BS, 1e30f};
+	for (size_t i = 0; i < ARRLEN(radii); i++) {
+		std::vector<u16> objects;
+		grid.getObjectsInArea(objects, radius_box(v3f(0, 0, 0), radii[i]));
+		UASSERTEQ(size_t, objects.size(), 3);
+		UASSERT(contains(objects, 1));
+		UASSERT(contains(objects, 2));
+		UASSERT(contains(objects, 3));
+	}
+}
+
+void TestActiveObjectGrid::testBeyondMapEdge()
+{
+	ActiveObjectGrid grid;
+	grid.insert(1, v3f(1e7f * BS, 0, 0));
+	grid.insert(2, v3f(0, -1e9f, 0));
+	UASSERTEQ(u32, grid.size(), 2);
+
+	std::vector<u16> objects;
+	grid.getObjectsInArea(objects, radius_box(v3f(0, 0, 0), 1e10f));
+	UASSERT(contains(objects, 1));
+	UASSERT(contains(objects, 2));
+
+	// Queries reaching past the edge find them in the edge blocks
+	objects.clear();
+	grid.getObjectsInArea(objects,
+		radius_box(v3f(MAX_MAP_GENERATION_LIMIT * BS, 0, 0), 10 * BS));
+	UASSERT(contains(objects, 1));
+	UASSERT(!contains(objects, 2));
+
+	// Moving within the clamped area keeps the object found
+	grid.update(1, v3f(2e7f * BS, 0, 0));
+	objects.clear();
+	grid.getObjectsInArea(objects,
+		radius_box(v3f(MAX_MAP_GENERATION_LIMIT * BS, 0, 0), 10 * BS));
+	UASSERT(contains(objects, 1));
+
+	grid.remove(1);
+	grid.remove(2);
+	UASSERTEQ(u32, grid.size(), 0);
+}
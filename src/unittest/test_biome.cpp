@@ -0,0 +1,191 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "mg_biome.h"
+#include "noise.h"
+#include "porting.h"
+#include "util/numeric.h"
+
+class TestBiome : public TestBase {
+public:
+	TestBiome() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestBiome"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testBiomeLookup();
+	void testBiomeLookupBenchmark();
+
+	static Biome *makeBiome(std::vector<Biome *> *biomes,
+		float heat, float humidity, s16 y_min, s16 y_max);
+	static void freeBiomes(std::vector<Biome *> *biomes);
+};
+
+static TestBiome g_test_instance;
+
+void TestBiome::runTests(IGameDef *gamedef)
+{
+	TEST(testBiomeLookup);
+	TEST(testBiomeLookupBenchmark);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Biome *TestBiome::makeBiome(std::vector<Biome *> *biomes,
+	float heat, float humidity, s16 y_min, s16 y_max)
+{
+	Biome *b = new Biome;
+	b->index          = biomes->size();
+	b->heat_point     = heat;
+	b->humidity_point = humidity;
+	b->y_min          = y_min;
+	b->y_max          = y_max;
+	biomes->push_back(b);
+	return b;
+}
+
+void TestBiome::freeBiomes(std::vector<Biome *> *biomes)
+{
+	for (size_t i = 0; i < biomes->size(); i++)
+		delete (*biomes)[i];
+	biomes->clear();
+}
+
+void TestBiome::testBiomeLookup()
+{
+	PcgRandom pr(82341);
+	std::vector<Biome *> biomes;
+	BiomeLookup lookup;
+
+	// No biome at all
+	biomes.push_back(NULL);
+	lookup.update(biomes);
+	UASSERT(lookup.find(50, 50, 0) == NULL);
+
+	// Points on a lattice make many ties, the lowest index must win
+	for (int i = 0; i < 40; i++) {
+		makeBiome(&biomes, pr.range(0, 4) * 25, pr.range(0, 4) * 25,
+			pr.range(-200, 0), pr.range(0, 200));
+	}
+	biomes.push_back(NULL);
+	for (int i = 0; i < 40; i++) {
+		makeBiome(&biomes, pr.range(-500, 1500) / 10.0f,
+			pr.range(-500, 1500) / 10.0f, pr.range(-300, 100), pr.range(-100, 300));
+	}
+	makeBiome(&biomes, 50, 50, 1000, 500);
+	lookup.update(biomes);
+
+	for (int i = 0; i < 200000; i++) {
+		// Mostly around the biome points, sometimes far away
+		float heat, humidity;
+		if (i % 10 == 0) {
+			heat = pr.range(-100000, 100000) / 100.0f;
+			humidity = pr.range(-100000, 100000) / 100.0f;
+		} else if (i % 10 == 1) {
+			heat = pr.range(0, 4) * 25 + pr.range(-2, 2) * 12.5f;
+			humidity = pr.range(0, 4) * 25 + pr.range(-2, 2) * 12.5f;
+		} else {
+			heat = pr.range(-30000, 130000) / 1000.0f;
+			humidity = pr.range(-30000, 130000) / 1000.0f;
+		}
+		s16 y = pr.range(-350, 350);
+		if (i % 100 == 0)
+			y = pr.range(0, 1) ? S16_MIN : S16_MAX;
+
+		UASSERT(lookup.find(heat, humidity, y) ==
+			lookup.findLinear(heat, humidity, y));
+	}
+
+	freeBiomes(&biomes);
+}
+
+void TestBiome::testBiomeLookupBenchmark()
+{
+	PcgRandom pr(6538);
+	std::vector<Biome *> biomes;
+	BiomeLookup lookup;
+
+	// Laid out like the biomes of a large game: surface, shore and ocean
+	// variants of each climate, and a few underground biomes
+	biomes.push_back(NULL);
+	for (int i = 0; i < 19; i++) {
+		float heat = pr.range(0, 100);
+		float humidity = pr.range(0, 100);
+		makeBiome(&biomes, heat, humidity, 4, 31000);
+		makeBiome(&biomes, heat, humidity, -1, 3);
+		makeBiome(&biomes, heat, humidity, -112, -2);
+	}
+	for (int i = 0; i < 4; i++)
+		makeBiome(&biomes, pr.range(0, 100), pr.range(0, 100), -31000, -113);
+	lookup.update(biomes);
+
+	// Columns of chunks, with the default heat and humidity noises and
+	// ground from 100 nodes below to 100 nodes above water level
+	NoiseParams np_heat(50, 50, v3f(1000, 1000, 1000), 5349, 3, 0.5, 2.0);
+	NoiseParams np_heat_blend(0, 1.5, v3f(8, 8, 8), 13, 2, 1.0, 2.0);
+	NoiseParams np_humidity(50, 50, v3f(1000, 1000, 1000), 842, 3, 0.5, 2.0);
+	NoiseParams np_humidity_blend(0, 1.5, v3f(8, 8, 8), 90003, 2, 1.0, 2.0);
+	NoiseParams np_ground(0, 100, v3f(250, 250, 250), 82341, 5, 0.6, 2.0);
+	Noise noise_heat(&np_heat, 1337, 80, 80);
+	Noise noise_heat_blend(&np_heat_blend, 1337, 80, 80);
+	Noise noise_humidity(&np_humidity, 1337, 80, 80);
+	Noise noise_humidity_blend(&np_humidity_blend, 1337, 80, 80);
+	Noise noise_ground(&np_ground, 1337, 80, 80);
+
+	const int chunks = 200;
+	const int count = chunks * 80 * 80;
+	std::vector<float> heat(count), humidity(count);
+	std::vector<s16> y(count);
+	for (int c = 0; c < chunks; c++) {
+		float x = (c % 20) * 80;
+		float z = (c / 20) * 80;
+		noise_heat.perlinMap2D(x, z);
+		noise_heat_blend.perlinMap2D(x, z);
+		noise_humidity.perlinMap2D(x, z);
+		noise_humidity_blend.perlinMap2D(x, z);
+		noise_ground.perlinMap2D(x, z);
+		for (int i = 0; i < 80 * 80; i++) {
+			heat[c * 80 * 80 + i] = noise_heat.result[i] +
+				noise_heat_blend.result[i];
+			humidity[c * 80 * 80 + i] = noise_humidity.result[i] +
+				noise_humidity_blend.result[i];
+			y[c * 80 * 80 + i] = rangelim(noise_ground.result[i], -100, 100);
+		}
+	}
+
+	std::vector<Biome *> found(count), found_linear(count);
+	u64 t0 = porting::getTimeUs();
+	for (int i = 0; i < count; i++)
+		found_linear[i] = lookup.findLinear(heat[i], humidity[i], y[i]);
+	u64 t1 = porting::getTimeUs();
+	for (int i = 0; i < count; i++)
+		found[i] = lookup.find(heat[i], humidity[i], y[i]);
+	u64 t2 = porting::getTimeUs();
+
+	UASSERT(found == found_linear);
+
+	// Lookups per microsecond are Mlookups/s
+	infostream << "TestBiome: " << biomes.size() - 1 << " biomes: linear search: "
+		<< (double)count / MYMAX(t1 - t0, 1) << " Mlookups/s, lookup: "
+		<< (double)count / MYMAX(t2 - t1, 1) << " Mlookups/s" << std::endl;
+
+	freeBiomes(&biomes);
+}
@@ -0,0 +1,379 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "block_send_queue.h"
+#include "face_position_cache.h"
+#include "mapblock.h"
+#include "porting.h"
+#include "util/numeric.h"
+
+class TestBlockSendQueue : public TestBase {
+public:
+	TestBlockSendQueue() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestBlockSendQueue"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testOrder();
+	void testShellsAddedLazily();
+	void testShift();
+	void testPushAndDefer();
+	void testKeep();
+	void testBlockSendBenchmark();
+};
+
+static TestBlockSendQueue g_test_instance;
+
+void TestBlockSendQueue::runTests(IGameDef *gamedef)
+{
+	TEST(testOrder);
+	TEST(testShellsAddedLazily);
+	TEST(testShift);
+	TEST(testPushAndDefer);
+	TEST(testKeep);
+	TEST(testBlockSendBenchmark);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static s16 block_distance(v3s16 a, v3s16 b)
+{
+	v3s16 diff = a - b;
+	return MYMAX(MYMAX(abs(diff.X), abs(diff.Y)), abs(diff.Z));
+}
+
+void TestBlockSendQueue::testOrder()
+{
+	std::set<v3s16> sent;
+	BlockSendQueue queue(sent);
+	v3s16 center(10, -3, 7);
+	v3f camera_pos = intToFloat(center * MAP_BLOCKSIZE, BS);
+	queue.update(center, camera_pos, v3f(1, 0, 0), 1.5f, 3, 100);
+
+	v3s16 p;
+	s16 d;
+	s16 last_d = 0;
+	while (queue.pop(&p, &d)) {
+		UASSERTEQ(s16, d, block_distance(p, center));
+		UASSERT(d >= last_d);
+		// The position in front of the camera comes first in its shell
+		if (d == 1 && last_d == 0)
+			UASSERT(p == center + v3s16(1, 0, 0));
+		UASSERT(sent.insert(p).second);
+		last_d = d;
+	}
+	UASSERTEQ(size_t, sent.size(), 7 * 7 * 7);
+
+	// Sent positions are not queued again
+	queue.reset();
+	queue.update(center, camera_pos, v3f(1, 0, 0), 1.5f, 3, 100);
+	sent.erase(center + v3s16(0, 2, 0));
+	UASSERT(queue.pop(&p, &d));
+	UASSERT(p == center + v3s16(0, 2, 0));
+	UASSERT(!queue.pop(&p, &d));
+}
+
+void TestBlockSendQueue::testShellsAddedLazily()
+{
+	std::set<v3s16> sent;
+	BlockSendQueue queue(sent);
+	v3s16 p;
+	s16 d;
+
+	queue.update(v3s16(0, 0, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 1);
+	UASSERT(queue.pop(&p, &d));
+	UASSERT(p == v3s16(0, 0, 0));
+	UASSERT(!queue.pop(&p, &d));
+
+	// Positions of shells not added yet are added with them
+	queue.push(v3s16(0, 0, 3));
+	UASSERTEQ(size_t, queue.size(), 0);
+
+	queue.update(v3s16(0, 0, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 1);
+	UASSERT(queue.pop(&p, &d));
+	UASSERTEQ(s16, d, 1);
+	UASSERTEQ(size_t, queue.size(), 25);
+
+	// Moving before all shells were added starts over
+	queue.update(v3s16(0, 1, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 1);
+	UASSERTEQ(size_t, queue.size(), 0);
+	UASSERT(queue.pop(&p, &d));
+	UASSERT(p == v3s16(0, 1, 0));
+}
+
+void TestBlockSendQueue::testShift()
+{
+	std::set<v3s16> sent;
+	BlockSendQueue queue(sent);
+	v3s16 p;
+	s16 d;
+
+	queue.update(v3s16(0, 0, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 2, 3);
+	while (queue.pop(&p, &d))
+		sent.insert(p);
+
+	// Only the positions that came into range are added
+	queue.update(v3s16(1, 0, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 2, 0);
+	UASSERTEQ(size_t, queue.size(), 5 * 5);
+	while (queue.pop(&p, &d)) {
+		UASSERTEQ(s16, p.X, 3);
+		UASSERTEQ(s16, d, 2);
+	}
+
+	// Those that went out of range are dropped
+	sent.erase(v3s16(-1, 0, 0));
+	queue.push(v3s16(-1, 0, 0));
+	UASSERTEQ(size_t, queue.size(), 1);
+	queue.update(v3s16(2, 0, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 2, 0);
+	UASSERTEQ(size_t, queue.size(), 5 * 5);
+	while (queue.pop(&p, &d))
+		UASSERTEQ(s16, p.X, 4);
+}
+
+void TestBlockSendQueue::testPushAndDefer()
+{
+	std::set<v3s16> sent;
+	BlockSendQueue queue(sent);
+	v3s16 p;
+	s16 d;
+	v3f camera_pos = intToFloat(v3s16(8, 8, 8), BS);
+
+	queue.update(v3s16(0, 0, 0), camera_pos, v3f(0, 0, 1), 1.5f, 5, 10);
+	size_t deferred = 0;
+	while (queue.pop(&p, &d)) {
+		if (isBlockInSight(p, camera_pos, v3f(0, 0, 1), 1.5f,
+				5 * BS * MAP_BLOCKSIZE, NULL)) {
+			sent.insert(p);
+		} else {
+			queue.defer(p);
+			deferred++;
+		}
+	}
+	UASSERT(deferred > 0);
+	UASSERTEQ(size_t, queue.deferredCount(), deferred);
+
+	// A modified block is queued again, once
+	sent.erase(v3s16(1, 1, 1));
+	queue.push(v3s16(1, 1, 1));
+	queue.push(v3s16(1, 1, 1));
+	UASSERTEQ(size_t, queue.size(), 1);
+	UASSERT(queue.pop(&p, &d));
+	UASSERT(p == v3s16(1, 1, 1));
+	sent.insert(p);
+
+	// A small turn doesn't look at the positions put aside
+	v3f dir(0.05f, 0, 1);
+	dir.normalize();
+	queue.update(v3s16(0, 0, 0), camera_pos, dir, 1.5f, 5, 10);
+	UASSERT(!queue.pop(&p, &d));
+	UASSERTEQ(size_t, queue.deferredCount(), deferred);
+
+	// Turning around queues those that came into sight
+	queue.update(v3s16(0, 0, 0), camera_pos, v3f(0, 0, -1), 1.5f, 5, 10);
+	UASSERT(queue.deferredCount() < deferred);
+	size_t count = 0;
+	while (queue.pop(&p, &d)) {
+		UASSERT(isBlockInSight(p, camera_pos, v3f(0, 0, -1), 1.5f,
+			5 * BS * MAP_BLOCKSIZE, NULL));
+		count++;
+	}
+	UASSERTEQ(size_t, count, deferred - queue.deferredCount());
+}
+
+void TestBlockSendQueue::testKeep()
+{
+	std::set<v3s16> sent;
+	BlockSendQueue queue(sent);
+	v3s16 p;
+	s16 d;
+	// A block not sent from afar, e.g. an underground or a not generated one
+	v3s16 kept(0, 0, 4);
+
+	queue.update(v3s16(0, 0, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 10);
+	while (queue.pop(&p, &d)) {
+		if (p == kept)
+			queue.keep(p, 2);
+		else
+			sent.insert(p);
+	}
+	UASSERTEQ(size_t, queue.keptCount(), 1);
+	UASSERT(queue.isDone());
+
+	// Walking towards it queues it again once it is near enough
+	queue.update(v3s16(0, 0, 1), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 0);
+	while (queue.pop(&p, &d))
+		UASSERT(p != kept);
+	UASSERTEQ(size_t, queue.keptCount(), 1);
+
+	queue.update(v3s16(0, 0, 2), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 0);
+	bool found = false;
+	while (queue.pop(&p, &d)) {
+		if (p == kept) {
+			UASSERTEQ(s16, d, 2);
+			found = true;
+		}
+		sent.insert(p);
+	}
+	UASSERT(found);
+	UASSERTEQ(size_t, queue.keptCount(), 0);
+
+	// Those that go out of range are added again with their shell
+	sent.erase(kept);
+	queue.push(kept);
+	UASSERT(queue.pop(&p, &d));
+	queue.keep(kept, 1);
+	queue.update(v3s16(0, 0, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 10);
+	while (queue.pop(&p, &d))
+		sent.insert(p);
+	UASSERTEQ(size_t, queue.keptCount(), 1);
+
+	queue.update(v3s16(0, 0, -2), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 10);
+	while (queue.pop(&p, &d))
+		sent.insert(p);
+	UASSERTEQ(size_t, queue.keptCount(), 0);
+
+	queue.update(v3s16(0, 0, 0), v3f(0, 0, 0), v3f(0, 0, 1), 1.5f, 5, 10);
+	found = false;
+	while (queue.pop(&p, &d))
+		found |= p == kept;
+	UASSERT(found);
+}
+
+/*
+	A client walking through the world and turning around, as seen by
+	GetNextBlocks(): blocks in sight are sent, the others are skipped.
+*/
+struct SyntheticClient
+{
+	v3s16 center;
+	v3f camera_pos;
+	v3f camera_dir;
+	std::set<v3s16> sent;
+	BlockSendQueue queue{sent};
+	// State of the shell walk the queue replaced
+	s16 nearest_unsent_d = 0;
+	v3s16 last_center;
+
+	void move(u32 client, u32 step)
+	{
+		// Walks about 5 nodes per second at 10 steps per second
+		camera_pos = v3f(client * 1000 + step * 0.5f, 20.0f,
+			client * 300) * BS;
+		center = getNodeBlockPos(floatToInt(camera_pos, BS));
+		camera_dir = v3f(0, 0, 1);
+		camera_dir.rotateXZBy(client * 3.6f + step * 0.5f);
+	}
+};
+
+#define BENCH_CLIENTS 100
+#define BENCH_STEPS 300
+#define BENCH_D_MAX 9
+#define BENCH_SENDS_PER_STEP 10
+
+static const f32 bench_fov = (72.0 * M_PI / 180) * 4./3.;
+static const f32 bench_range = BENCH_D_MAX * BS * MAP_BLOCKSIZE;
+
+static void select_from_queue(SyntheticClient &c, u32 *looked_at)
+{
+	c.queue.update(c.center, c.camera_pos, c.camera_dir, bench_fov,
+		BENCH_D_MAX, 2);
+	u32 selected = 0;
+	v3s16 p;
+	s16 d;
+	while (selected < BENCH_SENDS_PER_STEP && c.queue.pop(&p, &d)) {
+		(*looked_at)++;
+		if (!isBlockInSight(p, c.camera_pos, c.camera_dir, bench_fov,
+				bench_range, NULL)) {
+			c.queue.defer(p);
+			continue;
+		}
+		c.sent.insert(p);
+		selected++;
+	}
+}
+
+static void select_from_shells(SyntheticClient &c, u32 *looked_at)
+{
+	if (c.last_center != c.center) {
+		c.nearest_unsent_d = 0;
+		c.last_center = c.center;
+	}
+
+	u32 selected = 0;
+	s16 nearest_sent_d = -1;
+	s16 d_max = MYMIN(BENCH_D_MAX, c.nearest_unsent_d + 2);
+	s16 d;
+	for (d = c.nearest_unsent_d; d <= d_max; d++) {
+		const std::vector<v3s16> &list = FacePositionCache::getFacePositions(d);
+		for (std::vector<v3s16>::const_iterator i = list.begin();
+				i != list.end(); ++i) {
+			if (selected >= BENCH_SENDS_PER_STEP)
+				goto queue_full_break;
+			v3s16 p = *i + c.center;
+			(*looked_at)++;
+			if (!isBlockInSight(p, c.camera_pos, c.camera_dir, bench_fov,
+					bench_range, NULL))
+				continue;
+			if (!c.sent.insert(p).second)
+				continue;
+			if (nearest_sent_d == -1)
+				nearest_sent_d = d;
+			selected++;
+		}
+	}
+queue_full_break:
+	if (d > BENCH_D_MAX)
+		c.nearest_unsent_d = 0;
+	else
+		c.nearest_unsent_d = nearest_sent_d != -1 ? nearest_sent_d : d;
+}
+
+void TestBlockSendQueue::testBlockSendBenchmark()
+{
+	for (int method = 0; method < 2; method++) {
+		std::vector<SyntheticClient> clients(BENCH_CLIENTS);
+		u32 looked_at = 0;
+		size_t sent = 0;
+
+		u64 t0 = porting::getTimeUs();
+		for (u32 step = 0; step < BENCH_STEPS; step++)
+		for (u32 i = 0; i < clients.size(); i++) {
+			clients[i].move(i, step);
+			if (method == 0)
+				select_from_queue(clients[i], &looked_at);
+			else
+				select_from_shells(clients[i], &looked_at);
+		}
+		u64 t1 = porting::getTimeUs();
+
+		for (u32 i = 0; i < clients.size(); i++)
+			sent += clients[i].sent.size();
+		UASSERT(sent > 0);
+
+		infostream << "TestBlockSendQueue: "
+			<< (method == 0 ? "priority queue" : "shell walk") << ": "
+			<< BENCH_CLIENTS << " clients, " << BENCH_STEPS << " steps, "
+			<< sent << " blocks sent, " << looked_at
+			<< " positions looked at, "
+			<< (float)(t1 - t0) / (BENCH_CLIENTS * BENCH_STEPS)
+			<< " us per client step" << std::endl;
+	}
+}
@@ -23,6 +23,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irrlichttypes_extrabloated.h"
 #include "log.h"
+#include "mapblock.h"
+#include "porting.h"
 #include "serialization.h"
 #include "nodedef.h"
 #include "noise.h"
@@ -37,6 +39,12 @@ class TestCompression : public TestBase {
 	void testRLECompression();
 	void testZlibCompression();
 	void testZlibLargeData();
+	void testZstdCompression();
+	void testCodecs();
+	void testCompressionBenchmark();
+
+private:
+	void checkRoundTrip(CompressionCodec codec, const std::string &data);
 };
 
 static TestCompression g_test_instance;
@@ -46,6 +54,11 @@ void TestCompression::runTests(IGameDef *gamedef)
 	TEST(testRLECompression);
 	TEST(testZlibCompression);
 	TEST(testZlibLargeData);
+#if USE_ZSTD
+	TEST(testZstdCompression);
+#endif
+	TEST(testCodecs);
+	TEST(testCompressionBenchmark);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -108,7 +121,7 @@ void TestCompression::testZlibCompression()
 	fromdata[3]=1;
 
 	std::ostringstream os(std::ios_base::binary);
-	compress(fromdata, os, SER_FMT_VER_HIGHEST_READ);
+	compress(fromdata, os, SER_FMT_VER_HIGHEST_ZLIB);
 
 	std::string str_out = os.str();
 
@@ -121,7 +134,7 @@ void TestCompression::testZlibCompression()
 	std::istringstream is(str_out, std::ios_base::binary);
 	std::ostringstream os2(std::ios_base::binary);
 
-	decompress(is, os2, SER_FMT_VER_HIGHEST_READ);
+	decompress(is, os2, SER_FMT_VER_HIGHEST_ZLIB);
 	std::string str_out2 = os2.str();
 
 	infostream << "decompress: ";
@@ -170,3 +183,150 @@ void TestCompression::testZlibLargeData()
 				i, str_decompressed[i], i, data_in[i]);
 	}
 }
+
+void TestCompression::checkRoundTrip(CompressionCodec codec,
+	const std::string &data)
+{
+	// Data following the compressed data must be left in the stream
+	std::ostringstream os(std::ios_base::binary);
+	compressWith(codec, data, os);
+	os << "trailer";
+
+	std::istringstream is(os.str(), std::ios_base::binary);
+	std::ostringstream os2(std::ios_base::binary);
+	decompressWith(codec, is, os2);
+	UASSERT(os2.str() == data);
+
+	std::string trailer;
+	is >> trailer;
+	UASSERT(trailer == "trailer");
+}
+
+#if USE_ZSTD
+void TestCompression::testZstdCompression()
+{
+	checkRoundTrip(COMPRESSION_ZSTD, "");
+	checkRoundTrip(COMPRESSION_ZSTD, std::string("\x01\x05\x05\x01", 4));
+
+	// Pseudorandom data larger than the stream buffers
+	std::string data(100000, '\0');
+	PseudoRandom pseudorandom(9420);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = pseudorandom.range(0, 255);
+	checkRoundTrip(COMPRESSION_ZSTD, data);
+
+	// Highly compressible data, so that the output outgrows the input
+	checkRoundTrip(COMPRESSION_ZSTD, std::string(1000000, 'x'));
+
+	// Truncated data
+	std::ostringstream os(std::ios_base::binary);
+	compressZstd(data, os);
+	std::istringstream is(os.str().substr(0, os.str().size() / 2),
+		std::ios_base::binary);
+	std::ostringstream os2(std::ios_base::binary);
+	EXCEPTION_CHECK(SerializationError, decompressZstd(is, os2));
+}
+#endif
+
+void TestCompression::testCodecs()
+{
+	CompressionCodec codec;
+	UASSERT(parseCompressionCodec("zlib", &codec) && codec == COMPRESSION_ZLIB);
+	UASSERT(!parseCompressionCodec("lzma", &codec));
+	UASSERT(parseCompressionCodec("zstd", &codec) == USE_ZSTD);
+	UASSERT(std::string(getCompressionCodecName(COMPRESSION_ZSTD)) == "zstd");
+
+	UASSERT(getCompressionCodec(SER_FMT_VER_HIGHEST_ZLIB) == COMPRESSION_ZLIB);
+	UASSERT(getCompressionCodec(29) == COMPRESSION_ZSTD);
+
+	checkRoundTrip(COMPRESSION_ZLIB, std::string(50000, 'x'));
+#if !USE_ZSTD
+	std::ostringstream os(std::ios_base::binary);
+	EXCEPTION_CHECK(SerializationError,
+		compressWith(COMPRESSION_ZSTD, std::string("x"), os));
+#endif
+}
+
+void TestCompression::testCompressionBenchmark()
+{
+	/*
+		Bulk node data of terrain blocks shaped like mapgen output: stone
+		with caves and scattered ores, grass at the surface, water up to
+		sea level and lit air above
+	*/
+	std::vector<std::string> dumps;
+	size_t total_size = 0;
+	v3s16 bp;
+	for (bp.Z = 0; bp.Z < 8; bp.Z++)
+	for (bp.Y = -2; bp.Y < 2; bp.Y++)
+	for (bp.X = 0; bp.X < 8; bp.X++) {
+		MapNode nodes[MapBlock::nodecount];
+		PseudoRandom pr(bp.X + bp.Y * 8 + bp.Z * 64);
+		for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+		for (s16 x = 0; x < MAP_BLOCKSIZE; x++) {
+			v3s16 p(bp.X * MAP_BLOCKSIZE + x, 0, bp.Z * MAP_BLOCKSIZE + z);
+			s16 surface = 4 + 20 * noise2d_perlin(p.X / 80.f, p.Z / 80.f,
+				1, 4, 0.5);
+			for (s16 y = 0; y < MAP_BLOCKSIZE; y++) {
+				p.Y = bp.Y * MAP_BLOCKSIZE + y;
+				MapNode &n = nodes[z * MapBlock::zstride +
+					y * MapBlock::ystride + x];
+				if (p.Y < surface - 1) {
+					float cave = noise3d_perlin(p.X / 20.f, p.Y / 20.f,
+						p.Z / 20.f, 2, 2, 0.5);
+					if (cave > 0.5)
+						n = MapNode(CONTENT_AIR);
+					else if (pr.range(0, 99) == 0)
+						n = MapNode(t_CONTENT_BRICK);
+					else
+						n = MapNode(t_CONTENT_STONE);
+				} else if (p.Y <= surface) {
+					n = MapNode(t_CONTENT_GRASS);
+				} else if (p.Y <= 0) {
+					n = MapNode(t_CONTENT_WATER, 0xCC);
+				} else {
+					n = MapNode(CONTENT_AIR, 0xFF);
+				}
+			}
+		}
+
+		std::ostringstream os(std::ios_base::binary);
+		MapNode::serializeBulk(os, SER_FMT_VER_HIGHEST_WRITE, nodes,
+			MapBlock::nodecount, 2, 2, false);
+		dumps.push_back(os.str());
+		total_size += dumps.back().size();
+	}
+
+	const CompressionCodec codecs[] = { COMPRESSION_ZLIB, COMPRESSION_ZSTD };
+	for (size_t c = 0; c < 2; c++) {
+		CompressionCodec codec = codecs[c];
+		CompressionCodec parsed;
+		if (!parseCompressionCodec(getCompressionCodecName(codec), &parsed))
+			continue;
+
+		std::vector<std::string> compressed;
+		size_t compressed_size = 0;
+		u64 t0 = porting::getTimeUs();
+		for (size_t i = 0; i < dumps.size(); i++) {
+			std::ostringstream os(std::ios_base::binary);
+			compressWith(codec, dumps[i], os);
+			compressed.push_back(os.str());
+			compressed_size += compressed.back().size();
+		}
+		u64 t1 = porting::getTimeUs();
+		for (size_t i = 0; i < dumps.size(); i++) {
+			std::istringstream is(compressed[i], std::ios_base::binary);
+			std::ostringstream os(std::ios_base::binary);
+			decompressWith(codec, is, os);
+			UASSERT(os.str() == dumps[i]);
+		}
+		u64 t2 = porting::getTimeUs();
+
+		// Bytes per microsecond are MB/s
+		infostream << "TestCompression: " << getCompressionCodecName(codec)
+			<< ": " << dumps.size() << " blocks, ratio "
+			<< (float)total_size / compressed_size << ", compress "
+			<< (float)total_size / MYMAX(t1 - t0, 1) << " MB/s, decompress "
+			<< (float)total_size / MYMAX(t2 - t1, 1) << " MB/s" << std::endl;
+	}
+}
@@ -0,0 +1,238 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <map>
+#include "noise.h"
+#include "network/congestioncontrol.h"
+#include "network/connection.h"
+
+/*
+	A link to a peer: the packets wait in a queue drained at the rate of
+	the link, a full queue drops them, and some get lost on the way.
+*/
+struct LossyLink
+{
+	float rate; // Packets per second
+	float rtt; // Round trip time of an empty queue
+	u32 queue_size;
+	float loss; // Share of the packets lost
+
+	LossyLink(float rate_, float rtt_, u32 queue_size_, float loss_) :
+		rate(rate_), rtt(rtt_), queue_size(queue_size_), loss(loss_)
+	{}
+};
+
+struct LinkResult
+{
+	u32 sent = 0;
+	u32 delivered = 0;
+	u32 dropped = 0;
+	// Round trip times of the delivered packets
+	double rtt_sum = 0.0;
+};
+
+class TestCongestionControl : public TestBase {
+public:
+	TestCongestionControl() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestCongestionControl"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testStartup();
+	void testPacing();
+	void testLinks();
+
+	static LinkResult simulate(const LossyLink &link, float duration,
+		u32 fixed_window);
+};
+
+static TestCongestionControl g_test_instance;
+
+void TestCongestionControl::runTests(IGameDef *gamedef)
+{
+	TEST(testStartup);
+	TEST(testPacing);
+	TEST(testLinks);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestCongestionControl::testStartup()
+{
+	con::CongestionControl cc(MIN_RELIABLE_WINDOW_SIZE, MAX_RELIABLE_WINDOW_SIZE);
+	UASSERT(cc.getWindow() == MIN_RELIABLE_WINDOW_SIZE);
+	UASSERT(cc.isStartingUp());
+
+	// Acks of a link that isn't full yet make the rates grow
+	double now = 0.0;
+	float bandwidth = 0.0f;
+	for (u32 round = 1; round <= 4; round++) {
+		u32 acks = 100 * round * round;
+		for (u32 i = 0; i < acks; i++) {
+			now += 0.05 / acks;
+			cc.onAck(now, 0.05f, 0);
+		}
+		UASSERT(cc.getBandwidth() >= bandwidth);
+		bandwidth = cc.getBandwidth();
+	}
+	UASSERT(bandwidth > 900 / 0.05f);
+	UASSERT(cc.getWindow() > MIN_RELIABLE_WINDOW_SIZE);
+	UASSERT(fabs(cc.getMinRTT() - 0.05f) < 0.001f);
+	UASSERT(cc.getPacingRate() > 2 * cc.getBandwidth());
+	UASSERT(cc.isStartingUp());
+
+	// Then the startup ends when they stop growing
+	for (u32 round = 0; round < 4; round++) {
+		for (u32 i = 0; i < 1600; i++) {
+			now += 0.05 / 1600;
+			cc.onAck(now, 0.05f, 1000);
+		}
+	}
+	UASSERT(!cc.isStartingUp());
+	UASSERT(cc.getPacingRate() <= cc.getBandwidth() * 1.25f);
+}
+
+void TestCongestionControl::testPacing()
+{
+	con::CongestionControl cc(MIN_RELIABLE_WINDOW_SIZE, MAX_RELIABLE_WINDOW_SIZE);
+
+	// Only a few packets go at once, then at the pacing rate
+	u32 sent = 0;
+	while (cc.canSend(0.0, sent)) {
+		cc.onSend();
+		sent++;
+	}
+	UASSERT(sent > 0 && sent < 10);
+
+	double next = cc.getNextSendTime();
+	UASSERT(next > 0.0);
+	UASSERT(!cc.canSend(next * 0.5, sent));
+	UASSERT(cc.canSend(next + 0.000001, sent));
+
+	u32 paced = 0;
+	for (double now = 0.0; now < 0.1; now += 0.0005) {
+		while (cc.canSend(now, 0)) {
+			cc.onSend();
+			paced++;
+		}
+	}
+	UASSERT(fabs(paced - cc.getPacingRate() * 0.1f) < 10);
+
+	// Nothing goes when the window is full
+	UASSERT(!cc.canSend(1.0, cc.getWindow()));
+}
+
+LinkResult TestCongestionControl::simulate(const LossyLink &link,
+	float duration, u32 fixed_window)
+{
+	// Sends as much as possible through the link, paced by a congestion
+	// control or in a fixed window, and resends the lost packets
+	const double step = 0.0005;
+	const float resend_timeout = 4 * link.rtt;
+
+	con::CongestionControl cc(MIN_RELIABLE_WINDOW_SIZE, MAX_RELIABLE_WINDOW_SIZE);
+	PcgRandom pr(1234);
+	LinkResult result;
+
+	// Acks by arrival time, with the time the packet was first sent
+	std::multimap<double, double> acks;
+	// Lost packets by resend time, with the time they were first sent
+	std::multimap<double, double> lost;
+	u32 in_flight = 0;
+	double queue_end = 0.0;
+
+	for (double now = 0.0; now < duration; now += step) {
+		while (!acks.empty() && acks.begin()->first <= now) {
+			in_flight--;
+			result.delivered++;
+			result.rtt_sum += now - acks.begin()->second;
+			cc.onAck(now, now - acks.begin()->second, in_flight);
+			acks.erase(acks.begin());
+		}
+
+		std::vector<double> first_sent;
+		while (!lost.empty() && lost.begin()->first <= now) {
+			first_sent.push_back(lost.begin()->second);
+			lost.erase(lost.begin());
+		}
+		for (;;) {
+			bool resend = !first_sent.empty();
+			if (!resend) {
+				if (fixed_window ? in_flight >= fixed_window :
+						!cc.canSend(now, in_flight))
+					break;
+				if (!fixed_window)
+					cc.onSend();
+				in_flight++;
+				first_sent.push_back(now);
+			}
+			double sent_time = first_sent.back();
+			first_sent.pop_back();
+			result.sent++;
+
+			// Through the queue of the link
+			queue_end = MYMAX(queue_end, now);
+			if ((queue_end - now) * link.rate >= link.queue_size ||
+					pr.range(0, 9999) < link.loss * 10000) {
+				result.dropped++;
+				lost.insert(std::make_pair(now + resend_timeout, sent_time));
+				continue;
+			}
+			queue_end += 1.0 / link.rate;
+			acks.insert(std::make_pair(queue_end + link.rtt, sent_time));
+		}
+	}
+	return result;
+}
+
+void TestCongestionControl::testLinks()
+{
+	const float duration = 20.0f;
+	// Fast, slow and lossy links
+	LossyLink links[] = {
+		LossyLink(20000, 0.02f, 2000, 0.0f),
+		LossyLink(200, 0.1f, 50, 0.0f),
+		LossyLink(2000, 0.05f, 200, 0.02f),
+	};
+
+	for (size_t i = 0; i < ARRLEN(links); i++) {
+		const LossyLink &link = links[i];
+		LinkResult paced = simulate(link, duration, 0);
+		// Like the loss based window sizes of a non legacy peer
+		LinkResult windowed = simulate(link, duration, 1024);
+
+		float usage = paced.delivered / (link.rate * duration);
+		float delay = paced.rtt_sum / MYMAX(paced.delivered, 1) - link.rtt;
+		infostream << "TestCongestionControl: link of " << link.rate
+			<< " packets/s, rtt " << link.rtt << "s, loss " << link.loss
+			<< ": usage " << usage << ", queue delay " << delay
+			<< "s, dropped " << paced.dropped << "/" << paced.sent
+			<< "; fixed window of 1024: usage "
+			<< windowed.delivered / (link.rate * duration)
+			<< ", dropped " << windowed.dropped << "/" << windowed.sent
+			<< std::endl;
+
+		// The link is used, without filling its queue
+		UASSERT(usage > 0.8f);
+		UASSERT(delay < link.queue_size / link.rate / 2);
+		UASSERT(paced.dropped <= link.loss * paced.sent * 1.5f + 50);
+	}
+}
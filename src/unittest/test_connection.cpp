@@ -20,8 +20,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "test.h"
 
 #include "log.h"
+#include "porting.h"
 #include "socket.h"
 #include "settings.h"
+#include "util/basic_macros.h"
 #include "util/serialize.h"
 #include "network/connection.h"
 
@@ -38,7 +40,14 @@ class TestConnection : public TestBase {
 	void runTests(IGameDef *gamedef);
 
 	void testHelpers();
+	void testReliablePacketBuffer();
+	void testReliablePacketBufferBenchmark();
 	void testConnectSendReceive();
+	void testBatchThroughput();
+	void testShardedThroughput();
+
+	static u32 exchange(UDPSocket &sender, UDPSocket &receiver,
+		const Address &address, bool batched);
 };
 
 static TestConnection g_test_instance;
@@ -46,7 +55,11 @@ static TestConnection g_test_instance;
 void TestConnection::runTests(IGameDef *gamedef)
 {
 	TEST(testHelpers);
+	TEST(testReliablePacketBuffer);
+	TEST(testReliablePacketBufferBenchmark);
 	TEST(testConnectSendReceive);
+	TEST(testBatchThroughput);
+	TEST(testShardedThroughput);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -120,6 +133,142 @@ void TestConnection::testHelpers()
 }
 
 
+static con::BufferedPacket makeReliable(u16 seqnum, u32 size = 4)
+{
+	SharedBuffer<u8> data(size);
+	memset(*data, 0, size);
+	SharedBuffer<u8> reliable = con::makeReliablePacket(data, seqnum);
+	Address address(127, 0, 0, 1, 30000);
+	return con::makePacket(address, reliable, 0xad26846a, 2, 0);
+}
+
+static u16 getSeqnum(const con::BufferedPacket &p)
+{
+	return readU16(&p.data[BASE_HEADER_SIZE + 1]);
+}
+
+void TestConnection::testReliablePacketBuffer()
+{
+	con::ReliablePacketBuffer buffer;
+	u16 seqnum;
+
+	UASSERT(buffer.empty());
+	UASSERT(!buffer.getFirstSeqnum(seqnum));
+
+	// Out of order, across the wrap around of the seqnums
+	u16 seqnums[] = {65535, 2, 65533, 0, 65531};
+	for (size_t i = 0; i < ARRLEN(seqnums); i++) {
+		con::BufferedPacket p = makeReliable(seqnums[i]);
+		buffer.insert(p, 65530);
+	}
+	UASSERT(buffer.size() == 5);
+	UASSERT(buffer.getFirstSeqnum(seqnum) && seqnum == 65531);
+	UASSERT(buffer.containsPacket(0));
+	UASSERT(!buffer.containsPacket(1));
+
+	// Resent packets are ignored, different ones with the same seqnum not
+	con::BufferedPacket p = makeReliable(0);
+	buffer.insert(p, 65530);
+	UASSERT(buffer.size() == 5);
+	p = makeReliable(0, 8);
+	EXCEPTION_CHECK(con::IncomingDataCorruption, buffer.insert(p, 65530));
+
+	// Neither the next expected packet nor those out of the window are kept
+	p = makeReliable(65530);
+	buffer.insert(p, 65530);
+	p = makeReliable(65529);
+	buffer.insert(p, 65530);
+	UASSERT(buffer.size() == 5);
+
+	u16 order[] = {65531, 65533, 65535, 0, 2};
+	for (size_t i = 0; i < ARRLEN(order); i++)
+		UASSERT(getSeqnum(buffer.popFirst()) == order[i]);
+	UASSERT(buffer.empty());
+	EXCEPTION_CHECK(con::NotFoundException, buffer.popFirst());
+
+	// Acks in any order, the first packet follows
+	for (u16 i = 0; i < 1000; i++) {
+		p = makeReliable(65000 + i);
+		buffer.insert(p, 64999);
+	}
+	UASSERT(buffer.size() == 1000);
+	UASSERT(getSeqnum(buffer.popSeqnum(65500)) == 65500);
+	EXCEPTION_CHECK(con::NotFoundException, buffer.popSeqnum(65500));
+	EXCEPTION_CHECK(con::NotFoundException, buffer.popSeqnum(64998));
+	for (u16 i = 0; i < 500; i++)
+		buffer.popSeqnum(65000 + i);
+	UASSERT(buffer.getFirstSeqnum(seqnum) && seqnum == 65501);
+	for (u16 i = 999; i > 501; i--)
+		buffer.popSeqnum(65000 + i);
+	UASSERT(buffer.size() == 1);
+	UASSERT(buffer.getFirstSeqnum(seqnum) && seqnum == 65501);
+	UASSERT(getSeqnum(buffer.popFirst()) == 65501);
+	UASSERT(buffer.empty());
+
+	// Packets time out in the order they were sent, and again once resent
+	for (u16 i = 0; i < 3; i++) {
+		p = makeReliable(i);
+		buffer.insert(p, 65535);
+	}
+	buffer.incrementTimeouts(0.5f);
+	UASSERT(buffer.getTimedOuts(1.0f, 10).empty());
+	buffer.incrementTimeouts(0.6f);
+	std::list<con::BufferedPacket> timed_outs = buffer.getTimedOuts(1.0f, 2);
+	UASSERT(timed_outs.size() == 2);
+	UASSERT(getSeqnum(timed_outs.front()) == 0);
+	UASSERT(getSeqnum(timed_outs.back()) == 1);
+	UASSERT(fabs(timed_outs.front().time - 1.1f) < 0.001f);
+	timed_outs = buffer.getTimedOuts(1.0f, 10);
+	UASSERT(timed_outs.size() == 1 && getSeqnum(timed_outs.front()) == 2);
+	UASSERT(buffer.getTimedOuts(1.0f, 10).empty());
+
+	buffer.popSeqnum(1);
+	buffer.incrementTimeouts(1.5f);
+	timed_outs = buffer.getTimedOuts(1.0f, 10);
+	UASSERT(timed_outs.size() == 2);
+	UASSERT(getSeqnum(timed_outs.front()) == 0);
+	UASSERT(getSeqnum(timed_outs.back()) == 2);
+	p = buffer.popFirst();
+	UASSERT(fabs(p.time) < 0.001f);
+	UASSERT(fabs(p.totaltime - 2.6f) < 0.001f);
+}
+
+void TestConnection::testReliablePacketBufferBenchmark()
+{
+	// A sender with a large window losing one packet in ten, the lost
+	// packets time out after the others are acked and are acked once resent
+	con::ReliablePacketBuffer buffer;
+	const u32 count = 200000;
+	const u16 window = 8192;
+	u64 t0 = porting::getTimeUs();
+	for (u32 i = 0; i < count; i++) {
+		u16 seqnum = i;
+		con::BufferedPacket p = makeReliable(seqnum, 512);
+		buffer.insert(p, seqnum - window);
+
+		u16 acked = seqnum - window / 2;
+		if (i >= window / 2 && acked % 10 != 0)
+			buffer.popSeqnum(acked);
+
+		if (i % 64 == 0) {
+			buffer.incrementTimeouts(0.1f);
+			std::list<con::BufferedPacket> timed_outs =
+				buffer.getTimedOuts(8.0f, 1000);
+			for (std::list<con::BufferedPacket>::iterator k = timed_outs.begin();
+					k != timed_outs.end(); ++k)
+				buffer.popSeqnum(getSeqnum(*k));
+		}
+		UASSERT(buffer.size() <= window);
+	}
+	while (!buffer.empty())
+		buffer.popFirst();
+	u64 t1 = porting::getTimeUs();
+
+	infostream << "TestConnection: reliable packet buffer, window of "
+		<< window << ": " << count * 1000000.0 / MYMAX(t1 - t0, 1)
+		<< " packets/s" << std::endl;
+}
+
 void TestConnection::testConnectSendReceive()
 {
 	DSTACK("TestConnection::Run");
@@ -341,3 +490,178 @@ void TestConnection::testConnectSendReceive()
 	UASSERT(hand_server.count == 1);
 	UASSERT(hand_server.last_id == 2);
 }
+
+u32 TestConnection::exchange(UDPSocket &sender, UDPSocket &receiver,
+	const Address &address, bool batched)
+{
+	// Sends numbered packets a batch at a time, so that the receive buffer
+	// of the socket does not overflow, and checks what comes back
+	const u32 count = 20000;
+	const int size = 512;
+	u8 sendbuffers[UDP_BATCH_SIZE][size];
+	u8 recvbuffers[UDP_BATCH_SIZE][size];
+	UDPDatagram datagrams[UDP_BATCH_SIZE];
+
+	memset(sendbuffers, 0, sizeof(sendbuffers));
+	u32 received = 0;
+	for (u32 seqnum = 0; seqnum < count; seqnum += UDP_BATCH_SIZE) {
+		for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+			writeU32(sendbuffers[i], seqnum + i);
+			datagrams[i].address = address;
+			datagrams[i].data = sendbuffers[i];
+			datagrams[i].size = size;
+		}
+		if (batched) {
+			UASSERT(sender.SendBatch(datagrams, UDP_BATCH_SIZE) == 0);
+		} else {
+			for (int i = 0; i < UDP_BATCH_SIZE; i++)
+				sender.Send(address, sendbuffers[i], size);
+		}
+
+		int batch_received = 0;
+		while (batch_received < UDP_BATCH_SIZE) {
+			int n;
+			if (batched) {
+				for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+					datagrams[i].data = recvbuffers[i];
+					datagrams[i].size = size;
+				}
+				n = receiver.ReceiveBatch(datagrams,
+					UDP_BATCH_SIZE - batch_received);
+			} else {
+				Address sender_address;
+				datagrams[0].size = receiver.Receive(sender_address,
+					recvbuffers[0], size);
+				n = datagrams[0].size < 0 ? 0 : 1;
+			}
+			UASSERT(n > 0);
+			for (int i = 0; i < n; i++) {
+				UASSERT(datagrams[i].size == size);
+				UASSERT(readU32(recvbuffers[i]) == seqnum + batch_received + i);
+			}
+			batch_received += n;
+		}
+		received += batch_received;
+	}
+	return received;
+}
+
+void TestConnection::testBatchThroughput()
+{
+	Address bind_addr(0, 0, 0, 0, 30002);
+	Address address(127, 0, 0, 1, 30002);
+
+	UDPSocket receiver(false);
+	receiver.Bind(bind_addr);
+	receiver.setTimeoutMs(1000);
+	UDPSocket sender(false);
+
+	for (int batched = 0; batched < 2; batched++) {
+		u64 t0 = porting::getTimeUs();
+		u32 packets = exchange(sender, receiver, address, batched);
+		u64 t1 = porting::getTimeUs();
+
+		infostream << "TestConnection: " << (batched ? "batched" : "single")
+			<< " I/O on loopback: " << packets * 1000000.0 / MYMAX(t1 - t0, 1)
+			<< " packets/s" << std::endl;
+	}
+}
+
+void TestConnection::testShardedThroughput()
+{
+	// A server sending reliable packets to many peers over loopback, on one
+	// connection thread and then on several
+	const u32 proto_id = 0xad26846a;
+	const u16 num_clients = 16;
+	const u32 num_packets = 100;
+	const u32 datasize = 1000;
+	u16 threads[] = {1, 4};
+
+	for (size_t t = 0; t < ARRLEN(threads); t++) {
+		u16 port = 30003 + t;
+		con::Connection server(proto_id, 512, 5.0, false, NULL, threads[t]);
+		server.Serve(Address(0, 0, 0, 0, port));
+
+		std::vector<con::Connection *> clients;
+		for (u16 i = 0; i < num_clients; i++) {
+			clients.push_back(new con::Connection(proto_id, 512, 5.0, false, NULL));
+			clients[i]->Connect(Address(127, 0, 0, 1, port));
+		}
+
+		// Each client says hello, so that the server knows its peer id
+		u64 timems0 = porting::getTimeMs();
+		for (u16 i = 0; i < num_clients; i++) {
+			while (!clients[i]->Connected() &&
+					porting::getTimeMs() - timems0 < 5000) {
+				try {
+					NetworkPacket pkt;
+					clients[i]->Receive(&pkt);
+				} catch (con::NoIncomingDataException &e) {
+					sleep_ms(1);
+				}
+			}
+			UASSERT(clients[i]->Connected());
+
+			NetworkPacket pkt(0, 4);
+			pkt << (u32)i;
+			clients[i]->Send(PEER_ID_SERVER, 0, &pkt, true);
+		}
+
+		std::vector<u16> peer_ids;
+		while (peer_ids.size() < num_clients &&
+				porting::getTimeMs() - timems0 < 5000) {
+			try {
+				NetworkPacket pkt;
+				server.Receive(&pkt);
+				// Skip the empty packets sent when connecting
+				if (pkt.getSize() == 4)
+					peer_ids.push_back(pkt.getPeerId());
+			} catch (con::NoIncomingDataException &e) {
+				sleep_ms(1);
+			}
+		}
+		UASSERT(peer_ids.size() == num_clients);
+
+		u64 t0 = porting::getTimeUs();
+		for (u32 n = 0; n < num_packets; n++)
+		for (size_t i = 0; i < peer_ids.size(); i++) {
+			NetworkPacket pkt(0, datasize);
+			pkt << n;
+			server.Send(peer_ids[i], 0, &pkt, true);
+		}
+
+		// Every client gets all the packets, in order
+		std::vector<u32> received(num_clients, 0);
+		u32 total = 0;
+		timems0 = porting::getTimeMs();
+		while (total < num_clients * num_packets &&
+				porting::getTimeMs() - timems0 < 10000) {
+			bool idle = true;
+			for (u16 i = 0; i < num_clients; i++) {
+				try {
+					NetworkPacket pkt;
+					clients[i]->Receive(&pkt);
+					u32 n;
+					pkt >> n;
+					UASSERT(n == received[i]);
+					received[i]++;
+					total++;
+					idle = false;
+				} catch (con::NoIncomingDataException &e) {
+				}
+			}
+			if (idle)
+				sleep_ms(1);
+		}
+		u64 t1 = porting::getTimeUs();
+		UASSERT(total == num_clients * num_packets);
+
+		infostream << "TestConnection: " << num_clients << " peers on "
+			<< threads[t] << " connection threads: "
+			<< total * 1000000.0 / MYMAX(t1 - t0, 1)
+			<< " reliable packets/s" << std::endl;
+
+		for (u16 i = 0; i < num_clients; i++)
+			delete clients[i];
+	}
+}
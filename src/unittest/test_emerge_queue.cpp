@@ -0,0 +1,187 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "emerge_queue.h"
+
+class TestEmergeQueue : public TestBase {
+public:
+	TestEmergeQueue() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestEmergeQueue"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testOrder();
+	void testChunkAffinity();
+	void testStealing();
+	void testUpdatePriorities();
+	void testChunkGenTracker();
+};
+
+static TestEmergeQueue g_test_instance;
+
+void TestEmergeQueue::runTests(IGameDef *gamedef)
+{
+	TEST(testOrder);
+	TEST(testChunkAffinity);
+	TEST(testStealing);
+	TEST(testUpdatePriorities);
+	TEST(testChunkGenTracker);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// With a chunk size of 5, chunks start at blocks -2, 3, 8...
+
+void TestEmergeQueue::testOrder()
+{
+	EmergeQueue queue(1, 5);
+	v3s16 pos;
+
+	queue.push(v3s16(0, 0, 0), 3);
+	queue.push(v3s16(5, 0, 0), 1);
+	queue.push(v3s16(10, 0, 0), 1);
+	// Already queued
+	queue.push(v3s16(0, 0, 0), 0);
+	UASSERTEQ(size_t, queue.size(), 3);
+
+	// Equal priorities keep the push order
+	UASSERT(queue.pop(0, &pos));
+	UASSERT(pos == v3s16(5, 0, 0));
+	UASSERT(queue.pop(0, &pos));
+	UASSERT(pos == v3s16(10, 0, 0));
+	UASSERT(queue.pop(0, &pos));
+	UASSERT(pos == v3s16(0, 0, 0));
+	UASSERT(!queue.pop(0, &pos));
+	UASSERTEQ(size_t, queue.size(), 0);
+}
+
+void TestEmergeQueue::testChunkAffinity()
+{
+	EmergeQueue queue(2, 5);
+
+	UASSERTEQ(size_t, queue.push(v3s16(0, 0, 0), 0), 0);
+	UASSERTEQ(size_t, queue.push(v3s16(1, 0, 0), 0), 0);
+	// A new chunk goes to the thread with fewest blocks
+	UASSERTEQ(size_t, queue.push(v3s16(5, 0, 0), 0), 1);
+	UASSERTEQ(size_t, queue.push(v3s16(10, 0, 0), 0), 1);
+	UASSERTEQ(size_t, queue.push(v3s16(-2, 2, -1), 0), 0);
+
+	UASSERT(queue.remove(v3s16(0, 0, 0)));
+	UASSERT(!queue.remove(v3s16(0, 0, 0)));
+	UASSERTEQ(size_t, queue.size(0), 2);
+	UASSERTEQ(size_t, queue.size(1), 2);
+}
+
+void TestEmergeQueue::testStealing()
+{
+	EmergeQueue queue(2, 5);
+	v3s16 pos;
+	bool stolen;
+
+	queue.push(v3s16(0, 0, 0), 0);
+	queue.push(v3s16(1, 0, 0), 1);
+	queue.push(v3s16(5, 0, 0), 2);
+	queue.push(v3s16(6, 0, 0), 3);
+	queue.push(v3s16(10, 0, 0), 4);
+	queue.push(v3s16(11, 0, 0), 5);
+	UASSERTEQ(size_t, queue.size(0), 4);
+	UASSERTEQ(size_t, queue.size(1), 2);
+
+	UASSERT(queue.pop(0, &pos, &stolen));
+	UASSERT(pos == v3s16(0, 0, 0) && !stolen);
+	UASSERT(queue.pop(1, &pos, &stolen));
+	UASSERT(pos == v3s16(5, 0, 0) && !stolen);
+	UASSERT(queue.pop(1, &pos, &stolen));
+	UASSERT(pos == v3s16(6, 0, 0) && !stolen);
+
+	// The chunk thread 0 works on is left to it, the next one is taken
+	UASSERT(queue.pop(1, &pos, &stolen));
+	UASSERT(pos == v3s16(10, 0, 0) && stolen);
+	UASSERTEQ(size_t, queue.size(0), 1);
+	UASSERTEQ(size_t, queue.size(1), 1);
+	UASSERT(queue.pop(1, &pos, &stolen));
+	UASSERT(pos == v3s16(11, 0, 0) && !stolen);
+
+	UASSERT(!queue.pop(1, &pos, &stolen));
+	UASSERT(queue.pop(0, &pos, &stolen));
+	UASSERT(pos == v3s16(1, 0, 0) && !stolen);
+	UASSERTEQ(size_t, queue.size(), 0);
+}
+
+void TestEmergeQueue::testUpdatePriorities()
+{
+	EmergeQueue queue(1, 5);
+	v3s16 pos;
+
+	for (s16 x = 0; x < 50; x += 5)
+		queue.push(v3s16(x, 0, 0), x);
+
+	// As if a player went from x = 0 to x = 30
+	queue.updatePriorities([](v3s16 p) {
+		return (float)abs(p.X - 30);
+	});
+
+	s16 last_distance = 0;
+	for (int i = 0; i < 10; i++) {
+		UASSERT(queue.pop(0, &pos));
+		UASSERT(abs(pos.X - 30) >= last_distance);
+		last_distance = abs(pos.X - 30);
+	}
+	UASSERTEQ(s16, last_distance, 30);
+
+	std::vector<v3s16> blocks;
+	queue.getBlocks(&blocks);
+	UASSERT(blocks.empty());
+}
+
+void TestEmergeQueue::testChunkGenTracker()
+{
+	ChunkGenTracker tracker(5);
+	std::vector<v3s16> waiting;
+
+	UASSERT(tracker.tryStart(v3s16(-2, -2, -2), v3s16(0, 0, 0)));
+	// Same chunk, and chunks next to it, even diagonally
+	UASSERT(!tracker.tryStart(v3s16(-2, -2, -2), v3s16(1, 0, 0)));
+	UASSERT(!tracker.tryStart(v3s16(3, -2, -2), v3s16(3, 0, 0)));
+	UASSERT(!tracker.tryStart(v3s16(-7, 3, 3), v3s16(-7, 3, 3)));
+	// The next ones have a chunk in between
+	UASSERT(tracker.tryStart(v3s16(8, -2, -2), v3s16(8, 0, 0)));
+	UASSERT(tracker.tryStart(v3s16(-2, -12, 3), v3s16(0, -12, 3)));
+	UASSERTEQ(size_t, tracker.size(), 3);
+
+	tracker.finish(v3s16(-2, -2, -2), &waiting);
+	UASSERTEQ(size_t, waiting.size(), 3);
+	UASSERT(waiting[0] == v3s16(1, 0, 0));
+	UASSERT(waiting[1] == v3s16(3, 0, 0));
+	UASSERT(waiting[2] == v3s16(-7, 3, 3));
+
+	// Still next to the chunk at x = 8
+	UASSERT(!tracker.tryStart(v3s16(3, -2, -2), v3s16(3, 0, 0)));
+	UASSERT(tracker.tryStart(v3s16(-2, -2, -2), v3s16(1, 0, 0)));
+
+	waiting.clear();
+	tracker.finish(v3s16(8, -2, -2), &waiting);
+	tracker.finish(v3s16(-2, -12, 3), &waiting);
+	tracker.finish(v3s16(-2, -2, -2), &waiting);
+	UASSERTEQ(size_t, waiting.size(), 1);
+	UASSERT(waiting[0] == v3s16(3, 0, 0));
+	UASSERTEQ(size_t, tracker.size(), 0);
+}
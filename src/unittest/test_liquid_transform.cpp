@@ -0,0 +1,265 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "gamedef.h"
+#include "map.h"
+#include "mapblock.h"
+#include "nodedef.h"
+#include "noise.h"
+#include "porting.h"
+#include "util/basic_macros.h"
+
+// A plain Map of blank blocks, full of air
+class LiquidTestMap : public TestMapBase {
+public:
+	LiquidTestMap(IGameDef *gamedef, const VoxelArea &blocks_) :
+		TestMapBase(gamedef, blocks_, MapNode(CONTENT_AIR))
+	{}
+};
+
+// The source and flowing nodes of a liquid flowing into each other
+static content_t c_liquid_source = CONTENT_IGNORE;
+static content_t c_liquid_flowing = CONTENT_IGNORE;
+
+class TestLiquidTransform : public TestBase {
+public:
+	TestLiquidTransform() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestLiquidTransform"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testLiquidQueue();
+	void testLiquidFlow(IGameDef *gamedef);
+	void testLiquidFlowThreads(IGameDef *gamedef);
+	void testLiquidFlowBenchmark(IGameDef *gamedef);
+
+	static void defineLiquid(IWritableNodeDefManager *ndef);
+	static void makeTerrain(LiquidTestMap *map, u32 seed, u32 num_sources);
+	static u32 flow(LiquidTestMap *map, u32 max_steps);
+};
+
+static TestLiquidTransform g_test_instance;
+
+void TestLiquidTransform::runTests(IGameDef *gamedef)
+{
+	defineLiquid((IWritableNodeDefManager *)gamedef->getNodeDefManager());
+
+	TEST(testLiquidQueue);
+	TEST(testLiquidFlow, gamedef);
+	TEST(testLiquidFlowThreads, gamedef);
+	TEST(testLiquidFlowBenchmark, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestLiquidTransform::testLiquidQueue()
+{
+	LiquidQueue queue;
+	v3s16 blockpos;
+	std::vector<u16> nodes;
+
+	UASSERT(!queue.popBlock(&blockpos, &nodes));
+
+	UASSERT(queue.push_back(v3s16(1, 2, 3)));
+	UASSERT(queue.push_back(v3s16(-1, 0, 0)));
+	UASSERT(queue.push_back(v3s16(15, 15, 15)));
+	UASSERT(!queue.push_back(v3s16(1, 2, 3)));
+	UASSERT(queue.push_back(v3s16(-16, 5, 0)));
+	UASSERT(queue.size() == 4);
+	UASSERT(queue.blockCount() == 2);
+
+	// Blocks come in the order they were first queued
+	UASSERT(queue.popBlock(&blockpos, &nodes));
+	UASSERT(blockpos == v3s16(0, 0, 0));
+	UASSERT(nodes.size() == 2);
+	UASSERT(nodes[0] == 3 * 256 + 2 * 16 + 1);
+	UASSERT(nodes[1] == 4095);
+	UASSERT(queue.size() == 2);
+
+	// A taken block is queued again
+	UASSERT(queue.push_back(v3s16(1, 2, 3)));
+	UASSERT(queue.popBlock(&blockpos, &nodes));
+	UASSERT(blockpos == v3s16(-1, 0, 0));
+	UASSERT(nodes.size() == 2);
+	UASSERT(nodes[0] == 15);
+	UASSERT(nodes[1] == 5 * 16);
+	UASSERT(queue.popBlock(&blockpos, &nodes));
+	UASSERT(blockpos == v3s16(0, 0, 0));
+	UASSERT(queue.size() == 0);
+	UASSERT(queue.blockCount() == 0);
+
+	// Shrinking drops the oldest nodes
+	for (s16 i = 0; i < 40; i++)
+		queue.push_back(v3s16(i % 16, i / 16, 0));
+	queue.shrink(30);
+	UASSERT(queue.size() == 30);
+	UASSERT(queue.push_back(v3s16(0, 0, 0)));
+	UASSERT(!queue.push_back(v3s16(7, 2, 0)));
+	queue.shrink(1);
+	UASSERT(queue.size() == 1);
+	UASSERT(queue.popBlock(&blockpos, &nodes));
+	UASSERT(blockpos == v3s16(0, 0, 0));
+	UASSERT(nodes.size() == 1 && nodes[0] == 0);
+}
+
+void TestLiquidTransform::defineLiquid(IWritableNodeDefManager *ndef)
+{
+	if (c_liquid_source != CONTENT_IGNORE)
+		return;
+
+	ContentFeatures f;
+	f.name = "test:liquid_source";
+	f.walkable = false;
+	f.liquid_type = LIQUID_SOURCE;
+	f.liquid_alternative_flowing = "test:liquid_flowing";
+	f.liquid_alternative_source = "test:liquid_source";
+	f.liquid_viscosity = 4;
+	c_liquid_source = ndef->set(f.name, f);
+
+	f.name = "test:liquid_flowing";
+	f.param_type_2 = CPT2_FLOWINGLIQUID;
+	f.liquid_type = LIQUID_FLOWING;
+	c_liquid_flowing = ndef->set(f.name, f);
+}
+
+void TestLiquidTransform::makeTerrain(LiquidTestMap *map, u32 seed,
+	u32 num_sources)
+{
+	PcgRandom pr(seed);
+	VoxelArea area = map->getNodeArea();
+
+	// Terraced stone with pits, walled in, and water sources above it
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++) {
+		s16 ground = area.MinEdge.Y + 4 + (x / 8 + z / 12) % 4;
+		if (x == area.MinEdge.X || x == area.MaxEdge.X ||
+				z == area.MinEdge.Z || z == area.MaxEdge.Z)
+			ground = area.MaxEdge.Y - 4;
+		else if (pr.range(0, 15) == 0)
+			ground -= 2;
+		for (s16 y = area.MinEdge.Y; y <= ground; y++) {
+			MapNode n(t_CONTENT_STONE);
+			map->setNode(v3s16(x, y, z), n);
+		}
+	}
+
+	for (u32 i = 0; i < num_sources; i++) {
+		v3s16 p(pr.range(area.MinEdge.X + 1, area.MaxEdge.X - 1),
+			area.MaxEdge.Y - 6,
+			pr.range(area.MinEdge.Z + 1, area.MaxEdge.Z - 1));
+		MapNode n(c_liquid_source);
+		map->setNode(p, n);
+		map->transforming_liquid_add(p);
+	}
+}
+
+u32 TestLiquidTransform::flow(LiquidTestMap *map, u32 max_steps)
+{
+	// Transforms until the liquids settle, returns the number of steps
+	u32 steps = 0;
+	while (map->transforming_liquid_size() > 0 && steps < max_steps) {
+		std::map<v3s16, MapBlock *> modified_blocks;
+		map->transformLiquids(modified_blocks, NULL);
+		steps++;
+	}
+	return steps;
+}
+
+void TestLiquidTransform::testLiquidFlow(IGameDef *gamedef)
+{
+	LiquidTestMap map(gamedef, VoxelArea(v3s16(-2, -1, -2), v3s16(1, 0, 1)));
+	VoxelArea area = map.getNodeArea();
+	makeTerrain(&map, 13, 6);
+
+	u32 steps = flow(&map, 5000);
+	UASSERT(steps < 5000);
+
+	// The water flowed down and spread on the ground
+	u32 num_flowing = 0;
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++) {
+		if (map.getNodeNoEx(v3s16(x, y, z)).getContent() ==
+				c_liquid_flowing)
+			num_flowing++;
+	}
+	UASSERT(num_flowing > 100);
+
+	// Settled liquids don't change when transformed again
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++)
+		map.transforming_liquid_add(v3s16(x, y, z));
+	while (map.transforming_liquid_size() > 0) {
+		std::map<v3s16, MapBlock *> modified_blocks;
+		map.transformLiquids(modified_blocks, NULL);
+		UASSERT(modified_blocks.empty());
+	}
+}
+
+void TestLiquidTransform::testLiquidFlowThreads(IGameDef *gamedef)
+{
+	// Liquids flow the same way whatever the number of threads
+	VoxelArea blocks(v3s16(-2, -1, -2), v3s16(1, 0, 1));
+	LiquidTestMap map1(gamedef, blocks);
+	LiquidTestMap map4(gamedef, blocks);
+	map4.setLiquidTransformThreads(4);
+	makeTerrain(&map1, 71, 20);
+	makeTerrain(&map4, 71, 20);
+
+	for (u32 step = 0; step < 40; step++) {
+		std::map<v3s16, MapBlock *> modified_blocks1, modified_blocks4;
+		map1.transformLiquids(modified_blocks1, NULL);
+		map4.transformLiquids(modified_blocks4, NULL);
+		UASSERT(modified_blocks1.size() == modified_blocks4.size());
+		UASSERT(map1.transforming_liquid_size() ==
+			map4.transforming_liquid_size());
+	}
+
+	VoxelArea area = map1.getNodeArea();
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++) {
+		MapNode n1 = map1.getNodeNoEx(v3s16(x, y, z));
+		MapNode n4 = map4.getNodeNoEx(v3s16(x, y, z));
+		UASSERT(n1.getContent() == n4.getContent() && n1.param2 == n4.param2);
+	}
+}
+
+void TestLiquidTransform::testLiquidFlowBenchmark(IGameDef *gamedef)
+{
+	VoxelArea blocks(v3s16(-3, -1, -3), v3s16(2, 0, 2));
+	u16 threads[] = {1, 4};
+	for (size_t i = 0; i < ARRLEN(threads); i++) {
+		LiquidTestMap map(gamedef, blocks);
+		map.setLiquidTransformThreads(threads[i]);
+		makeTerrain(&map, 29, 200);
+
+		u64 t0 = porting::getTimeUs();
+		u32 steps = flow(&map, 10000);
+		u64 t1 = porting::getTimeUs();
+
+		infostream << "TestLiquidTransform: flood of "
+			<< map.getNodeArea().getVolume() << " nodes on " << threads[i]
+			<< " threads: " << steps << " steps, "
+			<< (t1 - t0) / 1000.0f / steps << " ms per step" << std::endl;
+	}
+}
@@ -0,0 +1,174 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "lua_api/l_vmanip.h"
+#include "map.h"
+#include "porting.h"
+
+extern "C" {
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+class TestLuaVoxelManip : public TestBase {
+public:
+	TestLuaVoxelManip() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestLuaVoxelManip"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testBuffer();
+	void testBufferBenchmark();
+
+	static lua_State *newState(MMVManip *vm);
+	static void runScript(lua_State *L, const char *script);
+};
+
+static TestLuaVoxelManip g_test_instance;
+
+void TestLuaVoxelManip::runTests(IGameDef *gamedef)
+{
+	TEST(testBuffer);
+	TEST(testBufferBenchmark);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+lua_State *TestLuaVoxelManip::newState(MMVManip *vm)
+{
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	LuaVoxelManip::Register(L);
+	LuaVoxelManipBuffer::Register(L);
+
+	// The global "vm", like a mapgen VoxelManip it doesn't own its data
+	LuaVoxelManip *o = new LuaVoxelManip(vm, true);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, "VoxelManip");
+	lua_setmetatable(L, -2);
+	lua_setglobal(L, "vm");
+
+	return L;
+}
+
+void TestLuaVoxelManip::runScript(lua_State *L, const char *script)
+{
+	if (luaL_loadstring(L, script) || lua_pcall(L, 0, 0, 0)) {
+		rawstream << "Lua error: " << lua_tostring(L, -1) << std::endl;
+		lua_pop(L, 1);
+		throw TestFailedException();
+	}
+}
+
+void TestLuaVoxelManip::testBuffer()
+{
+	MMVManip vm(NULL);
+	VoxelArea area(v3s16(-3, 0, 2), v3s16(6, 9, 11));
+	vm.addArea(area);
+	for (s32 i = 0; i != area.getVolume(); i++)
+		vm.m_data[i] = MapNode(i % 100, i % 16, i % 7);
+
+	lua_State *L = newState(&vm);
+	runScript(L,
+		"local data = vm:get_data_buffer()\n"
+		"local light = vm:get_light_buffer()\n"
+		"local param2 = vm:get_param2_buffer()\n"
+		"assert(#data == 1000 and #light == 1000 and #param2 == 1000)\n"
+		"assert(data[0] == nil and data[1001] == nil and data.x == nil)\n"
+		"for i = 1, #data do\n"
+		"	assert(data[i] == (i - 1) % 100)\n"
+		"	assert(light[i] == (i - 1) % 16)\n"
+		"	assert(param2[i] == (i - 1) % 7)\n"
+		"end\n"
+		"assert(not pcall(function() data[1001] = 1 end))\n"
+		"assert(not pcall(function() data[0] = 1 end))\n"
+		"for i = 1, #data do\n"
+		"	data[i] = i + 1000\n"
+		"	param2[i] = i % 256\n"
+		"end\n"
+		"light[5] = 255\n"
+		// The buffer works on after the VoxelManip is gone from Lua
+		"vm = nil\n"
+		"collectgarbage()\n"
+		"assert(data[1] == 1001)\n"
+		"data[2] = 7\n");
+	lua_close(L);
+
+	for (s32 i = 0; i != area.getVolume(); i++) {
+		UASSERTEQ(content_t, vm.m_data[i].getContent(), i == 1 ? 7 : i + 1001);
+		UASSERTEQ(int, vm.m_data[i].param1, i == 4 ? 255 : i % 16);
+		UASSERTEQ(int, vm.m_data[i].param2, (i + 1) % 256);
+	}
+}
+
+void TestLuaVoxelManip::testBufferBenchmark()
+{
+	// A mapchunk, changing some of the nodes like a mapgen mod
+	MMVManip vm(NULL);
+	VoxelArea area(v3s16(0, 0, 0), v3s16(79, 79, 79));
+	vm.addArea(area);
+	for (s32 i = 0; i != area.getVolume(); i++)
+		vm.m_data[i] = MapNode(i % 3);
+
+	lua_State *L = newState(&vm);
+	runScript(L,
+		"table_data = {}\n"
+		"function table_round_trip(step)\n"
+		"	local data = vm:get_data(table_data)\n"
+		"	for i = 1, #data, step do\n"
+		"		if data[i] == 1 then\n"
+		"			data[i] = 5\n"
+		"		end\n"
+		"	end\n"
+		"	vm:set_data(data)\n"
+		"end\n"
+		"function buffer_round_trip(step)\n"
+		"	local data = vm:get_data_buffer()\n"
+		"	for i = 1, #data, step do\n"
+		"		if data[i] == 5 then\n"
+		"			data[i] = 1\n"
+		"		end\n"
+		"	end\n"
+		"end\n");
+
+	// Every node, then one node out of 64 like a mod placing decorations
+	const int rounds = 3;
+	const char *steps[] = {"1", "64"};
+	for (size_t s = 0; s < ARRLEN(steps); s++) {
+		std::string step = std::string("(") + steps[s] + ")";
+		u64 t0 = porting::getTimeUs();
+		for (int i = 0; i < rounds; i++)
+			runScript(L, ("table_round_trip" + step).c_str());
+		u64 t1 = porting::getTimeUs();
+		for (int i = 0; i < rounds; i++)
+			runScript(L, ("buffer_round_trip" + step).c_str());
+		u64 t2 = porting::getTimeUs();
+
+		infostream << "TestLuaVoxelManip: " << area.getVolume()
+			<< " nodes, step " << steps[s] << ": tables: "
+			<< (t1 - t0) / 1000.0f / rounds << " ms, buffer: "
+			<< (t2 - t1) / 1000.0f / rounds << " ms" << std::endl;
+	}
+	lua_close(L);
+
+	for (s32 i = 0; i != area.getVolume(); i++)
+		UASSERTEQ(content_t, vm.m_data[i].getContent(), i % 3);
+}
@@ -0,0 +1,200 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "gamedef.h"
+#include "map.h"
+#include "mapblock.h"
+#include "mapsector.h"
+#include "porting.h"
+#include "server.h"
+#include "util/numeric.h"
+
+// The lookup through the sectors, as done before the block index
+static MapNode get_node_through_sector(Map *map, v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapSector *sector = map->getSectorNoGenerateNoEx(v2s16(blockpos.X, blockpos.Z));
+	MapBlock *block = sector ? sector->getBlockNoCreateNoEx(blockpos.Y) : NULL;
+	if (!block)
+		return MapNode(CONTENT_IGNORE);
+	bool is_valid_p;
+	return block->getNodeNoCheck(p - blockpos * MAP_BLOCKSIZE, &is_valid_p);
+}
+
+class TestMap : public TestBase {
+public:
+	TestMap() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMap"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testBlockIndex(IGameDef *gamedef);
+	void testGetNodeBenchmark(IGameDef *gamedef);
+	void testBlockDataCache(IGameDef *gamedef);
+};
+
+static TestMap g_test_instance;
+
+void TestMap::runTests(IGameDef *gamedef)
+{
+	TEST(testBlockIndex, gamedef);
+	TEST(testGetNodeBenchmark, gamedef);
+	TEST(testBlockDataCache, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestMap::testBlockIndex(IGameDef *gamedef)
+{
+	TestMapBase map(gamedef);
+
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 0, 0)) == NULL);
+
+	// A cached miss must not hide a block that is added later
+	MapBlock *b0 = map.createBlock(v3s16(0, 0, 0));
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 0, 0)) == b0);
+
+	MapBlock *b1 = map.createBlock(v3s16(0, -1, 0));
+	MapBlock *b2 = map.createBlock(v3s16(-3, 7, 2));
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, -1, 0)) == b1);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(-3, 7, 2)) == b2);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 0, 0)) == b0);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 1, 0)) == NULL);
+
+	// Neither may a cached hit outlive its block
+	MapSector *sector = map.getSectorNoGenerateNoEx(v2s16(0, 0));
+	sector->deleteBlock(b1);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, -1, 0)) == NULL);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 0, 0)) == b0);
+
+	std::vector<v2s16> sectors;
+	sectors.push_back(v2s16(0, 0));
+	map.deleteSectors(sectors);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 0, 0)) == NULL);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(-3, 7, 2)) == b2);
+
+	// Lookups in a second map don't see the blocks of the first one
+	TestMapBase map2(gamedef);
+	UASSERT(map2.getBlockNoCreateNoEx(v3s16(-3, 7, 2)) == NULL);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(-3, 7, 2)) == b2);
+}
+
+void TestMap::testGetNodeBenchmark(IGameDef *gamedef)
+{
+	TestMapBase map(gamedef);
+
+	// 8x4x8 blocks filled with a mix of contents
+	const v3s16 bmin(-4, -2, -4);
+	const v3s16 bmax(3, 1, 3);
+	const content_t contents[] = {
+		CONTENT_AIR, t_CONTENT_STONE, t_CONTENT_GRASS, t_CONTENT_WATER,
+	};
+	PseudoRandom pr(1234);
+	v3s16 bp;
+	for (bp.Z = bmin.Z; bp.Z <= bmax.Z; bp.Z++)
+	for (bp.Y = bmin.Y; bp.Y <= bmax.Y; bp.Y++)
+	for (bp.X = bmin.X; bp.X <= bmax.X; bp.X++) {
+		MapBlock *block = map.createBlock(bp);
+		for (u32 i = 0; i < MapBlock::nodecount; i++)
+			block->getData()[i] = MapNode(contents[pr.range(0, 3)]);
+	}
+
+	const v3s16 nmin = bmin * MAP_BLOCKSIZE;
+	const v3s16 nmax = (bmax + v3s16(1, 1, 1)) * MAP_BLOCKSIZE - v3s16(1, 1, 1);
+
+	// Random reads, partly outside of the loaded area
+	std::vector<v3s16> positions(1 << 18);
+	for (size_t i = 0; i < positions.size(); i++)
+		positions[i] = v3s16(pr.range(nmin.X - 8, nmax.X + 8),
+			pr.range(nmin.Y - 8, nmax.Y + 8),
+			pr.range(nmin.Z - 8, nmax.Z + 8));
+
+	u64 sum_sector = 0, sum_index = 0;
+	u64 t0 = porting::getTimeUs();
+	for (size_t i = 0; i < positions.size(); i++)
+		sum_sector += get_node_through_sector(&map, positions[i]).getContent();
+	u64 t1 = porting::getTimeUs();
+	for (size_t i = 0; i < positions.size(); i++)
+		sum_index += map.getNodeNoEx(positions[i]).getContent();
+	u64 t2 = porting::getTimeUs();
+	UASSERTEQ(u64, sum_index, sum_sector);
+
+	infostream << "TestMap: " << positions.size() << " random reads: sectors "
+		<< (t1 - t0) << "us, block index " << (t2 - t1) << "us" << std::endl;
+
+	// Locally coherent reads, as done by a scan over an area
+	sum_sector = sum_index = 0;
+	v3s16 p;
+	t0 = porting::getTimeUs();
+	for (p.Z = nmin.Z; p.Z <= nmax.Z; p.Z++)
+	for (p.Y = nmin.Y; p.Y <= nmax.Y; p.Y++)
+	for (p.X = nmin.X; p.X <= nmax.X; p.X++)
+		sum_sector += get_node_through_sector(&map, p).getContent();
+	t1 = porting::getTimeUs();
+	for (p.Z = nmin.Z; p.Z <= nmax.Z; p.Z++)
+	for (p.Y = nmin.Y; p.Y <= nmax.Y; p.Y++)
+	for (p.X = nmin.X; p.X <= nmax.X; p.X++)
+		sum_index += map.getNodeNoEx(p).getContent();
+	t2 = porting::getTimeUs();
+	UASSERTEQ(u64, sum_index, sum_sector);
+
+	infostream << "TestMap: coherent reads of " << (8 * 4 * 8) << " blocks: sectors "
+		<< (t1 - t0) << "us, block index " << (t2 - t1) << "us" << std::endl;
+}
+
+void TestMap::testBlockDataCache(IGameDef *gamedef)
+{
+	TestMapBase map(gamedef);
+	MapBlock *b0 = map.createBlock(v3s16(0, 0, 0));
+	MapBlock *b1 = map.createBlock(v3s16(1, 0, 0));
+
+	BlockDataCache cache;
+	std::shared_ptr<const std::string> data0 =
+		std::make_shared<const std::string>("block 0");
+	cache.set(b0, 28, data0);
+	cache.set(b1, 28, std::make_shared<const std::string>("block 1"));
+	UASSERT(cache.get(b0, 28) == data0);
+	UASSERT(!cache.get(b0, 27));
+	UASSERTEQ(size_t, cache.size(), 2);
+
+	// Changes invalidate the cached data
+	MapNode n(t_CONTENT_STONE);
+	b0->setNode(v3s16(0, 0, 0), n);
+	UASSERT(!cache.get(b0, 28));
+	UASSERTEQ(size_t, cache.size(), 1);
+
+	// A block loaded again at the same position doesn't get the old data
+	cache.set(b0, 28, data0);
+	MapSector *sector = map.getSectorNoGenerateNoEx(v2s16(0, 0));
+	sector->deleteBlock(b0);
+	b0 = map.createBlock(v3s16(0, 0, 0));
+	UASSERT(!cache.get(b0, 28));
+
+	// Pruning drops unloaded and changed blocks, and keeps the others
+	cache.set(b0, 28, data0);
+	sector->deleteBlock(b0);
+	cache.prune(&map);
+	UASSERTEQ(size_t, cache.size(), 1);
+	UASSERT(cache.get(b1, 28));
+	b1->setNode(v3s16(0, 0, 0), n);
+	cache.prune(&map);
+	UASSERTEQ(size_t, cache.size(), 0);
+}
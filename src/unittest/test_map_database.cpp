@@ -0,0 +1,136 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <algorithm>
+#include "database-sqlite3.h"
+#include "settings.h"
+#include "util/string.h"
+
+class TestMapDatabase : public TestBase {
+public:
+	TestMapDatabase() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapDatabase"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testSQLite3(bool async_save);
+	void testSQLite3AsyncSave();
+};
+
+static TestMapDatabase g_test_instance;
+
+void TestMapDatabase::runTests(IGameDef *gamedef)
+{
+	bool async_save = g_settings->getBool("sqlite_async_save");
+
+	TEST(testSQLite3, false);
+	TEST(testSQLite3, true);
+	TEST(testSQLite3AsyncSave);
+
+	g_settings->setBool("sqlite_async_save", async_save);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static std::string block_data(const v3s16 &pos, int generation)
+{
+	return "block " + itos(pos.X) + "," + itos(pos.Y) + "," + itos(pos.Z) +
+		" generation " + itos(generation);
+}
+
+void TestMapDatabase::testSQLite3(bool async_save)
+{
+	g_settings->setBool("sqlite_async_save", async_save);
+	std::string savedir = getTestTempDirectory() +
+		(async_save ? DIR_DELIM "async" : DIR_DELIM "sync");
+
+	std::vector<v3s16> positions;
+	for (s16 i = 0; i < 100; i++)
+		positions.push_back(v3s16(i * 7 - 300, i % 5 - 2, -i));
+
+	{
+		MapDatabaseSQLite3 db(savedir);
+		db.beginSave();
+		for (size_t i = 0; i < positions.size(); i++)
+			UASSERT(db.saveBlock(positions[i], block_data(positions[i], 0)));
+		db.endSave();
+
+		// A second save overrides the first one
+		db.beginSave();
+		for (size_t i = 0; i < positions.size(); i += 2)
+			UASSERT(db.saveBlock(positions[i], block_data(positions[i], 1)));
+		db.endSave();
+
+		// Blocks read back right after saving, whether written or not
+		for (size_t i = 0; i < positions.size(); i++) {
+			std::string data;
+			db.loadBlock(positions[i], &data);
+			UASSERT(data == block_data(positions[i], i % 2 ? 0 : 1));
+		}
+
+		UASSERT(db.deleteBlock(positions[1]));
+		std::string data;
+		db.loadBlock(positions[1], &data);
+		UASSERT(data.empty());
+	}
+
+	MapDatabaseSQLite3 db(savedir);
+
+	std::vector<v3s16> listed;
+	db.listAllLoadableBlocks(listed);
+	UASSERTEQ(size_t, listed.size(), positions.size() - 1);
+	for (size_t i = 0; i < positions.size(); i++) {
+		bool found = std::find(listed.begin(), listed.end(), positions[i]) !=
+			listed.end();
+		UASSERT(found == (i != 1));
+	}
+
+	for (size_t i = 0; i < positions.size(); i++) {
+		std::string data;
+		db.loadBlock(positions[i], &data);
+		if (i == 1)
+			UASSERT(data.empty());
+		else
+			UASSERT(data == block_data(positions[i], i % 2 ? 0 : 1));
+	}
+}
+
+void TestMapDatabase::testSQLite3AsyncSave()
+{
+	g_settings->setBool("sqlite_async_save", true);
+	std::string savedir = getTestTempDirectory() + DIR_DELIM "async_many";
+
+	// Saves outside of beginSave()/endSave() are written too
+	{
+		MapDatabaseSQLite3 db(savedir);
+		for (s16 i = 0; i < 1000; i++)
+			UASSERT(db.saveBlock(v3s16(i, 0, 0), block_data(v3s16(i, 0, 0), i)));
+	}
+
+	// The database can be read by a connection that doesn't write
+	g_settings->setBool("sqlite_async_save", false);
+	MapDatabaseSQLite3 db(savedir);
+	for (s16 i = 0; i < 1000; i++) {
+		std::string data;
+		db.loadBlock(v3s16(i, 0, 0), &data);
+		UASSERT(data == block_data(v3s16(i, 0, 0), i));
+	}
+}
@@ -0,0 +1,231 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <map>
+#include <sstream>
+
+#include "gamedef.h"
+#include "mapblock.h"
+#include "mapblock_serializer.h"
+#include "serialization.h"
+#include "voxel.h"
+#include "util/numeric.h"
+
+class TestMapBlock : public TestBase {
+public:
+	TestMapBlock() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapBlock"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testContentSummaryEdits(IGameDef *gamedef);
+	void testContentSummaryBulk(IGameDef *gamedef);
+	void testModCounter(IGameDef *gamedef);
+	void testSerializer(IGameDef *gamedef);
+
+private:
+	void checkContentSummary(MapBlock &block);
+};
+
+static TestMapBlock g_test_instance;
+
+void TestMapBlock::runTests(IGameDef *gamedef)
+{
+	TEST(testContentSummaryEdits, gamedef);
+	TEST(testContentSummaryBulk, gamedef);
+	TEST(testModCounter, gamedef);
+	TEST(testSerializer, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestMapBlock::checkContentSummary(MapBlock &block)
+{
+	// Count contents with a full scan of the block
+	std::map<content_t, u16> counts;
+	v3s16 p;
+	for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+	for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+	for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++)
+		counts[block.getNodeNoEx(p).getContent()]++;
+
+	const std::vector<content_t> &contents = block.getContents();
+	UASSERTEQ(size_t, contents.size(), counts.size());
+
+	size_t i = 0;
+	for (std::map<content_t, u16>::const_iterator it = counts.begin();
+			it != counts.end(); ++it, i++) {
+		UASSERTEQ(content_t, contents[i], it->first);
+		UASSERTEQ(u16, block.getContentCount(it->first), it->second);
+		UASSERT(block.containsContent(it->first));
+	}
+	UASSERT(block.isUniform(contents[0]) == (contents.size() == 1));
+}
+
+void TestMapBlock::testContentSummaryEdits(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+
+	// Freshly allocated blocks are all ignore
+	UASSERT(block.isUniform(CONTENT_IGNORE));
+	UASSERTEQ(u16, block.getContentCount(CONTENT_IGNORE), MapBlock::nodecount);
+	UASSERT(!block.containsContent(CONTENT_AIR));
+
+	const content_t palette[] = {
+		CONTENT_AIR, CONTENT_IGNORE,
+		t_CONTENT_STONE, t_CONTENT_GRASS, t_CONTENT_WATER, t_CONTENT_LAVA,
+	};
+	const u32 palette_size = sizeof(palette) / sizeof(palette[0]);
+
+	PseudoRandom pr(1337);
+	for (u32 i = 0; i < 20000; i++) {
+		MapNode n(palette[pr.range(0, palette_size - 1)]);
+		s16 x = pr.range(0, MAP_BLOCKSIZE - 1);
+		s16 y = pr.range(0, MAP_BLOCKSIZE - 1);
+		s16 z = pr.range(0, MAP_BLOCKSIZE - 1);
+		if (i % 2)
+			block.setNode(x, y, z, n);
+		else
+			block.setNodeNoCheck(x, y, z, n);
+
+		// Query in between so that the updates are incremental
+		if (i % 997 == 0)
+			checkContentSummary(block);
+	}
+	checkContentSummary(block);
+
+	// Fill the block with a single content again
+	MapNode stone(t_CONTENT_STONE);
+	block.drawbox(0, 0, 0, MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE, stone);
+	UASSERT(block.isUniform(t_CONTENT_STONE));
+	checkContentSummary(block);
+}
+
+void TestMapBlock::testContentSummaryBulk(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+
+	PseudoRandom pr(42);
+	v3s16 p;
+	for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+	for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+	for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++) {
+		MapNode n(pr.range(0, 1) ? t_CONTENT_STONE : CONTENT_AIR);
+		block.setNode(p, n);
+	}
+	checkContentSummary(block);
+
+	// Copying in from a VoxelManipulator replaces the data wholesale
+	VoxelManipulator vm;
+	VoxelArea area(v3s16(0, 0, 0), v3s16(MAP_BLOCKSIZE - 1,
+		MAP_BLOCKSIZE - 1, MAP_BLOCKSIZE - 1));
+	vm.addArea(area);
+	for (s32 i = 0; i < area.getVolume(); i++)
+		vm.m_data[i] = MapNode(i % 3 ? t_CONTENT_WATER : t_CONTENT_GRASS);
+	block.copyFrom(vm);
+	UASSERT(!block.containsContent(t_CONTENT_STONE));
+	checkContentSummary(block);
+
+	// A deserialized block summarizes the new data, not the old one
+	std::ostringstream os(std::ios_base::binary);
+	block.serialize(os, SER_FMT_VER_HIGHEST_WRITE, true);
+
+	MapBlock block2(NULL, v3s16(0, 0, 0), gamedef);
+	UASSERT(block2.isUniform(CONTENT_IGNORE));
+	std::istringstream is(os.str(), std::ios_base::binary);
+	block2.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, true);
+	UASSERT(!block2.containsContent(CONTENT_IGNORE));
+	checkContentSummary(block2);
+	UASSERTEQ(u16, block2.getContentCount(t_CONTENT_WATER),
+		block.getContentCount(t_CONTENT_WATER));
+}
+
+void TestMapBlock::testModCounter(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	MapBlock block2(NULL, v3s16(0, 0, 0), gamedef);
+	UASSERT(block.getModCounter() != block2.getModCounter());
+
+	u64 counter = block.getModCounter();
+	MapNode n(t_CONTENT_STONE);
+	block.setNode(v3s16(1, 2, 3), n);
+	UASSERT(block.getModCounter() != counter);
+
+	// Saving doesn't change the block
+	counter = block.getModCounter();
+	block.resetModified();
+	std::ostringstream os(std::ios_base::binary);
+	block.serialize(os, SER_FMT_VER_HIGHEST_WRITE, false);
+	UASSERTEQ(u64, block.getModCounter(), counter);
+
+	VoxelManipulator vm;
+	vm.addArea(VoxelArea(v3s16(0, 0, 0), v3s16(MAP_BLOCKSIZE - 1,
+		MAP_BLOCKSIZE - 1, MAP_BLOCKSIZE - 1)));
+	block.copyTo(vm);
+	block.copyFrom(vm);
+	UASSERT(block.getModCounter() != counter);
+}
+
+void TestMapBlock::testSerializer(IGameDef *gamedef)
+{
+	const content_t palette[] = {
+		CONTENT_AIR, t_CONTENT_STONE, t_CONTENT_GRASS, t_CONTENT_WATER,
+	};
+
+	std::vector<MapBlock *> blocks;
+	PseudoRandom pr(7);
+	for (s16 i = 0; i < 20; i++) {
+		MapBlock *block = new MapBlock(NULL, v3s16(i, 0, 0), gamedef);
+		v3s16 p;
+		for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+		for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+		for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++) {
+			MapNode n(palette[pr.range(0, i % 4)], pr.range(0, 15), i);
+			block->setNode(p, n);
+		}
+		blocks.push_back(block);
+	}
+	// Blocks can be listed more than once
+	blocks.push_back(blocks[3]);
+
+	MapBlockSerializer serializer(gamedef, 4);
+	for (int disk = 0; disk < 2; disk++) {
+		std::vector<std::shared_ptr<const std::string>> results;
+		serializer.serialize(blocks, SER_FMT_VER_HIGHEST_WRITE, disk, &results);
+		UASSERTEQ(size_t, results.size(), blocks.size());
+		UASSERT(results[3] == results.back());
+
+		for (size_t i = 0; i < blocks.size(); i++) {
+			std::ostringstream os(std::ios_base::binary);
+			blocks[i]->serialize(os, SER_FMT_VER_HIGHEST_WRITE, disk);
+			UASSERT(results[i] && *results[i] == os.str());
+
+			MapBlock block2(NULL, blocks[i]->getPos(), gamedef);
+			std::istringstream is(*results[i], std::ios_base::binary);
+			block2.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, disk);
+			for (u32 j = 0; j < MapBlock::nodecount; j++)
+				UASSERT(block2.getData()[j] == blocks[i]->getData()[j]);
+		}
+	}
+
+	for (size_t i = 0; i < blocks.size() - 1; i++)
+		delete blocks[i];
+}
@@ -19,8 +19,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "test.h"
 
+#include <string.h>
 #include "exceptions.h"
 #include "noise.h"
+#include "noise_cache.h"
+#include "porting.h"
+#include "util/basic_macros.h"
 
 class TestNoise : public TestBase {
 public:
@@ -34,6 +38,9 @@ class TestNoise : public TestBase {
 	void testNoise3dPoint();
 	void testNoise3dBulk();
 	void testNoiseInvalidParams();
+	void testNoiseSIMD();
+	void testNoiseBenchmark();
+	void testNoiseMapCache();
 
 	static const float expected_2d_results[10 * 10];
 	static const float expected_3d_results[10 * 10 * 10];
@@ -48,6 +55,9 @@ void TestNoise::runTests(IGameDef *gamedef)
 	TEST(testNoise3dPoint);
 	TEST(testNoise3dBulk);
 	TEST(testNoiseInvalidParams);
+	TEST(testNoiseSIMD);
+	TEST(testNoiseBenchmark);
+	TEST(testNoiseMapCache);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -120,6 +130,173 @@ void TestNoise::testNoiseInvalidParams()
 	UASSERT(exception_thrown);
 }
 
+static const NoiseSIMD all_noise_simd[] = {
+	NOISE_SIMD_NONE,
+	NOISE_SIMD_SSE2,
+	NOISE_SIMD_AVX2,
+};
+
+void TestNoise::testNoiseMapCache()
+{
+	NoiseParams np_terrain(4, 70, v3f(600, 600, 600), 82341, 5, 0.6, 2.0);
+	NoiseParams np_persist(0.6, 0.1, v3f(2000, 2000, 2000), 539, 3, 0.6, 2.0);
+	Noise terrain(&np_terrain, 1337, 20, 20);
+	Noise persist(&np_persist, 1337, 20, 20);
+	Noise expected(&np_terrain, 1337, 20, 20);
+	Noise expected_persist(&np_persist, 1337, 20, 20);
+
+	NoiseMapCache cache(3);
+	u32 hits, misses;
+
+	// Two stacked chunks, then the first map again after a change of
+	// position and of the result
+	for (int i = 0; i != 2; i++) {
+		expected_persist.perlinMap2D(-80, 160);
+		expected.perlinMap2D(-80, 160, expected_persist.result);
+		cache.perlinMap2D(&terrain, -80, 160, &persist);
+		UASSERT(memcmp(terrain.result, expected.result,
+			20 * 20 * sizeof(float)) == 0);
+		terrain.result[0] = 1000;
+	}
+	cache.takeStats(&hits, &misses);
+	UASSERTEQ(u32, hits, 1);
+	UASSERTEQ(u32, misses, 2);
+	UASSERTEQ(size_t, cache.size(), 2);
+
+	// The persistence map is part of the key
+	cache.perlinMap2D(&terrain, -80, 160);
+	expected.perlinMap2D(-80, 160);
+	UASSERT(memcmp(terrain.result, expected.result,
+		20 * 20 * sizeof(float)) == 0);
+
+	cache.takeStats(&hits, &misses);
+	UASSERTEQ(u32, hits, 0);
+	UASSERTEQ(u32, misses, 1);
+
+	// The least recently used map, the persistence one, goes first
+	cache.perlinMap2D(&terrain, -60, 160);
+	UASSERTEQ(size_t, cache.size(), 3);
+	cache.perlinMap2D(&terrain, -80, 160);
+	cache.perlinMap2D(&terrain, -80, 160, &persist);
+	cache.perlinMap2D(&persist, -80, 160);
+	cache.takeStats(&hits, &misses);
+	UASSERTEQ(u32, hits, 2);
+	UASSERTEQ(u32, misses, 2);
+
+	// Disabled cache
+	cache.setMaxMaps(0);
+	UASSERTEQ(size_t, cache.size(), 0);
+	cache.perlinMap2D(&terrain, -80, 160);
+	cache.perlinMap2D(&terrain, -80, 160);
+	cache.takeStats(&hits, &misses);
+	UASSERTEQ(u32, hits + misses, 0);
+}
+
+void TestNoise::testNoiseSIMD()
+{
+	NoiseSIMD simd = getNoiseSIMD();
+
+	// Sizes that are not multiples of the vector width, a spread that
+	// puts several lattice points in a row and a lacunarity below 1
+	NoiseParams params[] = {
+		NoiseParams(0, 40, v3f(80, 80, 80), 983240, 4, 0.55, 2.0, NOISE_FLAG_EASED),
+		NoiseParams(-0.6, 1, v3f(250, 350, 250), 5333, 5, 0.63, 2.0),
+		NoiseParams(0, 1, v3f(100, 100, 100), 6467, 4, 0.75, 2.0, NOISE_FLAG_ABSVALUE),
+		NoiseParams(12, 1, v3f(2557, 2557, 2557), 6538, 4, 0.8, 0.5),
+		NoiseParams(0, 12, v3f(7, 5, 3), 52534, 3, 0.5, 2.0),
+	};
+
+	float persistence_map[37 * 19 * 11];
+	for (u32 i = 0; i != 37 * 19 * 11; i++)
+		persistence_map[i] = 0.4 + (i % 7) * 0.05;
+
+	for (size_t p = 0; p != ARRLEN(params); p++)
+	for (int dims = 2; dims <= 3; dims++)
+	for (int persist = 0; persist <= 1; persist++) {
+		float *pmap = persist ? persistence_map : NULL;
+		size_t size = dims == 3 ? 37 * 19 * 11 : 37 * 19;
+
+		UASSERT(setNoiseSIMD(NOISE_SIMD_NONE));
+		Noise expected(&params[p], 1337, 37, 19, dims == 3 ? 11 : 1);
+		if (dims == 3)
+			expected.perlinMap3D(-1234.5, 77, 4321, pmap);
+		else
+			expected.perlinMap2D(-1234.5, 77, pmap);
+
+		for (size_t s = 1; s != ARRLEN(all_noise_simd); s++) {
+			if (!setNoiseSIMD(all_noise_simd[s]))
+				continue;
+
+			Noise actual(&params[p], 1337, 37, 19, dims == 3 ? 11 : 1);
+			if (dims == 3)
+				actual.perlinMap3D(-1234.5, 77, 4321, pmap);
+			else
+				actual.perlinMap2D(-1234.5, 77, pmap);
+
+			// The kernels do the same operations in the same order
+			UASSERT(memcmp(actual.result, expected.result,
+				size * sizeof(float)) == 0);
+		}
+	}
+
+	UASSERT(setNoiseSIMD(simd));
+}
+
+void TestNoise::testNoiseBenchmark()
+{
+	NoiseSIMD simd = getNoiseSIMD();
+
+	// Chunk sized noises of the mapgens, as made by their constructors
+	struct {
+		const char *name;
+		NoiseParams np;
+		u32 sy;
+		u32 sz;
+	} configs[] = {
+		{"mgv5 ground", NoiseParams(0, 40, v3f(80, 80, 80), 983240, 4, 0.55, 2.0,
+			NOISE_FLAG_EASED), 82, 80},
+		{"mgv5 cave1", NoiseParams(0, 12, v3f(50, 50, 50), 52534, 4, 0.5, 2.0), 81, 80},
+		{"mgv7 mountain", NoiseParams(-0.6, 1, v3f(250, 350, 250), 5333, 5, 0.63,
+			2.0), 82, 80},
+		{"mgv7 ridge", NoiseParams(0, 1, v3f(100, 100, 100), 6467, 4, 0.75, 2.0), 82, 80},
+		{"mgv7 terrain_base", NoiseParams(4, 70, v3f(600, 600, 600), 82341, 5, 0.6,
+			2.0), 80, 1},
+		{"mgcarpathian mnt_var", NoiseParams(0, 1, v3f(499, 499, 499), 2490, 5, 0.6,
+			2.0), 82, 80},
+		{"mgcarpathian base", NoiseParams(12, 1, v3f(2557, 2557, 2557), 6538, 4, 0.8,
+			0.5), 80, 1},
+		{"mgfractal cave1", NoiseParams(0, 12, v3f(61, 61, 61), 52534, 3, 0.5, 2.0),
+			81, 80},
+		{"mgfractal seabed", NoiseParams(-14, 9, v3f(600, 600, 600), 41900, 5, 0.6,
+			2.0), 80, 1},
+	};
+
+	for (size_t c = 0; c != ARRLEN(configs); c++)
+	for (size_t s = 0; s != ARRLEN(all_noise_simd); s++) {
+		if (!setNoiseSIMD(all_noise_simd[s]))
+			continue;
+
+		Noise noise(&configs[c].np, 1337, 80, configs[c].sy, configs[c].sz);
+		const int chunks = configs[c].sz > 1 ? 8 : 200;
+		u64 t0 = porting::getTimeUs();
+		for (int i = 0; i != chunks; i++) {
+			if (configs[c].sz > 1)
+				noise.perlinMap3D(i * 80, -32, 0);
+			else
+				noise.perlinMap2D(i * 80, 0);
+		}
+		u64 t1 = porting::getTimeUs();
+
+		// Points per microsecond are Mpoints/s
+		double points = (double)chunks * 80 * configs[c].sy * configs[c].sz;
+		infostream << "TestNoise: " << configs[c].name << ": "
+			<< getNoiseSIMDName(all_noise_simd[s]) << ": "
+			<< points / MYMAX(t1 - t0, 1) << " Mpoints/s" << std::endl;
+	}
+
+	UASSERT(setNoiseSIMD(simd));
+}
+
 const float TestNoise::expected_2d_results[10 * 10] = {
 	19.11726, 18.49626, 16.48476, 15.02135, 14.75713, 16.26008, 17.54822,
 	18.06860, 18.57016, 18.48407, 18.49649, 17.89160, 15.94162, 14.54901,
@@ -0,0 +1,247 @@
+/*
+Minetest
+Copyright (C) 2010-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "map.h"
+#include "mapgen.h"
+#include "mg_ore.h"
+#include "noise.h"
+#include "porting.h"
+
+// Content ids of the test, they don't need a node definition manager
+#define C_STONE        10
+#define C_DESERT_STONE 11
+#define C_SANDSTONE    12
+#define C_ORE_FIRST    100
+
+class TestOre : public TestBase {
+public:
+	TestOre() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestOre"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testOreFilters();
+	void testOreBenchmark();
+
+	static void makeOres(std::vector<Ore *> *ores);
+	static void makeChunk(MMVManip *vm, u8 *biomemap, v3s16 nmin, v3s16 nmax,
+		u32 seed);
+};
+
+static TestOre g_test_instance;
+
+void TestOre::runTests(IGameDef *gamedef)
+{
+	TEST(testOreFilters);
+	TEST(testOreBenchmark);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestOre::testOreFilters()
+{
+	OreScatter ore;
+	u8 biomemap[] = {0, 1, 2, 3};
+
+	ore.updateFilters();
+	UASSERT(!ore.isWherein(C_STONE));
+	UASSERT(!ore.isWherein(CONTENT_AIR));
+	UASSERT(ore.isInBiome(biomemap, 2));
+	UASSERT(ore.isInBiome(NULL, 2));
+
+	ore.c_wherein.push_back(C_STONE);
+	ore.c_wherein.push_back(CONTENT_IGNORE);
+	ore.biomes.insert(1);
+	ore.biomes.insert(3);
+	ore.updateFilters();
+	UASSERT(ore.isWherein(C_STONE));
+	UASSERT(ore.isWherein(CONTENT_IGNORE));
+	UASSERT(!ore.isWherein(C_DESERT_STONE));
+	UASSERT(!ore.isWherein(0));
+	UASSERT(!ore.isWherein(CONTENT_AIR));
+	UASSERT(!ore.isWherein(MAX_REGISTERED_CONTENT));
+	UASSERT(!ore.isInBiome(biomemap, 0));
+	UASSERT(ore.isInBiome(biomemap, 1));
+	UASSERT(!ore.isInBiome(biomemap, 2));
+	UASSERT(ore.isInBiome(biomemap, 3));
+	UASSERT(ore.isInBiome(NULL, 2));
+}
+
+void TestOre::makeOres(std::vector<Ore *> *ores)
+{
+	PcgRandom pr(2490);
+
+	// Like the ores of a large game: mostly scatter ores, some in sheets,
+	// puffs, blobs and veins
+	for (int i = 0; i < 40; i++) {
+		Ore *ore;
+		if (i < 24) {
+			ore = new OreScatter;
+			ore->clust_scarcity = pr.range(8, 24) * pr.range(8, 24) * pr.range(8, 24);
+			ore->clust_num_ores = pr.range(3, 8);
+			ore->clust_size     = pr.range(2, 5);
+			if (i % 6 == 0) {
+				ore->flags |= OREFLAG_USE_NOISE;
+				ore->np = NoiseParams(0, 1, v3f(100, 100, 100), 25 + i, 3, 0.7, 2.0);
+				ore->nthresh = 0.2;
+			}
+		} else if (i < 29) {
+			OreSheet *sheet = new OreSheet;
+			sheet->clust_size = 0;
+			sheet->column_height_min = 1;
+			sheet->column_height_max = 8;
+			sheet->column_midpoint_factor = 0.5;
+			sheet->np = NoiseParams(0, 1, v3f(100, 100, 100), 766 + i, 3, 0.7, 2.0);
+			sheet->nthresh = 0.4;
+			ore = sheet;
+		} else if (i < 32) {
+			OrePuff *puff = new OrePuff;
+			puff->clust_size = 0;
+			puff->np = NoiseParams(0, 1, v3f(64, 64, 64), 12 + i, 3, 0.7, 2.0);
+			puff->np_puff_top = NoiseParams(4, 2, v3f(40, 40, 40), 47, 3, 0.7, 2.0);
+			puff->np_puff_bottom = NoiseParams(4, 2, v3f(40, 40, 40), 11, 3, 0.7, 2.0);
+			puff->nthresh = 0.6;
+			ore = puff;
+		} else if (i < 37) {
+			ore = new OreBlob;
+			ore->clust_scarcity = 16 * 16 * 16;
+			ore->clust_size     = 5;
+			ore->np = NoiseParams(0, 1, v3f(5, 5, 5), 766 + i, 1, 0.0, 2.0);
+			ore->nthresh = 0.0;
+		} else {
+			OreVein *vein = new OreVein;
+			vein->clust_size = 0;
+			vein->np = NoiseParams(0, 1, v3f(200, 200, 200), 7 + i, 4, 0.7, 2.0);
+			vein->nthresh = 0.6;
+			vein->random_factor = 0.3;
+			ore = vein;
+		}
+
+		ore->index = i;
+		ore->c_ore = C_ORE_FIRST + i;
+		ore->ore_param2 = 0;
+		ore->c_wherein.push_back(C_STONE);
+		if (i % 4 == 1)
+			ore->c_wherein.push_back(C_DESERT_STONE);
+		if (i % 8 == 2)
+			ore->c_wherein.push_back(C_SANDSTONE);
+		if (i % 5 == 3) {
+			ore->biomes.insert(1);
+			ore->biomes.insert(3);
+		}
+		ore->y_min = -31000;
+		ore->y_max = 31000;
+		if (i < 24) {
+			ore->y_min = pr.range(-31000, -64);
+			ore->y_max = i % 3 ? 31000 : pr.range(-64, 64);
+		}
+		ore->updateFilters();
+		ores->push_back(ore);
+	}
+}
+
+void TestOre::makeChunk(MMVManip *vm, u8 *biomemap, v3s16 nmin, v3s16 nmax,
+	u32 seed)
+{
+	PcgRandom pr(seed);
+	VoxelArea &area = vm->m_area;
+
+	// Biomes in patches of 16x16 nodes
+	u8 patches[25];
+	for (int i = 0; i < 25; i++)
+		patches[i] = pr.range(0, 4);
+	u32 index2d = 0;
+	for (s16 z = nmin.Z; z <= nmax.Z; z++)
+	for (s16 x = nmin.X; x <= nmax.X; x++, index2d++)
+		biomemap[index2d] = patches[(z - nmin.Z) / 16 * 5 + (x - nmin.X) / 16];
+
+	// Stone with layers of sandstone, desert stone in biome 2 and caves
+	u32 i = 0;
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++, i++) {
+		content_t c = C_STONE;
+		if (y % 20 == 0)
+			c = C_SANDSTONE;
+		else if (((z - area.MinEdge.Z) / 16 + (x - area.MinEdge.X) / 16) % 5 == 2)
+			c = C_DESERT_STONE;
+		vm->m_data[i] = MapNode(c);
+	}
+
+	for (int cave = 0; cave < 40; cave++) {
+		v3s16 p(pr.range(area.MinEdge.X, area.MaxEdge.X),
+			pr.range(area.MinEdge.Y, area.MaxEdge.Y),
+			pr.range(area.MinEdge.Z, area.MaxEdge.Z));
+		s16 r = pr.range(3, 10);
+		for (s16 z = p.Z - r; z <= p.Z + r; z++)
+		for (s16 y = p.Y - r; y <= p.Y + r; y++)
+		for (s16 x = p.X - r; x <= p.X + r; x++) {
+			v3s16 d = v3s16(x, y, z) - p;
+			if (area.contains(v3s16(x, y, z)) &&
+					d.X * d.X + d.Y * d.Y + d.Z * d.Z <= r * r)
+				vm->m_data[area.index(x, y, z)] = MapNode(CONTENT_AIR);
+		}
+	}
+}
+
+void TestOre::testOreBenchmark()
+{
+	std::vector<Ore *> ores;
+	makeOres(&ores);
+
+	v3s16 csize(80, 80, 80);
+	MMVManip vm(NULL);
+	std::vector<u8> biomemap(csize.X * csize.Z);
+
+	Mapgen mg;
+	mg.seed = 1337;
+	mg.vm = &vm;
+	mg.biomemap = &biomemap[0];
+
+	u64 time = 0;
+	u32 hash = 2166136261U;
+	const int chunks = 10;
+	for (int c = 0; c < chunks; c++) {
+		v3s16 nmin(c * csize.X - 32, -32 - c % 3 * csize.Y, -32);
+		v3s16 nmax = nmin + csize - v3s16(1, 1, 1);
+		vm.clear();
+		vm.addArea(VoxelArea(nmin - v3s16(16, 16, 16), nmax + v3s16(16, 16, 16)));
+		makeChunk(&vm, mg.biomemap, nmin, nmax, c);
+
+		u32 blockseed = Mapgen::getBlockSeed(nmin, mg.seed);
+		u64 t0 = porting::getTimeUs();
+		for (size_t i = 0; i < ores.size(); i++)
+			ores[i]->placeOre(&mg, blockseed + i, nmin, nmax, 0);
+		time += porting::getTimeUs() - t0;
+
+		for (s32 i = 0; i < vm.m_area.getVolume(); i++)
+			hash = (hash ^ vm.m_data[i].getContent()) * 16777619U;
+	}
+
+	// Changes to the ore code must keep the hash, so that existing worlds
+	// go on being generated the same way
+	infostream << "TestOre: " << ores.size() << " ores: "
+		<< time / 1000.0f / chunks << " ms per chunk, result hash "
+		<< hash << std::endl;
+
+	for (size_t i = 0; i < ores.size(); i++)
+		delete ores[i];
+}
@@ -21,7 +21,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "mg_schematic.h"
 #include "gamedef.h"
+#include "map.h"
 #include "nodedef.h"
+#include "porting.h"
+#include "util/numeric.h"
 
 class TestSchematic : public TestBase {
 public:
@@ -33,6 +36,13 @@ class TestSchematic : public TestBase {
 	void testMtsSerializeDeserialize(INodeDefManager *ndef);
 	void testLuaTableSerialize(INodeDefManager *ndef);
 	void testFileSerializeDeserialize(INodeDefManager *ndef);
+	void testBlitToVManip(IWritableNodeDefManager *ndef);
+	void testBlitToVManipBenchmark(IWritableNodeDefManager *ndef);
+
+	static void makeResolvedSchematic(Schematic *schem, INodeDefManager *ndef,
+		v3s16 size, const std::vector<std::string> &names);
+	static void blitReference(Schematic *schem, INodeDefManager *ndef,
+		MMVManip *vm, v3s16 p, Rotation rot, bool force_place);
 
 	static const content_t test_schem1_data[7 * 6 * 4];
 	static const content_t test_schem2_data[3 * 3 * 3];
@@ -52,6 +62,8 @@ void TestSchematic::runTests(IGameDef *gamedef)
 	TEST(testMtsSerializeDeserialize, ndef);
 	TEST(testLuaTableSerialize, ndef);
 	TEST(testFileSerializeDeserialize, ndef);
+	TEST(testBlitToVManip, ndef);
+	TEST(testBlitToVManipBenchmark, ndef);
 
 	ndef->resetNodeResolveState();
 }
@@ -181,6 +193,239 @@ void TestSchematic::testFileSerializeDeserialize(INodeDefManager *ndef)
 }
 
 
+void TestSchematic::makeResolvedSchematic(Schematic *schem,
+	INodeDefManager *ndef, v3s16 size, const std::vector<std::string> &names)
+{
+	// Node contents of schemdata are indexes into names, like in a file
+	schem->size = size;
+	schem->schemdata = new MapNode[size.X * size.Y * size.Z];
+	schem->slice_probs = new u8[size.Y];
+	schem->m_nodenames = names;
+	schem->m_nnlistsizes.push_back(names.size());
+}
+
+
+// Schematic::blitToVManip() as it was before the rotated copies
+void TestSchematic::blitReference(Schematic *schem, INodeDefManager *ndef,
+	MMVManip *vm, v3s16 p, Rotation rot, bool force_place)
+{
+	const v3s16 &size = schem->size;
+	MapNode *schemdata = schem->schemdata;
+
+	int xstride = 1;
+	int ystride = size.X;
+	int zstride = size.X * size.Y;
+
+	s16 sx = size.X;
+	s16 sy = size.Y;
+	s16 sz = size.Z;
+
+	int i_start, i_step_x, i_step_z;
+	switch (rot) {
+		case ROTATE_90:
+			i_start  = sx - 1;
+			i_step_x = zstride;
+			i_step_z = -xstride;
+			SWAP(s16, sx, sz);
+			break;
+		case ROTATE_180:
+			i_start  = zstride * (sz - 1) + sx - 1;
+			i_step_x = -xstride;
+			i_step_z = -zstride;
+			break;
+		case ROTATE_270:
+			i_start  = zstride * (sz - 1);
+			i_step_x = -zstride;
+			i_step_z = xstride;
+			SWAP(s16, sx, sz);
+			break;
+		default:
+			i_start  = 0;
+			i_step_x = xstride;
+			i_step_z = zstride;
+	}
+
+	s16 y_map = p.Y;
+	for (s16 y = 0; y != sy; y++) {
+		if ((schem->slice_probs[y] != MTSCHEM_PROB_ALWAYS) &&
+			(schem->slice_probs[y] <= myrand_range(1, MTSCHEM_PROB_ALWAYS)))
+			continue;
+
+		for (s16 z = 0; z != sz; z++) {
+			u32 i = z * i_step_z + y * ystride + i_start;
+			for (s16 x = 0; x != sx; x++, i += i_step_x) {
+				u32 vi = vm->m_area.index(p.X + x, y_map, p.Z + z);
+				if (!vm->m_area.contains(vi))
+					continue;
+
+				if (schemdata[i].getContent() == CONTENT_IGNORE)
+					continue;
+
+				u8 placement_prob     = schemdata[i].param1 & MTSCHEM_PROB_MASK;
+				bool force_place_node = schemdata[i].param1 & MTSCHEM_FORCE_PLACE;
+
+				if (placement_prob == MTSCHEM_PROB_NEVER)
+					continue;
+
+				if (!force_place && !force_place_node) {
+					content_t c = vm->m_data[vi].getContent();
+					if (c != CONTENT_AIR && c != CONTENT_IGNORE)
+						continue;
+				}
+
+				if ((placement_prob != MTSCHEM_PROB_ALWAYS) &&
+					(placement_prob <= myrand_range(1, MTSCHEM_PROB_ALWAYS)))
+					continue;
+
+				vm->m_data[vi] = schemdata[i];
+				vm->m_data[vi].param1 = 0;
+
+				if (rot)
+					vm->m_data[vi].rotateAlongYAxis(ndef, rot);
+			}
+		}
+		y_map++;
+	}
+}
+
+
+void TestSchematic::testBlitToVManip(IWritableNodeDefManager *ndef)
+{
+	static const v3s16 size(7, 5, 4);
+	static const u32 volume = size.X * size.Y * size.Z;
+	PcgRandom pr(5117);
+
+	content_t c_facedir;
+	if (!ndef->getId("test:facedir", c_facedir)) {
+		ContentFeatures f;
+		f.name = "test:facedir";
+		f.param_type_2 = CPT2_FACEDIR;
+		c_facedir = ndef->set(f.name, f);
+	}
+
+	std::vector<std::string> names;
+	names.push_back("air");
+	names.push_back("ignore");
+	names.push_back("default:stone");
+	names.push_back("default:brick");
+	names.push_back("test:facedir");
+
+	Schematic schem;
+	makeResolvedSchematic(&schem, ndef, size, names);
+	for (size_t i = 0; i != volume; i++) {
+		// Runs of nodes with the same flags, some single nodes
+		u8 param1 = (i > 0 && pr.range(0, 3)) ? schem.schemdata[i - 1].param1 :
+			pr.range(0, 1) ? pr.range(0, 255) :
+			pr.range(0, 1) * MTSCHEM_FORCE_PLACE | MTSCHEM_PROB_ALWAYS;
+		schem.schemdata[i] = MapNode(pr.range(0, names.size() - 1), param1,
+			pr.range(0, 255));
+	}
+	for (s16 y = 0; y != size.Y; y++)
+		schem.slice_probs[y] = pr.range(0, 3) ? MTSCHEM_PROB_ALWAYS : 64;
+
+	ndef->pendNodeResolve(&schem);
+	UASSERTEQ(size_t, schem.c_nodes.size(), names.size());
+
+	// The schematics go past every side of the VoxelManip
+	VoxelArea area(v3s16(0, 0, 0), v3s16(9, 9, 9));
+	for (int n = 0; n < 500; n++) {
+		MMVManip vm(NULL), vm_ref(NULL);
+		vm.addArea(area);
+		vm_ref.addArea(area);
+		for (s32 i = 0; i != area.getVolume(); i++) {
+			static const content_t contents[] = {CONTENT_AIR, CONTENT_IGNORE,
+				t_CONTENT_STONE, c_facedir};
+			vm.m_data[i] = MapNode(contents[pr.range(0, 3)],
+				pr.range(0, 255), pr.range(0, 255));
+			vm_ref.m_data[i] = vm.m_data[i];
+		}
+
+		v3s16 p(pr.range(-8, 10), pr.range(-6, 10), pr.range(-8, 10));
+		Rotation rot = (Rotation)pr.range(ROTATE_0, ROTATE_270);
+		bool force_place = pr.range(0, 1);
+		u32 seed = pr.next();
+
+		mysrand(seed);
+		schem.blitToVManip(&vm, p, rot, force_place);
+		u32 rand_after = myrand();
+		mysrand(seed);
+		blitReference(&schem, ndef, &vm_ref, p, rot, force_place);
+
+		UASSERT(rand_after == myrand());
+		for (s32 i = 0; i != area.getVolume(); i++)
+			UASSERT(vm.m_data[i] == vm_ref.m_data[i]);
+	}
+}
+
+
+void TestSchematic::testBlitToVManipBenchmark(IWritableNodeDefManager *ndef)
+{
+	std::vector<std::string> names;
+	names.push_back("air");
+	names.push_back("default:stone");
+	names.push_back("test:facedir");
+
+	// A tree: trunk of facedir nodes, round crown with random leaves, air
+	// around that is never placed
+	static const v3s16 size(7, 9, 7);
+	Schematic schem;
+	makeResolvedSchematic(&schem, ndef, size, names);
+	u32 i = 0;
+	for (s16 z = 0; z != size.Z; z++)
+	for (s16 y = 0; y != size.Y; y++)
+	for (s16 x = 0; x != size.X; x++, i++) {
+		v3s16 d(x - 3, y - 6, z - 3);
+		if (d.X == 0 && d.Z == 0 && y < 7)
+			schem.schemdata[i] = MapNode(2, MTSCHEM_PROB_ALWAYS |
+				MTSCHEM_FORCE_PLACE, 0);
+		else if (d.X * d.X + d.Y * d.Y + d.Z * d.Z <= 9)
+			schem.schemdata[i] = MapNode(1, d.X * d.X + d.Z * d.Z == 9 ?
+				64 : MTSCHEM_PROB_ALWAYS, 0);
+		else
+			schem.schemdata[i] = MapNode(0, MTSCHEM_PROB_NEVER, 0);
+	}
+	for (s16 y = 0; y != size.Y; y++)
+		schem.slice_probs[y] = MTSCHEM_PROB_ALWAYS;
+	ndef->pendNodeResolve(&schem);
+
+	// Trees all over a chunk, on ground at half height
+	VoxelArea area(v3s16(-16, -16, -16), v3s16(95, 95, 95));
+	MMVManip vm(NULL), vm_ref(NULL);
+	vm.addArea(area);
+	vm_ref.addArea(area);
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++) {
+		u32 vi = area.index(x, y, z);
+		vm.m_data[vi] = MapNode(y < 40 ? t_CONTENT_STONE : CONTENT_AIR);
+		vm_ref.m_data[vi] = vm.m_data[vi];
+	}
+
+	const int count = 20000;
+	std::vector<v3s16> positions(count);
+	PcgRandom pr(2);
+	for (int n = 0; n < count; n++)
+		positions[n] = v3s16(pr.range(-3, 76), 40, pr.range(-3, 76));
+
+	mysrand(11);
+	u64 t0 = porting::getTimeUs();
+	for (int n = 0; n < count; n++)
+		blitReference(&schem, ndef, &vm_ref, positions[n], (Rotation)(n & 3), false);
+	u64 t1 = porting::getTimeUs();
+	mysrand(11);
+	for (int n = 0; n < count; n++)
+		schem.blitToVManip(&vm, positions[n], (Rotation)(n & 3), false);
+	u64 t2 = porting::getTimeUs();
+
+	for (s32 i = 0; i != area.getVolume(); i++)
+		UASSERT(vm.m_data[i] == vm_ref.m_data[i]);
+
+	infostream << "TestSchematic: " << count << " trees: per node: "
+		<< (t1 - t0) / 1000.0f << " ms, rotated spans: "
+		<< (t2 - t1) / 1000.0f << " ms" << std::endl;
+}
+
+
 // Should form a cross-shaped-thing...?
 const content_t TestSchematic::test_schem1_data[7 * 6 * 4] = {
 	3, 3, 1, 1, 1, 3, 3, // Y=0, Z=0
@@ -19,10 +19,33 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "test.h"
 
+#include <cmath>
+
 #include "gamedef.h"
+#include "map.h"
+#include "mapblock.h"
+#include "nodedef.h"
+#include "noise.h"
+#include "porting.h"
 #include "voxelalgorithms.h"
+#include "util/directiontables.h"
 #include "util/numeric.h"
 
+// A plain Map of blank blocks, lit by the sun from above
+class LightingTestMap : public TestMapBase {
+public:
+	LightingTestMap(IGameDef *gamedef, const VoxelArea &blocks_) :
+		TestMapBase(gamedef, blocks_, sunlit_air(gamedef))
+	{}
+
+	static MapNode sunlit_air(IGameDef *gamedef)
+	{
+		MapNode air(CONTENT_AIR);
+		air.setLight(LIGHTBANK_DAY, LIGHT_SUN, gamedef->getNodeDefManager());
+		return air;
+	}
+};
+
 class TestVoxelAlgorithms : public TestBase {
 public:
 	TestVoxelAlgorithms() { TestManager::registerTestModule(this); }
@@ -33,6 +56,15 @@ class TestVoxelAlgorithms : public TestBase {
 	void testPropogateSunlight(INodeDefManager *ndef);
 	void testClearLightAndCollectSources(INodeDefManager *ndef);
 	void testVoxelLineIterator(INodeDefManager *ndef);
+	void testLightingUpdate(IGameDef *gamedef);
+	void testLightingUpdateDeferred(IGameDef *gamedef);
+	void testLightingUpdateBenchmark(IGameDef *gamedef);
+
+	static void setNodes(Map *map,
+		const std::vector<std::pair<v3s16, MapNode> > &nodes);
+	static void explode(Map *map, v3s16 center, s16 radius);
+	static void makeTerrain(Map *map, const VoxelArea &area, u32 seed);
+	static u32 checkLighting(LightingTestMap *map);
 };
 
 static TestVoxelAlgorithms g_test_instance;
@@ -44,6 +76,9 @@ void TestVoxelAlgorithms::runTests(IGameDef *gamedef)
 	TEST(testPropogateSunlight, ndef);
 	TEST(testClearLightAndCollectSources, ndef);
 	TEST(testVoxelLineIterator, ndef);
+	TEST(testLightingUpdate, gamedef);
+	TEST(testLightingUpdateDeferred, gamedef);
+	TEST(testLightingUpdateBenchmark, gamedef);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -261,3 +296,279 @@ void TestVoxelAlgorithms::testVoxelLineIterator(INodeDefManager *ndef)
 		UASSERTEQ(int, actual_nodecount, nodecount);
 	}
 }
+
+void TestVoxelAlgorithms::setNodes(Map *map,
+	const std::vector<std::pair<v3s16, MapNode> > &nodes)
+{
+	// Like Map::addNodeAndUpdate(), for many nodes at once
+	INodeDefManager *ndef = map->getNodeDefManager();
+	std::vector<std::pair<v3s16, MapNode> > oldnodes;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		oldnodes.push_back(std::make_pair(nodes[i].first,
+			map->getNodeNoEx(nodes[i].first)));
+		MapNode n = nodes[i].second;
+		n.setLight(LIGHTBANK_DAY, 0, ndef);
+		n.setLight(LIGHTBANK_NIGHT, 0, ndef);
+		map->setNode(nodes[i].first, n);
+	}
+
+	std::map<v3s16, MapBlock *> modified_blocks;
+	voxalgo::update_lighting_nodes(map, oldnodes, modified_blocks);
+}
+
+void TestVoxelAlgorithms::explode(Map *map, v3s16 center, s16 radius)
+{
+	// Like a mod removing the nodes of an explosion one by one
+	std::map<v3s16, MapBlock *> modified_blocks;
+	for (s16 z = center.Z - radius; z <= center.Z + radius; z++)
+	for (s16 y = center.Y - radius; y <= center.Y + radius; y++)
+	for (s16 x = center.X - radius; x <= center.X + radius; x++) {
+		v3s16 p(x, y, z);
+		if ((p - center).getLengthSQ() <= radius * radius)
+			map->addNodeAndUpdate(p, MapNode(CONTENT_AIR), modified_blocks);
+	}
+}
+
+void TestVoxelAlgorithms::makeTerrain(Map *map, const VoxelArea &area, u32 seed)
+{
+	PcgRandom pr(seed);
+
+	// Hilly ground with torches on it, one block at a time
+	v3s16 bmin = getNodeBlockPos(area.MinEdge);
+	v3s16 bmax = getNodeBlockPos(area.MaxEdge);
+	for (s16 bz = bmin.Z; bz <= bmax.Z; bz++)
+	for (s16 by = bmin.Y; by <= bmax.Y; by++)
+	for (s16 bx = bmin.X; bx <= bmax.X; bx++) {
+		std::vector<std::pair<v3s16, MapNode> > nodes;
+		for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+		for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+		for (s16 x = 0; x < MAP_BLOCKSIZE; x++) {
+			v3s16 p = v3s16(bx, by, bz) * MAP_BLOCKSIZE + v3s16(x, y, z);
+			s16 ground = 4 * sin(p.X / 9.0) + 4 * cos(p.Z / 7.0);
+			if (p.Y <= ground)
+				nodes.push_back(std::make_pair(p, MapNode(t_CONTENT_STONE)));
+			else if (p.Y == ground + 1 && pr.range(0, 63) == 0)
+				nodes.push_back(std::make_pair(p, MapNode(t_CONTENT_TORCH)));
+		}
+		setNodes(map, nodes);
+	}
+
+	// Caves, with torches in them
+	for (int cave = 0; cave < 12; cave++) {
+		v3s16 c(pr.range(area.MinEdge.X, area.MaxEdge.X),
+			pr.range(area.MinEdge.Y, 0),
+			pr.range(area.MinEdge.Z, area.MaxEdge.Z));
+		s16 r = pr.range(3, 7);
+		std::vector<std::pair<v3s16, MapNode> > nodes;
+		for (s16 z = c.Z - r; z <= c.Z + r; z++)
+		for (s16 y = c.Y - r; y <= c.Y + r; y++)
+		for (s16 x = c.X - r; x <= c.X + r; x++) {
+			v3s16 p(x, y, z);
+			if (area.contains(p) && (p - c).getLengthSQ() <= r * r)
+				nodes.push_back(std::make_pair(p, MapNode(CONTENT_AIR)));
+		}
+		setNodes(map, nodes);
+		nodes.clear();
+		nodes.push_back(std::make_pair(c, MapNode(t_CONTENT_TORCH)));
+		setNodes(map, nodes);
+	}
+}
+
+u32 TestVoxelAlgorithms::checkLighting(LightingTestMap *map)
+{
+	// Lights the whole map from scratch, and counts the nodes lit otherwise
+	INodeDefManager *ndef = map->getNodeDefManager();
+	VoxelArea area = map->getNodeArea();
+	v3s16 extent = area.getExtent();
+	std::vector<u8> light[2];
+	std::vector<u32> queue[LIGHT_SUN + 1];
+	u32 errors = 0;
+
+	for (int bank = 0; bank < 2; bank++) {
+		light[bank].assign(area.getVolume(), 0);
+		for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+		for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++) {
+			bool sunlit = bank == 0;
+			for (s16 y = area.MaxEdge.Y; y >= area.MinEdge.Y; y--) {
+				u32 i = area.index(x, y, z);
+				const ContentFeatures &f = ndef->get(
+					map->getNodeNoEx(v3s16(x, y, z)));
+				sunlit = sunlit && f.sunlight_propagates;
+				light[bank][i] = sunlit ? LIGHT_SUN : f.light_source;
+				queue[light[bank][i]].push_back(i);
+			}
+		}
+
+		for (int l = LIGHT_SUN; l > 1; l--)
+		for (size_t q = 0; q < queue[l].size(); q++) {
+			u32 i = queue[l][q];
+			if (light[bank][i] != l)
+				continue;
+			v3s16 p = area.MinEdge + v3s16(i % extent.X,
+				i / extent.X % extent.Y, i / (extent.X * extent.Y));
+			for (int d = 0; d < 6; d++) {
+				v3s16 p2 = p + g_6dirs[d];
+				if (!area.contains(p2))
+					continue;
+				u32 i2 = area.index(p2);
+				if (light[bank][i2] < l - 1 && ndef->get(
+						map->getNodeNoEx(p2)).light_propagates) {
+					light[bank][i2] = l - 1;
+					queue[l - 1].push_back(i2);
+				}
+			}
+		}
+		for (int l = 0; l <= LIGHT_SUN; l++)
+			queue[l].clear();
+	}
+
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++) {
+		MapNode n = map->getNodeNoEx(v3s16(x, y, z));
+		u32 i = area.index(x, y, z);
+		if (n.getLight(LIGHTBANK_DAY, ndef) != light[0][i] ||
+				n.getLight(LIGHTBANK_NIGHT, ndef) != light[1][i])
+			errors++;
+	}
+	return errors;
+}
+
+void TestVoxelAlgorithms::testLightingUpdate(IGameDef *gamedef)
+{
+	LightingTestMap map(gamedef,
+		VoxelArea(v3s16(-2, -2, -2), v3s16(1, 1, 1)));
+	VoxelArea area = map.getNodeArea();
+	PcgRandom pr(39);
+
+	makeTerrain(&map, area, 3);
+	UASSERTEQ(u32, checkLighting(&map), 0);
+
+	// Digging and placing stone and torches, one node at a time
+	std::map<v3s16, MapBlock *> modified_blocks;
+	for (int i = 0; i < 400; i++) {
+		v3s16 p(pr.range(-12, 12), pr.range(-20, 10), pr.range(-12, 12));
+		content_t c[] = {CONTENT_AIR, t_CONTENT_STONE, t_CONTENT_TORCH};
+		map.addNodeAndUpdate(p, MapNode(c[pr.range(0, 2)]), modified_blocks);
+	}
+	UASSERTEQ(u32, checkLighting(&map), 0);
+
+	// Explosions, lighting dark caves
+	for (int i = 0; i < 6; i++) {
+		v3s16 c(pr.range(-20, 20), pr.range(-25, 0), pr.range(-20, 20));
+		std::vector<std::pair<v3s16, MapNode> > nodes;
+		for (s16 z = c.Z - 5; z <= c.Z + 5; z++)
+		for (s16 y = c.Y - 5; y <= c.Y + 5; y++)
+		for (s16 x = c.X - 5; x <= c.X + 5; x++) {
+			if ((v3s16(x, y, z) - c).getLengthSQ() <= 25)
+				nodes.push_back(std::make_pair(v3s16(x, y, z),
+					MapNode(CONTENT_AIR)));
+		}
+		setNodes(&map, nodes);
+	}
+	UASSERTEQ(u32, checkLighting(&map), 0);
+
+	// Covering it all, shadowing the ground
+	std::vector<std::pair<v3s16, MapNode> > roof;
+	for (s16 z = -20; z <= 20; z++)
+	for (s16 x = -20; x <= 20; x++)
+		roof.push_back(std::make_pair(v3s16(x, 20, z), MapNode(t_CONTENT_STONE)));
+	setNodes(&map, roof);
+	UASSERTEQ(u32, checkLighting(&map), 0);
+}
+
+void TestVoxelAlgorithms::testLightingUpdateDeferred(IGameDef *gamedef)
+{
+	LightingTestMap map(gamedef,
+		VoxelArea(v3s16(-2, -2, -2), v3s16(1, 1, 1)));
+	VoxelArea area = map.getNodeArea();
+	PcgRandom pr(1009);
+
+	makeTerrain(&map, area, 5);
+	map.setLightingDeferred(true);
+
+	// Nodes changed several times before their update, and updates
+	// of a part of the queue between the changes
+	std::map<v3s16, MapBlock *> modified_blocks;
+	for (int i = 0; i < 20; i++) {
+		for (int j = 0; j < 50; j++) {
+			v3s16 p(pr.range(-8, 8), pr.range(-12, 8), pr.range(-8, 8));
+			content_t c[] = {CONTENT_AIR, t_CONTENT_STONE, t_CONTENT_TORCH};
+			map.addNodeAndUpdate(p, MapNode(c[pr.range(0, 2)]),
+				modified_blocks);
+		}
+		if (i % 4 == 0)
+			explode(&map, v3s16(pr.range(-20, 20), pr.range(-25, 0),
+				pr.range(-20, 20)), 4);
+		UASSERT(map.isLightingUpdatePending());
+		if (i % 3 != 2)
+			map.updateLighting(modified_blocks, 1);
+	}
+	map.updateLighting(modified_blocks);
+	UASSERT(!map.isLightingUpdatePending());
+	UASSERTEQ(u32, checkLighting(&map), 0);
+}
+
+void TestVoxelAlgorithms::testLightingUpdateBenchmark(IGameDef *gamedef)
+{
+	LightingTestMap map(gamedef,
+		VoxelArea(v3s16(-3, -3, -3), v3s16(2, 1, 2)));
+	VoxelArea area = map.getNodeArea();
+	makeTerrain(&map, area, 7);
+	PcgRandom pr(81);
+
+	// A player digging a tunnel and placing torches in it
+	std::map<v3s16, MapBlock *> modified_blocks;
+	u64 t0 = porting::getTimeUs();
+	for (s16 x = -40; x < 40; x++) {
+		for (s16 y = -12; y < -10; y++)
+			map.addNodeAndUpdate(v3s16(x, y, 3), MapNode(CONTENT_AIR),
+				modified_blocks);
+		if (x % 8 == 0)
+			map.addNodeAndUpdate(v3s16(x, -12, 4), MapNode(t_CONTENT_TORCH),
+				modified_blocks);
+	}
+	u64 t1 = porting::getTimeUs();
+
+	// Explosions, and a pit opening a cave to the sky
+	for (int i = 0; i < 8; i++) {
+		v3s16 c(pr.range(-30, 30), pr.range(-30, 0), pr.range(-30, 30));
+		std::vector<std::pair<v3s16, MapNode> > nodes;
+		for (s16 z = c.Z - 6; z <= c.Z + 6; z++)
+		for (s16 y = c.Y - 6; y <= c.Y + 6; y++)
+		for (s16 x = c.X - 6; x <= c.X + 6; x++) {
+			if ((v3s16(x, y, z) - c).getLengthSQ() <= 36)
+				nodes.push_back(std::make_pair(v3s16(x, y, z),
+					MapNode(CONTENT_AIR)));
+		}
+		setNodes(&map, nodes);
+	}
+	std::vector<std::pair<v3s16, MapNode> > pit;
+	for (s16 z = -8; z < 8; z++)
+	for (s16 y = -40; y < 10; y++)
+	for (s16 x = -8; x < 8; x++)
+		pit.push_back(std::make_pair(v3s16(x, y, z), MapNode(CONTENT_AIR)));
+	setNodes(&map, pit);
+	u64 t2 = porting::getTimeUs();
+
+	// Explosions removing their nodes one by one, lit at once and
+	// lit by a deferred update
+	for (int i = 0; i < 4; i++)
+		explode(&map, v3s16(pr.range(-30, 30), pr.range(-30, 0),
+			pr.range(-30, 30)), 5);
+	u64 t3 = porting::getTimeUs();
+	map.setLightingDeferred(true);
+	for (int i = 0; i < 4; i++)
+		explode(&map, v3s16(pr.range(-30, 30), pr.range(-30, 0),
+			pr.range(-30, 30)), 5);
+	map.updateLighting(modified_blocks);
+	u64 t4 = porting::getTimeUs();
+
+	infostream << "TestVoxelAlgorithms: lighting of a tunnel: "
+		<< (t1 - t0) / 1000.0f << " ms, explosions and a pit: "
+		<< (t2 - t1) / 1000.0f << " ms, explosions node by node: "
+		<< (t3 - t2) / 1000.0f << " ms, deferred: "
+		<< (t4 - t3) / 1000.0f << " ms" << std::endl;
+
+	UASSERTEQ(u32, checkLighting(&map), 0);
+}
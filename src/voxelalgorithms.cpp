@@ -18,9 +18,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "voxelalgorithms.h"
+#include <algorithm>
 #include "nodedef.h"
 #include "mapblock.h"
 #include "map.h"
+#include "porting.h"
 
 namespace voxalgo
 {
@@ -181,12 +183,10 @@ typedef v3s16 mapblock_v3;
 
 //! Contains information about a node whose light is about to change.
 struct ChangingLight {
-	//! Relative position of the node in its map block.
-	relative_v3 rel_position;
-	//! Position of the node's block.
-	mapblock_v3 block_position;
 	//! Pointer to the node's block.
 	MapBlock *block;
+	//! Index of the node in its block's data.
+	u16 index;
 	/*!
 	 * Direction from the node that caused this node's changing
 	 * to this node.
@@ -194,17 +194,14 @@ struct ChangingLight {
 	direction source_direction;
 
 	ChangingLight() :
-		rel_position(),
-		block_position(),
 		block(NULL),
+		index(0),
 		source_direction(6)
 	{}
 
-	ChangingLight(relative_v3 rel_pos, mapblock_v3 block_pos,
-		MapBlock *b, direction source_dir) :
-		rel_position(rel_pos),
-		block_position(block_pos),
+	ChangingLight(MapBlock *b, u16 i, direction source_dir) :
 		block(b),
+		index(i),
 		source_direction(source_dir)
 	{}
 };
@@ -260,13 +257,11 @@ struct LightQueue {
 	 * The parameters are the same as in ChangingLight's constructor.
 	 * \param light light level of the ChangingLight
 	 */
-	inline void push(u8 light, const relative_v3 &rel_pos,
-		const mapblock_v3 &block_pos, MapBlock *block,
+	inline void push(u8 light, MapBlock *block, u16 index,
 		direction source_dir)
 	{
 		assert(light <= LIGHT_SUN);
-		lights[light].push_back(
-			ChangingLight(rel_pos, block_pos, block, source_dir));
+		lights[light].push_back(ChangingLight(block, index, source_dir));
 	}
 };
 
@@ -304,74 +299,97 @@ const static v3s16 neighbor_dirs[6] = {
 };
 
 /*!
- * Transforms the given map block offset by one node towards
+ * Returns the index of a node in the data of its map block.
+ */
+inline u16 node_index(const relative_v3 &rel_pos)
+{
+	return rel_pos.Z * MapBlock::zstride + rel_pos.Y * MapBlock::ystride +
+		rel_pos.X;
+}
+
+/*!
+ * Transforms the given node index by one node towards
  * the specified direction.
  * \param dir the direction of the transformation
- * \param rel_pos the node's relative position in its map block
- * \param block_pos position of the node's block
+ * \param index the node's index in its map block
+ * \returns true if the node is in the neighboring block,
+ * the index is then the node's index in that block.
  */
-bool step_rel_block_pos(direction dir, relative_v3 &rel_pos,
-	mapblock_v3 &block_pos)
+inline bool step_node_index(direction dir, u16 &index)
 {
-	switch (dir) {
-	case 0:
-		if (rel_pos.X < MAP_BLOCKSIZE - 1) {
-			rel_pos.X++;
-		} else {
-			rel_pos.X = 0;
-			block_pos.X++;
-			return true;
-		}
-		break;
-	case 1:
-		if (rel_pos.Y < MAP_BLOCKSIZE - 1) {
-			rel_pos.Y++;
-		} else {
-			rel_pos.Y = 0;
-			block_pos.Y++;
-			return true;
-		}
-		break;
-	case 2:
-		if (rel_pos.Z < MAP_BLOCKSIZE - 1) {
-			rel_pos.Z++;
-		} else {
-			rel_pos.Z = 0;
-			block_pos.Z++;
-			return true;
-		}
-		break;
-	case 3:
-		if (rel_pos.Z > 0) {
-			rel_pos.Z--;
-		} else {
-			rel_pos.Z = MAP_BLOCKSIZE - 1;
-			block_pos.Z--;
-			return true;
-		}
-		break;
-	case 4:
-		if (rel_pos.Y > 0) {
-			rel_pos.Y--;
-		} else {
-			rel_pos.Y = MAP_BLOCKSIZE - 1;
-			block_pos.Y--;
-			return true;
-		}
-		break;
-	case 5:
-		if (rel_pos.X > 0) {
-			rel_pos.X--;
-		} else {
-			rel_pos.X = MAP_BLOCKSIZE - 1;
-			block_pos.X--;
-			return true;
-		}
-		break;
+	// Per direction: the coordinate's place in the index, and the
+	// difference of the indices of two neighboring nodes
+	static const u8 shift[6] = {0, 4, 8, 8, 4, 0};
+	static const s16 step[6] = {1, MapBlock::ystride, MapBlock::zstride,
+		-(s16)MapBlock::zstride, -(s16)MapBlock::ystride, -1};
+	static const u16 border[6] = {MAP_BLOCKSIZE - 1, MAP_BLOCKSIZE - 1,
+		MAP_BLOCKSIZE - 1, 0, 0, 0};
+
+	if (((index >> shift[dir]) & (MAP_BLOCKSIZE - 1)) == border[dir]) {
+		index -= step[dir] * (MAP_BLOCKSIZE - 1);
+		return true;
 	}
+	index += step[dir];
 	return false;
 }
 
+/*!
+ * Returns the loaded neighbor of a map block, NULL if there is none.
+ */
+inline MapBlock *get_neighbor_block(Map *map, MapBlock *block,
+	direction dir)
+{
+	MapBlock *neighbor = map->getBlockNoCreateNoEx(
+		block->getPos() + neighbor_dirs[dir]);
+	if (neighbor == NULL || neighbor->isDummy())
+		return NULL;
+	return neighbor;
+}
+
+/*!
+ * Looks up the features of nodes, remembering the last content.
+ * Neighboring nodes are mostly of the same content, this saves
+ * most of the lookups through the node definition manager.
+ */
+class NodeFeaturesCache {
+public:
+	NodeFeaturesCache(INodeDefManager *ndef) :
+		m_ndef(ndef),
+		m_content(CONTENT_IGNORE),
+		m_features(&ndef->get(CONTENT_IGNORE))
+	{}
+
+	inline const ContentFeatures &get(const MapNode &n)
+	{
+		if (n.getContent() != m_content) {
+			m_content = n.getContent();
+			m_features = &m_ndef->get(m_content);
+		}
+		return *m_features;
+	}
+
+	//! Same as MapNode::getLight(), with the cached features
+	inline u8 getLight(const MapNode &n, LightBank bank)
+	{
+		const ContentFeatures &f = get(n);
+		return MYMAX(f.light_source, n.getLightRaw(bank, f));
+	}
+
+private:
+	INodeDefManager *m_ndef;
+	content_t m_content;
+	const ContentFeatures *m_features;
+};
+
+/*!
+ * Marks the block of a node whose light was changed as modified.
+ */
+inline void light_changed(MapBlock *block)
+{
+	block->raiseModified(MOD_STATE_WRITE_NEEDED,
+		MOD_REASON_SET_NODE_NO_CHECK);
+}
+
 /*
  * Removes all light that is potentially emitted by the specified
  * light sources. These nodes will have zero light.
@@ -389,22 +407,17 @@ void unspread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 	// Stores data popped from from_nodes
 	u8 current_light;
 	ChangingLight current;
-	// Data of the current neighbor
-	mapblock_v3 neighbor_block_pos;
-	relative_v3 neighbor_rel_pos;
-	// A dummy boolean
-	bool is_valid_position;
 	// Direction of the brightest neighbor of the node
 	direction source_dir;
+	NodeFeaturesCache features(nodemgr);
 	while (from_nodes.next(current_light, current)) {
 		// For all nodes that need unlighting
 
 		// There is no brightest neighbor
 		source_dir = 6;
 		// The current node
-		const MapNode &node = current.block->getNodeNoCheck(
-			current.rel_position, &is_valid_position);
-		const ContentFeatures &f = nodemgr->get(node);
+		const MapNode &node = current.block->getData()[current.index];
+		const ContentFeatures &f = features.get(node);
 		// If the node emits light, it behaves like it had a
 		// brighter neighbor.
 		u8 brightest_neighbor_light = f.light_source + 1;
@@ -416,12 +429,11 @@ void unspread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 			if (current.source_direction + i == 5) {
 				continue;
 			}
-			// Get the neighbor's position and block
-			neighbor_rel_pos = current.rel_position;
-			neighbor_block_pos = current.block_position;
+			// Get the neighbor's index and block
+			u16 neighbor_index = current.index;
 			MapBlock *neighbor_block;
-			if (step_rel_block_pos(i, neighbor_rel_pos, neighbor_block_pos)) {
-				neighbor_block = map->getBlockNoCreateNoEx(neighbor_block_pos);
+			if (step_node_index(i, neighbor_index)) {
+				neighbor_block = get_neighbor_block(map, current.block, i);
 				if (neighbor_block == NULL) {
 					current.block->setLightingComplete(bank, i, false);
 					continue;
@@ -430,10 +442,8 @@ void unspread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 				neighbor_block = current.block;
 			}
 			// Get the neighbor itself
-			MapNode neighbor = neighbor_block->getNodeNoCheck(neighbor_rel_pos,
-				&is_valid_position);
-			const ContentFeatures &neighbor_f = nodemgr->get(
-				neighbor.getContent());
+			MapNode &neighbor = neighbor_block->getData()[neighbor_index];
+			const ContentFeatures &neighbor_f = features.get(neighbor);
 			u8 neighbor_light = neighbor.getLightRaw(bank, neighbor_f);
 			// If the neighbor has at least as much light as this node, then
 			// it won't lose its light, since it should have been added to
@@ -442,13 +452,14 @@ void unspread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 				// Unlight, but only if the node has light.
 				if (neighbor_light > 0) {
 					neighbor.setLight(bank, 0, neighbor_f);
-					neighbor_block->setNodeNoCheck(neighbor_rel_pos, neighbor);
-					from_nodes.push(neighbor_light, neighbor_rel_pos,
-						neighbor_block_pos, neighbor_block, i);
+					light_changed(neighbor_block);
+					from_nodes.push(neighbor_light, neighbor_block,
+						neighbor_index, i);
 					// The current node was modified earlier, so its block
 					// is in modified_blocks.
 					if (current.block != neighbor_block) {
-						modified_blocks[neighbor_block_pos] = neighbor_block;
+						modified_blocks[neighbor_block->getPos()] =
+							neighbor_block;
 					}
 				}
 			} else {
@@ -466,8 +477,8 @@ void unspread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 		// then add this node to the output nodes.
 		if (brightest_neighbor_light > 1 && f.light_propagates) {
 			brightest_neighbor_light--;
-			light_sources.push(brightest_neighbor_light, current.rel_position,
-				current.block_position, current.block,
+			light_sources.push(brightest_neighbor_light, current.block,
+				current.index,
 				(source_dir == 6) ? 6 : 5 - source_dir
 				/* with opposite direction*/);
 		}
@@ -494,11 +505,7 @@ void spread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 	u8 spreading_light;
 	// The ChangingLight for the current node.
 	ChangingLight current;
-	// Position of the current neighbor.
-	mapblock_v3 neighbor_block_pos;
-	relative_v3 neighbor_rel_pos;
-	// A dummy boolean.
-	bool is_valid_position;
+	NodeFeaturesCache features(nodemgr);
 	while (light_sources.next(spreading_light, current)) {
 		spreading_light--;
 		for (direction i = 0; i < 6; i++) {
@@ -506,12 +513,11 @@ void spread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 			if (current.source_direction + i == 5) {
 				continue;
 			}
-			// Get the neighbor's position and block
-			neighbor_rel_pos = current.rel_position;
-			neighbor_block_pos = current.block_position;
+			// Get the neighbor's index and block
+			u16 neighbor_index = current.index;
 			MapBlock *neighbor_block;
-			if (step_rel_block_pos(i, neighbor_rel_pos, neighbor_block_pos)) {
-				neighbor_block = map->getBlockNoCreateNoEx(neighbor_block_pos);
+			if (step_node_index(i, neighbor_index)) {
+				neighbor_block = get_neighbor_block(map, current.block, i);
 				if (neighbor_block == NULL) {
 					current.block->setLightingComplete(bank, i, false);
 					continue;
@@ -520,21 +526,21 @@ void spread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 				neighbor_block = current.block;
 			}
 			// Get the neighbor itself
-			MapNode neighbor = neighbor_block->getNodeNoCheck(neighbor_rel_pos,
-				&is_valid_position);
-			const ContentFeatures &f = nodemgr->get(neighbor.getContent());
+			MapNode &neighbor = neighbor_block->getData()[neighbor_index];
+			const ContentFeatures &f = features.get(neighbor);
 			if (f.light_propagates) {
 				// Light up the neighbor, if it has less light than it should.
 				u8 neighbor_light = neighbor.getLightRaw(bank, f);
 				if (neighbor_light < spreading_light) {
 					neighbor.setLight(bank, spreading_light, f);
-					neighbor_block->setNodeNoCheck(neighbor_rel_pos, neighbor);
-					light_sources.push(spreading_light, neighbor_rel_pos,
-						neighbor_block_pos, neighbor_block, i);
+					light_changed(neighbor_block);
+					light_sources.push(spreading_light, neighbor_block,
+						neighbor_index, i);
 					// The current node was modified earlier, so its block
 					// is in modified_blocks.
 					if (current.block != neighbor_block) {
-						modified_blocks[neighbor_block_pos] = neighbor_block;
+						modified_blocks[neighbor_block->getPos()] =
+							neighbor_block;
 					}
 				}
 			}
@@ -542,6 +548,26 @@ void spread_light(Map *map, INodeDefManager *nodemgr, LightBank bank,
 	}
 }
 
+/*!
+ * Sets the light of the nodes in the queue to the light level
+ * they were pushed with, before spreading the lights.
+ * \param max_light lights of greater levels are left alone
+ */
+void set_queued_lights(INodeDefManager *nodemgr, LightBank bank,
+	const LightQueue &queue, u8 max_light = LIGHT_SUN)
+{
+	NodeFeaturesCache features(nodemgr);
+	for (u8 i = 0; i <= max_light; i++) {
+		const std::vector<ChangingLight> &lights = queue.lights[i];
+		for (std::vector<ChangingLight>::const_iterator it = lights.begin();
+				it < lights.end(); ++it) {
+			MapNode &n = it->block->getData()[it->index];
+			n.setLight(bank, i, features.get(n));
+			light_changed(it->block);
+		}
+	}
+}
+
 struct SunlightPropagationUnit{
 	v2s16 relative_pos;
 	bool is_sunlit;
@@ -561,43 +587,108 @@ struct SunlightPropagationData{
  * Returns true if the node gets sunlight from the
  * node above it.
  *
- * \param pos position of the node.
+ * \param block the node's block.
+ * \param index the node's index in its block.
  */
-bool is_sunlight_above(Map *map, v3s16 pos, INodeDefManager *ndef)
+bool is_sunlight_above(Map *map, MapBlock *block, u16 index,
+	INodeDefManager *ndef)
 {
-	bool sunlight = true;
-	mapblock_v3 source_block_pos;
-	relative_v3 source_rel_pos;
-	getNodeBlockPosWithOffset(pos + v3s16(0, 1, 0), source_block_pos,
-		source_rel_pos);
 	// If the node above has sunlight, this node also can get it.
-	MapBlock *source_block = map->getBlockNoCreateNoEx(source_block_pos);
-	if (source_block == NULL) {
-		// But if there is no node above, then use heuristics
-		MapBlock *node_block = map->getBlockNoCreateNoEx(getNodeBlockPos(pos));
-		if (node_block == NULL) {
-			sunlight = false;
-		} else {
-			sunlight = !node_block->getIsUnderground();
+	MapBlock *source_block = block;
+	if (step_node_index(1, index)) {
+		source_block = map->getBlockNoCreateNoEx(
+			block->getPos() + neighbor_dirs[1]);
+		if (source_block == NULL) {
+			// But if there is no node above, then use heuristics
+			return !block->getIsUnderground();
 		}
-	} else {
-		bool is_valid_position;
-		MapNode above = source_block->getNodeNoCheck(source_rel_pos,
-			&is_valid_position);
-		if (is_valid_position) {
-			if (above.getContent() == CONTENT_IGNORE) {
-				// Trust heuristics
-				if (source_block->getIsUnderground()) {
-					sunlight = false;
-				}
-			} else if (above.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN) {
-				// If the node above doesn't have sunlight, this
-				// node is in shadow.
-				sunlight = false;
-			}
+		if (source_block->isDummy()) {
+			return true;
 		}
 	}
-	return sunlight;
+	const MapNode &above = source_block->getData()[index];
+	if (above.getContent() == CONTENT_IGNORE) {
+		// Trust heuristics
+		return !source_block->getIsUnderground();
+	}
+	// If the node above doesn't have sunlight, this
+	// node is in shadow.
+	return above.getLight(LIGHTBANK_DAY, ndef) == LIGHT_SUN;
+}
+
+/*!
+ * Removes the light of a changed node that became darker, and the
+ * sunlight of the nodes below it if it had sunlight.
+ */
+void unlight_changed_node(Map *map, NodeFeaturesCache &features,
+	LightBank bank, MapBlock *block, u16 index, u8 old_light,
+	UnlightQueue &disappearing_lights,
+	std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	MapNode &n = block->getData()[index];
+	n.setLight(bank, 0, features.get(n));
+	light_changed(block);
+	disappearing_lights.push(old_light, block, index, 6);
+
+	if (bank != LIGHTBANK_DAY || old_light != LIGHT_SUN)
+		return;
+
+	// Remove sunlight
+	for (;;) {
+		if (step_node_index(4, index)) {
+			block = get_neighbor_block(map, block, 4);
+			if (block == NULL)
+				break;
+		}
+		MapNode &n2 = block->getData()[index];
+		const ContentFeatures &f2 = features.get(n2);
+
+		// If this node doesn't have sunlight, the nodes below
+		// it don't have too.
+		if (n2.getLightRaw(LIGHTBANK_DAY, f2) != LIGHT_SUN) {
+			break;
+		}
+		// Remove sunlight and add to unlight queue.
+		n2.setLight(LIGHTBANK_DAY, 0, f2);
+		light_changed(block);
+		modified_blocks[block->getPos()] = block;
+		disappearing_lights.push(LIGHT_SUN, block, index,
+			4 /* The node above caused the change */);
+	}
+}
+
+/*!
+ * Gives sunlight to the nodes below a node that has sunlight,
+ * and adds them to the light sources.
+ */
+void propagate_sunlight_down(Map *map, NodeFeaturesCache &features,
+	MapBlock *block, u16 index, ReLightQueue &light_sources,
+	std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	for (;;) {
+		if (step_node_index(4, index)) {
+			block = get_neighbor_block(map, block, 4);
+			if (block == NULL)
+				break;
+		}
+		MapNode &n2 = block->getData()[index];
+		const ContentFeatures &f2 = features.get(n2);
+
+		// If the node has sunlight, so have the nodes below it
+		if (n2.getLightRaw(LIGHTBANK_DAY, f2) == LIGHT_SUN) {
+			break;
+		}
+		// If the node terminates sunlight, stop.
+		if (!f2.sunlight_propagates) {
+			break;
+		}
+		// Light the node now, so that the changed nodes above
+		// it stop here, and mark it for spreading.
+		n2.setLight(LIGHTBANK_DAY, LIGHT_SUN, f2);
+		light_changed(block);
+		modified_blocks[block->getPos()] = block;
+		light_sources.push(LIGHT_SUN, block, index, 4);
+	}
 }
 
 static const LightBank banks[] = { LIGHTBANK_DAY, LIGHTBANK_NIGHT };
@@ -607,23 +698,55 @@ void update_lighting_nodes(Map *map,
 	std::map<v3s16, MapBlock*> &modified_blocks)
 {
 	INodeDefManager *ndef = map->getNodeDefManager();
-	// For node getter functions
-	bool is_valid_position;
+	NodeFeaturesCache features(ndef);
+
+	// Find the blocks of the changed nodes, the block is NULL if the
+	// node is not loaded
+	std::vector<ChangingLight> changed_nodes(oldnodes.size());
+	MapBlock *last_block = NULL;
+	for (size_t j = 0; j < oldnodes.size(); j++) {
+		relative_v3 rel_pos;
+		mapblock_v3 block_pos;
+		getNodeBlockPosWithOffset(oldnodes[j].first, block_pos, rel_pos);
+		MapBlock *block = last_block;
+		if (block == NULL || block->getPos() != block_pos) {
+			block = map->getBlockNoCreateNoEx(block_pos);
+			if (block == NULL || block->isDummy()) {
+				continue;
+			}
+			last_block = block;
+			// Add the block of the added node to modified_blocks
+			modified_blocks[block_pos] = block;
+		}
+		changed_nodes[j] = ChangingLight(block, node_index(rel_pos), 6);
+	}
 
 	// Process each light bank separately
 	for (s32 i = 0; i < 2; i++) {
 		LightBank bank = banks[i];
 		UnlightQueue disappearing_lights(256);
 		ReLightQueue light_sources(256);
+		// The light of each changed node before the change. A node may
+		// have got light since, if its update was deferred: it goes too.
+		std::vector<u8> old_lights(oldnodes.size());
+		for (size_t j = 0; j < oldnodes.size(); j++) {
+			old_lights[j] = oldnodes[j].second.getLight(bank, ndef);
+			if (changed_nodes[j].block == NULL) {
+				continue;
+			}
+			const MapNode &n =
+				changed_nodes[j].block->getData()[changed_nodes[j].index];
+			const ContentFeatures &f = features.get(n);
+			if (f.param_type == CPT_LIGHT)
+				old_lights[j] = MYMAX(old_lights[j], n.getLightRaw(bank, f));
+		}
 		// Nodes that are brighter than the brightest modified node was
 		// won't change, since they didn't get their light from a
 		// modified node.
 		u8 min_safe_light = 0;
-		for (std::vector<std::pair<v3s16, MapNode> >::iterator it =
-				oldnodes.begin(); it < oldnodes.end(); ++it) {
-			u8 old_light = it->second.getLight(bank, ndef);
-			if (old_light > min_safe_light) {
-				min_safe_light = old_light;
+		for (size_t j = 0; j < oldnodes.size(); j++) {
+			if (old_lights[j] > min_safe_light) {
+				min_safe_light = old_lights[j];
 			}
 		}
 		// If only one node changed, even nodes with the same brightness
@@ -631,155 +754,163 @@ void update_lighting_nodes(Map *map,
 		if (oldnodes.size() > 1) {
 			min_safe_light++;
 		}
-		// For each changed node process sunlight and initialize
-		for (std::vector<std::pair<v3s16, MapNode> >::iterator it =
-				oldnodes.begin(); it < oldnodes.end(); ++it) {
-			// Get position and block of the changed node
-			v3s16 p = it->first;
-			relative_v3 rel_pos;
-			mapblock_v3 block_pos;
-			getNodeBlockPosWithOffset(p, block_pos, rel_pos);
-			MapBlock *block = map->getBlockNoCreateNoEx(block_pos);
-			if (block == NULL || block->isDummy()) {
+		// Changed nodes that let light through
+		std::vector<ChangingLight> transparent_nodes;
+		// Changed nodes that may get sunlight from above
+		std::vector<size_t> sunlight_candidates;
+		// For each changed node initialize
+		for (size_t j = 0; j < oldnodes.size(); j++) {
+			MapBlock *block = changed_nodes[j].block;
+			if (block == NULL) {
 				continue;
 			}
+			u16 index = changed_nodes[j].index;
 			// Get the new node
-			MapNode n = block->getNodeNoCheck(rel_pos, &is_valid_position);
-			if (!is_valid_position) {
-				break;
-			}
-
-			// Light of the old node
-			u8 old_light = it->second.getLight(bank, ndef);
-
-			// Add the block of the added node to modified_blocks
-			modified_blocks[block_pos] = block;
+			const MapNode &n = block->getData()[index];
+			const ContentFeatures &f = features.get(n);
 
 			// Get new light level of the node
 			u8 new_light = 0;
-			if (ndef->get(n).light_propagates) {
-				if (bank == LIGHTBANK_DAY && ndef->get(n).sunlight_propagates
-					&& is_sunlight_above(map, p, ndef)) {
-					new_light = LIGHT_SUN;
-				} else {
-					new_light = ndef->get(n).light_source;
-					for (int i = 0; i < 6; i++) {
-						v3s16 p2 = p + neighbor_dirs[i];
-						bool is_valid;
-						MapNode n2 = map->getNodeNoEx(p2, &is_valid);
-						if (is_valid) {
-							u8 spread = n2.getLight(bank, ndef);
-							// If it is sure that the neighbor won't be
-							// unlighted, its light can spread to this node.
-							if (spread > new_light && spread >= min_safe_light) {
-								new_light = spread - 1;
-							}
-						}
+			if (f.light_propagates) {
+				transparent_nodes.push_back(changed_nodes[j]);
+				if (bank == LIGHTBANK_DAY && f.sunlight_propagates
+					&& is_sunlight_above(map, block, index, ndef)) {
+					// The sunlight above may be removed, decide later
+					sunlight_candidates.push_back(j);
+					continue;
+				}
+				new_light = f.light_source;
+				for (direction d = 0; d < 6; d++) {
+					u16 index2 = index;
+					MapBlock *block2 = block;
+					if (step_node_index(d, index2)) {
+						block2 = get_neighbor_block(map, block, d);
+						if (block2 == NULL)
+							continue;
+					}
+					u8 spread = features.getLight(
+						block2->getData()[index2], bank);
+					// If it is sure that the neighbor won't be
+					// unlighted, its light can spread to this node.
+					if (spread > new_light && spread >= min_safe_light) {
+						new_light = spread - 1;
 					}
 				}
 			} else {
 				// If this is an opaque node, it still can emit light.
-				new_light = ndef->get(n).light_source;
+				new_light = f.light_source;
 			}
 
 			if (new_light > 0) {
-				light_sources.push(new_light, rel_pos, block_pos, block, 6);
+				light_sources.push(new_light, block, index, 6);
 			}
 
-			if (new_light < old_light) {
+			if (new_light < old_lights[j]) {
 				// The node became opaque or doesn't provide as much
 				// light as the previous one, so it must be unlighted.
-
-				// Add to unlight queue
-				n.setLight(bank, 0, ndef);
-				block->setNodeNoCheck(rel_pos, n);
-				disappearing_lights.push(old_light, rel_pos, block_pos, block,
-					6);
-
-				// Remove sunlight, if there was any
-				if (bank == LIGHTBANK_DAY && old_light == LIGHT_SUN) {
-					for (s16 y = p.Y - 1;; y--) {
-						v3s16 n2pos(p.X, y, p.Z);
-
-						MapNode n2;
-
-						n2 = map->getNodeNoEx(n2pos, &is_valid_position);
-						if (!is_valid_position)
-							break;
-
-						// If this node doesn't have sunlight, the nodes below
-						// it don't have too.
-						if (n2.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN) {
-							break;
-						}
-						// Remove sunlight and add to unlight queue.
-						n2.setLight(LIGHTBANK_DAY, 0, ndef);
-						map->setNode(n2pos, n2);
-						relative_v3 rel_pos2;
-						mapblock_v3 block_pos2;
-						getNodeBlockPosWithOffset(n2pos, block_pos2, rel_pos2);
-						MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block_pos2);
-						disappearing_lights.push(LIGHT_SUN, rel_pos2,
-							block_pos2, block2,
-							4 /* The node above caused the change */);
-					}
-				}
-			} else if (new_light > old_light) {
-				// It is sure that the node provides more light than the previous
-				// one, unlighting is not necessary.
-				// Propagate sunlight
-				if (bank == LIGHTBANK_DAY && new_light == LIGHT_SUN) {
-					for (s16 y = p.Y - 1;; y--) {
-						v3s16 n2pos(p.X, y, p.Z);
-
-						MapNode n2;
-
-						n2 = map->getNodeNoEx(n2pos, &is_valid_position);
-						if (!is_valid_position)
-							break;
-
-						// This should not happen, but if the node has sunlight
-						// then the iteration should stop.
-						if (n2.getLight(LIGHTBANK_DAY, ndef) == LIGHT_SUN) {
-							break;
-						}
-						// If the node terminates sunlight, stop.
-						if (!ndef->get(n2).sunlight_propagates) {
-							break;
-						}
-						relative_v3 rel_pos2;
-						mapblock_v3 block_pos2;
-						getNodeBlockPosWithOffset(n2pos, block_pos2, rel_pos2);
-						MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block_pos2);
-						// Mark node for lighting.
-						light_sources.push(LIGHT_SUN, rel_pos2, block_pos2,
-							block2, 4);
-					}
-				}
+				unlight_changed_node(map, features, bank, block, index,
+					old_lights[j], disappearing_lights, modified_blocks);
 			}
+		}
 
+		// Process sunlight from the top down, once the sunlight the
+		// changed nodes lost is removed: a changed node above may have
+		// lost its sunlight or may give it to the nodes below.
+		std::sort(sunlight_candidates.begin(), sunlight_candidates.end(),
+			[&oldnodes] (size_t a, size_t b) {
+				return oldnodes[a].first.Y > oldnodes[b].first.Y;
+			});
+		for (size_t k = 0; k < sunlight_candidates.size(); k++) {
+			size_t j = sunlight_candidates[k];
+			MapBlock *block = changed_nodes[j].block;
+			u16 index = changed_nodes[j].index;
+			MapNode &n = block->getData()[index];
+			const ContentFeatures &f = features.get(n);
+			if (is_sunlight_above(map, block, index, ndef)) {
+				// Light the node now, the nodes below will be lit too.
+				n.setLight(LIGHTBANK_DAY, LIGHT_SUN, f);
+				light_changed(block);
+				light_sources.push(LIGHT_SUN, block, index, 6);
+				propagate_sunlight_down(map, features, block, index,
+					light_sources, modified_blocks);
+			} else {
+				// Lights of the neighbors are added after unlighting
+				if (f.light_source > 0)
+					light_sources.push(f.light_source, block, index, 6);
+				if (f.light_source < old_lights[j])
+					unlight_changed_node(map, features, bank, block, index,
+						old_lights[j], disappearing_lights, modified_blocks);
+			}
 		}
 		// Remove lights
 		unspread_light(map, ndef, bank, disappearing_lights, light_sources,
 			modified_blocks);
-		// Initialize light values for light spreading.
-		for (u8 i = 0; i <= LIGHT_SUN; i++) {
-			const std::vector<ChangingLight> &lights = light_sources.lights[i];
-			for (std::vector<ChangingLight>::const_iterator it = lights.begin();
-					it < lights.end(); ++it) {
-				MapNode n = it->block->getNodeNoCheck(it->rel_position,
-					&is_valid_position);
-				n.setLight(bank, i, ndef);
-				it->block->setNodeNoCheck(it->rel_position, n);
+		// The lights that are left can all be trusted. The changed nodes
+		// get the light of their neighbors that were not safe above.
+		for (size_t j = 0; j < transparent_nodes.size(); j++) {
+			const ChangingLight &changed = transparent_nodes[j];
+			u8 light = 0;
+			for (direction d = 0; d < 6; d++) {
+				u16 index = changed.index;
+				MapBlock *block = changed.block;
+				if (step_node_index(d, index)) {
+					block = get_neighbor_block(map, block, d);
+					if (block == NULL)
+						continue;
+				}
+				u8 spread = features.getLight(block->getData()[index], bank);
+				if (spread > light + 1)
+					light = spread - 1;
 			}
+			if (light > 0)
+				light_sources.push(light, changed.block, changed.index, 6);
 		}
+		// Initialize light values for light spreading.
+		set_queued_lights(ndef, bank, light_sources);
 		// Spread lights.
 		spread_light(map, ndef, bank, light_sources, modified_blocks);
 	}
 }
 
+void LightingUpdateQueue::push(v3s16 p, const MapNode &oldnode)
+{
+	if (!m_nodes.insert(p).second)
+		return;
+
+	v3s16 blockpos = getNodeBlockPos(p);
+	std::vector<std::pair<v3s16, MapNode> > &nodes = m_blocks[blockpos];
+	if (nodes.empty())
+		m_block_order.push_back(blockpos);
+	nodes.push_back(std::make_pair(p, oldnode));
+}
+
+void LightingUpdateQueue::update(Map *map, u32 max_time_ms,
+	std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	// Blocks are taken until the batch has as many nodes as a block
+	const size_t batch_size = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+	u64 end_time = porting::getTimeMs() + max_time_ms;
+	std::vector<std::pair<v3s16, MapNode> > batch;
+	while (!m_block_order.empty()) {
+		batch.clear();
+		while (!m_block_order.empty() && batch.size() < batch_size) {
+			std::unordered_map<v3s16, std::vector<std::pair<v3s16, MapNode> > >
+				::iterator it = m_blocks.find(m_block_order.front());
+			m_block_order.pop_front();
+			const std::vector<std::pair<v3s16, MapNode> > &nodes = it->second;
+			for (size_t i = 0; i < nodes.size(); i++)
+				m_nodes.erase(nodes[i].first);
+			batch.insert(batch.end(), nodes.begin(), nodes.end());
+			m_blocks.erase(it);
+		}
+
+		update_lighting_nodes(map, batch, modified_blocks);
+
+		if (max_time_ms != 0 && porting::getTimeMs() >= end_time)
+			break;
+	}
+}
+
 /*!
  * Borders of a map block in relative node coordinates.
  * Compatible with type 'direction'.
@@ -875,9 +1006,8 @@ void update_block_border_lighting(Map *map, MapBlock *block,
 							n.setLight(bank, 0, ndef);
 							b->setNodeNoCheck(x, y, z, n);
 							modified_blocks[b->getPos()]=b;
-							disappearing_lights.push(light,
-								relative_v3(x, y, z), b->getPos(), b,
-								6);
+							disappearing_lights.push(light, b,
+								node_index(relative_v3(x, y, z)), 6);
 						}
 					}
 				}
@@ -887,16 +1017,7 @@ void update_block_border_lighting(Map *map, MapBlock *block,
 		unspread_light(map, ndef, bank, disappearing_lights, light_sources,
 			modified_blocks);
 		// Initialize light values for light spreading.
-		for (u8 i = 0; i <= LIGHT_SUN; i++) {
-			const std::vector<ChangingLight> &lights = light_sources.lights[i];
-			for (std::vector<ChangingLight>::const_iterator it = lights.begin();
-					it < lights.end(); ++it) {
-				MapNode n = it->block->getNodeNoCheck(it->rel_position,
-					&is_valid_position);
-				n.setLight(bank, i, ndef);
-				it->block->setNodeNoCheck(it->rel_position, n);
-			}
-		}
+		set_queued_lights(ndef, bank, light_sources);
 		// Spread lights.
 		spread_light(map, ndef, bank, light_sources, modified_blocks);
 	}
@@ -1044,8 +1165,7 @@ bool propagate_block_sunlight(Map *map, INodeDefManager *ndef,
 					n.setLight(LIGHTBANK_DAY, LIGHT_SUN, f);
 					block->setNodeNoCheck(current_pos, n);
 					modified = true;
-					relight->push(LIGHT_SUN, current_pos, data->target_block,
-						block, 4);
+					relight->push(LIGHT_SUN, block, node_index(current_pos), 4);
 				} else {
 					// Light already valid, propagation stopped.
 					break;
@@ -1062,8 +1182,7 @@ bool propagate_block_sunlight(Map *map, INodeDefManager *ndef,
 					n.setLight(LIGHTBANK_DAY, 0, f);
 					block->setNodeNoCheck(current_pos, n);
 					modified = true;
-					unlight->push(LIGHT_SUN, current_pos, data->target_block,
-						block, 4);
+					unlight->push(LIGHT_SUN, block, node_index(current_pos), 4);
 				} else {
 					// Reached shadow, propagation stopped.
 					break;
@@ -1155,7 +1274,7 @@ void finish_bulk_light_update(Map *map, mapblock_v3 minblock,
 					node.getLightNoChecks(bank, &f):
 					f.light_source;
 				if (light > 1)
-					relight[b].push(light, relpos, blockpos, block, 6);
+					relight[b].push(light, block, node_index(relpos), 6);
 			} // end of banks
 		} // end of nodes
 	} // end of blocks
@@ -1168,16 +1287,7 @@ void finish_bulk_light_update(Map *map, mapblock_v3 minblock,
 		// Sunlight is already initialized.
 		u8 maxlight = (b == 0) ? LIGHT_MAX : LIGHT_SUN;
 		// Initialize light values for light spreading.
-		for (u8 i = 0; i <= maxlight; i++) {
-			const std::vector<ChangingLight> &lights = relight[b].lights[i];
-			for (std::vector<ChangingLight>::const_iterator it = lights.begin();
-					it < lights.end(); ++it) {
-				MapNode n = it->block->getNodeNoCheck(it->rel_position,
-					&is_valid);
-				n.setLight(bank, i, ndef);
-				it->block->setNodeNoCheck(it->rel_position, n);
-			}
-		}
+		set_queued_lights(ndef, bank, relight[b], maxlight);
 		// Spread lights.
 		spread_light(map, ndef, bank, relight[b], *modified_blocks);
 	}
@@ -1265,7 +1375,7 @@ void blit_back_with_light(ServerMap *map, MMVManip *vm,
 					// If the new node is dimmer, unlight.
 					if (oldlight > newlight) {
 						unlight[b].push(
-							oldlight, relpos, blockpos, block, 6);
+							oldlight, block, node_index(relpos), 6);
 					}
 				} // end of banks
 			} // end of nodes
@@ -1390,7 +1500,7 @@ void repair_block_light(ServerMap *map, MapBlock *block,
 				// surrounding light, as it can only become brighter)
 				if (LIGHT_SUN > light) {
 					unlight[b].push(
-						LIGHT_SUN, relpos, blockpos, block, 6);
+						LIGHT_SUN, block, node_index(relpos), 6);
 				}
 			} // end of banks
 		} // end of nodes
@@ -20,6 +20,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef VOXELALGORITHMS_HEADER
 #define VOXELALGORITHMS_HEADER
 
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
 #include "voxel.h"
 #include "mapnode.h"
 #include "util/container.h"
@@ -73,6 +76,49 @@ void update_lighting_nodes(
 	std::vector<std::pair<v3s16, MapNode> > &oldnodes,
 	std::map<v3s16, MapBlock*> &modified_blocks);
 
+/*!
+ * Changed nodes waiting for their lighting update.
+ * The nodes are grouped by map block, and the nodes of neighboring
+ * blocks are updated together, so that the changes of an area, like
+ * the nodes removed by an explosion, are processed in one update.
+ * A node changed again before its update keeps the node it first
+ * replaced.
+ */
+class LightingUpdateQueue
+{
+public:
+	/*!
+	 * Queues a changed node. The new node must have zero light level
+	 * on the map, like for update_lighting_nodes().
+	 *
+	 * \param oldnode the node that was replaced
+	 */
+	void push(v3s16 p, const MapNode &oldnode);
+
+	/*!
+	 * Updates the lighting of queued nodes in the order their blocks
+	 * were queued, until it took max_time_ms milliseconds.
+	 * Updates at least one batch of nodes, 0 means no limit.
+	 *
+	 * \param modified_blocks output, contains all map blocks that
+	 * the function modified
+	 */
+	void update(Map *map, u32 max_time_ms,
+		std::map<v3s16, MapBlock*> &modified_blocks);
+
+	size_t size() const { return m_nodes.size(); }
+	bool empty() const { return m_nodes.empty(); }
+
+private:
+	//! Queued node positions
+	std::unordered_set<v3s16> m_nodes;
+	//! Queued nodes and the nodes they replaced, by block
+	std::unordered_map<v3s16, std::vector<std::pair<v3s16, MapNode> > >
+		m_blocks;
+	//! Blocks in the order they were queued
+	std::deque<v3s16> m_block_order;
+};
+
 /*!
  * Updates borders of the given mapblock.
  * Only updates if the block was marked with incomplete